@@ -0,0 +1,331 @@
+/* diskconv.c: Convert and check disk images
+   Copyright (c) 2014 Philip Kendall
+
+   $Id$
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
+#include <libspectrum.h>
+
+#include "compat.h"
+#include "peripherals/disk/disk.h"
+#include "utils.h"
+
+static int process_files( int count, char **filenames );
+static int process_file( const char *filename, const char *outfile );
+static char *output_filename( const char *filename );
+static char *temp_filename( const char *filename );
+static void check_sector( disk_t *d, const disk_sector_t *sector,
+			  void *user_data );
+
+char *progname;
+
+int check_only = 0;
+int verbose = 0;
+int jobs = 1;
+const char *out_type = NULL;
+const char *out_dir = NULL;
+
+static const char *disk_type_names[] = {
+  "unknown", "UDI", "FDI", "TD0", "SDF", "MGT", "IMG", "SAD", "DSK",
+  "extended DSK", "TRD", "SCL", "OPD", "LOG",
+};
+
+static const char *out_types[] = {
+  "udi", "dsk", "mgt", "opd", "opu", "img", "trd", "sad", "fdi", "scl", "log",
+  NULL
+};
+
+typedef struct disk_check_t {
+  const char *filename;
+  int sectors;
+  int id_crc_errors;
+  int data_crc_errors;
+  int no_data;
+  int weak;
+} disk_check_t;
+
+int
+main( int argc, char **argv )
+{
+  int c, error, i;
+
+  progname = argv[0];
+
+  error = init_libspectrum(); if( error ) return error;
+
+  while( ( c = getopt( argc, argv, "cd:j:t:v" ) ) != -1 ) {
+
+    switch( c ) {
+
+    case 'c': check_only = 1; break;
+    case 'd': out_dir = optarg; break;
+    case 'j': jobs = atoi( optarg ); break;
+    case 't': out_type = optarg; break;
+    case 'v': verbose = 1; break;
+
+    case '?':
+      /* getopt prints an error message to stderr */
+      return 1;
+
+    }
+
+  }
+
+  argc -= optind;
+  argv += optind;
+
+  if( out_type ) {
+    if( *out_type == '.' ) out_type++;
+    for( i = 0; out_types[i] && strcasecmp( out_type, out_types[i] ); i++ )
+      ;
+    if( !out_types[i] ) {
+      fprintf( stderr, "%s: unknown disk image type `%s'\n", progname,
+	       out_type );
+      return 1;
+    }
+  }
+
+  if( jobs < 1 ) jobs = 1;
+
+  if( check_only || out_type ) {
+    if( argc < 1 ) {
+      fprintf( stderr,
+	       "%s: usage: %s [-v] [-j <jobs>] -c <infile>...\n"
+	       "%s: usage: %s [-v] [-j <jobs>] [-d <dir>] -t <type> "
+	       "<infile>...\n",
+	       progname, progname, progname, progname );
+      return 1;
+    }
+    return process_files( argc, argv );
+  }
+
+  if( argc < 2 ) {
+    fprintf( stderr,
+	     "%s: usage: %s [-v] <infile> <outfile>\n"
+	     "%s: usage: %s [-v] [-j <jobs>] -c <infile>...\n"
+	     "%s: usage: %s [-v] [-j <jobs>] [-d <dir>] -t <type> "
+	     "<infile>...\n",
+	     progname, progname, progname, progname, progname, progname );
+    return 1;
+  }
+
+  return process_file( argv[0], argv[1] );
+}
+
+/* Process every file, with up to 'jobs' of them at the same time */
+static int
+process_files( int count, char **filenames )
+{
+  int i, error = 0;
+#ifdef HAVE_FORK
+  int running = 0, status;
+  pid_t pid;
+
+  if( jobs > 1 ) {
+    for( i = 0; i < count; i++ ) {
+
+      if( running == jobs ) {
+	if( wait( &status ) == -1 ) break;
+	if( !WIFEXITED( status ) || WEXITSTATUS( status ) ) error = 1;
+	running--;
+      }
+
+      fflush( stdout );
+      pid = fork();
+      if( pid == -1 ) {
+	/* Can't start another one, so just do it here */
+	if( process_file( filenames[i], NULL ) ) error = 1;
+      } else if( pid == 0 ) {
+	exit( process_file( filenames[i], NULL ) );
+      } else {
+	running++;
+      }
+
+    }
+
+    while( running-- ) {
+      if( wait( &status ) == -1 ) break;
+      if( !WIFEXITED( status ) || WEXITSTATUS( status ) ) error = 1;
+    }
+
+    return error;
+  }
+#endif				/* #ifdef HAVE_FORK */
+
+  for( i = 0; i < count; i++ )
+    if( process_file( filenames[i], NULL ) ) error = 1;
+
+  return error;
+}
+
+/* Open a disk image, report on its contents and write it out again if
+   we have been asked to; 'outfile' of NULL means derive the name from
+   the -t and -d options */
+static int
+process_file( const char *filename, const char *outfile )
+{
+  disk_t d;
+  disk_check_t check;
+  char *output = NULL, *temp = NULL;
+  int error;
+
+  memset( &d, 0, sizeof( d ) );
+  d.flag = DISK_FLAG_NONE;
+
+  error = disk_open( &d, filename, 0, 0 );
+  if( error != DISK_OK ) {
+    fprintf( stderr, "%s: couldn't open `%s': %s\n", progname, filename,
+	     disk_strerror( error ) );
+    return 1;
+  }
+
+  memset( &check, 0, sizeof( check ) );
+  check.filename = filename;
+  disk_scan( &d, check_sector, &check );
+
+  if( check_only || verbose ) {
+    printf( "%s: %s, %d side%s, %d cylinders, %d bytes per track, "
+	    "%d sectors, %d ID CRC errors, %d data CRC errors, "
+	    "%d without data, %d weak\n",
+	    filename, d.type < DISK_TYPE_LAST ? disk_type_names[ d.type ] : "?",
+	    d.sides, d.sides == 1 ? "" : "s", d.cylinders, d.bpt,
+	    check.sectors, check.id_crc_errors, check.data_crc_errors,
+	    check.no_data, check.weak );
+  }
+
+  if( check_only ) {
+    disk_close( &d );
+    return check.id_crc_errors || check.data_crc_errors;
+  }
+
+  if( !outfile ) outfile = output = output_filename( filename );
+
+  /* Don't lose the original image if normalising it fails */
+  if( !strcmp( outfile, filename ) ) {
+    temp = temp_filename( outfile );
+  }
+
+  /* Let disk_write() choose the format from the extension, and always
+     write a complete image */
+  d.type = DISK_TYPE_NONE;
+  d.file_type = DISK_TYPE_NONE;
+
+  error = disk_write( &d, temp ? temp : outfile );
+  if( error != DISK_OK ) {
+    fprintf( stderr, "%s: couldn't write `%s': %s\n", progname, outfile,
+	     disk_strerror( error ) );
+    remove( temp ? temp : outfile );
+  } else if( temp && rename( temp, outfile ) ) {
+    fprintf( stderr, "%s: couldn't rename `%s' to `%s': %s\n", progname,
+	     temp, outfile, strerror( errno ) );
+    remove( temp );
+    error = DISK_WRFILE;
+  }
+
+  disk_close( &d );
+  libspectrum_free( temp );
+  libspectrum_free( output );
+
+  return error != DISK_OK;
+}
+
+/* 'filename' with ".new" inserted before the extension, which tells
+   disk_write() the format */
+static char *
+temp_filename( const char *filename )
+{
+  const char *ext;
+  char *temp;
+  size_t length;
+
+  ext = strrchr( filename, '.' );
+  if( !ext || strchr( ext, '/' ) ) ext = filename + strlen( filename );
+
+  length = strlen( filename ) + 5;
+  temp = libspectrum_new( char, length );
+  snprintf( temp, length, "%.*s.new%s", (int)( ext - filename ), filename,
+	    ext );
+
+  return temp;
+}
+
+/* The input filename with its extension replaced by the -t type, placed
+   in the -d directory if one was given */
+static char *
+output_filename( const char *filename )
+{
+  char *copy, *base, *ext, *output;
+  size_t length;
+
+  copy = utils_safe_strdup( filename );
+  base = out_dir ? compat_basename( copy ) : copy;
+  ext = strrchr( base, '.' );
+  if( ext && !strchr( ext, '/' ) ) *ext = '\0';
+
+  length = ( out_dir ? strlen( out_dir ) + 1 : 0 ) + strlen( base ) + 1 +
+	   strlen( out_type ) + 1;
+  output = libspectrum_new( char, length );
+  snprintf( output, length, "%s%s%s.%s", out_dir ? out_dir : "",
+	    out_dir ? "/" : "", base, out_type );
+
+  libspectrum_free( copy );
+
+  return output;
+}
+
+static void
+check_sector( disk_t *d, const disk_sector_t *sector, void *user_data )
+{
+  disk_check_t *check = user_data;
+
+  check->sectors++;
+  if( sector->id_crc_error ) check->id_crc_errors++;
+  if( !sector->has_data ) check->no_data++;
+  if( sector->data_crc_error ) check->data_crc_errors++;
+  if( sector->weak ) check->weak++;
+
+  if( !verbose ||
+      !( sector->id_crc_error || !sector->has_data ||
+	 sector->data_crc_error || sector->weak ) )
+    return;
+
+  printf( "%s:   side %d cylinder %2d: C=%d H=%d R=%d N=%d%s%s%s%s%s\n",
+	  check->filename, sector->head, sector->cylinder,
+	  sector->c, sector->h, sector->r, sector->n,
+	  sector->fm ? " FM" : "",
+	  sector->id_crc_error ? " ID-CRC-error" : "",
+	  sector->has_data ? "" : " no-data",
+	  sector->data_crc_error ? " data-CRC-error" : "",
+	  sector->weak ? " weak" : "" );
+}
@@ -35,6 +35,9 @@
 #include <strings.h>		/* Needed for strncasecmp() on QNX6 */
 #endif /* #ifdef HAVE_STRINGS_H */
 #include <fcntl.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif				/* #ifdef HAVE_PTHREAD */
 
 #ifdef HAVE_INTTYPES_H
 #include <inttypes.h>
@@ -72,6 +75,7 @@ z_stream zstream;			/* zlib struct */
 unsigned char zbuf_o[ZBUF_SIZE];	/* zlib output buffer */
 unsigned char zbuf_i[ZBUF_INP_SIZE];	/* zlib input buffer */
 int fmf_compr_feof = 0;
+int fmf_compr_end = 0;			/* (V2) a zlib stream has finished */
 #endif	/* USE_ZLIB */
 
 typedef enum {
@@ -139,6 +143,9 @@ const char *machine_name[] = {
 #define SCR_PITCH 40
 libspectrum_byte zxscr[9600 * 2];	/* 2x 40x240 bitmap1 bitmap2 */
 libspectrum_byte attrs[9600];		/* 40x240 attrib */
+libspectrum_byte zxdirty[9600];		/* 40x240 cells changed in this frame */
+int frm_dirty_y0 = 240, frm_dirty_y1 = 0;	/* changed lines */
+int frm_inv;				/* FLASH inverted in this frame */
 
 #define SOUND_CHUNK_LEN 8192
 libspectrum_signed_byte *sound8;	/* sound buffer for x-law */
@@ -178,6 +185,20 @@ int frm_slice_x, frm_slice_y, frm_slice_w, frm_slice_h;
 int frm_w = -1, frm_h = -1;
 int frm_fps = 0;
 
+int fmf_jobs = 0;			/* colour conversion threads (0 -> one per CPU) */
+#ifdef HAVE_PTHREAD
+#define CONV_MAX_JOBS 16
+pthread_t conv_thread[CONV_MAX_JOBS];
+int conv_band[CONV_MAX_JOBS];
+int conv_threads = 0;			/* worker threads running */
+pthread_mutex_t conv_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t conv_start = PTHREAD_COND_INITIALIZER;
+pthread_cond_t conv_done = PTHREAD_COND_INITIALIZER;
+unsigned int conv_generation = 0;	/* incremented for every frame */
+int conv_pending = 0;			/* bands not yet converted */
+int conv_exit = 0;
+#endif				/* #ifdef HAVE_PTHREAD */
+
 int out_w, out_h;
 int out_fps = 0;			/* desired output frame rate */
 int out_header_ok = 0;			/* output header ok? */
@@ -185,12 +206,21 @@ int out_header_ok = 0;			/* output header ok? */
 int out_chn = 2, out_rte = -1, out_fsz, out_len;	/* by default convert sound to 2 channel (STEREO) */
 
 /* fmf variables */
+int fmf_version = 1;			/* fmf file version */
 int fmf_compr = 0;			/* fmf compressed or not */
 int fmf_little_endian = 0;		/* little endian PCM */
 int snd_little_endian = -1;			/* little endian PCM */
 libspectrum_qword fmf_slice_no = 0;
 libspectrum_qword fmf_sound_no = 0;
 
+typedef struct fmf_keyframe_t {	/* (V2) keyframe index */
+  libspectrum_qword frame;		/* frame no after its 'N' */
+  libspectrum_qword offset;		/* file offset of its 'N' */
+} fmf_keyframe_t;
+
+fmf_keyframe_t *fmf_index = NULL;
+size_t fmf_index_n = 0;
+
 /* sound variables */
 #define SOUND_BUFF_MAX_SIZE 65536	/* soft max size of collected sound samples */
 type_t snd_enc;				/* sound type (pcm/alaw) */
@@ -279,6 +309,10 @@ fgetc_compr( FILE *f )
       fget_read++;
       zstream.next_out = zbuf_o;
       do {
+	if( fmf_compr_end ) {		/* V2: a keyframe starts a new stream */
+	  inflateReset( &zstream );
+	  fmf_compr_end = 0;
+	}
 	if( zstream.avail_in == 0 && !fmf_compr_feof ) {
 	  zstream.avail_in = fread( zbuf_i, 1, ZBUF_INP_SIZE, inp_file );
 	  zstream.next_in = zbuf_i;
@@ -286,6 +320,10 @@ fgetc_compr( FILE *f )
 	    fmf_compr_feof = 1;
 	}
 	s = inflate( &zstream, fmf_compr_feof ? Z_FINISH : Z_SYNC_FLUSH );
+	if( s == Z_STREAM_END && fmf_version == 2 ) {
+	  fmf_compr_end = 1;
+	  if( zstream.avail_out == ZBUF_SIZE ) s = Z_OK;	/* nothing yet */
+	}
       } while ( zstream.avail_out != 0 && s == Z_OK );
       zstream.next_out = zbuf_o;
     }
@@ -301,15 +339,24 @@ fgetc_compr( FILE *f )
 int
 fread_compr( void *buff, size_t n, size_t m, FILE *f )
 {
-  size_t i;
+  size_t i, avail;
   int d;
   char *b = buff;
 
   if( fmf_compr ) {
-    for( i = n * m; i > 0; i-- ) {
-      if( ( d = fgetc_compr( f ) ) == -1 )	/****FIXME may too slow */
-        return ( n * m - i ) / n;
-      *b++ = d;
+    for( i = n * m; i > 0; ) {
+      if( zstream.avail_out == ZBUF_SIZE ) {	/* refill the buffer */
+        if( ( d = fgetc_compr( f ) ) == -1 )
+          return ( n * m - i ) / n;
+        *b++ = d; i--;
+        continue;
+      }
+      avail = ZBUF_SIZE - zstream.avail_out;	/* copy what we have */
+      if( avail > i ) avail = i;
+      memcpy( b, zstream.next_out, avail );
+      zstream.next_out += avail;
+      zstream.avail_out += avail;
+      b += avail; i -= avail;
     }
     return m;
   } else {
@@ -869,6 +916,125 @@ setup_frame_wh( void )
   yuv_uvlen = yuv_ylen = frm_w * frm_h;
 }
 
+static libspectrum_qword
+get_dword( const libspectrum_byte *b )
+{
+  return b[0] | ( b[1] << 8 ) | ( b[2] << 16 ) |
+	 ( (libspectrum_qword)b[3] << 24 );
+}
+
+/* Load the keyframe index of a V2 file. Only done if the file is on its
+   own: the offsets are meaningless in a concatenation or a pipe */
+void
+fmf_read_index( void )
+{
+  libspectrum_byte b[16];
+  libspectrum_qword offset, size, length, n, i;
+  long pos = ftell( inp_file );
+
+  fmf_index_n = 0;
+  if( pos != 16 || fseek( inp_file, -16, SEEK_END ) == -1 ) return;
+
+  size = ftell( inp_file ) + 16;
+  if( fread( b, 16, 1, inp_file ) != 1 || memcmp( b + 12, "FMFI", 4 ) )
+    goto done;
+  offset = get_dword( b ) | get_dword( b + 4 ) << 32;
+  length = get_dword( b + 8 );
+  if( length < 24 || ( length - 24 ) % 12 || offset + length != size )
+    goto done;
+  n = ( length - 24 ) / 12;
+
+  if( fseek( inp_file, offset + 8, SEEK_SET ) == -1 ) goto done;
+  fmf_index = realloc( fmf_index, ( n ? n : 1 ) * sizeof( *fmf_index ) );
+  if( !fmf_index ) goto done;
+  for( i = 0; i < n; i++ ) {
+    if( fread( b, 12, 1, inp_file ) != 1 ) goto done;
+    fmf_index[i].frame = get_dword( b );
+    fmf_index[i].offset = get_dword( b + 4 ) | get_dword( b + 8 ) << 32;
+    if( fmf_index[i].offset >= offset ||
+	( i && fmf_index[i].frame <= fmf_index[i - 1].frame ) ) goto done;
+  }
+  fmf_index_n = n;
+
+done:
+  if( !fmf_index_n ) printi( 1, "fmf_read_index(): no usable index.\n" );
+  fseek( inp_file, pos, SEEK_SET );
+}
+
+/* Read from the input past the compressed data, i.e. first what inflate
+   has not used */
+static size_t
+fmf_read_raw( libspectrum_byte *buff, size_t len )
+{
+  size_t n = 0;
+
+#ifdef USE_ZLIB
+  if( fmf_compr ) {
+    n = len < zstream.avail_in ? len : zstream.avail_in;
+    memcpy( buff, zstream.next_in, n );
+    zstream.next_in += n;
+    zstream.avail_in -= n;
+    buff += n; len -= n;
+  }
+#endif	/* USE_ZLIB */
+  if( len ) n += fread( buff, 1, len, inp_file );
+  return n;
+}
+
+/* Skip the index trailer after the 'X' of a V2 file */
+int
+fmf_skip_index( void )
+{
+  libspectrum_byte b[256];
+  libspectrum_qword len;
+
+#ifdef USE_ZLIB
+  if( fmf_compr ) {
+    int s = Z_OK;
+
+    while( !fmf_compr_end && s == Z_OK ) {	/* run to the end of stream */
+      if( zstream.avail_in == 0 ) {
+        zstream.avail_in = fread( zbuf_i, 1, ZBUF_INP_SIZE, inp_file );
+        zstream.next_in = zbuf_i;
+      }
+      zstream.next_out = b;
+      zstream.avail_out = sizeof( b );
+      if( ( s = inflate( &zstream, Z_SYNC_FLUSH ) ) == Z_STREAM_END )
+        fmf_compr_end = 1;
+    }
+    zstream.next_out = zbuf_o;
+    zstream.avail_out = ZBUF_SIZE;
+  }
+#endif	/* USE_ZLIB */
+
+  if( fmf_read_raw( b, 8 ) != 8 || memcmp( b, "FMFI", 4 ) ) {
+    printe( "\n\nCorrupt input file (index) @0x%08lx.\n",
+            (unsigned long)ftell( inp_file ) );
+    return ERR_CORRUPT_INP;
+  }
+  for( len = get_dword( b + 4 ) * 12 + 16; len > 0; ) {
+    size_t n = len > sizeof( b ) ? sizeof( b ) : len;
+    if( fmf_read_raw( b, n ) != n ) {
+      printe( "\n\nCorrupt input file (index) @0x%08lx.\n",
+              (unsigned long)ftell( inp_file ) );
+      return ERR_CORRUPT_INP;
+    }
+    len -= n;
+  }
+
+#ifdef USE_ZLIB
+  if( fmf_compr ) {		/* a concatenated file starts a new stream */
+    if( zstream.avail_in )
+      fseek( inp_file, -(long)zstream.avail_in, SEEK_CUR );
+    inflateReset( &zstream );
+    zstream.avail_in = 0;
+    fmf_compr_end = 0;
+    fmf_compr_feof = 0;
+  }
+#endif	/* USE_ZLIB */
+  return 0;
+}
+
 int
 check_fmf_head( void )
 {
@@ -878,13 +1044,14 @@ check_fmf_head( void )
   }
   if( fread_buff( fhead, 12, FROM_BUFF ) != 1 ||
 	fhead[0] != 'V' ||
-	fhead[1] != '1' ||	/* V1 */
+	( fhead[1] != '1' && fhead[1] != '2' ) ||	/* V1 or V2 */
 	( fhead[2] != 'e' && fhead[2] != 'E' ) ||		/* endianness */
 	( fhead[3] != 'U' && fhead[3] != 'Z' ) )		/* compressed? */
   {
     printe("This version of Fuse Movie File not supported, sorry...\n");
     return ERR_VERSION_INP;
   }
+  fmf_version = fhead[1] - '0';
   fmf_little_endian = fhead[2] == 'e' ? 1 : 0;
   fmf_compr = fhead[3] == 'Z' ? 1 : 0;
 
@@ -938,8 +1105,13 @@ check_fmf_head( void )
   if( out_rte == -1 ) out_rte = snd_rte;
   if( out_chn == -1 ) out_chn = snd_chn;
   do_now = DO_SLICE;
-  printi( 1, "check_fmf_head(): file:  FMF V1 %s endian %scompressed.\n",
-          fmf_little_endian ? "little" : "big", fmf_compr ? "" : "un" );
+  if( fmf_version == 2 ) fmf_read_index();
+  printi( 1, "check_fmf_head(): file:  FMF V%d %s endian %scompressed.\n",
+          fmf_version, fmf_little_endian ? "little" : "big",
+          fmf_compr ? "" : "un" );
+  if( fmf_index_n )
+    printi( 1, "check_fmf_head(): index: %lu keyframes.\n",
+            (unsigned long)fmf_index_n );
   printi( 1, "check_fmf_head(): video: frame rate = 1:%d frame time: %dus %s machine timing.\n", frm_rte, machine_ftime[frm_mch - 'A'],
           machine_name[frm_mch - 'A'] );
   printi( 1, "check_fmf_head(): audio: sampling rate %dHz %c encoded %s sound.\n",
@@ -1027,6 +1199,59 @@ fmf_read_init( void )		/* read first N */
   return fmf_read_frame_head();
 }
 
+/* Inside a cut, jump to the last keyframe whose preceding frames are all
+   cut, instead of decoding every one of them */
+int
+fmf_cut_seek( void )
+{
+  size_t i, k = fmf_index_n;
+  libspectrum_qword skip = 0, usec, ftime;
+  int err;
+
+  if( cut_cmd != TYPE_CUT || !fmf_index_n ) return 0;
+
+  ftime = machine_ftime[frm_mch - 'A'] * frm_rte;
+  for( i = 0; i < fmf_index_n; i++ ) {
+    if( fmf_index[i].frame <= frame_no + 1 ) continue;
+    if( cut_t_t == TYPE_FRAME ) {
+      if( fmf_index[i].frame - 1 > cut__to ) break;
+    } else {
+      usec = time_frm + ( fmf_index[i].frame - frame_no - 1 ) * ftime;
+      if( time_sec + usec / 1000000 > cut__to ) break;
+    }
+    k = i;
+  }
+  if( k == fmf_index_n ) return 0;
+
+  if( fseek( inp_file, fmf_index[k].offset, SEEK_SET ) == -1 ) return 0;
+#ifdef USE_ZLIB
+  if( fmf_compr ) {
+    inflateReset( &zstream );
+    zstream.avail_in = 0;
+    zstream.next_out = zbuf_o;
+    zstream.avail_out = ZBUF_SIZE;
+    fmf_compr_end = 0;
+    fmf_compr_feof = 0;
+  }
+#endif	/* USE_ZLIB */
+  if( ( err = fmf_read_chunk_head() ) ) return err;
+  if( fhead[0] != 'N' ) {
+    printe( "\n\nfmf_cut_seek(): Corrupt input file (N) @0x%08lx.\n",
+            (unsigned long)ftell( inp_file ) );
+    return ERR_CORRUPT_INP;
+  }
+
+  skip = fmf_index[k].frame - frame_no - 1;
+  printi( 2, "fmf_cut_seek(): skip %"PRIu64" frames to keyframe %"PRIu64".\n",
+          skip, fmf_index[k].frame );
+  frame_no += skip;
+  drop_no += skip;
+  time_frm += skip * ftime;
+  time_sec += time_frm / 1000000;
+  time_frm %= 1000000;
+  return 0;
+}
+
 int
 fmf_read_sound( void )
 {
@@ -1195,7 +1420,7 @@ fmf_read_slice_blokk( libspectrum_byte *scrl, int w, int h )
 int
 fmf_read_screen( void )
 {
-  int err;
+  int err, i;
 
   if( fread_compr( fhead, 6, 1, inp_file ) != 1 ) {
     printe( "\n\nCorrupt input file ($) @0x%08lx.\n", (unsigned long)ftell( inp_file ) );
@@ -1236,6 +1461,12 @@ fmf_read_screen( void )
   if( ( err = fmf_read_slice_blokk( attrs + frm_slice_y * SCR_PITCH + frm_slice_x,
 			       frm_slice_w, frm_slice_h ) ) ) return err;
 /*	fprintf(stderr, "next slice@0x%08x\n", (unsigned int)ftell(scr)); */
+  for( i = 0; i < frm_slice_h; i++ )
+    memset( zxdirty + ( frm_slice_y + i ) * SCR_PITCH + frm_slice_x, 1,
+            frm_slice_w );
+  if( frm_slice_y < frm_dirty_y0 ) frm_dirty_y0 = frm_slice_y;
+  if( frm_slice_y + frm_slice_h > frm_dirty_y1 )
+    frm_dirty_y1 = frm_slice_y + frm_slice_h;
   fmf_slice_no++;
   printi( 3, "fmf_read_screen(): x=%d, y=%d, w=%d, h=%d\n", frm_slice_x, frm_slice_y, frm_slice_w, frm_slice_h );
   return 0;
@@ -1282,96 +1513,228 @@ scr_read_scr( void )
   return 0;
 }
 
-void
-out_2_yuv( void )
+/* Convert 'w' cells of line 'y' from column 'x' */
+static void
+out_2_yuv( int x, int y, int w )
 {
 
   libspectrum_byte *bitmap, *attr;
-  int i, w, idx;
+  int i, idx;
   int Y, U, V;
-  int x = frm_slice_x, y = frm_slice_y, h = frm_slice_h;
-  int inv = ( frame_no * frm_rte % 32 ) > 15 ? 1 : 0;
+  int inv = frm_inv;
 
-  w = frm_slice_w;
-  for( h = frm_slice_h; h > 0; h--, y++, w = frm_slice_w ) {
-    if( scr_t != TYPE_HRE )
-      idx = y * OUT_PITCH + x * 8 ;		/* 8pixel/data */
-    else
-      idx = y * OUT_PITCH * 2 + x * 16 ;	/* 16 pixel/data*/
-    bitmap = &zxscr[SCR_PITCH * y + x];
-    attr   = &attrs[SCR_PITCH * y + x];
-    for( ; w > 0; w--, bitmap++, attr++ ) {
-      int px, fx, ix = *attr;
-      int bits = scr_t == TYPE_HRE ? ( *bitmap << 8 ) + *(bitmap + 9600) : *bitmap;
-
-      fx = ( ix & 0x80 ) * inv;
-      px = ( ( ix & 0x38 ) >> 3 ) + ( ( ix & 0x40 ) ? 8 : 0 );
-      ix = ( ix & 0x07 ) + ( ( ix & 0x40 ) ? 8 : 0 );
-      for( i = ( scr_t == TYPE_HRE ? 16 : 8 ); i > 0; i-- ) {
-        if( ( bits ^ fx ) & 128 ) {	/* ink */
-          Y = yuv_pal[ ix * 3 + 0 ];
-          U = yuv_pal[ ix * 3 + 1 ];
-          V = yuv_pal[ ix * 3 + 2 ];
-        } else {			/* paper */
-          Y = yuv_pal[ px * 3 + 0 ];
-          U = yuv_pal[ px * 3 + 1 ];
-          V = yuv_pal[ px * 3 + 2 ];
-        }
-        pix_yuv[0][idx]   = Y;
-        pix_yuv[1][idx]   = U;
-        pix_yuv[2][idx++] = V;
-        bits <<= 1;
+  if( scr_t != TYPE_HRE )
+    idx = y * OUT_PITCH + x * 8 ;		/* 8pixel/data */
+  else
+    idx = y * OUT_PITCH * 2 + x * 16 ;	/* 16 pixel/data*/
+  bitmap = &zxscr[SCR_PITCH * y + x];
+  attr   = &attrs[SCR_PITCH * y + x];
+  for( ; w > 0; w--, bitmap++, attr++ ) {
+    int px, fx, ix = *attr;
+    int bits = scr_t == TYPE_HRE ? ( *bitmap << 8 ) + *(bitmap + 9600) : *bitmap;
+
+    fx = ( ix & 0x80 ) * inv;
+    px = ( ( ix & 0x38 ) >> 3 ) + ( ( ix & 0x40 ) ? 8 : 0 );
+    ix = ( ix & 0x07 ) + ( ( ix & 0x40 ) ? 8 : 0 );
+    for( i = ( scr_t == TYPE_HRE ? 16 : 8 ); i > 0; i-- ) {
+      if( ( bits ^ fx ) & 128 ) {	/* ink */
+        Y = yuv_pal[ ix * 3 + 0 ];
+        U = yuv_pal[ ix * 3 + 1 ];
+        V = yuv_pal[ ix * 3 + 2 ];
+      } else {			/* paper */
+        Y = yuv_pal[ px * 3 + 0 ];
+        U = yuv_pal[ px * 3 + 1 ];
+        V = yuv_pal[ px * 3 + 2 ];
       }
+      pix_yuv[0][idx]   = Y;
+      pix_yuv[1][idx]   = U;
+      pix_yuv[2][idx++] = V;
+      bits <<= 1;
     }
   }
 }
 
-void
-out_2_rgb( void )
+static void
+out_2_rgb( int x, int y, int w )
 {
   libspectrum_byte *bitmap, *attr;
-  int i, w, idx;
+  int i, idx;
   int R, G, B;
-  int x = frm_slice_x, y = frm_slice_y, h = frm_slice_h;
-  int inv = ( frame_no * frm_rte % 32 ) > 15 ? 1 : 0;
+  int inv = frm_inv;
 
-  w = frm_slice_w;
-  for( h = frm_slice_h; h > 0; h--, y++, w = frm_slice_w ) {
-    if( scr_t != TYPE_HRE )
-      idx = y * OUT_PITCH + x * 8 ;		/* 8pixel/data */
-    else
-      idx = y * OUT_PITCH * 2 + x * 16 ;	/* 16 pixel/data*/
-
-    idx *= 3;
-
-    bitmap = &zxscr[SCR_PITCH * y + x];
-    attr   = &attrs[SCR_PITCH * y + x];
-    for( ; w > 0; w--, bitmap++, attr++ ) {
-      int px, fx, ix = *attr;
-      int bits = scr_t == TYPE_HRE ? ( *bitmap << 8 ) + *(bitmap + 9600) : *bitmap;
-
-      fx = ( ix & 0x80 ) * inv;
-      px = ( ( ix & 0x38 ) >> 3 ) + ( ( ix & 0x40 ) ? 8 : 0 );
-      ix = ( ix & 0x07 ) + ( ( ix & 0x40 ) ? 8 : 0 );
-      for( i = scr_t == TYPE_HRE ? 16 : 8; i > 0; i-- ) {
-        if( ( bits ^ fx ) & 128 ) {	/* ink */
-          R = rgb_pal[ ix * 3 + 0 ];
-          G = rgb_pal[ ix * 3 + 1 ];
-          B = rgb_pal[ ix * 3 + 2 ];
-        } else {			/* paper */
-          R = rgb_pal[ px * 3 + 0 ];
-          G = rgb_pal[ px * 3 + 1 ];
-          B = rgb_pal[ px * 3 + 2 ];
-        }
-        pix_rgb[idx++] = R;
-        pix_rgb[idx++] = G;
-        pix_rgb[idx++] = B;
-        bits <<= 1;
+  if( scr_t != TYPE_HRE )
+    idx = y * OUT_PITCH + x * 8 ;		/* 8pixel/data */
+  else
+    idx = y * OUT_PITCH * 2 + x * 16 ;	/* 16 pixel/data*/
+
+  idx *= 3;
+
+  bitmap = &zxscr[SCR_PITCH * y + x];
+  attr   = &attrs[SCR_PITCH * y + x];
+  for( ; w > 0; w--, bitmap++, attr++ ) {
+    int px, fx, ix = *attr;
+    int bits = scr_t == TYPE_HRE ? ( *bitmap << 8 ) + *(bitmap + 9600) : *bitmap;
+
+    fx = ( ix & 0x80 ) * inv;
+    px = ( ( ix & 0x38 ) >> 3 ) + ( ( ix & 0x40 ) ? 8 : 0 );
+    ix = ( ix & 0x07 ) + ( ( ix & 0x40 ) ? 8 : 0 );
+    for( i = scr_t == TYPE_HRE ? 16 : 8; i > 0; i-- ) {
+      if( ( bits ^ fx ) & 128 ) {	/* ink */
+        R = rgb_pal[ ix * 3 + 0 ];
+        G = rgb_pal[ ix * 3 + 1 ];
+        B = rgb_pal[ ix * 3 + 2 ];
+      } else {			/* paper */
+        R = rgb_pal[ px * 3 + 0 ];
+        G = rgb_pal[ px * 3 + 1 ];
+        B = rgb_pal[ px * 3 + 2 ];
+      }
+      pix_rgb[idx++] = R;
+      pix_rgb[idx++] = G;
+      pix_rgb[idx++] = B;
+      bits <<= 1;
+    }
+  }
+}
+
+/* Convert the changed cells of lines 'y0' to 'y1' - 1 */
+static void
+out_convert_lines( int y0, int y1 )
+{
+  libspectrum_byte *dirty;
+  int x, w;
+
+  for( ; y0 < y1; y0++ ) {
+    dirty = &zxdirty[SCR_PITCH * y0];
+    for( x = 0; x < SCR_PITCH; x += w ) {
+      for( w = 0; x + w < SCR_PITCH && dirty[x + w]; w++ )
+        dirty[x + w] = 0;
+      if( !w ) {
+        w = 1;
+        continue;
       }
+      if( out_t >= TYPE_YUV )
+        out_2_yuv( x, y0, w );
+      else
+        out_2_rgb( x, y0, w );
     }
   }
 }
 
+/* Lines of band 'band' out of 'conv_bands' */
+static void
+out_convert_band( int band, int bands )
+{
+  int lines = frm_dirty_y1 - frm_dirty_y0;
+
+  out_convert_lines( frm_dirty_y0 + lines * band / bands,
+                     frm_dirty_y0 + lines * ( band + 1 ) / bands );
+}
+
+#ifdef HAVE_PTHREAD
+static void*
+conv_worker( void *arg )
+{
+  int band = *(int *)arg;
+  unsigned int seen = 0;
+
+  pthread_mutex_lock( &conv_lock );
+  while( 1 ) {
+    while( conv_generation == seen && !conv_exit )
+      pthread_cond_wait( &conv_start, &conv_lock );
+    if( conv_exit ) break;
+    seen = conv_generation;
+    pthread_mutex_unlock( &conv_lock );
+
+    out_convert_band( band, conv_threads + 1 );
+
+    pthread_mutex_lock( &conv_lock );
+    if( --conv_pending == 0 )
+      pthread_cond_signal( &conv_done );
+  }
+  pthread_mutex_unlock( &conv_lock );
+  return NULL;
+}
+#endif				/* #ifdef HAVE_PTHREAD */
+
+/* Start the colour conversion workers; the main thread does a share too */
+void
+conv_start_threads( void )
+{
+#ifdef HAVE_PTHREAD
+  int i;
+
+  if( fmf_jobs <= 0 ) {
+#ifdef _SC_NPROCESSORS_ONLN
+    fmf_jobs = sysconf( _SC_NPROCESSORS_ONLN );
+#endif
+    if( fmf_jobs <= 0 ) fmf_jobs = 1;
+  }
+  if( fmf_jobs > CONV_MAX_JOBS ) fmf_jobs = CONV_MAX_JOBS;
+
+  for( i = 0; i < fmf_jobs - 1; i++ ) {
+    conv_band[i] = i + 1;
+    if( pthread_create( &conv_thread[i], NULL, conv_worker, &conv_band[i] ) )
+      break;
+    conv_threads++;
+  }
+  printi( 1, "conv_start_threads(): %d colour conversion thread(s).\n",
+          conv_threads + 1 );
+#else				/* #ifdef HAVE_PTHREAD */
+  fmf_jobs = 1;
+#endif				/* #ifdef HAVE_PTHREAD */
+}
+
+void
+conv_stop_threads( void )
+{
+#ifdef HAVE_PTHREAD
+  int i;
+
+  if( !conv_threads ) return;
+
+  pthread_mutex_lock( &conv_lock );
+  conv_exit = 1;
+  pthread_cond_broadcast( &conv_start );
+  pthread_mutex_unlock( &conv_lock );
+  for( i = 0; i < conv_threads; i++ )
+    pthread_join( conv_thread[i], NULL );
+  conv_threads = 0;
+#endif				/* #ifdef HAVE_PTHREAD */
+}
+
+/* Convert every cell changed since the last frame to RGB or YUV. This is
+   done once per frame rather than once per slice, so each cell is
+   converted only once however many slices covered it */
+void
+out_convert_frame( void )
+{
+  if( frm_dirty_y0 >= frm_dirty_y1 ) return;
+
+  frm_inv = ( frame_no * frm_rte % 32 ) > 15 ? 1 : 0;
+
+#ifdef HAVE_PTHREAD
+  if( conv_threads ) {
+    pthread_mutex_lock( &conv_lock );
+    conv_pending = conv_threads;
+    conv_generation++;
+    pthread_cond_broadcast( &conv_start );
+    pthread_mutex_unlock( &conv_lock );
+
+    out_convert_band( 0, conv_threads + 1 );
+
+    pthread_mutex_lock( &conv_lock );
+    while( conv_pending )
+      pthread_cond_wait( &conv_done, &conv_lock );
+    pthread_mutex_unlock( &conv_lock );
+  } else
+#endif				/* #ifdef HAVE_PTHREAD */
+  {
+    out_convert_lines( frm_dirty_y0, frm_dirty_y1 );
+  }
+
+  frm_dirty_y0 = 240; frm_dirty_y1 = 0;
+}
+
 int
 out_write_frame( void )
 {
@@ -1525,6 +1888,8 @@ print_help( void )
 	  "     --acodecs                 List available FFMPEG audio codecs (see\n"
 	  "                                 -a/--acodec).\n"
 #endif
+	  "  -j --jobs <n>                Convert video frames with `n' threads (by\n"
+	  "                                 default one per CPU).\n"
 	  "     --info                    Scan input file(s) and print information.\n"
 	  "  -v --verbose                 Increase the verbosity level by one.\n"
 	  "  -q --quiet                   Decrease the verbosity level by one.\n"
@@ -1607,6 +1972,7 @@ parse_args( int argc, char *argv[] )
     {"vcodecs",0, &ffmpeg_list, 2},	/* list formats */
 #endif
     {"info", 0, &do_info, 1},
+    {"jobs", 1, NULL, 'j'},		/* colour conversion threads */
 
     {"help", 0, NULL, 'h'},
     {"version", 0, NULL, 'V'},
@@ -1624,7 +1990,7 @@ parse_args( int argc, char *argv[] )
     char t;
     int  i;
 
-    c = getopt_long (argc, argv, "i:o:s:f:g:C:wumSPY"
+    c = getopt_long (argc, argv, "i:o:s:f:g:C:j:wumSPY"
 #ifdef USE_FFMPEG
 				"p:F:a:c:A:r:R:E:X"
 #endif
@@ -1834,6 +2200,13 @@ parse_args( int argc, char *argv[] )
       if( verbose > VERBOSE_MIN )
 	verbose--;
       break;
+    case 'j':		/* colour conversion threads */
+      fmf_jobs = atoi( optarg );
+      if( fmf_jobs < 0 ) {
+	printe( "Bad value for -j/--jobs ...\n");
+	return ERR_BAD_PARAM;
+      }
+      break;
     case 'g':		/* progress 'bar' */
       if( !strcmp( optarg, "%" ) )
         prg_t = TYPE_PERC;
@@ -1910,6 +2283,7 @@ main( int argc, char *argv[] )
   }
   if( !sound_only && ( err = open_out() ) ) return err;
   if( ( err = open_snd() ) ) return err;
+  if( out_t >= TYPE_PPM ) conv_start_threads();
 
   if( snd_t == TYPE_UNSET && out_t == TYPE_FFMPEG ) {
     snd_t = TYPE_FFMPEG;
@@ -1952,12 +2326,6 @@ main( int argc, char *argv[] )
       } else {						/* read SCR file */
         if( ( err = scr_read_scr() ) ) eop = 1;
       }
-      if( out_t != TYPE_NONE ) {		/* convert slice to RGB or YUV if needed */
-        if( out_t >= TYPE_YUV )
-          out_2_yuv();
-        else if( out_t >= TYPE_PPM )
-          out_2_rgb();
-      }
       break;
     case DO_SOUND:
     case DO_SOUND_FLUSH:
@@ -1967,18 +2335,27 @@ main( int argc, char *argv[] )
       do_now = DO_SLICE;
       break;
     case DO_FRAME:
+      if( out_t >= TYPE_PPM )		/* convert changes to RGB or YUV */
+        out_convert_frame();
       if( out_t != TYPE_NONE ) {
         out_write_frame();
       }
     case DO_LAST_FRAME:
+      if( out_t >= TYPE_PPM )		/* the next file may change the screen */
+        out_convert_frame();
       if( inp_t == TYPE_FMF ) {
         if( do_now == DO_LAST_FRAME ) {
+          if( fmf_version == 2 && ( err = fmf_skip_index() ) ) {
+            eop = 1;
+            break;
+          }
           fread_buff( fhead, 1, INTO_BUFF );	/* check concatenation */
           if( feof_compr( inp_file ) )
             do_now = DO_FILE;
           else
             do_now = DO_HEAD;
         } else {
+          if( cut_cut && ( err = fmf_cut_seek() ) ) eop = 1;
           do_now = DO_FRAME_HEAD;
         }
       } else {
@@ -1994,6 +2371,7 @@ main( int argc, char *argv[] )
   }
   if( prg_t != TYPE_NONE ) print_progress( 1 ); /* update progress */
   if( ( out_t >= TYPE_SCR && out_t <= TYPE_JPEG ) && out_name ) unlink( out_name );
+  conv_stop_threads();
   close_snd();				/* close snd file */
   close_out();				/* close out file */
   if( prg_t != TYPE_NONE ) fprintf( stderr, "\n" );
@@ -2006,6 +2384,7 @@ main( int argc, char *argv[] )
 #ifdef USE_ZLIB
   inflateEnd( &zstream );
 #endif	/* USE_ZLIB */
+  free( fmf_index );
 
   return 0;
 }
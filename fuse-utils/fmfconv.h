@@ -108,6 +108,7 @@ typedef enum {
 } type_t;
 
 extern int verbose;
+extern int fmf_jobs;			/* colour conversion threads */
 
 extern FILE *out, *snd;
 
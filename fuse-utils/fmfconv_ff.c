@@ -695,6 +695,8 @@ open_video( AVCodec *codec )
     }
   }
 
+  c->thread_count = fmf_jobs;	/* let the encoder use the same threads */
+
 #ifdef HAVE_FFMPEG_AVCODEC_OPEN2
   AVDictionary *options = NULL;
   if( ffmpeg_libx264 ) {
@@ -0,0 +1,692 @@
+/* specindex.c: Index and find duplicates in a collection of Spectrum files
+   Copyright (c) 2015 Philip Kendall
+
+   $Id$
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+/*
+  The index is a text file with one line per file, sorted by content
+  hash so that duplicates are next to each other:
+
+    <hash> <tab> <class> <tab> <type> <tab> <details> <tab> <path>
+
+  The hash is of the file's normalised contents: the machine, registers
+  and RAM of a snapshot, the data of each data block of a tape, and the
+  decompressed bytes of anything else. This means a .z80 and a .szx of
+  the same machine state, or a .tap and a .tzx.gz of the same program,
+  have the same hash.
+*/
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_DIRENT_H
+#include <dirent.h>
+#endif				/* #ifdef HAVE_DIRENT_H */
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif				/* #ifdef HAVE_PTHREAD */
+
+#include <libspectrum.h>
+
+#include "compat.h"
+#include "utils.h"
+
+#define MAX_JOBS 64
+
+/* FNV-1a, 64 bit */
+#define HASH_INIT 0xcbf29ce484222325ULL
+#define HASH_PRIME 0x100000001b3ULL
+
+typedef unsigned long long index_hash;
+
+typedef struct index_entry {
+  char *path;
+  index_hash hash;
+  libspectrum_class_t class;
+  libspectrum_id_t type;
+  char *details;
+  int error;
+} index_entry;
+
+static int index_paths( int count, char **paths, const char *outfile,
+			int duplicates );
+static int lookup_files( const char *indexfile, int count, char **paths );
+static int add_path( const char *path );
+static void index_file( index_entry *entry );
+static int index_contents( index_entry *entry, const libspectrum_byte *buffer,
+			   size_t length );
+
+char *progname;
+
+static int jobs = 0;
+
+static index_entry *entries;
+static size_t entry_count, entries_allocated;
+
+static size_t next_entry;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t next_entry_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif				/* #ifdef HAVE_PTHREAD */
+
+static const char *
+class_name( libspectrum_class_t class )
+{
+  switch( class ) {
+  case LIBSPECTRUM_CLASS_CARTRIDGE_TIMEX: return "timex-cartridge";
+  case LIBSPECTRUM_CLASS_DISK_PLUS3: return "plus3-disk";
+  case LIBSPECTRUM_CLASS_DISK_TRDOS: return "trdos-disk";
+  case LIBSPECTRUM_CLASS_DISK_OPUS: return "opus-disk";
+  case LIBSPECTRUM_CLASS_RECORDING: return "recording";
+  case LIBSPECTRUM_CLASS_SNAPSHOT: return "snapshot";
+  case LIBSPECTRUM_CLASS_TAPE: return "tape";
+  case LIBSPECTRUM_CLASS_COMPRESSED: return "compressed";
+  case LIBSPECTRUM_CLASS_HARDDISK: return "harddisk";
+  case LIBSPECTRUM_CLASS_CARTRIDGE_IF2: return "if2-cartridge";
+  case LIBSPECTRUM_CLASS_MICRODRIVE: return "microdrive";
+  case LIBSPECTRUM_CLASS_DISK_PLUSD: return "plusd-disk";
+  case LIBSPECTRUM_CLASS_DISK_GENERIC: return "disk";
+  case LIBSPECTRUM_CLASS_AUXILIARY: return "auxiliary";
+  default: return "unknown";
+  }
+}
+
+int
+main( int argc, char **argv )
+{
+  const char *outfile = NULL, *indexfile = NULL;
+  int duplicates = 0;
+  int c, error;
+
+  progname = argv[0];
+
+  error = init_libspectrum(); if( error ) return error;
+
+  while( ( c = getopt( argc, argv, "dj:l:o:" ) ) != -1 ) {
+
+    switch( c ) {
+
+    case 'd': duplicates = 1; break;
+    case 'j': jobs = atoi( optarg ); break;
+    case 'l': indexfile = optarg; break;
+    case 'o': outfile = optarg; break;
+
+    case '?':
+      /* getopt prints an error message to stderr */
+      return 1;
+
+    }
+
+  }
+
+  argc -= optind;
+  argv += optind;
+
+  if( argc < 1 ) {
+    fprintf( stderr,
+	     "%s: usage: %s [-d] [-j <jobs>] [-o <index>] <path>...\n"
+	     "%s: usage: %s -l <index> <file>...\n",
+	     progname, progname, progname, progname );
+    return 1;
+  }
+
+  if( indexfile ) return lookup_files( indexfile, argc, argv );
+
+  return index_paths( argc, argv, outfile, duplicates );
+}
+
+static void
+hash_bytes( index_hash *hash, const libspectrum_byte *data, size_t length )
+{
+  index_hash h = *hash;
+  size_t i;
+
+  for( i = 0; i < length; i++ ) {
+    h ^= data[i];
+    h *= HASH_PRIME;
+  }
+
+  *hash = h;
+}
+
+static void
+hash_dword( index_hash *hash, libspectrum_dword value )
+{
+  libspectrum_byte bytes[4];
+
+  bytes[0] = value & 0xff; bytes[1] = ( value >> 8 ) & 0xff;
+  bytes[2] = ( value >> 16 ) & 0xff; bytes[3] = value >> 24;
+
+  hash_bytes( hash, bytes, 4 );
+}
+
+static int
+compare_entries( const void *a, const void *b )
+{
+  const index_entry *entry1 = a, *entry2 = b;
+
+  if( entry1->hash != entry2->hash )
+    return entry1->hash < entry2->hash ? -1 : 1;
+
+  return strcmp( entry1->path, entry2->path );
+}
+
+/* Replace anything which would break the line and field structure of
+   the index */
+static void
+sanitise( char *text )
+{
+  for( ; *text; text++ )
+    if( *text == '\t' || *text == '\n' || *text == '\r' ) *text = ' ';
+}
+
+#ifdef HAVE_PTHREAD
+static void*
+index_worker( void *arg )
+{
+  size_t i;
+
+  while( 1 ) {
+    pthread_mutex_lock( &next_entry_lock );
+    i = next_entry++;
+    pthread_mutex_unlock( &next_entry_lock );
+
+    if( i >= entry_count ) break;
+
+    index_file( &entries[i] );
+  }
+
+  return NULL;
+}
+#endif				/* #ifdef HAVE_PTHREAD */
+
+/* Index every file in 'entries' using up to 'jobs' threads, including
+   this one */
+static void
+index_entries( void )
+{
+#ifdef HAVE_PTHREAD
+  pthread_t threads[ MAX_JOBS ];
+  int i, started = 0;
+
+  if( jobs <= 0 ) {
+#ifdef _SC_NPROCESSORS_ONLN
+    jobs = sysconf( _SC_NPROCESSORS_ONLN );
+#endif
+    if( jobs <= 0 ) jobs = 1;
+  }
+  if( jobs > MAX_JOBS ) jobs = MAX_JOBS;
+
+  next_entry = 0;
+
+  for( i = 0; i < jobs - 1; i++ ) {
+    if( pthread_create( &threads[i], NULL, index_worker, NULL ) ) break;
+    started++;
+  }
+
+  index_worker( NULL );
+
+  for( i = 0; i < started; i++ )
+    pthread_join( threads[i], NULL );
+
+#else				/* #ifdef HAVE_PTHREAD */
+
+  for( next_entry = 0; next_entry < entry_count; next_entry++ )
+    index_file( &entries[ next_entry ] );
+
+#endif				/* #ifdef HAVE_PTHREAD */
+}
+
+static int
+index_paths( int count, char **paths, const char *outfile, int duplicates )
+{
+  FILE *f = stdout;
+  size_t i, j, k, found;
+  int n, error = 0;
+
+  for( n = 0; n < count; n++ )
+    if( add_path( paths[n] ) ) error = 1;
+
+  index_entries();
+
+  qsort( entries, entry_count, sizeof( *entries ), compare_entries );
+
+  if( outfile ) {
+    f = fopen( outfile, "w" );
+    if( !f ) {
+      fprintf( stderr, "%s: couldn't open `%s': %s\n", progname, outfile,
+	       strerror( errno ) );
+      return 1;
+    }
+  }
+
+  for( i = 0; i < entry_count; i++ ) {
+    index_entry *entry = &entries[i];
+
+    if( entry->error ) { error = 1; continue; }
+
+    sanitise( entry->details );
+    sanitise( entry->path );
+
+    fprintf( f, "%016llx\t%s\t%d\t%s\t%s\n", entry->hash,
+	     class_name( entry->class ), entry->type, entry->details,
+	     entry->path );
+  }
+
+  if( outfile && fclose( f ) ) {
+    fprintf( stderr, "%s: error writing to `%s': %s\n", progname, outfile,
+	     strerror( errno ) );
+    error = 1;
+  }
+
+  /* Report each set of files with the same contents */
+  if( duplicates ) {
+    for( i = 0; i < entry_count; i = j ) {
+      for( j = i + 1;
+	   j < entry_count && entries[j].hash == entries[i].hash; j++ )
+	;
+
+      found = 0;
+      for( k = i; k < j; k++ )
+	if( !entries[k].error ) found++;
+      if( found < 2 ) continue;
+
+      printf( "%016llx:", entries[i].hash );
+      for( k = i; k < j; k++ )
+	if( !entries[k].error ) printf( " %s", entries[k].path );
+      printf( "\n" );
+    }
+  }
+
+  for( i = 0; i < entry_count; i++ ) {
+    libspectrum_free( entries[i].path );
+    libspectrum_free( entries[i].details );
+  }
+  libspectrum_free( entries );
+
+  return error;
+}
+
+static void
+add_entry( const char *path )
+{
+  index_entry *entry;
+
+  if( entry_count == entries_allocated ) {
+    entries_allocated = entries_allocated ? 2 * entries_allocated : 1024;
+    entries = libspectrum_renew( index_entry, entries, entries_allocated );
+  }
+
+  entry = &entries[ entry_count++ ];
+  entry->path = utils_safe_strdup( path );
+  entry->hash = HASH_INIT;
+  entry->class = LIBSPECTRUM_CLASS_UNKNOWN;
+  entry->type = LIBSPECTRUM_ID_UNKNOWN;
+  entry->details = NULL;
+  entry->error = 0;
+}
+
+/* Add a file to the list to be indexed, or everything below a directory */
+static int
+add_path( const char *path )
+{
+  struct stat file_info;
+  int error = 0;
+
+  if( stat( path, &file_info ) ) {
+    fprintf( stderr, "%s: couldn't stat `%s': %s\n", progname, path,
+	     strerror( errno ) );
+    return 1;
+  }
+
+  if( S_ISDIR( file_info.st_mode ) ) {
+#ifdef HAVE_DIRENT_H
+    DIR *dir;
+    struct dirent *dirent;
+
+    dir = opendir( path );
+    if( !dir ) {
+      fprintf( stderr, "%s: couldn't open `%s': %s\n", progname, path,
+	       strerror( errno ) );
+      return 1;
+    }
+
+    while( ( dirent = readdir( dir ) ) ) {
+      char *child;
+      size_t length;
+
+      if( !strcmp( dirent->d_name, "." ) || !strcmp( dirent->d_name, ".." ) )
+	continue;
+
+      length = strlen( path ) + strlen( dirent->d_name ) + 2;
+      child = libspectrum_new( char, length );
+      snprintf( child, length, "%s/%s", path, dirent->d_name );
+
+      /* Don't follow symbolic links to directories, so we can't loop */
+      if( !lstat( child, &file_info ) && !S_ISLNK( file_info.st_mode ) )
+	error |= add_path( child );
+      else if( !stat( child, &file_info ) && S_ISREG( file_info.st_mode ) )
+	add_entry( child );
+
+      libspectrum_free( child );
+    }
+
+    closedir( dir );
+#else				/* #ifdef HAVE_DIRENT_H */
+    fprintf( stderr, "%s: `%s' is a directory\n", progname, path );
+    error = 1;
+#endif				/* #ifdef HAVE_DIRENT_H */
+  } else if( S_ISREG( file_info.st_mode ) ) {
+    add_entry( path );
+  }
+
+  return error;
+}
+
+/* Read a file, decompress it as many times as needed and index what's
+   inside */
+static void
+index_file( index_entry *entry )
+{
+  unsigned char *file_buffer;
+  libspectrum_byte *buffer, *new_buffer;
+  size_t length, new_length;
+  char *filename, *new_filename;
+  libspectrum_id_t type;
+  libspectrum_class_t class;
+
+  if( read_file( entry->path, &file_buffer, &length ) ) {
+    entry->error = 1;
+    return;
+  }
+
+  buffer = file_buffer;
+  filename = utils_safe_strdup( entry->path );
+
+  while( 1 ) {
+    if( libspectrum_identify_file_raw( &type, filename, buffer, length ) ||
+	libspectrum_identify_class( &class, type ) ) {
+      entry->error = 1;
+      break;
+    }
+
+    if( class != LIBSPECTRUM_CLASS_COMPRESSED ) {
+      entry->type = type;
+      entry->class = class;
+      if( index_contents( entry, buffer, length ) ) {
+	fprintf( stderr, "%s: couldn't read `%s'\n", progname, entry->path );
+	entry->error = 1;
+      }
+      break;
+    }
+
+    new_filename = NULL;
+    if( libspectrum_uncompress_file( &new_buffer, &new_length, &new_filename,
+				     type, buffer, length, filename ) ) {
+      fprintf( stderr, "%s: couldn't decompress `%s'\n", progname,
+	       entry->path );
+      entry->error = 1;
+      break;
+    }
+
+    if( buffer != file_buffer ) libspectrum_free( buffer );
+    libspectrum_free( filename );
+
+    buffer = new_buffer; length = new_length;
+    filename = utils_safe_strdup( new_filename ? new_filename : "" );
+    free( new_filename );
+  }
+
+  if( buffer != file_buffer ) libspectrum_free( buffer );
+  libspectrum_free( filename );
+  free( file_buffer );
+}
+
+static char *
+snapshot_details( libspectrum_snap *snap, index_hash *hash )
+{
+  libspectrum_machine machine = libspectrum_snap_machine( snap );
+  int i;
+
+  /* Only the state which every format can store */
+  hash_dword( hash, machine );
+  hash_dword( hash, libspectrum_snap_pc( snap ) );
+  hash_dword( hash, libspectrum_snap_sp( snap ) );
+  hash_dword( hash,
+	      libspectrum_snap_a( snap ) << 8 | libspectrum_snap_f( snap ) );
+  hash_dword( hash, libspectrum_snap_bc( snap ) );
+  hash_dword( hash, libspectrum_snap_de( snap ) );
+  hash_dword( hash, libspectrum_snap_hl( snap ) );
+  hash_dword( hash, libspectrum_snap_ix( snap ) );
+  hash_dword( hash, libspectrum_snap_iy( snap ) );
+
+  for( i = 0; i < 16; i++ ) {
+    const libspectrum_byte *page = libspectrum_snap_pages( snap, i );
+    if( !page ) continue;
+    hash_dword( hash, i );
+    hash_bytes( hash, page, 0x4000 );
+  }
+
+  return utils_safe_strdup( libspectrum_machine_name( machine ) );
+}
+
+typedef enum loader_type {
+  LOADER_NONE,			/* no data at all */
+  LOADER_ROM,			/* only standard speed blocks */
+  LOADER_TURBO,			/* data at non-standard timings */
+  LOADER_CUSTOM,		/* pulses, raw or generalised data */
+} loader_type;
+
+static const char *loader_names[] = { "none", "rom", "turbo", "custom" };
+
+static char *
+tape_details( libspectrum_tape *tape, index_hash *hash )
+{
+  libspectrum_tape_block *block;
+  libspectrum_tape_iterator iterator;
+  loader_type loader = LOADER_NONE;
+  const char *title = NULL, *publisher = NULL, *year = NULL;
+  char *details;
+  size_t i, length;
+  int blocks = 0;
+
+  for( block = libspectrum_tape_iterator_init( &iterator, tape );
+       block;
+       block = libspectrum_tape_iterator_next( &iterator ) ) {
+
+    loader_type block_loader = LOADER_NONE;
+
+    switch( libspectrum_tape_block_type( block ) ) {
+
+    case LIBSPECTRUM_TAPE_BLOCK_ROM:
+      block_loader = LOADER_ROM;
+      break;
+
+    case LIBSPECTRUM_TAPE_BLOCK_TURBO:
+    case LIBSPECTRUM_TAPE_BLOCK_PURE_DATA:
+    case LIBSPECTRUM_TAPE_BLOCK_DATA_BLOCK:
+      block_loader = LOADER_TURBO;
+      break;
+
+    case LIBSPECTRUM_TAPE_BLOCK_PULSES:
+    case LIBSPECTRUM_TAPE_BLOCK_RAW_DATA:
+    case LIBSPECTRUM_TAPE_BLOCK_GENERALISED_DATA:
+    case LIBSPECTRUM_TAPE_BLOCK_RLE_PULSE:
+    case LIBSPECTRUM_TAPE_BLOCK_PULSE_SEQUENCE:
+      block_loader = LOADER_CUSTOM;
+      break;
+
+    case LIBSPECTRUM_TAPE_BLOCK_ARCHIVE_INFO:
+      for( i = 0; i < libspectrum_tape_block_count( block ); i++ ) {
+	const char *text = libspectrum_tape_block_texts( block, i );
+	switch( libspectrum_tape_block_ids( block, i ) ) {
+	case 0: title = text; break;
+	case 1: publisher = text; break;
+	case 3: year = text; break;
+	}
+      }
+      break;
+
+    default:
+      break;
+
+    }
+
+    if( block_loader > loader ) loader = block_loader;
+
+    /* The data is what matters, not how it was encoded */
+    if( block_loader == LOADER_ROM || block_loader == LOADER_TURBO ) {
+      length = libspectrum_tape_block_data_length( block );
+      hash_dword( hash, length );
+      hash_bytes( hash, libspectrum_tape_block_data( block ), length );
+      blocks++;
+    }
+  }
+
+  length = 64 + ( title ? strlen( title ) : 0 ) +
+	   ( publisher ? strlen( publisher ) : 0 ) +
+	   ( year ? strlen( year ) : 0 );
+  details = libspectrum_new( char, length );
+  snprintf( details, length, "%d blocks, %s loader%s%s%s%s%s%s", blocks,
+	    loader_names[ loader ],
+	    title ? ", " : "", title ? title : "",
+	    publisher ? ", " : "", publisher ? publisher : "",
+	    year ? ", " : "", year ? year : "" );
+
+  return details;
+}
+
+/* Hash the normalised contents of a decompressed file and describe it */
+static int
+index_contents( index_entry *entry, const libspectrum_byte *buffer,
+		size_t length )
+{
+  libspectrum_snap *snap;
+  libspectrum_tape *tape;
+
+  switch( entry->class ) {
+
+  case LIBSPECTRUM_CLASS_SNAPSHOT:
+    snap = libspectrum_snap_alloc();
+    if( libspectrum_snap_read( snap, buffer, length, entry->type, NULL ) ) {
+      libspectrum_snap_free( snap );
+      return 1;
+    }
+    entry->details = snapshot_details( snap, &entry->hash );
+    libspectrum_snap_free( snap );
+    return 0;
+
+  case LIBSPECTRUM_CLASS_TAPE:
+    tape = libspectrum_tape_alloc();
+    if( libspectrum_tape_read( tape, buffer, length, entry->type, NULL ) ) {
+      libspectrum_tape_free( tape );
+      return 1;
+    }
+    entry->details = tape_details( tape, &entry->hash );
+    libspectrum_tape_free( tape );
+    return 0;
+
+  default:
+    hash_bytes( &entry->hash, buffer, length );
+    entry->details = libspectrum_new( char, 32 );
+    snprintf( entry->details, 32, "%lu bytes", (unsigned long)length );
+    return 0;
+
+  }
+}
+
+static int
+compare_hash( const void *a, const void *b )
+{
+  const index_hash *hash1 = a;
+  const index_entry *entry = b;
+
+  return *hash1 < entry->hash ? -1 : *hash1 > entry->hash ? 1 : 0;
+}
+
+/* Hash each file and print the index lines with the same hash */
+static int
+lookup_files( const char *indexfile, int count, char **paths )
+{
+  unsigned char *buffer;
+  char *line, *next, *end;
+  size_t length, i;
+  int k, error = 0;
+
+  if( read_file( indexfile, &buffer, &length ) ) return 1;
+
+  /* Each index line becomes an entry whose 'path' is the whole line */
+  for( line = (char*)buffer; line < (char*)buffer + length; line = next ) {
+    end = memchr( line, '\n', (char*)buffer + length - line );
+    if( !end ) end = (char*)buffer + length;
+    next = end + 1;
+    *end = '\0';
+
+    if( *line ) {
+      add_entry( line );
+      entries[ entry_count - 1 ].hash = strtoull( line, NULL, 16 );
+    }
+  }
+
+  free( buffer );
+
+  qsort( entries, entry_count, sizeof( *entries ), compare_entries );
+
+  for( k = 0; k < count; k++ ) {
+    index_entry file, *match;
+
+    memset( &file, 0, sizeof( file ) );
+    file.path = paths[k];
+    file.hash = HASH_INIT;
+    index_file( &file );
+    libspectrum_free( file.details );
+
+    if( file.error ) { error = 1; continue; }
+
+    match = bsearch( &file.hash, entries, entry_count, sizeof( *entries ),
+		     compare_hash );
+    if( !match ) {
+      printf( "%s: not found\n", paths[k] );
+      continue;
+    }
+
+    /* bsearch() finds any one of the matches, so go back to the first */
+    while( match > entries && match[-1].hash == file.hash ) match--;
+
+    for( ; match < entries + entry_count && match->hash == file.hash;
+	 match++ )
+      printf( "%s: %s\n", paths[k], match->path );
+  }
+
+  for( i = 0; i < entry_count; i++ ) libspectrum_free( entries[i].path );
+  libspectrum_free( entries );
+
+  return error;
+}
@@ -175,3 +175,15 @@ read_file( const char *filename, unsigned char **buffer, size_t *length )
   
   return 0;
 }
+
+char *
+utils_safe_strdup( const char *src )
+{
+  char *dest = NULL;
+  if( src ) {
+    size_t length = strlen( src ) + 1;
+    dest = libspectrum_new( char, length );
+    memcpy( dest, src, length );
+  }
+  return dest;
+}
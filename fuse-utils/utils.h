@@ -32,6 +32,8 @@ int init_libspectrum( void );
 int get_creator( libspectrum_creator **creator, const char *program );
 int read_file( const char *filename, unsigned char **buffer, size_t *length );
 
+char *utils_safe_strdup( const char *src );
+
 struct rzx_key {
   libspectrum_dword id;
   const char *description;
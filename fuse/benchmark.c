@@ -0,0 +1,327 @@
+/* benchmark.c: Emulation speed benchmarks
+   Copyright (c) 2015 Philip Kendall
+
+   $Id$
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+/*
+  Each workload is a short machine code program run on a freshly reset
+  machine for settings_current.benchmark_frames frames, as fast as
+  possible: the speed regulating timer is removed and sound is generated
+  but never sent to a sound device. The results are printed one line per
+  workload, tab separated:
+
+    workload, machine, frames, emulated MHz, host ns per instruction,
+    then the seconds spent in the Z80 core, display, sound and the other
+    events
+
+  Instructions are counted as RZX does, one per M1 cycle. Display and
+  sound updates made while an instruction is executing (screen writes,
+  border changes, beeper and AY writes) are charged to the Z80; the
+  display and sound times are those of the end of frame work.
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <libspectrum.h>
+
+#include "benchmark.h"
+#include "event.h"
+#include "fuse.h"
+#include "machine.h"
+#include "memory.h"
+#include "settings.h"
+#include "sound.h"
+#include "tape.h"
+#include "timer/timer.h"
+#include "ui/ui.h"
+#include "z80/z80.h"
+
+int benchmark_active = 0;
+
+static benchmark_subsystem current_subsystem;
+static double subsystem_start;
+static double subsystem_time[ BENCHMARK_SUBSYSTEMS ];
+
+typedef struct benchmark_workload_t {
+
+  const char *name;
+  libspectrum_machine machine;
+
+  libspectrum_word address;	/* where the code is loaded and started */
+  const libspectrum_byte *code;
+  size_t length;
+
+  int (*setup)( void );		/* anything else needed; may be NULL */
+
+} benchmark_workload_t;
+
+/* Register arithmetic in uncontended memory */
+static const libspectrum_byte alu_code[] = {
+  0xf3,				/*       di          */
+  0x80,				/* loop: add a,b     */
+  0xa9,				/*       xor c       */
+  0x0c,				/*       inc c       */
+  0x91,				/*       sub c       */
+  0xb0,				/*       or b        */
+  0x17,				/*       rla         */
+  0x10, 0xf8,			/*       djnz loop   */
+  0x18, 0xf6,			/*       jr loop     */
+};
+
+/* Running from, reading and writing to contended memory, including the
+   first third of the screen */
+static const libspectrum_byte contended_code[] = {
+  0xf3,				/*       di          */
+  0x21, 0x00, 0x40,		/*       ld hl,16384 */
+  0x7e,				/* loop: ld a,(hl)   */
+  0x2f,				/*       cpl         */
+  0x77,				/*       ld (hl),a   */
+  0x23,				/*       inc hl      */
+  0x7c,				/*       ld a,h      */
+  0xe6, 0x47,			/*       and 0x47    */
+  0x67,				/*       ld h,a      */
+  0x18, 0xf6,			/*       jr loop     */
+};
+
+/* Large block copies */
+static const libspectrum_byte ldir_code[] = {
+  0xf3,				/*       di          */
+  0x21, 0x00, 0x90,		/* loop: ld hl,0x9000 */
+  0x11, 0x00, 0xc0,		/*       ld de,0xc000 */
+  0x01, 0x00, 0x30,		/*       ld bc,0x3000 */
+  0xed, 0xb0,			/*       ldir        */
+  0x18, 0xf3,			/*       jr loop     */
+};
+
+/* Changing the border colour as fast as possible, as border effect demos
+   do */
+static const libspectrum_byte border_code[] = {
+  0xf3,				/*       di          */
+  0xaf,				/*       xor a       */
+  0xd3, 0xfe,			/* loop: out (254),a */
+  0x3c,				/*       inc a       */
+  0xe6, 0x07,			/*       and 7       */
+  0x18, 0xf9,			/*       jr loop     */
+};
+
+/* Writing every AY register in turn, over and over */
+static const libspectrum_byte ay_code[] = {
+  0xf3,				/*       di          */
+  0x16, 0x00,			/*       ld d,0      */
+  0x1e, 0x00,			/* regs: ld e,0      */
+  0x01, 0xfd, 0xff,		/* next: ld bc,0xfffd */
+  0xed, 0x59,			/*       out (c),e   */
+  0x06, 0xbf,			/*       ld b,0xbf   */
+  0xed, 0x51,			/*       out (c),d   */
+  0x14,				/*       inc d       */
+  0x1c,				/*       inc e       */
+  0x7b,				/*       ld a,e      */
+  0xfe, 0x0e,			/*       cp 14       */
+  0x20, 0xf0,			/*       jr nz,next  */
+  0x18, 0xec,			/*       jr regs     */
+};
+
+/* Loading screen sized blocks with the ROM loader */
+static const libspectrum_byte tape_code[] = {
+  0xf3,				/* loop: di          */
+  0xdd, 0x21, 0x00, 0xc0,	/*       ld ix,0xc000 */
+  0x11, 0x00, 0x1b,		/*       ld de,6912  */
+  0x3e, 0xff,			/*       ld a,255    */
+  0x37,				/*       scf         */
+  0xcd, 0x56, 0x05,		/*       call 1366   */
+  0x18, 0xf0,			/*       jr loop     */
+};
+
+static int tape_setup( void );
+
+static benchmark_workload_t workloads[] = {
+  { "alu",       LIBSPECTRUM_MACHINE_48,  0x8000,
+    alu_code, sizeof( alu_code ), NULL },
+  { "contended", LIBSPECTRUM_MACHINE_48,  0x6000,
+    contended_code, sizeof( contended_code ), NULL },
+  { "ldir",      LIBSPECTRUM_MACHINE_48,  0x8000,
+    ldir_code, sizeof( ldir_code ), NULL },
+  { "border",    LIBSPECTRUM_MACHINE_48,  0x8000,
+    border_code, sizeof( border_code ), NULL },
+  { "ay",        LIBSPECTRUM_MACHINE_128, 0x8000,
+    ay_code, sizeof( ay_code ), NULL },
+  { "tape",      LIBSPECTRUM_MACHINE_48,  0x8000,
+    tape_code, sizeof( tape_code ), tape_setup },
+};
+
+void
+benchmark_switch( benchmark_subsystem subsystem )
+{
+  double now = timer_get_time();
+
+  subsystem_time[ current_subsystem ] += now - subsystem_start;
+  subsystem_start = now;
+  current_subsystem = subsystem;
+}
+
+/* A .tap file with enough blocks to keep loading for the whole run: each
+   block takes about four and a half seconds to load */
+static int
+tape_setup( void )
+{
+  const size_t block_length = 6912 + 2;
+  size_t blocks, i, j;
+  libspectrum_byte *buffer, *ptr;
+  int error;
+
+  blocks = settings_current.benchmark_frames / 200 + 1;
+  buffer = ptr = libspectrum_new( libspectrum_byte,
+				  blocks * ( block_length + 2 ) );
+
+  for( i = 0; i < blocks; i++ ) {
+    libspectrum_byte checksum = 0xff;
+
+    *ptr++ = block_length & 0xff; *ptr++ = block_length >> 8;
+    *ptr++ = 0xff;
+    for( j = 0; j < 6912; j++ ) {
+      *ptr = ( i + j * 7 ) ^ ( j >> 5 );
+      checksum ^= *ptr++;
+    }
+    *ptr++ = checksum;
+  }
+
+  error = tape_read_buffer( buffer, ptr - buffer, LIBSPECTRUM_ID_TAPE_TAP,
+			    NULL, 0 );
+  libspectrum_free( buffer );
+  if( error ) return error;
+
+  /* The ROM's interrupt routine is run between blocks */
+  z80.iy.w = 0x5c3a; z80.im = 1;
+
+  return tape_do_play( 0 );
+}
+
+static int
+run_workload( benchmark_workload_t *workload )
+{
+  libspectrum_dword target, done = 0, instructions = 0;
+  double start, elapsed;
+  size_t i;
+  int error;
+
+  error = machine_select( workload->machine ); if( error ) return error;
+  if( machine_current->machine != workload->machine ) {
+    ui_error( UI_ERROR_ERROR, "benchmark '%s' needs the %s",
+	      workload->name,
+	      libspectrum_machine_name( workload->machine ) );
+    return 1;
+  }
+
+  /* Run flat out */
+  event_remove_type( timer_event );
+
+  for( i = 0; i < workload->length; i++ )
+    writebyte_internal( workload->address + i, workload->code[i] );
+
+  z80.pc.w = workload->address;
+  z80.sp.w = 0xff00;
+  z80.iff1 = z80.iff2 = 0;
+
+  if( workload->setup ) {
+    error = workload->setup(); if( error ) return error;
+  }
+
+  target = settings_current.benchmark_frames *
+	   machine_current->timings.tstates_per_frame;
+
+  for( i = 0; i < BENCHMARK_SUBSYSTEMS; i++ ) subsystem_time[i] = 0;
+
+  benchmark_active = 1;
+  start = subsystem_start = timer_get_time();
+  current_subsystem = BENCHMARK_EVENTS;
+
+  while( done < target ) {
+    libspectrum_dword before = tstates;
+    libspectrum_word r = z80.r;
+
+    benchmark_switch( BENCHMARK_Z80 );
+    z80_do_opcodes();
+    done += tstates - before;
+    instructions += (libspectrum_word)( z80.r - r );
+
+    benchmark_switch( BENCHMARK_EVENTS );
+    event_do_events();
+  }
+
+  benchmark_switch( BENCHMARK_EVENTS );
+  elapsed = timer_get_time() - start;
+  benchmark_active = 0;
+
+  if( elapsed <= 0 ) elapsed = 1e-6;
+
+  printf( "%s\t%s\t%d\t%.2f\t%.2f\t%.3f\t%.3f\t%.3f\t%.3f\n",
+	  workload->name, machine_current->id,
+	  settings_current.benchmark_frames, done / elapsed / 1000000,
+	  instructions ? elapsed * 1e9 / instructions : 0,
+	  subsystem_time[ BENCHMARK_Z80 ], subsystem_time[ BENCHMARK_DISPLAY ],
+	  subsystem_time[ BENCHMARK_SOUND ],
+	  subsystem_time[ BENCHMARK_EVENTS ] );
+
+  if( workload->setup == tape_setup ) tape_close();
+
+  return 0;
+}
+
+int
+benchmark_run( void )
+{
+  const char *name = settings_current.benchmark;
+  size_t i;
+  int found = 0, error = 0;
+
+  /* Generate the sound, but don't play it; and the tape must be loaded
+     by the ROM loader */
+  sound_end();
+  settings_current.sound = 0;
+  sound_silent = 1;
+  settings_current.tape_traps = 0;
+
+  if( settings_current.benchmark_frames < 1 )
+    settings_current.benchmark_frames = 1;
+
+  printf( "# workload\tmachine\tframes\tMHz\tns/instruction\t"
+	  "z80\tdisplay\tsound\tevents\n" );
+
+  for( i = 0; i < ARRAY_SIZE( workloads ); i++ ) {
+    if( strcmp( name, "all" ) && strcmp( name, workloads[i].name ) ) continue;
+
+    found = 1;
+    if( run_workload( &workloads[i] ) ) error = 1;
+    fflush( stdout );
+  }
+
+  if( !found ) {
+    ui_error( UI_ERROR_ERROR, "unknown benchmark '%s'", name );
+    return 1;
+  }
+
+  return error;
+}
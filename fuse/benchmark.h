@@ -0,0 +1,50 @@
+/* benchmark.h: Emulation speed benchmarks
+   Copyright (c) 2015 Philip Kendall
+
+   $Id$
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+#ifndef FUSE_BENCHMARK_H
+#define FUSE_BENCHMARK_H
+
+/* The parts of the emulation time is charged to */
+typedef enum benchmark_subsystem {
+
+  BENCHMARK_Z80,
+  BENCHMARK_DISPLAY,
+  BENCHMARK_SOUND,
+  BENCHMARK_EVENTS,
+
+  BENCHMARK_SUBSYSTEMS,		/* End marker */
+
+} benchmark_subsystem;
+
+extern int benchmark_active;
+
+/* Charge the time from now on to 'subsystem' */
+void benchmark_switch( benchmark_subsystem subsystem );
+
+/* Run the workloads named by settings_current.benchmark and print the
+   results */
+int benchmark_run( void );
+
+#endif			/* #ifndef FUSE_BENCHMARK_H */
@@ -32,6 +32,10 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif				/* #ifdef HAVE_SYS_MMAN_H */
+
 #include "compat.h"
 #include "utils.h"
 #include "ui/ui.h"
@@ -71,6 +75,35 @@ compat_file_read( compat_fd fd, utils_file *file )
   return 0;
 }
 
+/* Map file->length bytes of the file read-only into memory. Returns
+   non-zero if the file could not be mapped, in which case the caller
+   should fall back to compat_file_read() */
+int
+compat_file_map( compat_fd fd, utils_file *file )
+{
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+  void *buffer;
+
+  if( file->length == 0 ) return 1;
+
+  buffer = mmap( NULL, file->length, PROT_READ, MAP_PRIVATE, fileno( fd ), 0 );
+  if( buffer == MAP_FAILED ) return 1;
+
+  file->buffer = buffer;
+  return 0;
+#else				/* #if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H */
+  return 1;
+#endif				/* #if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H */
+}
+
+void
+compat_file_unmap( utils_file *file )
+{
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+  munmap( file->buffer, file->length );
+#endif				/* #if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H */
+}
+
 int
 compat_file_write( compat_fd fd, const unsigned char *buffer, size_t length )
 {
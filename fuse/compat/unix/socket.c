@@ -29,6 +29,10 @@
 #include <string.h>
 #include <unistd.h>
 
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
 #include "compat.h"
 #include "fuse.h"
 #include "ui/ui.h"
@@ -36,6 +40,8 @@
 const compat_socket_t compat_socket_invalid = -1;
 const int compat_socket_EBADF = EBADF;
 
+/* Where available, an eventfd does the job of the pipe: a single
+   descriptor, and any number of wakes is discarded with one read */
 struct compat_socket_selfpipe_t {
   int read_fd;
   int write_fd;
@@ -78,6 +84,12 @@ compat_socket_selfpipe_t* compat_socket_selfpipe_alloc( void )
   compat_socket_selfpipe_t *self =
     libspectrum_new( compat_socket_selfpipe_t, 1 );
 
+#ifdef HAVE_SYS_EVENTFD_H
+  self->read_fd = self->write_fd = eventfd( 0, 0 );
+  if( self->read_fd != -1 )
+    return self;
+#endif
+
   error = pipe( pipefd );
   if( error ) {
     ui_error( UI_ERROR_ERROR, "%s: %d: error %d creating pipe", __FILE__, __LINE__, error );
@@ -93,7 +105,8 @@ compat_socket_selfpipe_t* compat_socket_selfpipe_alloc( void )
 void compat_socket_selfpipe_free( compat_socket_selfpipe_t *self )
 {
   close( self->read_fd );
-  close( self->write_fd );
+  if( self->write_fd != self->read_fd )
+    close( self->write_fd );
   libspectrum_free( self );
 }
 
@@ -105,6 +118,14 @@ compat_socket_t compat_socket_selfpipe_get_read_fd( compat_socket_selfpipe_t *se
 void compat_socket_selfpipe_wake( compat_socket_selfpipe_t *self )
 {
   const char dummy = 0;
+
+#ifdef HAVE_SYS_EVENTFD_H
+  if( self->write_fd == self->read_fd ) {
+    eventfd_write( self->write_fd, 1 );
+    return;
+  }
+#endif
+
   write( self->write_fd, &dummy, 1 );
 }
 
@@ -113,6 +134,18 @@ void compat_socket_selfpipe_discard_data( compat_socket_selfpipe_t *self )
   char bitbucket;
   ssize_t bytes_read;
 
+#ifdef HAVE_SYS_EVENTFD_H
+  eventfd_t count;
+
+  if( self->write_fd == self->read_fd ) {
+    if( eventfd_read( self->read_fd, &count ) == -1 && errno != EAGAIN )
+      ui_error( UI_ERROR_ERROR,
+                "%s: %d: unexpected error %d (%s) reading from eventfd",
+                __FILE__, __LINE__, errno, strerror(errno) );
+    return;
+  }
+#endif
+
   do {
     bytes_read = read( self->read_fd, &bitbucket, 1 );
     if( bytes_read == -1 && errno != EINTR ) {
@@ -37,6 +37,7 @@
 #include "machine.h"
 #include "movie.h"
 #include "peripherals/scld.h"
+#include "quicksave.h"
 #include "rectangle.h"
 #include "screenshot.h"
 #include "settings.h"
@@ -164,6 +165,9 @@ display_init( int *argc, char ***argv )
   if(ui_init(argc, argv))
     return 1;
 
+  quicksave_register( &display_lores_border, sizeof( display_lores_border ) );
+  quicksave_register( &display_hires_border, sizeof( display_hires_border ) );
+
   /* Set up the 'all pixels must be refreshed' marker */
   display_all_dirty = 0;
   for( i = 0; i < DISPLAY_SCREEN_WIDTH_COLS; i++ )
@@ -51,6 +51,7 @@
 #include <fat.h>
 #endif				/* #ifdef GEKKO */
 
+#include "benchmark.h"
 #include "debugger/debugger.h"
 #include "display.h"
 #include "event.h"
@@ -84,12 +85,14 @@
 #include "pokefinder/pokemem.h"
 #include "profile.h"
 #include "psg.h"
+#include "quicksave.h"
 #include "rzx.h"
 #include "settings.h"
 #include "slt.h"
 #include "snapshot.h"
 #include "sound.h"
 #include "spectrum.h"
+#include "stems.h"
 #include "tape.h"
 #include "timer/timer.h"
 #include "ui/scaler/scaler.h"
@@ -178,6 +181,8 @@ int main(int argc, char **argv)
 
   if( settings_current.unittests ) {
     r = unittests_run();
+  } else if( settings_current.benchmark ) {
+    r = benchmark_run();
   } else {
     while( !fuse_exiting ) {
       z80_do_opcodes();
@@ -332,6 +337,7 @@ static int fuse_init(int argc, char **argv)
 
   fuse_emulation_paused = 0;
   movie_init();
+  stems_init();
 
   return 0;
 }
@@ -547,7 +553,7 @@ parse_nonoption_args( int argc, char **argv, int first_arg,
 
     filename = argv[i];
 
-    error = utils_read_file( filename, &file );
+    error = utils_map_file( filename, &file );
     if( error ) return error;
 
     error = libspectrum_identify_file_with_class( &type, &class, filename,
@@ -840,6 +846,7 @@ static int fuse_end(void)
   settings_end();
 
   psg_end();
+  stems_end();
   rzx_end();
   tape_end();
   debugger_end();
@@ -868,6 +875,7 @@ static int fuse_end(void)
   ui_media_drive_end();
   memory_end();
   mempool_end();
+  quicksave_end();
   module_end();
   pokemem_end();
 
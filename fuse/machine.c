@@ -42,6 +42,7 @@
 #include "movie.h"
 #include "peripherals/ula.h"
 #include "pokefinder/pokemem.h"
+#include "quicksave.h"
 #include "settings.h"
 #include "snapshot.h"
 #include "sound.h"
@@ -50,6 +51,7 @@
 #include "ui/ui.h"
 #include "ui/uidisplay.h"
 #include "utils.h"
+#include "z80/z80.h"
 
 fuse_machine_info **machine_types = NULL; /* Array of available machines */
 int machine_count = 0;
@@ -334,6 +336,7 @@ machine_reset( int hard_reset )
   tape_stop();
 
   memory_pool_free();
+  quicksave_invalidate();
 
   machine_current->ram.romcs = 0;
 
@@ -348,10 +351,14 @@ machine_reset( int hard_reset )
 
   error = machine_current->memory_map(); if( error ) return error;
 
-  /* Set up the contention array */
+  /* Set up the contention array, and see if there's any contention at
+     all */
+  z80_contention_free = 1;
   for( i = 0; i < machine_current->timings.tstates_per_frame; i++ ) {
     ula_contention[ i ] = machine_current->ram.contend_delay( i );
     ula_contention_no_mreq[ i ] = machine_current->ram.contend_delay_no_mreq( i );
+    if( ula_contention[ i ] || ula_contention_no_mreq[ i ] )
+      z80_contention_free = 0;
   }
 
   /* Update the disk menu items */
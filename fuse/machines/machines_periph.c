@@ -114,11 +114,17 @@ static const periph_port_t beta128_pentagon_ports[] = {
   { 0, 0, NULL, NULL }
 };
 
+static const periph_pc_trap_t beta128_pentagon_pc_traps[] = {
+  { 0xfe00, 0x3c00, beta_pc_trap, NULL },
+  { 0, 0, NULL, NULL }
+};
+
 static const periph_t beta128_pentagon = {
   NULL,
   beta128_pentagon_ports,
   0,
-  NULL
+  NULL,
+  beta128_pentagon_pc_traps
 };
 
 static const periph_port_t beta128_pentagon_late_ports[] = {
@@ -134,7 +140,8 @@ static const periph_t beta128_pentagon_late = {
   NULL,
   beta128_pentagon_late_ports,
   0,
-  NULL
+  NULL,
+  beta128_pentagon_pc_traps
 };
 
 static const periph_port_t pentagon1024_memory_ports[] = {
@@ -39,6 +39,7 @@
 #include "peripherals/disk/opus.h"
 #include "peripherals/spectranet.h"
 #include "peripherals/ula.h"
+#include "quicksave.h"
 #include "settings.h"
 #include "spectrum.h"
 #include "ui/ui.h"
@@ -132,6 +133,14 @@ memory_init( void )
     }
 
   module_register( &memory_module_info );
+
+  /* The RAM itself is quicksaved separately as not all of it is in use */
+  quicksave_register( memory_map_read, sizeof( memory_map_read ) );
+  quicksave_register( memory_map_write, sizeof( memory_map_write ) );
+  quicksave_register( memory_map_ram, sizeof( memory_map_ram ) );
+  quicksave_register( &memory_current_screen,
+		      sizeof( memory_current_screen ) );
+  quicksave_register( &memory_screen_mask, sizeof( memory_screen_mask ) );
 }
 
 static void
@@ -50,6 +50,7 @@
 #include "screenshot.h"
 #include "settings.h"
 #include "snapshot.h"
+#include "stems.h"
 #include "tape.h"
 #include "ui/scaler/scaler.h"
 #include "ui/ui.h"
@@ -195,6 +196,19 @@ MENU_CALLBACK( menu_file_aylogging_stop )
   ui_menu_activate( UI_MENU_ITEM_AY_LOGGING, 0 );
 }
 
+MENU_CALLBACK( menu_file_audiostems_stop )
+{
+  if ( !stems_recording ) return;
+
+  ui_widget_finish();
+
+  /* Restart the sound system so it stops rendering the stems */
+  fuse_emulation_pause();
+  stems_stop_recording();
+  ui_menu_activate( UI_MENU_ITEM_AUDIO_STEMS, 0 );
+  fuse_emulation_unpause();
+}
+
 MENU_CALLBACK( menu_file_openscrscreenshot )
 {
   char *filename;
@@ -871,6 +885,28 @@ MENU_CALLBACK( menu_file_aylogging_record )
   fuse_emulation_unpause();
 }
 
+MENU_CALLBACK( menu_file_audiostems_record )
+{
+  char *stemsfile;
+
+  if( stems_recording ) return;
+
+  fuse_emulation_pause();
+
+  stemsfile = ui_get_save_filename( "Fuse - Record Audio Stems" );
+  if( !stemsfile ) { fuse_emulation_unpause(); return; }
+
+  if( !stems_start_recording( stemsfile ) )
+    ui_menu_activate( UI_MENU_ITEM_AUDIO_STEMS, 1 );
+
+  libspectrum_free( stemsfile );
+
+  display_refresh_all();
+
+  /* The sound system starts rendering the stems as it restarts here */
+  fuse_emulation_unpause();
+}
+
 int
 menu_check_media_changed( void )
 {
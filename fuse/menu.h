@@ -64,6 +64,7 @@ MENU_CALLBACK( menu_file_recording_play );
 MENU_CALLBACK( menu_file_recording_stop );
 MENU_CALLBACK( menu_file_recording_finalise );
 MENU_CALLBACK( menu_file_aylogging_stop );
+MENU_CALLBACK( menu_file_audiostems_stop );
 MENU_CALLBACK( menu_file_openscrscreenshot );
 MENU_CALLBACK( menu_file_movie_stop );
 MENU_CALLBACK( menu_file_movie_pause );
@@ -125,6 +126,7 @@ MENU_CALLBACK( menu_file_savebinarydata );
 MENU_CALLBACK( menu_file_exit );
 
 MENU_CALLBACK( menu_file_aylogging_record );
+MENU_CALLBACK( menu_file_audiostems_record );
 
 MENU_CALLBACK( menu_file_savescreenasscr );
 MENU_CALLBACK( menu_file_savescreenaspng );
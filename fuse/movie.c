@@ -48,6 +48,7 @@
 #include "settings.h"
 #include "sound.h"
 #include "ui/ui.h"
+#include "writer.h"
 
 #undef MOVIE_DEBUG_PRINT
 
@@ -58,7 +59,7 @@
     File Header:
       off  len  data          description
       0    4    "FMF_"	Magic header
-      4    2    "V1"		Version
+      4    2    "V2"		Version (V1 files have no keyframes or index)
       6    1    <e|E>		Endianness (e - little / E- big)
       7    1    <U|Z>		Compression ( U - uncompressed / Z - zlib compressed )
       8    1    #		Frame rate ( 1:# )
@@ -69,7 +70,7 @@
       14   1    <S|M>		Sound stereo / mono
       15   1    "\n"		padding (<new line>)
 
-    e.g. FMF_V1eZ\001$AU\000\175M	-> little endian compressed normal screen, 48k timing, u-Law mono 32000Hz sound
+    e.g. FMF_V2eZ\001$AU\000\175M	-> little endian compressed normal screen, 48k timing, u-Law mono 32000Hz sound
     Data
     Frame data header
       off  len  data          description
@@ -113,8 +114,61 @@
       off  len  data          description
       There is no any data... It mark the end of the last frame. So we can
       concat several FMF file without any problem...
+
+    Keyframes (V2)
+      Every 250th frame is a keyframe: its N chunk is followed by the whole
+      screen as a single slice. In a compressed file the zlib stream is
+      finished just before the N chunk and a new one started, so the frame
+      can be decoded starting from its own file offset. The zlib stream
+      after the X chunk is finished as well.
+
+    Index trailer (V2)
+      Follows the X chunk, uncompressed. All values are little endian.
+      off  len  data          description
+      0    4    "FMFI"	Magic header
+      4    4    n		Number of keyframes
+      8    12*n		For every keyframe: frame number (4 bytes, the
+                                first N chunk is frame 1) and file offset
+                                of its N chunk (8 bytes)
+      8+12n 8   offset	File offset of the trailer itself
+      16+12n 4  length	Length of the trailer (24 + 12*n)
+      20+12n 4  "FMFI"	Magic trailer
+*/
+
+/*
+  Encoding a frame (RLE of the screen slices, A-law of the sound, zlib
+  deflate of the lot) is done on a separate writer thread where we have
+  POSIX threads (see writer.c). The emulation thread just records each
+  chunk, together with a copy of the dirty slice of display_last_screen
+  or the sound samples, into a frame buffer, and hands the buffer over at
+  the start of the next frame.
 */
 
+typedef enum movie_chunk_type {
+  MOVIE_CHUNK_DATA,		/* bytes to be written as they are */
+  MOVIE_CHUNK_AREA,		/* screen slice to be RLE encoded */
+  MOVIE_CHUNK_SOUND,		/* sound samples */
+  MOVIE_CHUNK_KEYFRAME,		/* restart compression, add to the index */
+} movie_chunk_type;
+
+typedef struct movie_chunk_t {
+  movie_chunk_type type;
+  size_t length;		/* bytes of data following the header */
+
+  int x, y, w, h;		/* MOVIE_CHUNK_AREA */
+
+  char format, stereo;		/* MOVIE_CHUNK_SOUND */
+  int freq, framesiz;
+  int len;			/* number of samples */
+
+  libspectrum_dword frame;	/* MOVIE_CHUNK_KEYFRAME */
+} movie_chunk_t;
+
+/* Keep the data following each chunk header suitably aligned */
+#define MOVIE_CHUNK_ALIGN( n ) ( ( (n) + 7 ) & ~(size_t)7 )
+
+static writer_t movie_writer;
+
 int movie_recording = 0;
 static int movie_paused = 0;
 
@@ -122,12 +176,23 @@ static int frame_no, slice_no;
 
 static FILE *of = NULL;	/* out file */
 static int fmf_screen;
-static libspectrum_byte head[8];
 static int freq = 0;
 static char stereo = 'M';
 static char format = '?';
 static int framesiz = 4;
 
+/* Frames between keyframes */
+#define MOVIE_KEYFRAME_INTERVAL 250
+
+/* The keyframe index, only touched by the writer */
+typedef struct movie_keyframe_t {
+  libspectrum_dword frame;
+  libspectrum_qword offset;
+} movie_keyframe_t;
+
+static movie_keyframe_t *keyframes = NULL;
+static size_t keyframe_count = 0, keyframe_allocated = 0;
+
 static libspectrum_byte sbuff[ 4096 ];
 #ifdef HAVE_ZLIB_H
 #define ZBUF_SIZE 8192
@@ -217,19 +282,20 @@ fwrite_compr( const void *b, size_t n, size_t m, FILE *f )
 #define fwrite_compr fwrite
 #endif	/* HAVE_ZLIB_H */
 
+/* 'dline' is the copy of the slice taken by movie_add_area(), 'w' dwords
+   per line */
 static void
-movie_compress_area( int x, int y, int w, int h, int s )
+movie_compress_area( const libspectrum_dword *dline, int w, int h, int s )
 {
-  libspectrum_dword *dpoint, *dline;
+  const libspectrum_dword *dpoint;
   libspectrum_byte d, d1, *b;
   libspectrum_byte buff[ 960 ];
   int w0, h0, l;
 
-  dline = &display_last_screen[x + 40 * y];
   b = buff; l = -1;
   d1 = ( ( *dline >> s ) & 0xff ) + 1;		/* *d1 != dpoint :-) */
 
-  for( h0 = h; h0 > 0; h0--, dline += 40 ) {
+  for( h0 = h; h0 > 0; h0--, dline += w ) {
     dpoint = dline;
     for( w0 = w; w0 > 0; w0--, dpoint++) {
       d = ( *dpoint >> s ) & 0xff;	/* bitmask1 */
@@ -264,6 +330,216 @@ movie_compress_area( int x, int y, int w, int h, int s )
   }
 }
 
+static void
+encode_area( const movie_chunk_t *chunk, const libspectrum_dword *data )
+{
+  libspectrum_byte head[7];
+
+  head[0] = '$';			/* RLE compressed data... */
+  head[1] = chunk->x;
+  head[2] = chunk->y & 0xff;
+  head[3] = chunk->y >> 8;
+  head[4] = chunk->w;
+  head[5] = chunk->h & 0xff;
+  head[6] = chunk->h >> 8;
+  fwrite_compr( head, 7, 1, of );
+  movie_compress_area( data, chunk->w, chunk->h, 0 );	/* Bitmap1 */
+  movie_compress_area( data, chunk->w, chunk->h, 8 );	/* Attrib/B2 */
+  if( fmf_screen == 'R' ) {
+    movie_compress_area( data, chunk->w, chunk->h, 16 );	/* HiRes attrib */
+  }
+}
+
+static inline void
+write_alaw( const libspectrum_signed_word *buff, int len )
+{
+  int i = 0;
+  while( len-- ) {
+    if( *buff >= 0)
+      sbuff[i++] = alaw_table[*buff >> 4];
+    else
+      sbuff[i++] = 0x7f & alaw_table [- *buff >> 4];
+    buff++;
+    if( i == 4096 ) {
+      i = 0;
+      fwrite_compr( sbuff, 4096, 1, of );	/* write frame */
+    }
+  }
+  if( i )
+    fwrite_compr( sbuff, i, 1, of );	/* write remaind */
+}
+
+static void
+add_sound( const movie_chunk_t *chunk, const libspectrum_signed_word *buff,
+	   int len )
+{
+  libspectrum_byte head[7];
+
+  head[0] = 'S';	/* sound frame */
+  head[1] = chunk->format;	/* sound format */
+  head[2] = chunk->freq & 0xff;
+  head[3] = chunk->freq >> 8;
+  head[4] = chunk->stereo;
+  len--;		/*len - 1*/
+  head[5] = len & 0xff;
+  head[6] = len >> 8;
+  len++;		/* len :-) */
+  fwrite_compr( head, 7, 1, of );	/* Sound frame */
+  if( chunk->format == 'P' )
+    fwrite_compr( buff, len * chunk->framesiz , 1, of );	/* write frame */
+  else if( chunk->format == 'A' )
+    write_alaw( buff, len * chunk->framesiz );
+}
+
+static void
+encode_sound( const movie_chunk_t *chunk, const libspectrum_signed_word *buff )
+{
+  int len = chunk->len;
+
+  while( len ) {
+    if( chunk->stereo == 'S' ) {
+      add_sound( chunk, buff, len > 131072 ? 65536 : len >> 1 );
+      buff += len > 131072 ? 131072 : len;
+      len -= len > 131072 ? 131072 : len;
+    } else {
+      add_sound( chunk, buff, len > 65536 ? 65536 : len );
+      buff += len > 65536 ? 65536 : len;
+      len -= len > 65536 ? 65536 : len;
+    }
+  }
+}
+
+#ifdef HAVE_ZLIB_H
+/* Finish the current zlib stream; with 'restart' start a new one */
+static void
+compr_finish( int restart )
+{
+  if( fmf_compr == 0 ) return;
+
+  zstream.avail_in = 0;
+  do {
+    zstream.avail_out = ZBUF_SIZE;
+    zstream.next_out = zbuf_o;
+    deflate( &zstream, Z_FINISH );
+    if( zstream.avail_out != ZBUF_SIZE )
+      fwrite( zbuf_o, ZBUF_SIZE - zstream.avail_out, 1, of );
+  } while ( zstream.avail_out != ZBUF_SIZE );
+
+  if( restart ) {
+    deflateReset( &zstream );
+  } else {
+    deflateEnd( &zstream );
+    fmf_compr = -1;
+  }
+}
+#endif	/* HAVE_ZLIB_H */
+
+static void
+encode_keyframe( const movie_chunk_t *chunk )
+{
+  long offset;
+
+#ifdef HAVE_ZLIB_H
+  compr_finish( 1 );
+#endif	/* HAVE_ZLIB_H */
+
+  offset = ftell( of );
+  if( offset == -1 ) return;		/* e.g. a pipe; no index then */
+
+  if( keyframe_count == keyframe_allocated ) {
+    keyframe_allocated = keyframe_allocated ? 2 * keyframe_allocated : 64;
+    keyframes = libspectrum_renew( movie_keyframe_t, keyframes,
+				   keyframe_allocated );
+  }
+  keyframes[ keyframe_count ].frame = chunk->frame;
+  keyframes[ keyframe_count ].offset = offset;
+  keyframe_count++;
+}
+
+static void
+write_dword( libspectrum_dword d )
+{
+  libspectrum_byte b[4];
+
+  b[0] = d & 0xff; b[1] = ( d >> 8 ) & 0xff;
+  b[2] = ( d >> 16 ) & 0xff; b[3] = d >> 24;
+  fwrite( b, 4, 1, of );
+}
+
+static void
+write_index( void )
+{
+  long offset = ftell( of );
+  size_t i;
+
+  if( offset == -1 ) return;
+
+  fwrite( "FMFI", 4, 1, of );
+  write_dword( keyframe_count );
+  for( i = 0; i < keyframe_count; i++ ) {
+    write_dword( keyframes[i].frame );
+    write_dword( keyframes[i].offset & 0xffffffff );
+    write_dword( keyframes[i].offset >> 32 );
+  }
+  write_dword( (libspectrum_qword)offset & 0xffffffff );
+  write_dword( (libspectrum_qword)offset >> 32 );
+  write_dword( 24 + 12 * keyframe_count );
+  fwrite( "FMFI", 4, 1, of );
+}
+
+/* Write out everything recorded into one frame buffer */
+static int
+encode_frame( const libspectrum_byte *ptr, size_t length,
+              void *user_data GCC_UNUSED )
+{
+  const libspectrum_byte *end = ptr + length;
+  const movie_chunk_t *chunk;
+  const void *data;
+
+  while( ptr < end ) {
+    chunk = (const movie_chunk_t *)ptr;
+    data = ptr + MOVIE_CHUNK_ALIGN( sizeof( *chunk ) );
+
+    switch( chunk->type ) {
+    case MOVIE_CHUNK_DATA: fwrite_compr( data, chunk->length, 1, of ); break;
+    case MOVIE_CHUNK_AREA: encode_area( chunk, data ); break;
+    case MOVIE_CHUNK_SOUND: encode_sound( chunk, data ); break;
+    case MOVIE_CHUNK_KEYFRAME: encode_keyframe( chunk ); break;
+    }
+
+    ptr = data;
+    ptr += MOVIE_CHUNK_ALIGN( chunk->length );
+  }
+
+  return 0;
+}
+
+/* Add a chunk to the frame being recorded, and return where its
+   'chunk->length' bytes of data should go */
+static void*
+frame_add_chunk( const movie_chunk_t *chunk )
+{
+  size_t header = MOVIE_CHUNK_ALIGN( sizeof( *chunk ) );
+  libspectrum_byte *ptr;
+
+  ptr = writer_reserve( &movie_writer,
+                        header + MOVIE_CHUNK_ALIGN( chunk->length ) );
+  memcpy( ptr, chunk, sizeof( *chunk ) );
+
+  return ptr + header;
+}
+
+static void
+frame_add_data( const void *data, size_t length )
+{
+  movie_chunk_t chunk;
+
+  memset( &chunk, 0, sizeof( chunk ) );
+  chunk.type = MOVIE_CHUNK_DATA;
+  chunk.length = length;
+  memcpy( frame_add_chunk( &chunk ), data, length );
+}
+
 /* Fetch pixel (x, y). On a Timex this will be a point on a 640x480 canvas,
    on a Sinclair/Amstrad/Russian clone this will be a point on a 320x240
    canvas */
@@ -275,38 +551,44 @@ movie_compress_area( int x, int y, int w, int h, int s )
 void
 movie_add_area( int x, int y, int w, int h )
 {
+  movie_chunk_t chunk;
+  libspectrum_dword *dest;
+  int i;
+
   if( movie_paused ) {
     movie_start_frame();
     return;
   }
-  head[0] = '$';			/* RLE compressed data... */
-  head[1] = x;
-  head[2] = y & 0xff;
-  head[3] = y >> 8;
-  head[4] = w;
-  head[5] = h & 0xff;
-  head[6] = h >> 8;
-  fwrite_compr( head, 7, 1, of );
-  movie_compress_area( x, y, w, h, 0 );	/* Bitmap1 */
-  movie_compress_area( x, y, w, h, 8 );	/* Attrib/B2 */
-  if( fmf_screen == 'R' ) {
-    movie_compress_area( x, y, w, h, 16 );	/* HiRes attrib */
-  }
+
+  memset( &chunk, 0, sizeof( chunk ) );
+  chunk.type = MOVIE_CHUNK_AREA;
+  chunk.x = x; chunk.y = y; chunk.w = w; chunk.h = h;
+  chunk.length = w * h * sizeof( *dest );
+
+  /* Only the dirty slice is copied; the writer never sees
+     display_last_screen itself */
+  dest = frame_add_chunk( &chunk );
+  for( i = 0; i < h; i++, dest += w )
+    memcpy( dest, &display_last_screen[ x + 40 * ( y + i ) ],
+	    w * sizeof( *dest ) );
+
   slice_no++;
 }
 
-static void
+static int
 movie_start_fmf( const char *name )
 {
+  libspectrum_byte head[8];
+
   if( ( of = fopen(name, "wb") ) == NULL ) {  /* trunc old file ? or append ? */
     ui_error( UI_ERROR_ERROR, "error opening movie file '%s': %s", name,
               strerror( errno ) );
-    return;
+    return 1;
   }
 #ifdef WORDS_BIGENDIAN
-  fwrite( "FMF_V1E", 7, 1, of );	/* write magic header Fuse Movie File */
+  fwrite( "FMF_V2E", 7, 1, of );	/* write magic header Fuse Movie File */
 #else	/* WORDS_BIGENDIAN */
-  fwrite( "FMF_V1e", 7, 1, of );	/* write magic header Fuse Movie File */
+  fwrite( "FMF_V2e", 7, 1, of );	/* write magic header Fuse Movie File */
 #endif	/* WORDS_BIGENDIAN */
 #ifdef HAVE_ZLIB_H
   if( option_enumerate_movie_movie_compr() == 0 ) {
@@ -338,7 +620,9 @@ movie_start_fmf( const char *name )
   head[6] = stereo;
   head[7] = '\n';	/* padding */
   fwrite( head, 8, 1, of );		/* write initial params */
+  writer_start( &movie_writer, encode_frame, NULL );
   movie_add_area( 0, 0, 40, 240 );
+  return 0;
 }
 
 void
@@ -348,7 +632,7 @@ movie_start( const char *name )	/* some init, open file (name)*/
   if( name == NULL || *name == '\0' )
     name = "fuse.fmf";			/* fuse movie file */
 
-  movie_start_fmf( name );
+  if( movie_start_fmf( name ) ) return;
   movie_recording = 1;
   ui_menu_activate( UI_MENU_ITEM_FILE_MOVIE_RECORDING, 1 );
   ui_menu_activate( UI_MENU_ITEM_FILE_MOVIE_PAUSE, 1 );
@@ -359,23 +643,17 @@ movie_stop( void )
 {
   if( !movie_paused && !movie_recording ) return;
 
+  /* Everything recorded so far must be out before the end marker */
+  writer_stop( &movie_writer );
+
   fwrite_compr( "X", 1, 1, of );	/* End of Recording! */
 #ifdef HAVE_ZLIB_H
-  {
-    if( fmf_compr != 0 ) {		/* close zlib */
-      zstream.avail_in = 0;
-      do {
-        zstream.avail_out = ZBUF_SIZE;
-        zstream.next_out = zbuf_o;
-        deflate( &zstream, Z_SYNC_FLUSH );
-        if( zstream.avail_out != ZBUF_SIZE )
-          fwrite( zbuf_o, ZBUF_SIZE - zstream.avail_out, 1, of );
-      } while ( zstream.avail_out != ZBUF_SIZE );
-      deflateEnd( &zstream );
-      fmf_compr = -1;
-    }
-  }
+  compr_finish( 0 );			/* close zlib */
 #endif	/* HAVE_ZLIB_H */
+  write_index();
+  libspectrum_free( keyframes );
+  keyframes = NULL;
+  keyframe_count = keyframe_allocated = 0;
   format = '?';
   if( of ) {
     fclose( of );
@@ -383,6 +661,9 @@ movie_stop( void )
   }
 #ifdef MOVIE_DEBUG_PRINT
   fprintf( stderr, "Debug movie: saved %d.%d frame(.slice)\n", frame_no, slice_no );
+  fprintf( stderr, "Debug movie: %d frames queued, max depth %lu, "
+	   "%d stalls\n", movie_writer.buffers,
+	   (unsigned long)movie_writer.max_depth, movie_writer.stalls );
 #endif 	/* MOVIE_DEBUG_PRINT */
   movie_recording = 0;
   movie_paused = 0;
@@ -415,71 +696,53 @@ movie_init_sound( int f, int s )
   framesiz = ( stereo == 'S' ? 2 : 1 ) * ( format == 'P' ? 2 : 1 );
 }
 
-static inline void
-write_alaw( libspectrum_signed_word *buff, int len )
-{
-  int i = 0;
-  while( len-- ) {  
-    if( *buff >= 0)
-      sbuff[i++] = alaw_table[*buff >> 4];
-    else
-      sbuff[i++] = 0x7f & alaw_table [- *buff >> 4];
-    buff++;
-    if( i == 4096 ) {
-      i = 0;
-      fwrite_compr( sbuff, 4096, 1, of );	/* write frame */
-    }
-  }
-  if( i )
-    fwrite_compr( sbuff, i, 1, of );	/* write remaind */
-}
-
-static void
-add_sound( libspectrum_signed_word *buff, int len )
-{
-  head[0] = 'S';	/* sound frame */
-  head[1] = format;	/* sound format */
-  head[2] = freq & 0xff;
-  head[3] = freq >> 8;
-  head[4] = stereo;
-  len--;		/*len - 1*/
-  head[5] = len & 0xff;
-  head[6] = len >> 8;
-  len++;		/* len :-) */
-  fwrite_compr( head, 7, 1, of );	/* Sound frame */
-  if( format == 'P' )
-    fwrite_compr( buff, len * framesiz , 1, of );	/* write frame */
-  else if( format == 'A' )
-    write_alaw( buff, len * framesiz );
-}
-
 void
 movie_add_sound( libspectrum_signed_word *buff, int len )
 {
-  while( len ) {
-    if( stereo == 'S' ) {
-      add_sound( buff, len > 131072 ? 65536 : len >> 1 );
-      buff += len > 131072 ? 131072 : len;
-      len -= len > 131072 ? 131072 : len;
-    } else {
-      add_sound( buff, len > 65536 ? 65536 : len );
-      buff += len > 65536 ? 65536 : len;
-      len -= len > 65536 ? 65536 : len;
-    }
-  }
+  movie_chunk_t chunk;
+
+  if( !len ) return;
+
+  /* The format is captured now as the sound may be reinitialised before
+     the writer gets to this chunk */
+  memset( &chunk, 0, sizeof( chunk ) );
+  chunk.type = MOVIE_CHUNK_SOUND;
+  chunk.format = format;
+  chunk.freq = freq;
+  chunk.stereo = stereo;
+  chunk.framesiz = framesiz;
+  chunk.len = len;
+  chunk.length = len * sizeof( *buff );
+  memcpy( frame_add_chunk( &chunk ), buff, chunk.length );
 }
 
 void
 movie_start_frame( void )
 {
+  libspectrum_byte head[4];
+  int keyframe = 0;
+
+  /* The previous frame is complete, so it can go to the writer */
+  writer_submit( &movie_writer );
+
+  if( frame_no && frame_no % MOVIE_KEYFRAME_INTERVAL == 0 ) {
+    movie_chunk_t chunk;
+
+    memset( &chunk, 0, sizeof( chunk ) );
+    chunk.type = MOVIE_CHUNK_KEYFRAME;
+    chunk.frame = frame_no + 1;
+    frame_add_chunk( &chunk );
+    keyframe = 1;
+  }
+
   /* $ - ZX$, T - TX$, C - HiCol, R - HiRes */
   head[0] = 'N';
   head[1] = settings_current.frame_rate;
   head[2] = get_screentype();
   head[3] = get_timing();
-  fwrite_compr( head, 4, 1, of );	/* New frame! */
+  frame_add_data( head, 4 );	/* New frame! */
   frame_no++;
-  if( movie_paused ) {
+  if( movie_paused || keyframe ) {
     movie_paused = 0;
     movie_add_area( 0, 0, 40, 240 );
   }
@@ -25,6 +25,8 @@
 
 #include <config.h>
 
+#include <string.h>
+
 #include <libspectrum.h>
 
 #include "debugger/debugger.h"
@@ -64,6 +66,20 @@ typedef struct periph_port_private_t {
 /* The list of currently active ports */
 static GSList *ports = NULL;
 
+/* Wrapper to pair up a PC trap with the peripheral it came from */
+typedef struct periph_pc_trap_private_t {
+  /* The peripheral this came from */
+  periph_type type;
+  /* The trap itself; not copied as the peripheral may change it */
+  const periph_pc_trap_t *trap;
+} periph_pc_trap_private_t;
+
+/* The list of currently active PC traps */
+static GSList *pc_traps = NULL;
+
+libspectrum_byte periph_pc_traps[ 0x10000 ];
+int periph_pc_traps_active = 0;
+
 /* The strings used for debugger events */
 static const char * const page_event_string = "page",
   * const unpage_event_string = "unpage";
@@ -82,6 +98,20 @@ port_register( periph_type type, const periph_port_t *port )
   ports = g_slist_append( ports, private );
 }
 
+/* Place one PC trap in the list of currently active ones */
+static void
+pc_trap_register( periph_type type, const periph_pc_trap_t *trap )
+{
+  periph_pc_trap_private_t *private;
+
+  private = libspectrum_new( periph_pc_trap_private_t, 1 );
+
+  private->type = type;
+  private->trap = trap;
+
+  pc_traps = g_slist_append( pc_traps, private );
+}
+
 /* Register a peripheral with the system */
 void
 periph_register( periph_type type, const periph_t *periph )
@@ -107,6 +137,15 @@ find_by_type( gconstpointer data, gconstpointer user_data )
   return periph->type - type;
 }
 
+/* Get the PC traps for one peripheral */
+static gint
+find_pc_trap_by_type( gconstpointer data, gconstpointer user_data )
+{
+  const periph_pc_trap_private_t *trap = data;
+  periph_type type = GPOINTER_TO_INT( user_data );
+  return trap->type - type;
+}
+
 /* Set whether a peripheral can be present on this machine or not */
 void
 periph_set_present( periph_type type, periph_present present )
@@ -126,16 +165,26 @@ periph_activate_type( periph_type type, int active )
 
   if( active ) {
     const periph_port_t *ptr;
+    const periph_pc_trap_t *trap;
     if( private->periph->activate )
       private->periph->activate();
     for( ptr = private->periph->ports; ptr && ptr->mask != 0; ptr++ )
       port_register( type, ptr );
+    for( trap = private->periph->pc_traps; trap && trap->mask != 0; trap++ )
+      pc_trap_register( type, trap );
   } else {
     GSList *found;
     while( ( found = g_slist_find_custom( ports, GINT_TO_POINTER( type ), find_by_type ) ) != NULL )
       ports = g_slist_remove( ports, found->data );
+    while( ( found = g_slist_find_custom( pc_traps, GINT_TO_POINTER( type ),
+                                          find_pc_trap_by_type ) ) != NULL ) {
+      libspectrum_free( found->data );
+      pc_traps = g_slist_delete_link( pc_traps, found );
+    }
   }
 
+  if( private->periph->pc_traps ) periph_update_pc_traps();
+
   return 1;
 }
 
@@ -215,6 +264,23 @@ set_types_inactive( void )
   g_hash_table_foreach( peripherals, set_type_inactive, NULL );
 }
 
+/* Free the memory used by a peripheral-PC trap pair */
+static void
+free_pc_trap( gpointer data, gpointer user_data GCC_UNUSED )
+{
+  periph_pc_trap_private_t *private = data;
+  libspectrum_free( private );
+}
+
+static void
+free_pc_traps( void )
+{
+  g_slist_foreach( pc_traps, free_pc_trap, NULL );
+  g_slist_free( pc_traps );
+  pc_traps = NULL;
+  periph_update_pc_traps();
+}
+
 /* Empty out the list of peripherals */
 void
 periph_clear( void )
@@ -222,6 +288,7 @@ periph_clear( void )
   g_slist_foreach( ports, free_peripheral, NULL );
   g_slist_free( ports );
   ports = NULL;
+  free_pc_traps();
   set_types_inactive();
 }
 
@@ -232,6 +299,7 @@ periph_end( void )
   g_slist_foreach( ports, free_peripheral, NULL );
   g_slist_free( ports );
   ports = NULL;
+  free_pc_traps();
 
   g_hash_table_destroy( peripherals );
   peripherals = NULL;
@@ -372,6 +440,75 @@ writeport_internal( libspectrum_word port, libspectrum_byte b )
   g_slist_foreach( ports, write_peripheral, &callback_info );
 }
 
+/*
+ * PC traps
+ */
+
+/* Mark every address a PC trap applies to */
+static void
+set_pc_trap( gpointer data, gpointer user_data GCC_UNUSED )
+{
+  const periph_pc_trap_private_t *private = data;
+  const periph_pc_trap_t *trap = private->trap;
+  libspectrum_word free_bits = ~trap->mask, bits = 0;
+  libspectrum_byte flags = 0;
+
+  if( trap->early ) flags |= PERIPH_PC_TRAP_EARLY;
+  if( trap->late ) flags |= PERIPH_PC_TRAP_LATE;
+
+  /* Step through every combination of the bits not in the mask */
+  do {
+    periph_pc_traps[ trap->value | bits ] |= flags;
+    bits = ( bits - free_bits ) & free_bits;
+  } while( bits );
+
+  periph_pc_traps_active = 1;
+}
+
+void
+periph_update_pc_traps( void )
+{
+  memset( periph_pc_traps, 0, sizeof( periph_pc_traps ) );
+  periph_pc_traps_active = 0;
+
+  g_slist_foreach( pc_traps, set_pc_trap, NULL );
+}
+
+/* Internal type used for passing to run_pc_trap */
+struct pc_trap_data_t {
+
+  libspectrum_word pc;
+  int late;
+};
+
+/* Call one PC trap if it applies to this address */
+static void
+run_pc_trap( gpointer data, gpointer user_data )
+{
+  const periph_pc_trap_private_t *private = data;
+  const struct pc_trap_data_t *callback_info = user_data;
+  const periph_pc_trap_t *trap = private->trap;
+  periph_pc_trap_function function = callback_info->late ? trap->late :
+                                                           trap->early;
+
+  if( function && ( callback_info->pc & trap->mask ) == trap->value )
+    function( callback_info->pc );
+}
+
+void
+periph_pc_trap_early( libspectrum_word pc )
+{
+  struct pc_trap_data_t callback_info = { pc, 0 };
+  g_slist_foreach( pc_traps, run_pc_trap, &callback_info );
+}
+
+void
+periph_pc_trap_late( libspectrum_word pc )
+{
+  struct pc_trap_data_t callback_info = { pc, 1 };
+  g_slist_foreach( pc_traps, run_pc_trap, &callback_info );
+}
+
 /*
  * The more Fuse-specific peripheral handling routines
  */
@@ -103,6 +103,23 @@ typedef struct periph_port_t {
 
 } periph_port_t;
 
+typedef void (*periph_pc_trap_function)( libspectrum_word pc );
+
+/* Information about a specific PC trap */
+typedef struct periph_pc_trap_t {
+
+  /* This peripheral is called for all values of PC where
+     PC & mask == value */
+  libspectrum_word mask;
+  libspectrum_word value;
+
+  /* Called before the opcode fetch; may be NULL */
+  periph_pc_trap_function early;
+  /* Called after the opcode fetch; may be NULL */
+  periph_pc_trap_function late;
+
+} periph_pc_trap_t;
+
 typedef void (*periph_activate_function)( void );
 
 /* Information about a peripheral */
@@ -115,6 +132,8 @@ typedef struct periph_t {
   int hard_reset;
   /* Function to be called when the peripheral is activated */
   periph_activate_function activate;
+  /* The list of PC traps for this peripheral; may be NULL */
+  const periph_pc_trap_t *pc_traps;
 } periph_t;
 
 /* Register a peripheral with the system */
@@ -146,6 +165,31 @@ libspectrum_byte readport_internal( libspectrum_word port );
 void writeport( libspectrum_word port, libspectrum_byte b );
 void writeport_internal( libspectrum_word port, libspectrum_byte b );
 
+/*
+ * PC traps
+ */
+
+/* The flags in periph_pc_traps[] */
+enum {
+  PERIPH_PC_TRAP_EARLY = 1 << 0,
+  PERIPH_PC_TRAP_LATE = 1 << 1,
+};
+
+/* For every address, whether any active peripheral traps it */
+extern libspectrum_byte periph_pc_traps[ 0x10000 ];
+
+/* Are there any PC traps at all? */
+extern int periph_pc_traps_active;
+
+/* Call the traps for 'pc'; only to be used if periph_pc_traps[ pc ] says
+   there are any */
+void periph_pc_trap_early( libspectrum_word pc );
+void periph_pc_trap_late( libspectrum_word pc );
+
+/* Rebuild periph_pc_traps[]; needed only if a peripheral changes one of
+   its traps while active */
+void periph_update_pc_traps( void );
+
 /*
  * The more Fuse-specific peripheral handling routines
  */
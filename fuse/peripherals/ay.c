@@ -33,6 +33,8 @@
 #include "periph.h"
 #include "printer.h"
 #include "psg.h"
+#include "quicksave.h"
+#include "settings.h"
 #include "sound.h"
 
 /* Unused bits in the AY registers are silently zeroed out; these masks
@@ -44,6 +46,12 @@ static const libspectrum_byte mask[ AY_REGISTERS ] = {
 
 };
 
+/* With more than one chip, the one the ports currently talk to, and the
+   state of the chips other than the first; the first is always
+   machine_current->ay, which is the one saved in snapshots */
+static int ay_selected;
+static ayinfo ay_extra[ AY_CHIPS_MAX - 1 ];
+
 static void ay_reset( int hard_reset );
 static void ay_from_snapshot( libspectrum_snap *snap );
 static void ay_to_snapshot( libspectrum_snap *snap );
@@ -118,6 +126,26 @@ ay_init( void )
   periph_register( PERIPH_TYPE_AY_PLUS3, &ay_periph_plus3 );
   periph_register( PERIPH_TYPE_AY_FULL_DECODE, &ay_periph_full_decode );
   periph_register( PERIPH_TYPE_AY_TIMEX, &ay_periph_timex );
+
+  quicksave_register( &ay_selected, sizeof( ay_selected ) );
+  quicksave_register( ay_extra, sizeof( ay_extra ) );
+}
+
+/* How many chips share the AY ports */
+int
+ay_chip_count( void )
+{
+  int chips = settings_current.ay_chips;
+
+  if( chips < 1 ) return 1;
+  if( chips > AY_CHIPS_MAX ) return AY_CHIPS_MAX;
+  return chips;
+}
+
+static ayinfo*
+ay_current( void )
+{
+  return ay_selected ? &ay_extra[ ay_selected - 1 ] : &machine_current->ay;
 }
 
 static void
@@ -127,6 +155,9 @@ ay_reset( int hard_reset GCC_UNUSED )
 
   ay->current_register = 0;
   memset( ay->registers, 0, sizeof( ay->registers ) );
+
+  ay_selected = 0;
+  memset( ay_extra, 0, sizeof( ay_extra ) );
 }
 
 /* What happens when the AY register port (traditionally 0xfffd on the 128K
@@ -134,12 +165,13 @@ ay_reset( int hard_reset GCC_UNUSED )
 libspectrum_byte
 ay_registerport_read( libspectrum_word port GCC_UNUSED, int *attached )
 {
+  ayinfo *ay = ay_current();
   int current;
   const libspectrum_byte port_input = 0xbf; /* always allow serial output */
 
   *attached = 1;
 
-  current = machine_current->ay.current_register;
+  current = ay->current_register;
 
   /* The AY I/O ports return input directly from the port when in
      input mode; but in output mode, they return an AND between the
@@ -147,26 +179,34 @@ ay_registerport_read( libspectrum_word port GCC_UNUSED, int *attached )
      reading R14... */
 
   if( current == 14 ) {
-    if(machine_current->ay.registers[7] & 0x40)
-      return (port_input & machine_current->ay.registers[14]);
+    if(ay->registers[7] & 0x40)
+      return (port_input & ay->registers[14]);
     else
       return port_input;
   }
 
   /* R15 is simpler to do, as the 8912 lacks the second I/O port, and
      the input-mode input is always 0xff */
-  if( current == 15 && !( machine_current->ay.registers[7] & 0x80 ) )
+  if( current == 15 && !( ay->registers[7] & 0x80 ) )
     return 0xff;
 
   /* Otherwise return register value, appropriately masked */
-  return machine_current->ay.registers[ current ] & mask[ current ];
+  return ay->registers[ current ] & mask[ current ];
 }
 
 /* And when it's written to */
 void
 ay_registerport_write( libspectrum_word port GCC_UNUSED, libspectrum_byte b )
 {
-  machine_current->ay.current_register = (b & 15);
+  /* With more than one chip, 0xff, 0xfe and 0xfd select the first,
+     second and third chips, as on TurboSound cards; these can't be
+     register numbers */
+  if( b >= 0xfc && ay_chip_count() > 1 ) {
+    if( 0xff - b < ay_chip_count() ) ay_selected = 0xff - b;
+    return;
+  }
+
+  ay_current()->current_register = (b & 15);
 }
 
 /* What happens when the AY data port (traditionally 0xbffd on the 128K
@@ -175,12 +215,17 @@ ay_registerport_write( libspectrum_word port GCC_UNUSED, libspectrum_byte b )
 void
 ay_dataport_write( libspectrum_word port GCC_UNUSED, libspectrum_byte b )
 {
+  ayinfo *ay = ay_current();
   int current;
 
-  current = machine_current->ay.current_register;
+  current = ay->current_register;
+
+  ay->registers[ current ] = b & mask[ current ];
+  sound_ay_write( ay_selected, current, b, tstates );
+
+  /* PSG files and the printer only know about the first chip */
+  if( ay_selected ) return;
 
-  machine_current->ay.registers[ current ] = b & mask[ current ];
-  sound_ay_write( current, b, tstates );
   if( psg_recording ) psg_write_register( current, b );
 
   if( current == 14 ) printer_serial_write( b );
@@ -191,13 +236,15 @@ ay_state_from_snapshot( libspectrum_snap *snap )
 {
   size_t i;
 
+  /* Snapshots have only the first chip */
+  ay_selected = 0;
   ay_registerport_write( 0xfffd,
                          libspectrum_snap_out_ay_registerport( snap ) );
 
   for( i = 0; i < AY_REGISTERS; i++ ) {
     machine_current->ay.registers[i] =
       libspectrum_snap_ay_registers( snap, i );
-    sound_ay_write( i, machine_current->ay.registers[i], 0 );
+    sound_ay_write( 0, i, machine_current->ay.registers[i], 0 );
   }
 }
 
@@ -30,6 +30,10 @@
 
 #define AY_REGISTERS 16
 
+/* The most AY chips which can share the AY ports, as on TurboSound
+   cards */
+#define AY_CHIPS_MAX 3
+
 typedef struct ayinfo {
   int current_register;
   libspectrum_byte registers[ AY_REGISTERS ];
@@ -37,6 +41,8 @@ typedef struct ayinfo {
 
 void ay_init( void );
 
+int ay_chip_count( void );
+
 libspectrum_byte ay_registerport_read( libspectrum_word port, int *attached );
 void ay_registerport_write( libspectrum_word port, libspectrum_byte b );
 
@@ -116,7 +116,7 @@ dck_reset( void )
 
   dck = libspectrum_dck_alloc();
 
-  error = utils_read_file( settings_current.dck_file, &file );
+  error = utils_map_file( settings_current.dck_file, &file );
   if( error ) { libspectrum_dck_free( dck, 0 ); return error; }
 
   error = libspectrum_dck_read2( dck, file.buffer, file.length,
@@ -82,11 +82,18 @@ static const periph_port_t beta_ports[] = {
   { 0, 0, NULL, NULL }
 };
 
+/* Covers both possible values of beta_pc_mask */
+static const periph_pc_trap_t beta_pc_traps[] = {
+  { 0xfe00, 0x3c00, beta_pc_trap, NULL },
+  { 0, 0, NULL, NULL }
+};
+
 static const periph_t beta_peripheral = {
   &settings_current.beta128,  
   beta_ports,
   1,
-  NULL
+  NULL,
+  beta_pc_traps
 };
 
 static void beta_reset( int hard_reset );
@@ -121,6 +128,14 @@ beta_unpage( void )
   machine_current->memory_map();
 }
 
+void
+beta_pc_trap( libspectrum_word pc )
+{
+  if( !beta_active && ( pc & beta_pc_mask ) == beta_pc_value &&
+      NOT_128_TYPE_OR_IS_48_TYPE )
+    beta_page();
+}
+
 static void
 beta_memory_map( void )
 {
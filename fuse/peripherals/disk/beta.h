@@ -43,6 +43,12 @@ extern memory_page beta_memory_map_romcs[MEMORY_PAGES_IN_16K];
 extern libspectrum_word beta_pc_mask; /* Bits to mask in PC for enable check */
 extern libspectrum_word beta_pc_value; /* Value to compare masked PC against */
 
+/* The Beta disk interface pages in and out only when the 48K ROM is
+   selected */
+#define NOT_128_TYPE_OR_IS_48_TYPE ( !( machine_current->capabilities & \
+            LIBSPECTRUM_MACHINE_CAPABILITY_128_MEMORY ) || \
+            machine_current->ram.current_rom )
+
 void beta_init( void );
 
 void beta_end( void );
@@ -50,6 +56,8 @@ void beta_end( void );
 void beta_page( void );
 void beta_unpage( void );
 
+void beta_pc_trap( libspectrum_word pc );
+
 void beta_cr_write( libspectrum_word port, libspectrum_byte b );
 
 libspectrum_byte beta_sr_read( libspectrum_word port, int *attached );
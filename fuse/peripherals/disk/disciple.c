@@ -75,6 +75,7 @@ static int memory_allocated = 0;
 static void disciple_reset( int hard_reset );
 static void disciple_memory_map( void );
 static void disciple_activate( void );
+static void disciple_pc_trap( libspectrum_word pc );
 
 static module_info_t disciple_module_info = {
 
@@ -104,6 +105,12 @@ disciple_unpage( void )
   machine_current->memory_map();
 }
 
+static void
+disciple_pc_trap( libspectrum_word pc GCC_UNUSED )
+{
+  disciple_page();
+}
+
 void
 disciple_memory_map( void )
 {
@@ -150,11 +157,20 @@ static const periph_port_t disciple_ports[] = {
   { 0, 0, NULL, NULL }
 };
 
+static const periph_pc_trap_t disciple_pc_traps[] = {
+  { 0xffff, 0x0001, disciple_pc_trap, NULL },
+  { 0xffff, 0x0008, disciple_pc_trap, NULL },
+  { 0xffff, 0x0066, disciple_pc_trap, NULL },
+  { 0xffff, 0x028e, disciple_pc_trap, NULL },
+  { 0, 0, NULL, NULL }
+};
+
 static const periph_t disciple_periph = {
   &settings_current.disciple,
   disciple_ports,
   1,
-  disciple_activate
+  disciple_activate,
+  disciple_pc_traps
 };
 
 void
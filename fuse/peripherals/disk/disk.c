@@ -25,6 +25,7 @@
 
 #include <config.h>
 
+#include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -35,9 +36,6 @@
 #include "bitmap.h"
 #include "crc.h"
 #include "disk.h"
-#include "settings.h"
-#include "ui/ui.h"
-#include "utils.h"
 
 /* The ordering of these strings must match the order of the 
  * disk_error_t enumeration in disk.h */
@@ -98,7 +96,7 @@ disk_gap_t gaps[] = {
 #define buff ( buffer->file.buffer + buffer->index )
 
 typedef struct buffer_t {		/* to store buffer data */
-  utils_file file;			/* buffer, length */
+  disk_file_t file;			/* buffer, length */
   size_t index;
 } buffer_t;
 
@@ -112,6 +110,49 @@ disk_strerror( int error )
   return disk_error[ error ];
 }
 
+/* read the whole of an image file into memory */
+static int
+file_read( const char *filename, disk_file_t *file )
+{
+  FILE *f;
+  long length;
+
+  if( ( f = fopen( filename, "rb" ) ) == NULL )
+    return 1;
+  if( fseek( f, 0, SEEK_END ) || ( length = ftell( f ) ) < 0 ||
+      fseek( f, 0, SEEK_SET ) ) {
+    fclose( f );
+    return 1;
+  }
+  file->length = length;
+  file->buffer = libspectrum_new( libspectrum_byte, length );
+  if( fread( file->buffer, 1, length, f ) != file->length ) {
+    libspectrum_free( file->buffer );
+    fclose( f );
+    return 1;
+  }
+  fclose( f );
+  return 0;
+}
+
+static void
+file_close( disk_file_t *file )
+{
+  libspectrum_free( file->buffer );
+  file->buffer = NULL;
+  file->length = 0;
+}
+
+static char *
+filename_dup( const char *filename )
+{
+  size_t length = strlen( filename ) + 1;
+  char *copy = libspectrum_new( char, length );
+
+  memcpy( copy, filename, length );
+  return copy;
+}
+
 static int
 buffread( void *data, size_t len, buffer_t *buffer )
 {
@@ -302,6 +343,8 @@ update_tracks_mode( disk_t *d )
   int mfm, fm, weak;
 
   for( i = 0; i < d->cylinders * d->sides; i++ ) {
+    if( d->source.decoded != NULL && !bitmap_test( d->source.decoded, i ) )
+      continue;				/* will be set when decoded */
     DISK_SET_TRACK_IDX( d, i );
     mfm = 0, fm = 0, weak = 0;
     bpt = d->track[-3] + 256 * d->track[-2];
@@ -667,14 +710,132 @@ trackgen( disk_t *d, buffer_t *buffer, int head, int track,
   return gap4_add( d, gap );
 }
 
-/* close and destroy a disk structure and data */
-void
-disk_close( disk_t *d )
+#define TRACKS_ALT 0
+#define TRACKS_OUTOUT 1
+
+/* release the image file tracks are decoded from */
+static void
+source_free( disk_source_t *s )
 {
+  if( s->decoded == NULL )
+    return;
+  file_close( &s->file );
+  libspectrum_free( s->decoded );
+  s->decoded = NULL;
+}
+
+/* generate track 'idx' from the sector data in the image file */
+int
+disk_decode_track( disk_t *d, int idx )
+{
+  disk_source_t *s = &d->source;
+  buffer_t buffer;
+  libspectrum_byte *t, *c, *f, *w;
+  int i, track_idx, head, cyl, error;
+  size_t offset;
+
+  /* mark it first, as trackgen() selects the track itself */
+  bitmap_set( s->decoded, idx );
+
+  /* Save position of current data */
+  t = d->track;
+  c = d->clocks;
+  f = d->fm;
+  w = d->weak;
+  i = d->i;
+  track_idx = d->track_idx;
+
+  head = idx % d->sides;
+  cyl = idx / d->sides;
+  offset = s->offset + (size_t)s->sectors * s->seclen *
+	   ( s->outout ? head * d->cylinders + cyl : idx );
+  buffer.file = s->file;
+  buffer.index = offset < s->file.length ? offset : s->file.length;
+
+  error = trackgen( d, &buffer, head, cyl, s->sector_base, s->sectors,
+		    s->seclen, s->preindex, s->gap, s->interleave,
+		    s->autofill );
+  if( error )		/* rather than leave half a track behind */
+    memset( d->track, 0, d->bpt + 3 * DISK_CLEN( d->bpt ) );
+  d->track[-3] = d->bpt & 0xff;
+  d->track[-2] = ( d->bpt >> 8 ) & 0xff;
+  d->track[-1] = 0x00;			/* MFM track */
+
+  d->track = t;
+  d->clocks = c;
+  d->fm = f;
+  d->weak = w;
+  d->i = i;
+  d->track_idx = track_idx;
+
+  if( --s->pending == 0 )
+    source_free( s );
+
+  return error;
+}
+
+/* decode all remaining tracks, so we do not need the image file anymore */
+static void
+decode_all_tracks( disk_t *d )
+{
+  int i;
+
+  for( i = 0; d->source.decoded != NULL && i < d->sides * d->cylinders; i++ ) {
+    if( !bitmap_test( d->source.decoded, i ) )
+      disk_decode_track( d, i );
+  }
+}
+
+/* take over the image file and decode every track only on first access;
+   track 0 is decoded now to check the geometry */
+static int
+lazy_tracks( buffer_t *buffer, disk_t *d, size_t offset, int outout,
+	     int sector_base, int sectors, int seclen, int preindex,
+	     int gap, int interleave, int autofill )
+{
+  disk_source_t *s = &d->source;
+
+  s->file = buffer->file;
+  buffer->file.buffer = NULL;		/* the disk owns it now */
+  buffer->file.length = 0;
+
+  s->offset = offset;
+  s->outout = outout;
+  s->sector_base = sector_base;
+  s->sectors = sectors;
+  s->seclen = seclen;
+  s->preindex = preindex;
+  s->gap = gap;
+  s->interleave = interleave;
+  s->autofill = autofill;
+  s->pending = d->sides * d->cylinders;
+  s->decoded = libspectrum_new0( libspectrum_byte, DISK_CLEN( s->pending ) );
+
+  if( disk_decode_track( d, 0 ) )
+    return d->status = DISK_GEOM;
+
+  return d->status = DISK_OK;
+}
+
+static void
+disk_free( disk_t *d )
+{
+  source_free( &d->source );
+  if( d->dirty_tracks != NULL ) {
+    libspectrum_free( d->dirty_tracks );
+    d->dirty_tracks = NULL;
+  }
   if( d->data != NULL ) {
     libspectrum_free( d->data );
     d->data = NULL;
   }
+}
+
+/* close and destroy a disk structure and data */
+void
+disk_close( disk_t *d )
+{
+  disk_free( d );
   if( d->filename != NULL ) {
     libspectrum_free( d->filename );
     d->filename = NULL;
@@ -724,6 +885,9 @@ disk_alloc( disk_t *d )
   if( dlen == 0 ) return d->status = DISK_GEOM;
 
   d->data = libspectrum_new0( libspectrum_byte, dlen );
+  d->dirty_tracks = libspectrum_new0( libspectrum_byte,
+				      DISK_CLEN( d->sides * d->cylinders ) );
+  d->source.decoded = NULL;
 
   return d->status = DISK_OK;
 }
@@ -750,6 +914,7 @@ disk_new( disk_t *d, int sides, int cylinders,
 
   d->wrprot = 0;
   d->dirty = 0;
+  d->file_type = DISK_TYPE_NONE;
   disk_update_tlens( d );
   return d->status = DISK_OK;
 }
@@ -1090,7 +1255,7 @@ open_udi( buffer_t *buffer, disk_t *d )
 static int
 open_img_mgt_opd( buffer_t *buffer, disk_t *d )
 {
-  int i, j, sectors, seclen;
+  int sectors, seclen;
 
   buffer->index = 0;
 
@@ -1123,60 +1288,45 @@ open_img_mgt_opd( buffer_t *buffer, disk_t *d )
   if( disk_alloc( d ) != DISK_OK )
     return d->status;
 
-  if( d->type == DISK_IMG ) {	/* IMG out-out */
-    for( j = 0; j < d->sides; j++ ) {
-      for( i = 0; i < d->cylinders; i++ ) {
-	if( trackgen( d, buffer, j, i, 1, sectors, seclen,
-		      NO_PREINDEX, GAP_MGT_PLUSD, NO_INTERLEAVE, NO_AUTOFILL ) )
-	  return d->status = DISK_GEOM;
-      }
-    }
-  } else {			/* MGT / OPD alt */
-    for( i = 0; i < d->cylinders; i++ ) {
-      for( j = 0; j < d->sides; j++ ) {
-        if( trackgen( d, buffer, j, i, d->type == DISK_MGT ? 1 : 0, sectors, seclen,
-		      NO_PREINDEX, GAP_MGT_PLUSD,
-		      d->type == DISK_MGT ? NO_INTERLEAVE : INTERLEAVE_OPUS, NO_AUTOFILL ) )
-	  return d->status = DISK_GEOM;
-      }
-    }
-  }
+  if( d->type == DISK_IMG )	/* IMG out-out */
+    return lazy_tracks( buffer, d, 0, TRACKS_OUTOUT, 1, sectors, seclen,
+			NO_PREINDEX, GAP_MGT_PLUSD, NO_INTERLEAVE,
+			NO_AUTOFILL );
 
-  return d->status = DISK_OK;
+  /* MGT / OPD alt */
+  return lazy_tracks( buffer, d, 0, TRACKS_ALT, d->type == DISK_MGT ? 1 : 0,
+		      sectors, seclen, NO_PREINDEX, GAP_MGT_PLUSD,
+		      d->type == DISK_MGT ? NO_INTERLEAVE : INTERLEAVE_OPUS,
+		      NO_AUTOFILL );
 }
 
 static int
 open_sad( buffer_t *buffer, disk_t *d, int preindex )
 {
-  int i, j, sectors, seclen;
+  int sectors, seclen;
 
   d->sides = buff[18];
   d->cylinders = buff[19];
   GEOM_CHECK;
   sectors = buff[20];
   seclen = buff[21] * 64;
-  buffer->index = 22;
+  if( buffer->file.length <
+	22 + (size_t)d->sides * d->cylinders * sectors * seclen )
+    return d->status = DISK_GEOM;
 
   /* create a DD disk */
   d->density = DISK_DD;
   if( disk_alloc( d ) != DISK_OK )
     return d->status;
 
-  for( j = 0; j < d->sides; j++ ) {
-    for( i = 0; i < d->cylinders; i++ ) {
-      if( trackgen( d, buffer, j, i, 1, sectors, seclen, preindex, 
-		    GAP_MGT_PLUSD, NO_INTERLEAVE, NO_AUTOFILL ) )
-	return d->status = DISK_GEOM;
-    }
-  }
-
-  return d->status = DISK_OK;
+  return lazy_tracks( buffer, d, 22, TRACKS_OUTOUT, 1, sectors, seclen,
+		      preindex, GAP_MGT_PLUSD, NO_INTERLEAVE, NO_AUTOFILL );
 }
 
 static int
 open_trd( buffer_t *buffer, disk_t *d )
 {
-  int i, j, sectors, seclen;
+  int i, sectors, seclen;
 
   if( buffseek( buffer, 8*256, SEEK_CUR ) == -1 )
       return d->status = DISK_OPEN;
@@ -1203,15 +1353,8 @@ open_trd( buffer_t *buffer, disk_t *d )
   if( disk_alloc( d ) != DISK_OK )
     return d->status;
 
-  buffer->index = 0;
-  for( i = 0; i < d->cylinders; i++ ) {
-    for( j = 0; j < d->sides; j++ ) {
-      if( trackgen( d, buffer, j, i, 1, sectors, seclen,
-    	    NO_PREINDEX, GAP_TRDOS, INTERLEAVE_2, 0x00 ) )
-	return d->status = DISK_GEOM;
-    }
-  }
-  return d->status = DISK_OK;
+  return lazy_tracks( buffer, d, 0, TRACKS_ALT, 1, sectors, seclen,
+		      NO_PREINDEX, GAP_TRDOS, INTERLEAVE_2, 0x00 );
 }
 
 static int
@@ -1824,6 +1967,8 @@ disk_update_tlens( disk_t *d )
   int i;
 
   for( i = 0; i < d->sides * d->cylinders; i++ ) {	/* check tracks */
+    if( d->source.decoded != NULL && !bitmap_test( d->source.decoded, i ) )
+      continue;				/* will be set when decoded */
     DISK_SET_TRACK_IDX( d, i );
     if( d->track[-3] + 256 * d->track[-2] == 0 ) {
       d->track[-3] = d->bpt & 0xff;
@@ -1851,7 +1996,10 @@ disk_open2( disk_t *d, const char *filename, int preindex )
     d->wrprot = 0;
 #endif			/* #ifdef GEKKO */
 
-  if( utils_read_file( filename, &buffer.file ) )
+  d->dirty_tracks = NULL;
+  d->source.decoded = NULL;
+
+  if( file_read( filename, &buffer.file ) )
     return d->status = DISK_OPEN;
 
   buffer.index = 0;
@@ -1900,20 +2048,20 @@ disk_open2( disk_t *d, const char *filename, int preindex )
     open_td0( &buffer, d, preindex );
     break;
   default:
-    utils_close_file( &buffer.file );
+    file_close( &buffer.file );
     return d->status = DISK_OPEN;
   }
+  if( buffer.file.buffer != NULL )	/* not kept for lazy decoding */
+    file_close( &buffer.file );
   if( d->status != DISK_OK ) {
-    if( d->data != NULL )
-      libspectrum_free( d->data );
-    utils_close_file( &buffer.file );
+    disk_free( d );
     return d->status;
   }
-  utils_close_file( &buffer.file );
   d->dirty = 0;
+  d->file_type = d->type;
   disk_update_tlens( d );
   update_tracks_mode( d );
-  d->filename = utils_safe_strdup( filename );
+  d->filename = filename_dup( filename );
   return d->status = DISK_OK;
 }
 
@@ -1931,10 +2079,14 @@ disk_merge_sides( disk_t *d, disk_t *d1, disk_t *d2, int autofill )
       ( autofill < 0 && d1->cylinders != d2->cylinders ) )
     return DISK_GEOM;
 
+  decode_all_tracks( d1 );
+  decode_all_tracks( d2 );
+
   d->wrprot = 0;
   d->dirty = 0;
   d->sides = 2;
   d->type = d1->type;
+  d->file_type = DISK_TYPE_NONE;
   d->cylinders = d2->cylinders > d1->cylinders ? d2->cylinders : d1->cylinders;
   d->bpt = d1->bpt;
   d->density = DISK_DENS_AUTO;
@@ -1975,24 +2127,18 @@ disk_merge_sides( disk_t *d, disk_t *d1, disk_t *d2, int autofill )
   return d->status = DISK_OK;
 }
 
-int
-disk_open( disk_t *d, const char *filename, int preindex, int merge_disks )
+char *
+disk_other_side( const char *filename )
 {
-  char *filename2;
+  const char *filename2;
+  char *other;
   char c = ' ';
   int l, g = 0, pos = 0;
-  disk_t d1, d2;
-
-  d->filename = NULL;
-  if( filename == NULL || *filename == '\0' )
-    return d->status = DISK_OPEN;
 
   l = strlen( filename );
+  if( l < 7 ) return NULL;
 
-  if( !merge_disks || l < 7 )	/* if we do not want to open two separated disk image as one double sided disk */
-    return disk_open2( d, filename, preindex );
-
-  filename2 = (char *)filename + ( l - 1 );
+  filename2 = filename + ( l - 1 );
   while( l ) {				/* [Ss]ide[ _][abAB12][ _.] */
     if( g == 0 && ( *filename2 == '.' || *filename2 == '_' ||
 		    *filename2 == ' ' ) ) {
@@ -2019,25 +2165,40 @@ disk_open( disk_t *d, const char *filename, int preindex, int merge_disks )
     l--;
     filename2--;
   }
-  if( g != 4 )
+  if( g != 4 ) return NULL;
+
+  other = filename_dup( filename );
+  other[ pos ] = c;
+  return other;
+}
+
+int
+disk_open( disk_t *d, const char *filename, int preindex, int merge_disks )
+{
+  char *filename2;
+  disk_t d1, d2;
+
+  d->filename = NULL;
+  if( filename == NULL || *filename == '\0' )
+    return d->status = DISK_OPEN;
+
+  /* if we do not want to open two separated disk image as one double
+     sided disk */
+  if( !merge_disks || ( filename2 = disk_other_side( filename ) ) == NULL )
     return d->status = disk_open2( d, filename, preindex );
+
   d1.data = NULL; d1.flag = d->flag;
   d2.data = NULL; d2.flag = d->flag;
-  filename2 = utils_safe_strdup( filename );
-  *(filename2 + pos) = c;
-
-  if( settings_current.disk_ask_merge &&
-      !ui_query( "Try to merge 'B' side of this disk?" ) ) {
-    libspectrum_free( filename2 );
-    return d->status = disk_open2( d, filename, preindex );
-  }
 
   if( disk_open2( &d2, filename2, preindex ) ) {
+    libspectrum_free( filename2 );
     return d->status = disk_open2( d, filename, preindex );
   }
 
-  if( disk_open2( &d1, filename, preindex ) )
+  if( disk_open2( &d1, filename, preindex ) ) {
+    libspectrum_free( filename2 );
     return d->status = d1.status;
+  }
 
   if( disk_merge_sides( d, &d1, &d2, 0x00 ) ) {
     disk_close( &d2 );
@@ -2048,6 +2209,94 @@ disk_open( disk_t *d, const char *filename, int preindex, int merge_disks )
   return d->status;
 }
 
+/* check the CRC of an ID or data field; 'mark' is the index of the
+   address mark, 'len' the number of bytes after it */
+static int
+field_crc_error( disk_t *d, int mark, int len, int mfm )
+{
+  libspectrum_word crc = 0xffff;
+  int i;
+
+  if( mfm ) {
+    crc = crc_fdc( crc, 0xa1 );
+    crc = crc_fdc( crc, 0xa1 );
+    crc = crc_fdc( crc, 0xa1 );
+  }
+  for( i = 0; i <= len; i++ )
+    crc = crc_fdc( crc, d->track[ mark + i ] );
+  return d->track[ mark + i ] != crc >> 8 ||
+	 d->track[ mark + i + 1 ] != ( crc & 0xff );
+}
+
+/* maximum distance of the data mark from the end of the ID field */
+#define DATAMARK_MAX_GAP 43
+
+int
+disk_scan( disk_t *d, disk_sector_fn fn, void *user_data )
+{
+  disk_sector_t s;
+  libspectrum_byte *t, *c, *f, *w;
+  int idx, track_idx, i, j, mark, end, deleted;
+
+  /* Save position of current data */
+  t = d->track;
+  c = d->clocks;
+  f = d->fm;
+  w = d->weak;
+  idx = d->i;
+  track_idx = d->track_idx;
+
+  for( i = 0; i < d->sides * d->cylinders; i++ ) {
+    DISK_SET_TRACK_IDX( d, i );
+    s.head = i % d->sides;
+    s.cylinder = i / d->sides;
+    d->i = 0;
+    while( id_read( d, &s.h, &s.c, &s.r, &s.n ) ) {
+      mark = d->i - 7;
+      s.fm = mark == 0 || d->track[ mark - 1 ] != 0xa1;
+      s.id_crc_error = field_crc_error( d, mark, 4, !s.fm );
+      s.has_data = s.deleted = s.data_crc_error = s.weak = 0;
+      s.data = NULL;
+      s.length = 0;
+
+      end = d->i;
+      if( datamark_read( d, &deleted ) &&
+	  d->i - end <= DATAMARK_MAX_GAP && d->track[ d->i - 1 ] != 0xfe ) {
+	mark = d->i - 1;
+	s.has_data = 1;
+	s.deleted = deleted;
+	s.data = d->track + d->i;
+	s.length = 0x80 << ( s.n & 0x07 );
+	if( d->i + s.length + 2 > d->bpt ) {	/* truncated by the index */
+	  s.length = d->bpt - d->i;
+	  s.data_crc_error = 1;
+	} else {
+	  s.data_crc_error =
+	    field_crc_error( d, mark, s.length, d->track[ mark - 1 ] == 0xa1 );
+	}
+	for( j = 0; j < s.length; j++ ) {
+	  if( bitmap_test( d->weak, d->i + j ) ) {
+	    s.weak = 1;
+	    break;
+	  }
+	}
+      } else {
+	d->i = end;			/* no data, go on after the ID */
+      }
+      fn( d, &s, user_data );
+    }
+  }
+
+  d->track = t;
+  d->clocks = c;
+  d->fm = f;
+  d->weak = w;
+  d->i = idx;
+  d->track_idx = track_idx;
+
+  return d->status = DISK_OK;
+}
+
 /*--------------------- start of write section ----------------*/
 
 static int
@@ -2294,11 +2543,46 @@ write_fdi( FILE *file, disk_t *d )
   return d->status = DISK_OK;
 }
 
+/* write a Track-Info block and the sector data of a track; mfm == -1
+   means take the gap byte from the track itself */
+static int
+cpc_write_track( FILE *file, disk_t *d, int side, int cyl, int sectors,
+		 int seclen, int mfm )
+{
+  int k, h, t, s, b;
+
+  memset( head, 0, 256 );
+  memcpy( head, "Track-Info\r\n", 12 );
+  DISK_SET_TRACK( d, side, cyl );
+  d->i = 0;
+  head[0x10] = cyl;
+  head[0x11] = side;
+  head[0x14] = seclen;
+  head[0x15] = sectors;
+  if( mfm != -1 )
+    head[0x16] = mfm ? 0x4e : 0xff;
+  head[0x17] = 0xe5;
+  k = 0;
+  while( id_read( d, &h, &t, &s, &b ) ) {
+    head[ 0x18 + k * 8 ] = t;
+    head[ 0x19 + k * 8 ] = h;
+    head[ 0x1a + k * 8 ] = s;
+    head[ 0x1b + k * 8 ] = b;
+    if( k == 0 && mfm == -1 ) {	/* if mixed MFM/FM tracks */
+      head[0x16] = d->track[ d->i ] == 0x4e ? 0x4e : 0xff;
+    }
+    k++;
+  }
+  if( fwrite( head, 256, 1, file ) != 1 )	/* Track head */
+    return 1;
+
+  return saverawtrack( d, file, side, cyl );
+}
+
 static int
 write_cpc( FILE *file, disk_t *d )
 {
-  int i, j, k, sbase, sectors, seclen, mfm, cyl;
-  int h, t, s, b;
+  int i, j, sbase, sectors, seclen, mfm, cyl;
   size_t len;
 
   i = check_disk_geom( d, &sbase, &sectors, &seclen, &mfm, &cyl );
@@ -2319,34 +2603,9 @@ write_cpc( FILE *file, disk_t *d )
   if( fwrite( head, 256, 1, file ) != 1 )	/* CPC head */
     return d->status = DISK_WRPART;
 
-  memset( head, 0, 256 );
-  memcpy( head, "Track-Info\r\n", 12 );
   for( i = 0; i < cyl; i++ ) {
     for( j = 0; j < d->sides; j++ ) {
-      DISK_SET_TRACK( d, j, i );
-      d->i = 0;
-      head[0x10] = i;
-      head[0x11] = j;
-      head[0x14] = seclen;
-      head[0x15] = sectors;
-      if( mfm != -1 )
-	head[0x16] = mfm ? 0x4e : 0xff;
-      head[0x17] = 0xe5;
-      k = 0;
-      while( id_read( d, &h, &t, &s, &b ) ) {
-	head[ 0x18 + k * 8 ] = t;
-	head[ 0x19 + k * 8 ] = h;
-	head[ 0x1a + k * 8 ] = s;
-	head[ 0x1b + k * 8 ] = b;
-	if( k == 0 && mfm == -1 ) {	/* if mixed MFM/FM tracks */
-	  head[0x16] = d->track[ d->i ] == 0x4e ? 0x4e : 0xff;
-	}
-	k++;
-      }
-      if( fwrite( head, 256, 1, file ) != 1 )	/* Track head */
-	return d->status = DISK_WRPART;
-
-      if( saverawtrack( d, file, j, i ) )
+      if( cpc_write_track( file, d, j, i, sectors, seclen, mfm ) )
 	return d->status = DISK_WRPART;
     }
   }
@@ -2553,17 +2812,216 @@ write_log( FILE *file, disk_t *d )
   return d->status = DISK_OK;
 }
 
+/* layout of a sector image file with fixed track positions */
+typedef struct layout_t {
+  long offset;			/* file offset of the first track */
+  long tsize;			/* bytes used by a track */
+  int outout;			/* TRACKS_OUTOUT or TRACKS_ALT */
+  int cylinders;		/* cylinders in the file */
+  int sector_base;		/* -1 if any sector layout can be written */
+  int sectors;
+  int seclen;			/* sector length code */
+} layout_t;
+
+static int
+get_file_layout( FILE *file, disk_t *d, long length, layout_t *l )
+{
+  l->offset = 0;
+  l->outout = TRACKS_ALT;
+  l->cylinders = d->cylinders;
+  l->sector_base = 1;
+  l->sectors = l->seclen = 0;
+
+  switch( d->type ) {
+  case DISK_TRD:
+    l->sectors = 16; l->seclen = SECLEN_256;
+    break;
+  case DISK_IMG:
+    l->outout = TRACKS_OUTOUT;
+  case DISK_MGT:
+    l->sectors = 10; l->seclen = SECLEN_512;
+    break;
+  case DISK_OPD:
+    l->sector_base = 0; l->sectors = 18; l->seclen = SECLEN_256;
+    break;
+  case DISK_SAD:
+    if( fread( head, 22, 1, file ) != 1 ||
+	memcmp( head, "Aley's disk backup", 18 ) || head[18] != d->sides )
+      return 1;
+    l->offset = 22;
+    l->outout = TRACKS_OUTOUT;
+    l->cylinders = head[19];
+    l->sectors = head[20];
+    l->seclen = calc_lenid( head[21] * 64 );
+    break;
+  case DISK_CPC:
+    if( fread( head, 256, 1, file ) != 1 ||
+	memcmp( head, "MV - CPC", 8 ) || head[0x31] != d->sides )
+      return 1;
+    l->offset = 256;
+    l->cylinders = head[0x30];
+    l->tsize = head[0x32] + 256 * head[0x33];
+    l->sector_base = -1;
+    break;
+  default:
+    return 1;
+  }
+  if( l->sector_base != -1 )
+    l->tsize = l->sectors * ( 0x80 << l->seclen );
+
+  if( l->cylinders > d->cylinders )
+    return 1;
+  /* TR-DOS images may be truncated, the others must be complete */
+  if( d->type != DISK_TRD &&
+      length != l->offset + l->tsize * d->sides * l->cylinders )
+    return 1;
+  return 0;
+}
+
+/* check whether track 'idx' can be stored in the image file as it is */
+static int
+track_fits_layout( disk_t *d, int idx, layout_t *l, long length )
+{
+  int head = idx % d->sides, cyl = idx / d->sides;
+  int sbase, sectors, seclen, mfm, r;
+  long pos;
+
+  if( cyl >= l->cylinders )
+    return 0;
+  pos = l->offset + l->tsize *
+	( l->outout ? head * l->cylinders + cyl : idx );
+  if( pos + l->tsize > length )
+    return 0;
+
+  r = guess_track_geom( d, head, cyl, &sbase, &sectors, &seclen, &mfm );
+  if( d->track[-1] & 0x80 || sbase == -1 )		/* weak or unformatted */
+    return 0;
+  if( l->sector_base == -1 )				/* CPC */
+    return !( r & DISK_SECLEN_VARI ) &&
+	   sectors * ( 0x80 << seclen ) + 256 == l->tsize;
+  return r == 0 && d->track[-1] == 0x00 && sbase == l->sector_base &&
+	 sectors == l->sectors && seclen == l->seclen;
+}
+
+/* if we write back to the image file the disk was read from (or last
+   written to), try to rewrite only the modified tracks. Returns 1 if
+   this is not possible and the whole image has to be written */
+static int
+write_dirty_tracks( disk_t *d, const char *filename )
+{
+  FILE *file;
+  layout_t l;
+  long length;
+  int i, head, cyl, sbase, sectors, seclen, mfm;
+
+  if( d->filename == NULL || strcmp( filename, d->filename ) ||
+      d->type != d->file_type )
+    return 1;
+
+  if( ( file = fopen( filename, "r+b" ) ) == NULL )
+    return 1;
+
+  if( fseek( file, 0, SEEK_END ) || ( length = ftell( file ) ) == -1 ||
+      fseek( file, 0, SEEK_SET ) || get_file_layout( file, d, length, &l ) ) {
+    fclose( file );
+    return 1;
+  }
+
+  for( i = 0; i < d->sides * d->cylinders; i++ ) {
+    if( bitmap_test( d->dirty_tracks, i ) &&
+	!track_fits_layout( d, i, &l, length ) ) {
+      fclose( file );
+      return 1;
+    }
+  }
+
+  d->status = DISK_OK;
+  for( i = 0; i < d->sides * d->cylinders; i++ ) {
+    if( !bitmap_test( d->dirty_tracks, i ) )
+      continue;
+    head = i % d->sides;
+    cyl = i / d->sides;
+    if( fseek( file, l.offset + l.tsize *
+	       ( l.outout ? head * l.cylinders + cyl : i ), SEEK_SET ) ) {
+      d->status = DISK_WRPART;
+      break;
+    }
+    if( d->type == DISK_CPC ) {
+      guess_track_geom( d, head, cyl, &sbase, &sectors, &seclen, &mfm );
+      if( cpc_write_track( file, d, head, cyl, sectors, seclen, -1 ) )
+	d->status = DISK_WRPART;
+    } else if( savetrack( d, file, head, cyl, l.sector_base, l.sectors,
+			  l.seclen ) ) {
+      d->status = DISK_WRPART;
+    }
+    if( d->status != DISK_OK )
+      break;
+  }
+
+  if( fclose( file ) == -1 && d->status == DISK_OK )
+    d->status = DISK_WRFILE;
+  return 0;
+}
+
+static int
+write_image( disk_t *d, const char *filename )
+{
+  FILE *file;
+
+  if( ( file = fopen( filename, "wb" ) ) == NULL )
+    return d->status = DISK_WRFILE;
+
+  switch( d->type ) {
+  case DISK_UDI:
+    write_udi( file, d );
+    break;
+  case DISK_IMG:
+  case DISK_MGT:
+  case DISK_OPD:
+    write_img_mgt_opd( file, d );
+    break;
+  case DISK_TRD:
+    write_trd( file, d );
+    break;
+  case DISK_SAD:
+    write_sad( file, d );
+    break;
+  case DISK_FDI:
+    write_fdi( file, d );
+    break;
+  case DISK_SCL:
+    write_scl( file, d );
+    break;
+  case DISK_CPC:
+    write_cpc( file, d );
+    break;
+  case DISK_LOG:
+    write_log( file, d );
+    break;
+  default:
+    fclose( file );
+    return d->status = DISK_WRFILE;
+    break;
+  }
+
+  if( d->status != DISK_OK ) {
+    fclose( file );
+    return d->status;
+  }
+
+  if( fclose( file ) == -1 )
+    return d->status = DISK_WRFILE;
+
+  return d->status = DISK_OK;
+}
+
 int
 disk_write( disk_t *d, const char *filename )
 {
-  FILE *file;
   const char *ext;
   size_t namelen;
   libspectrum_byte *t, *c, *f, *w;
-  int idx;
-
-  if( ( file = fopen( filename, "wb" ) ) == NULL )
-    return d->status = DISK_WRFILE;
+  int idx, track_idx;
 
   namelen = strlen( filename );
   if( namelen < 4 )
@@ -2602,38 +3060,13 @@ disk_write( disk_t *d, const char *filename )
   f = d->fm;
   w = d->weak;
   idx = d->i;
+  track_idx = d->track_idx;
 
   update_tracks_mode( d );
-  switch( d->type ) {
-  case DISK_UDI:
-    write_udi( file, d );
-    break;
-  case DISK_IMG:
-  case DISK_MGT:
-  case DISK_OPD:
-    write_img_mgt_opd( file, d );
-    break;
-  case DISK_TRD:
-    write_trd( file, d );
-    break;
-  case DISK_SAD:
-    write_sad( file, d );
-    break;
-  case DISK_FDI:
-    write_fdi( file, d );
-    break;
-  case DISK_SCL:
-    write_scl( file, d );
-    break;
-  case DISK_CPC:
-    write_cpc( file, d );
-    break;
-  case DISK_LOG:
-    write_log( file, d );
-    break;
-  default:
-    return d->status = DISK_WRFILE;
-    break;
+  if( write_dirty_tracks( d, filename ) ) {
+    /* we may overwrite the file the tracks are decoded from */
+    decode_all_tracks( d );
+    write_image( d, filename );
   }
 
   /* Restore position of previous data.
@@ -2643,14 +3076,17 @@ disk_write( disk_t *d, const char *filename )
   d->fm = f;
   d->weak = w;
   d->i = idx;
+  d->track_idx = track_idx;
 
   if( d->status != DISK_OK ) {
-    fclose( file );
+    d->file_type = DISK_TYPE_NONE;	/* do not trust the file anymore */
     return d->status;
   }
 
-  if( fclose( file ) == -1 )
-    return d->status = DISK_WRFILE;
+  memset( d->dirty_tracks, 0, DISK_CLEN( d->sides * d->cylinders ) );
+  /* if written to another file, the caller may or may not switch to it */
+  d->file_type = d->filename != NULL && !strcmp( filename, d->filename ) ?
+		 d->type : DISK_TYPE_NONE;
 
-  return d->status = DISK_OK;
+  return d->status;
 }
@@ -28,6 +28,10 @@
 
 #include <config.h>
 
+#include <libspectrum.h>
+
+#include "bitmap.h"
+
 static const unsigned int DISK_FLAG_NONE = 0x00;
 static const unsigned int DISK_FLAG_PLUS3_CPC = 0x01;	/* try to fix some CPC issue */
 static const unsigned int DISK_FLAG_OPEN_DS = 0x02;	/* try to open the other side too */
@@ -86,6 +90,29 @@ typedef enum disk_dens_t {
   DISK_HD,		/* 12500 bpt*/
 } disk_dens_t;
 
+/* sector images with a fixed layout are decoded track by track on first
+   access instead of when the image is opened */
+/* an image file read into memory */
+typedef struct disk_file_t {
+  libspectrum_byte *buffer;
+  size_t length;
+} disk_file_t;
+
+typedef struct disk_source_t {
+  disk_file_t file;		/* image file */
+  libspectrum_byte *decoded;	/* decoded tracks bitmap, NULL if all decoded */
+  int pending;			/* number of tracks not yet decoded */
+  size_t offset;		/* file offset of the first track */
+  int outout;			/* side 0 stored first, otherwise alternating */
+  int sector_base;
+  int sectors;
+  int seclen;
+  int preindex;
+  int gap;
+  int interleave;
+  int autofill;
+} disk_source_t;
+
 typedef struct disk_t {
   char *filename;	/* original filename */
   int sides;		/* 1 or 2 */
@@ -106,8 +133,30 @@ typedef struct disk_t {
   int i;			/* index for track and clocks */
   disk_type_t type;		/* DISK_UDI, ... */
   disk_dens_t density;		/* DISK_SD DISK_DD, or DISK_HD */
+  disk_type_t file_type;	/* format of the image file 'filename' */
+  int track_idx;		/* index of current track */
+  libspectrum_byte *dirty_tracks;	/* tracks changed since last open/write */
+  disk_source_t source;		/* tracks not yet decoded from the file */
 } disk_t;
 
+/* a sector as found on the disk by disk_scan() */
+typedef struct disk_sector_t {
+  int head;			/* physical side */
+  int cylinder;			/* physical cylinder */
+  int c, h, r, n;		/* ID field: cylinder, head, sector, length */
+  int fm;			/* FM (single density) recorded */
+  int id_crc_error;
+  int has_data;			/* a data field follows the ID field */
+  int deleted;			/* deleted data mark */
+  int data_crc_error;		/* data CRC error or data truncated */
+  int weak;			/* data contain weak bytes */
+  libspectrum_byte *data;	/* data bytes in the track buffer */
+  int length;
+} disk_sector_t;
+
+typedef void (*disk_sector_fn)( disk_t *d, const disk_sector_t *sector,
+				void *user_data );
+
 /* every track data:
 TRACK_LEN TYPE TRACK......DATA CLOCK..MARKS MF..MARKS WEAK..MARKS
                ^               ^            ^         ^
@@ -119,16 +168,32 @@ TRACK_LEN TYPE TRACK......DATA CLOCK..MARKS MF..MARKS WEAK..MARKS
 
 #define DISK_CLEN( bpt ) ( ( bpt ) / 8 + ( ( bpt ) % 8 ? 1 : 0 ) )
 
-#define DISK_SET_TRACK_IDX( d, idx ) \
-   d->track = d->data + 3 + ( idx ) * d->tlen; \
-   d->clocks = d->track  + d->bpt; \
-   d->fm     = d->clocks + DISK_CLEN( d->bpt ); \
-   d->weak   = d->fm     + DISK_CLEN( d->bpt )
+/* a track which can't be decoded is left unformatted; see
+   disk_decode_track() */
+#define DISK_SET_TRACK_IDX( d, idx ) do { \
+   if( (d)->source.decoded != NULL && \
+       !bitmap_test( (d)->source.decoded, ( idx ) ) ) \
+     disk_decode_track( (d), ( idx ) ); \
+   (d)->track_idx = ( idx ); \
+   (d)->track = (d)->data + 3 + ( idx ) * (d)->tlen; \
+   (d)->clocks = (d)->track  + (d)->bpt; \
+   (d)->fm     = (d)->clocks + DISK_CLEN( (d)->bpt ); \
+   (d)->weak   = (d)->fm     + DISK_CLEN( (d)->bpt ); \
+} while( 0 )
 
 #define DISK_SET_TRACK( d, head, cyl ) \
    DISK_SET_TRACK_IDX( (d), (d)->sides * cyl + head )
 
+/* record that the current track has been modified */
+#define DISK_SET_TRACK_DIRTY( d ) do { \
+   (d)->dirty = 1; \
+   bitmap_set( (d)->dirty_tracks, (d)->track_idx ); \
+} while( 0 )
+
 const char *disk_strerror( int error );
+/* decode track 'idx' from the image file; used by DISK_SET_TRACK_IDX.
+   If that fails, the track is left unformatted and non-zero returned */
+int disk_decode_track( disk_t *d, int idx );
 /* create an unformatted disk sides -> (1/2) cylinders -> track/side,
    dens -> 'density' related to unformatted length of a track (SD = 3125,
    DD = 6250, HD = 12500, type -> if write this disk we want to convert
@@ -141,6 +206,10 @@ int disk_new( disk_t *d, int sides, int cylinders, disk_dens_t dens, disk_type_t
    supported
 */
 int disk_open( disk_t *d, const char *filename, int preindex, int disk_merge );
+/* if filename names one side of a disk split into two image files
+   ("...Side A.dsk" and so on), return a newly allocated copy naming the
+   other side; otherwise NULL. disk_open() merges these when asked to */
+char *disk_other_side( const char *filename );
 /* merge two one sided disk (d1, d2) to a two sided one (d),
    after merge closes d1 and d2
 */
@@ -148,9 +217,13 @@ int disk_merge_sides( disk_t *d, disk_t *d1, disk_t *d2, int autofill );
 /* write a disk image file (from the disk buffer). the d->type
    gives the format of file. if it DISK_TYPE_AUTO, disk_write
    try to guess from the file name (extension). if fail save as
-   UDI.
+   UDI. if we write back to the original TRD/IMG/MGT/SAD/DSK file,
+   only the modified tracks are rewritten.
 */
 int disk_write( disk_t *d, const char *filename );
+/* call fn() for every sector ID field on the disk, track by track
+*/
+int disk_scan( disk_t *d, disk_sector_fn fn, void *user_data );
 /* format disk to plus3 accept for formatting
 */
 int disk_preformat( disk_t *d );
@@ -360,7 +360,7 @@ fdd_read_write_data( fdd_t *d, fdd_write_t write )
 #else
     bitmap_reset( d->disk.weak, d->disk.i );
 #endif
-    d->disk.dirty = 1;
+    DISK_SET_TRACK_DIRTY( &d->disk );
   } else {	/* read */
     d->data = d->disk.track[ d->disk.i ];
     if( bitmap_test( d->disk.clocks, d->disk.i ) )
@@ -79,6 +79,8 @@ static void opus_memory_map( void );
 static void opus_enabled_snapshot( libspectrum_snap *snap );
 static void opus_from_snapshot( libspectrum_snap *snap );
 static void opus_to_snapshot( libspectrum_snap *snap );
+static void opus_pc_trap_page( libspectrum_word pc );
+static void opus_pc_trap_unpage( libspectrum_word pc );
 
 static module_info_t opus_module_info = {
 
@@ -90,11 +92,20 @@ static module_info_t opus_module_info = {
 
 };
 
+static const periph_pc_trap_t opus_pc_traps[] = {
+  { 0xffff, 0x0008, NULL, opus_pc_trap_page },
+  { 0xffff, 0x0048, NULL, opus_pc_trap_page },
+  { 0xffff, 0x1708, NULL, opus_pc_trap_page },
+  { 0xffff, 0x1748, NULL, opus_pc_trap_unpage },
+  { 0, 0, NULL, NULL }
+};
+
 static const periph_t opus_periph = {
   &settings_current.opus,
   NULL,
   1,
-  NULL
+  NULL,
+  opus_pc_traps
 };
 
 void
@@ -113,6 +124,18 @@ opus_unpage( void )
   machine_current->memory_map();
 }
 
+static void
+opus_pc_trap_page( libspectrum_word pc GCC_UNUSED )
+{
+  if( !opus_active ) opus_page();
+}
+
+static void
+opus_pc_trap_unpage( libspectrum_word pc GCC_UNUSED )
+{
+  if( opus_active ) opus_unpage();
+}
+
 static void
 opus_memory_map( void )
 {
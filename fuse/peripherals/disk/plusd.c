@@ -66,6 +66,7 @@ static void plusd_enabled_snapshot( libspectrum_snap *snap );
 static void plusd_from_snapshot( libspectrum_snap *snap );
 static void plusd_to_snapshot( libspectrum_snap *snap );
 static void plusd_activate( void );
+static void plusd_pc_trap( libspectrum_word pc );
 
 static module_info_t plusd_module_info = {
 
@@ -95,6 +96,12 @@ plusd_unpage( void )
   machine_current->memory_map();
 }
 
+static void
+plusd_pc_trap( libspectrum_word pc GCC_UNUSED )
+{
+  plusd_page();
+}
+
 static void
 plusd_memory_map( void )
 {
@@ -124,11 +131,20 @@ static const periph_port_t plusd_ports[] = {
   { 0, 0, NULL, NULL }
 };
 
+static const periph_pc_trap_t plusd_pc_traps[] = {
+  { 0xffff, 0x0008, plusd_pc_trap, NULL },
+  { 0xffff, 0x003a, plusd_pc_trap, NULL },
+  { 0xffff, 0x0066, plusd_pc_trap, NULL },
+  { 0xffff, 0x028e, plusd_pc_trap, NULL },
+  { 0, 0, NULL, NULL }
+};
+
 static const periph_t plusd_periph = {
   &settings_current.plusd,
   plusd_ports,
   1,
-  plusd_activate
+  plusd_activate,
+  plusd_pc_traps
 };
 
 void
@@ -49,6 +49,8 @@ static void divide_page( void );
 static void divide_unpage( void );
 static libspectrum_ide_register port_to_ide_register( libspectrum_byte port );
 static void divide_activate( void );
+static void divide_pc_trap_map( libspectrum_word pc );
+static void divide_pc_trap_unmap( libspectrum_word pc );
 
 /* Data */
 
@@ -58,11 +60,24 @@ static const periph_port_t divide_ports[] = {
   { 0, 0, NULL, NULL }
 };
 
+static const periph_pc_trap_t divide_pc_traps[] = {
+  { 0xff00, 0x3d00, divide_pc_trap_map, NULL },
+  { 0xfff8, 0x1ff8, NULL, divide_pc_trap_unmap },
+  { 0xffff, 0x0000, NULL, divide_pc_trap_map },
+  { 0xffff, 0x0008, NULL, divide_pc_trap_map },
+  { 0xffff, 0x0038, NULL, divide_pc_trap_map },
+  { 0xffff, 0x0066, NULL, divide_pc_trap_map },
+  { 0xffff, 0x04c6, NULL, divide_pc_trap_map },
+  { 0xffff, 0x0562, NULL, divide_pc_trap_map },
+  { 0, 0, NULL, NULL }
+};
+
 static const periph_t divide_periph = {
   &settings_current.divide_enabled,
   divide_ports,
   1,
-  divide_activate
+  divide_activate,
+  divide_pc_traps
 };
 
 static const libspectrum_byte DIVIDE_CONTROL_CONMEM = 0x80;
@@ -323,6 +338,18 @@ divide_set_automap( int state )
   divide_refresh_page_state();
 }
 
+static void
+divide_pc_trap_map( libspectrum_word pc GCC_UNUSED )
+{
+  divide_set_automap( 1 );
+}
+
+static void
+divide_pc_trap_unmap( libspectrum_word pc GCC_UNUSED )
+{
+  divide_set_automap( 0 );
+}
+
 void
 divide_refresh_page_state( void )
 {
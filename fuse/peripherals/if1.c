@@ -218,11 +218,22 @@ static const periph_port_t if1_ports[] = {
   { 0, 0, NULL, NULL }
 };
 
+static void if1_pc_trap_page( libspectrum_word pc );
+static void if1_pc_trap_unpage( libspectrum_word pc );
+
+static const periph_pc_trap_t if1_pc_traps[] = {
+  { 0xffff, 0x0008, if1_pc_trap_page, NULL },
+  { 0xffff, 0x1708, if1_pc_trap_page, NULL },
+  { 0xffff, 0x0700, NULL, if1_pc_trap_unpage },
+  { 0, 0, NULL, NULL }
+};
+
 static const periph_t if1_periph = {
   &settings_current.interface1,
   if1_ports,
   1,
-  NULL
+  NULL,
+  if1_pc_traps
 };
 
 /* Memory source */
@@ -432,6 +443,18 @@ if1_unpage( void )
   debugger_event( unpage_event );
 }
 
+static void
+if1_pc_trap_page( libspectrum_word pc GCC_UNUSED )
+{
+  if1_page();
+}
+
+static void
+if1_pc_trap_unpage( libspectrum_word pc GCC_UNUSED )
+{
+  if1_unpage();
+}
+
 void
 if1_memory_map( void )
 {
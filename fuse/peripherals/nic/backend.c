@@ -0,0 +1,371 @@
+/* backend.c: Ethernet frame backends for emulated network interfaces
+   Copyright (c) 2014 Philip Kendall
+
+   $Id$
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compat.h"
+#include "backend.h"
+#include "loopback.h"
+#include "ui/ui.h"
+
+/* pcapng block types and the option we use; see
+   http://www.winpcap.org/ntar/draft/PCAP-DumpFileFormat.html */
+#define PCAPNG_SECTION_HEADER         0x0a0d0d0a
+#define PCAPNG_INTERFACE_DESCRIPTION  0x00000001
+#define PCAPNG_ENHANCED_PACKET        0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC       0x1a2b3c4d
+#define PCAPNG_LINKTYPE_ETHERNET      1
+#define PCAPNG_OPTION_END             0
+#define PCAPNG_OPTION_EPB_FLAGS       2
+
+#define PCAPNG_DIRECTION_MASK         0x03
+#define PCAPNG_DIRECTION_INBOUND      0x01
+#define PCAPNG_DIRECTION_OUTBOUND     0x02
+
+/* Largest frame we will deal with, and largest block we will read */
+#define FRAME_MAX                     0x600
+#define BLOCK_MAX                     0x10000
+
+struct nic_backend_t {
+
+  nic_backend_type type;
+
+  int tap_fd;				/* NIC_BACKEND_TAP */
+  nic_loopback_t *loopback;		/* NIC_BACKEND_LOOPBACK */
+
+  FILE *replay;				/* NIC_BACKEND_REPLAY */
+  libspectrum_byte *replay_block;
+  libspectrum_byte *replay_frame;	/* Next frame to deliver, or NULL */
+  size_t replay_length;
+  libspectrum_qword replay_time;
+
+  FILE *capture;
+
+  /* Emulated time, relative to the first call to nic_backend_set_time() */
+  int have_origin;
+  libspectrum_qword origin;
+  libspectrum_qword time;
+
+};
+
+static int replay_next( nic_backend_t *self );
+static void capture_frame( nic_backend_t *self, const libspectrum_byte *buffer,
+			   size_t length, libspectrum_dword direction );
+
+static void
+put_dword( libspectrum_byte *p, libspectrum_dword value )
+{
+  p[0] = value & 0xff; p[1] = ( value >> 8 ) & 0xff;
+  p[2] = ( value >> 16 ) & 0xff; p[3] = value >> 24;
+}
+
+static libspectrum_dword
+get_dword( const libspectrum_byte *p )
+{
+  return p[0] | ( p[1] << 8 ) | ( p[2] << 16 ) | ( (libspectrum_dword)p[3] << 24 );
+}
+
+nic_backend_t*
+nic_backend_alloc( nic_backend_type type, const char *name )
+{
+  nic_backend_t *self = libspectrum_new0( nic_backend_t, 1 );
+
+  self->type = type;
+  self->tap_fd = -1;
+
+  switch( type ) {
+
+  case NIC_BACKEND_TAP:
+    self->tap_fd = compat_get_tap( name );
+    break;
+
+  case NIC_BACKEND_LOOPBACK:
+    self->loopback = nic_loopback_alloc( name );
+    break;
+
+  case NIC_BACKEND_REPLAY:
+    if( !name ) {
+      ui_error( UI_ERROR_ERROR, "no network capture file to replay" );
+      break;
+    }
+    self->replay = fopen( name, "rb" );
+    if( !self->replay ) {
+      ui_error( UI_ERROR_ERROR, "couldn't open '%s': %s", name,
+		strerror( errno ) );
+      break;
+    }
+    self->replay_block = libspectrum_new( libspectrum_byte, BLOCK_MAX );
+    if( replay_next( self ) ) {
+      ui_error( UI_ERROR_ERROR, "'%s' is not a pcapng capture", name );
+      fclose( self->replay ); self->replay = NULL;
+    }
+    break;
+
+  }
+
+  return self;
+}
+
+void
+nic_backend_free( nic_backend_t *self )
+{
+  if( self->tap_fd >= 0 ) close( self->tap_fd );
+  if( self->loopback ) nic_loopback_free( self->loopback );
+  if( self->replay ) fclose( self->replay );
+  if( self->capture ) fclose( self->capture );
+  libspectrum_free( self->replay_block );
+  libspectrum_free( self );
+}
+
+int
+nic_backend_type_from_string( const char *string, nic_backend_type *type )
+{
+  if( !string || !strcmp( string, "tap" ) ) {
+    *type = NIC_BACKEND_TAP;
+  } else if( !strcmp( string, "loopback" ) ) {
+    *type = NIC_BACKEND_LOOPBACK;
+  } else if( !strcmp( string, "replay" ) ) {
+    *type = NIC_BACKEND_REPLAY;
+  } else {
+    ui_error( UI_ERROR_ERROR, "unknown network backend '%s'", string );
+    return 1;
+  }
+
+  return 0;
+}
+
+int
+nic_backend_capture( nic_backend_t *self, const char *filename )
+{
+  libspectrum_byte header[48];
+
+  if( self->capture ) fclose( self->capture );
+
+  self->capture = fopen( filename, "wb" );
+  if( !self->capture ) {
+    ui_error( UI_ERROR_ERROR, "couldn't open '%s': %s", filename,
+	      strerror( errno ) );
+    return 1;
+  }
+
+  /* Section header block, with unknown section length */
+  put_dword( header +  0, PCAPNG_SECTION_HEADER );
+  put_dword( header +  4, 28 );
+  put_dword( header +  8, PCAPNG_BYTE_ORDER_MAGIC );
+  put_dword( header + 12, 0x00000001 );	/* Version 1.0 */
+  put_dword( header + 16, 0xffffffff );
+  put_dword( header + 20, 0xffffffff );
+  put_dword( header + 24, 28 );
+
+  /* Interface description block, with the default microsecond
+     resolution timestamps */
+  put_dword( header + 28, PCAPNG_INTERFACE_DESCRIPTION );
+  put_dword( header + 32, 20 );
+  put_dword( header + 36, PCAPNG_LINKTYPE_ETHERNET );
+  put_dword( header + 40, FRAME_MAX );
+  put_dword( header + 44, 20 );
+
+  if( fwrite( header, sizeof( header ), 1, self->capture ) != 1 ) {
+    ui_error( UI_ERROR_ERROR, "error writing to '%s'", filename );
+    fclose( self->capture ); self->capture = NULL;
+    return 1;
+  }
+
+  return 0;
+}
+
+void
+nic_backend_set_time( nic_backend_t *self, libspectrum_qword usecs )
+{
+  if( !self->have_origin ) {
+    self->origin = usecs;
+    self->have_origin = 1;
+  }
+
+  self->time = usecs - self->origin;
+}
+
+size_t
+nic_backend_recv( nic_backend_t *self, libspectrum_byte *buffer, size_t length )
+{
+  ssize_t n = 0;
+
+  switch( self->type ) {
+
+  case NIC_BACKEND_TAP:
+    if( self->tap_fd < 0 ) return 0;
+    n = read( self->tap_fd, buffer, length );
+    if( n < 0 ) n = 0;
+    break;
+
+  case NIC_BACKEND_LOOPBACK:
+    if( !self->loopback ) return 0;
+    n = nic_loopback_recv( self->loopback, buffer, length );
+    break;
+
+  case NIC_BACKEND_REPLAY:
+    if( !self->replay_frame || self->replay_time > self->time ) return 0;
+    n = self->replay_length < length ? self->replay_length : length;
+    memcpy( buffer, self->replay_frame, n );
+    self->replay_frame = NULL;
+    if( replay_next( self ) ) {
+      fclose( self->replay ); self->replay = NULL;
+    }
+    break;
+
+  }
+
+  if( n ) capture_frame( self, buffer, n, PCAPNG_DIRECTION_INBOUND );
+
+  return n;
+}
+
+void
+nic_backend_send( nic_backend_t *self, const libspectrum_byte *buffer,
+		  size_t length )
+{
+  capture_frame( self, buffer, length, PCAPNG_DIRECTION_OUTBOUND );
+
+  switch( self->type ) {
+
+  case NIC_BACKEND_TAP:
+    if( self->tap_fd < 0 ) return;
+    if( write( self->tap_fd, buffer, length ) != length ) {
+      /* write failed: disable TAP */
+      close( self->tap_fd );
+      self->tap_fd = -1;
+    }
+    break;
+
+  case NIC_BACKEND_LOOPBACK:
+    if( self->loopback ) nic_loopback_send( self->loopback, buffer, length );
+    break;
+
+  case NIC_BACKEND_REPLAY:
+    /* The replayed frames are what the far end sent in response to these,
+       so there's nothing to do with them */
+    break;
+
+  }
+}
+
+/* Find the next received frame in the replay file. Returns non-zero on
+   a malformed file; running out of frames is not an error */
+static int
+replay_next( nic_backend_t *self )
+{
+  libspectrum_byte *block = self->replay_block;
+  libspectrum_dword type, length, captured, flags;
+  size_t offset;
+
+  if( !self->replay ) return 0;
+
+  while( 1 ) {
+
+    if( fread( block, 8, 1, self->replay ) != 1 ) return 0;
+
+    type = get_dword( block );
+    length = get_dword( block + 4 );
+    if( length < 12 || length > BLOCK_MAX || length % 4 ) return 1;
+
+    if( fread( block + 8, length - 8, 1, self->replay ) != 1 ) return 1;
+
+    if( type == PCAPNG_SECTION_HEADER ) {
+      /* We only deal with captures in the byte order we write */
+      if( length < 28 || get_dword( block + 8 ) != PCAPNG_BYTE_ORDER_MAGIC )
+	return 1;
+      continue;
+    }
+
+    if( type != PCAPNG_ENHANCED_PACKET || length < 32 ) continue;
+
+    captured = get_dword( block + 20 );
+    if( captured > length - 32 || captured > FRAME_MAX ) return 1;
+
+    /* Frames without a direction are assumed to have been received */
+    flags = PCAPNG_DIRECTION_INBOUND;
+    offset = 28 + ( ( captured + 3 ) & ~3 );
+    while( offset + 4 <= length - 4 ) {
+      libspectrum_word code = block[ offset ] | ( block[ offset + 1 ] << 8 );
+      libspectrum_word size = block[ offset + 2 ] | ( block[ offset + 3 ] << 8 );
+
+      if( code == PCAPNG_OPTION_END ) break;
+      if( code == PCAPNG_OPTION_EPB_FLAGS && size == 4 &&
+	  offset + 8 <= length - 4 )
+	flags = get_dword( block + offset + 4 );
+      offset += 4 + ( ( size + 3 ) & ~3 );
+    }
+
+    if( ( flags & PCAPNG_DIRECTION_MASK ) == PCAPNG_DIRECTION_OUTBOUND )
+      continue;
+
+    self->replay_time = ( (libspectrum_qword)get_dword( block + 12 ) << 32 ) |
+			get_dword( block + 16 );
+    self->replay_frame = block + 28;
+    self->replay_length = captured;
+
+    return 0;
+  }
+}
+
+static void
+capture_frame( nic_backend_t *self, const libspectrum_byte *buffer,
+	       size_t length, libspectrum_dword direction )
+{
+  libspectrum_byte header[28], trailer[16];
+  static const libspectrum_byte padding[3] = { 0, 0, 0 };
+  size_t pad, block_length;
+
+  if( !self->capture ) return;
+
+  pad = ( 4 - length % 4 ) % 4;
+  block_length = sizeof( header ) + length + pad + sizeof( trailer );
+
+  put_dword( header +  0, PCAPNG_ENHANCED_PACKET );
+  put_dword( header +  4, block_length );
+  put_dword( header +  8, 0 );		/* Interface ID */
+  put_dword( header + 12, self->time >> 32 );
+  put_dword( header + 16, self->time & 0xffffffff );
+  put_dword( header + 20, length );
+  put_dword( header + 24, length );
+
+  put_dword( trailer +  0, PCAPNG_OPTION_EPB_FLAGS | ( 4 << 16 ) );
+  put_dword( trailer +  4, direction );
+  put_dword( trailer +  8, PCAPNG_OPTION_END );
+  put_dword( trailer + 12, block_length );
+
+  if( fwrite( header, sizeof( header ), 1, self->capture ) != 1 ||
+      fwrite( buffer, length, 1, self->capture ) != 1 ||
+      ( pad && fwrite( padding, pad, 1, self->capture ) != 1 ) ||
+      fwrite( trailer, sizeof( trailer ), 1, self->capture ) != 1 ) {
+    ui_error( UI_ERROR_ERROR, "error writing network capture" );
+    fclose( self->capture ); self->capture = NULL;
+  }
+}
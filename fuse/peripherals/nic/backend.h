@@ -0,0 +1,59 @@
+/* backend.h: Ethernet frame backends for emulated network interfaces
+   Copyright (c) 2014 Philip Kendall
+
+   $Id$
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+#ifndef FUSE_NIC_BACKEND_H
+#define FUSE_NIC_BACKEND_H
+
+#include <libspectrum.h>
+
+typedef enum nic_backend_type {
+  NIC_BACKEND_TAP,		/* Host TAP interface */
+  NIC_BACKEND_LOOPBACK,		/* In-process virtual network */
+  NIC_BACKEND_REPLAY,		/* Received frames from a capture file */
+} nic_backend_type;
+
+typedef struct nic_backend_t nic_backend_t;
+
+/* 'name' is the TAP interface, the loopback script (may be NULL) or the
+   capture file to replay respectively */
+nic_backend_t* nic_backend_alloc( nic_backend_type type, const char *name );
+void nic_backend_free( nic_backend_t *self );
+
+int nic_backend_type_from_string( const char *string, nic_backend_type *type );
+
+/* Write every frame sent or received to a pcapng file */
+int nic_backend_capture( nic_backend_t *self, const char *filename );
+
+/* Set the current emulated time, used to timestamp captured frames and
+   to schedule replayed ones */
+void nic_backend_set_time( nic_backend_t *self, libspectrum_qword usecs );
+
+/* Returns the length of the frame, or 0 if none is waiting */
+size_t nic_backend_recv( nic_backend_t *self, libspectrum_byte *buffer,
+			 size_t length );
+void nic_backend_send( nic_backend_t *self, const libspectrum_byte *buffer,
+		       size_t length );
+
+#endif			/* #ifndef FUSE_NIC_BACKEND_H */
@@ -34,9 +34,9 @@
 #include "config.h"
 
 #include <string.h>
-#include <unistd.h>
 
 #include "compat.h"
+#include "backend.h"
 #include "enc28j60.h"
 #include "fuse.h"
 #include "settings.h"
@@ -116,8 +116,8 @@ struct nic_enc28j60_t {
   libspectrum_byte curr_register;
   libspectrum_byte curr_register_bank;
 
-  /* TAP file descriptor */
-  int tap_fd;
+  /* Where frames are sent to and received from */
+  nic_backend_t *backend;
 
   /* ---------------------------------------------------------------------------
    * SPI state
@@ -139,7 +139,7 @@ nic_enc28j60_alloc( void )
 {
   nic_enc28j60_t *self = libspectrum_new( nic_enc28j60_t, 1 );
 
-  self->tap_fd = -1;
+  self->backend = NULL;
   self->spi_state = SPI_IDLE;
   return self;
 }
@@ -147,26 +147,51 @@ nic_enc28j60_alloc( void )
 void
 nic_enc28j60_init( nic_enc28j60_t *self )
 {
-  self->tap_fd = compat_get_tap( settings_current.speccyboot_tap );
+  nic_backend_type type;
+  const char *name;
+
+  if( nic_backend_type_from_string( settings_current.speccyboot_network,
+                                    &type ) )
+    return;
+
+  switch( type ) {
+  case NIC_BACKEND_TAP: name = settings_current.speccyboot_tap; break;
+  case NIC_BACKEND_LOOPBACK: name = settings_current.speccyboot_script; break;
+  case NIC_BACKEND_REPLAY: name = settings_current.speccyboot_replay; break;
+  default: name = NULL; break;
+  }
+
+  self->backend = nic_backend_alloc( type, name );
+
+  if( settings_current.speccyboot_capture )
+    nic_backend_capture( self->backend, settings_current.speccyboot_capture );
 }
 
 void
 nic_enc28j60_free( nic_enc28j60_t *self )
 {
+  if( self->backend ) nic_backend_free( self->backend );
   libspectrum_free( self );
 }
 
+/* Tell the backend the current emulated time */
+void
+nic_enc28j60_set_time( nic_enc28j60_t *self, libspectrum_qword usecs )
+{
+  if( self->backend ) nic_backend_set_time( self->backend, usecs );
+}
+
 /* Poll for received frames. */
 void
 nic_enc28j60_poll( nic_enc28j60_t *self )
 {
-  ssize_t n;
+  size_t n;
 
   if ( (ECON1(self) & ECON1_RXEN)     /* Ethernet RX enabled? */
-       && self->tap_fd > 0
-       && (n = read( self->tap_fd,
-                     self->eth_rx_buf + ETH_STATUS_LENGTH,
-                     ETH_MAX )) > 0) {
+       && self->backend
+       && (n = nic_backend_recv( self->backend,
+                                 self->eth_rx_buf + ETH_STATUS_LENGTH,
+                                 ETH_MAX )) > 0) {
     libspectrum_word erxwrpt = GET_PTR_REG( self, ERXWRPT );
     libspectrum_word erxst   = GET_PTR_REG( self, ERXST );
     libspectrum_word erxnd   = GET_PTR_REG( self, ERXND );
@@ -210,10 +235,9 @@ perform_side_effects_for_write( nic_enc28j60_t *self )
     libspectrum_word frame_start = (GET_PTR_REG(self, ETXST) & 0x1fff) + 1;
     libspectrum_word frame_end   = GET_PTR_REG(self, ETXND) & 0x1fff;
 
-    if ( frame_end > frame_start && self->tap_fd >= 0) {
-      ssize_t length = (frame_end - frame_start) + 1;
-      if ( write( self->tap_fd, self->sram + frame_start, length ) != length )
-        self->tap_fd = -1; /* write failed: disable TAP */
+    if ( frame_end > frame_start && self->backend ) {
+      size_t length = (frame_end - frame_start) + 1;
+      nic_backend_send( self->backend, self->sram + frame_start, length );
     }
 
     ECON1(self) &= ~ECON1_TXRTS;
@@ -34,6 +34,8 @@
 #ifndef FUSE_ENC28J60_H
 #define FUSE_ENC28J60_H
 
+#include <libspectrum.h>
+
 typedef enum nic_enc28j60_spi_state {
   SPI_IDLE = -2,
   SPI_CMD  = -1,  /* expect a command byte */
@@ -53,7 +55,7 @@ nic_enc28j60_t* nic_enc28j60_alloc( void );
 void nic_enc28j60_init( nic_enc28j60_t *self );
 void nic_enc28j60_free( nic_enc28j60_t *self );
 
-void nic_enc28j60_set_tap_fd( nic_enc28j60_t *self, int tap_fd );
+void nic_enc28j60_set_time( nic_enc28j60_t *self, libspectrum_qword usecs );
 
 void nic_enc28j60_poll( nic_enc28j60_t *self );
 void nic_enc28j60_reset( nic_enc28j60_t *self );
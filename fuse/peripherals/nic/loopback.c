@@ -0,0 +1,1658 @@
+/* loopback.c: In-process virtual network for emulated network interfaces
+   Copyright (c) 2014 Philip Kendall
+
+   $Id$
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+/* The emulated interface is connected to a virtual switch with a single
+   host on it. The host answers ARP and ping, hands out an address by
+   DHCP, serves files by TFTP and provides whichever UDP and TCP services
+   the script asks for. Everything happens synchronously when a frame is
+   sent, so there is no dependence on real time and the results are the
+   same on every run.
+
+   Interfaces which implement TCP/IP themselves, like the W5100, use the
+   nic_loopback_socket_*() functions instead of sending and receiving
+   frames. Their sockets sit behind a minimal client stack which talks to
+   the host through the same switch.
+
+   Nothing is ever lost between the host and the emulated interface, so
+   neither TCP implementation bothers with retransmission. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compat.h"
+#include "fuse.h"
+#include "loopback.h"
+#include "ui/ui.h"
+#include "utils.h"
+
+#define FRAME_MAX                     1514
+
+#define ETH_DESTINATION               0
+#define ETH_SOURCE                    6
+#define ETH_TYPE                      12
+#define ETH_HEADER                    14
+
+#define ETH_TYPE_IP                   0x0800
+#define ETH_TYPE_ARP                  0x0806
+
+#define IP_HEADER                     20
+#define IP_PROTOCOL_ICMP              1
+#define IP_PROTOCOL_TCP               6
+#define IP_PROTOCOL_UDP               17
+
+#define UDP_HEADER                    8
+#define TCP_HEADER                    20
+#define TCP_MSS                       536
+
+#define TCP_FIN                       0x01
+#define TCP_SYN                       0x02
+#define TCP_RST                       0x04
+#define TCP_PSH                       0x08
+#define TCP_ACK                       0x10
+
+#define DHCP_SERVER_PORT              67
+#define DHCP_CLIENT_PORT              68
+#define DHCP_MAGIC                    0x63825363
+#define DHCP_OPTIONS                  240
+#define DHCP_DISCOVER                 1
+#define DHCP_OFFER                    2
+#define DHCP_REQUEST                  3
+#define DHCP_ACK                      5
+
+#define TFTP_PORT                     69
+#define TFTP_BLOCK                    512
+#define TFTP_RRQ                      1
+#define TFTP_DATA                     3
+#define TFTP_ACK                      4
+#define TFTP_ERROR                    5
+
+#define MAX_SERVICES                  16
+#define MAX_CONNECTIONS               4
+
+typedef enum loopback_action {
+  LOOPBACK_ECHO,		/* Send back whatever is received */
+  LOOPBACK_FILE,		/* Send a file, then close the connection */
+  LOOPBACK_DISCARD,		/* Ignore whatever is received */
+} loopback_action;
+
+typedef struct loopback_service_t {
+  int protocol;
+  libspectrum_word port;
+  loopback_action action;
+  utils_file file;
+} loopback_service_t;
+
+typedef enum loopback_tcp_state {
+  TCP_CLOSED = 0,
+  TCP_SYN_RECEIVED,
+  TCP_ESTABLISHED,
+  TCP_LAST_ACK,
+} loopback_tcp_state;
+
+typedef struct loopback_tcp_t {
+
+  loopback_tcp_state state;
+  const loopback_service_t *service;
+
+  libspectrum_byte peer_mac[6];
+  libspectrum_byte peer_ip[4];
+  libspectrum_word peer_port;
+  libspectrum_word port;
+
+  libspectrum_dword snd_una;	/* Oldest unacknowledged sequence number */
+  libspectrum_dword snd_nxt;	/* Next sequence number to send */
+  libspectrum_dword rcv_nxt;	/* Next sequence number expected */
+  libspectrum_word window;	/* Peer's receive window */
+  libspectrum_word mss;
+
+  /* Data not yet acknowledged by the peer, 'sent' bytes of which have
+     been sent */
+  libspectrum_byte *pending;
+  size_t pending_length, sent;
+
+  int close_when_sent;
+  int fin_sent;
+
+} loopback_tcp_t;
+
+typedef struct loopback_tftp_t {
+  int active;
+  libspectrum_byte peer_mac[6];
+  libspectrum_byte peer_ip[4];
+  libspectrum_word peer_port;
+  libspectrum_word port;
+  utils_file file;
+  libspectrum_word block;
+} loopback_tftp_t;
+
+typedef enum loopback_socket_state {
+  SOCKET_CLOSED = 0,
+  SOCKET_SYN_SENT,
+  SOCKET_ESTABLISHED,
+  SOCKET_FIN_SENT,
+} loopback_socket_state;
+
+struct nic_loopback_socket_t {
+
+  nic_loopback_t *owner;
+  struct nic_loopback_socket_t *next;
+
+  int protocol;
+  libspectrum_word port;
+
+  /* TCP only */
+  loopback_socket_state state;
+  libspectrum_byte peer_ip[4];
+  libspectrum_word peer_port;
+  libspectrum_dword snd_nxt;	/* Next sequence number to send */
+  libspectrum_dword rcv_nxt;	/* Next sequence number expected */
+  int peer_closed;		/* FIN or RST received */
+
+  /* Data received but not yet read */
+  libspectrum_byte *received;
+  size_t received_length;
+
+};
+
+typedef struct loopback_frame_t {
+  struct loopback_frame_t *next;
+  size_t length;
+  libspectrum_byte data[ FRAME_MAX ];
+} loopback_frame_t;
+
+struct nic_loopback_t {
+
+  libspectrum_byte mac[6];
+  libspectrum_byte ip[4];
+  libspectrum_byte client_ip[4];
+  libspectrum_byte netmask[4];
+
+  char *tftp_root;
+  char *bootfile;
+
+  loopback_service_t services[ MAX_SERVICES ];
+  size_t service_count;
+
+  loopback_tcp_t connections[ MAX_CONNECTIONS ];
+  loopback_tftp_t tftp;
+
+  /* Frames waiting to be received by the emulated interface */
+  loopback_frame_t *head, *tail;
+
+  /* Sockets opened by the emulated interface */
+  nic_loopback_socket_t *sockets;
+
+  libspectrum_word ip_id;
+  libspectrum_word next_port;
+  libspectrum_dword next_sequence;
+
+};
+
+static const libspectrum_byte broadcast_mac[6] =
+  { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+static const libspectrum_byte broadcast_ip[4] = { 0xff, 0xff, 0xff, 0xff };
+
+/* The emulated interface's address, when the loopback code builds its
+   frames */
+static const libspectrum_byte client_mac[6] = { 0x02, 0, 0, 0, 0, 0x02 };
+
+static int read_script( nic_loopback_t *self, const char *script );
+static void arp_input( nic_loopback_t *self, const libspectrum_byte *frame,
+		       size_t length );
+static void ip_input( nic_loopback_t *self, const libspectrum_byte *frame,
+		      size_t length );
+static void tcp_output( nic_loopback_t *self, loopback_tcp_t *connection );
+
+static libspectrum_word
+get_word( const libspectrum_byte *p )
+{
+  return ( p[0] << 8 ) | p[1];
+}
+
+static void
+put_word( libspectrum_byte *p, libspectrum_word value )
+{
+  p[0] = value >> 8; p[1] = value & 0xff;
+}
+
+static libspectrum_dword
+get_dword( const libspectrum_byte *p )
+{
+  return ( (libspectrum_dword)p[0] << 24 ) | ( p[1] << 16 ) | ( p[2] << 8 ) |
+	 p[3];
+}
+
+static void
+put_dword( libspectrum_byte *p, libspectrum_dword value )
+{
+  p[0] = value >> 24; p[1] = ( value >> 16 ) & 0xff;
+  p[2] = ( value >> 8 ) & 0xff; p[3] = value & 0xff;
+}
+
+/* One's complement sum, as used by the IP, ICMP, UDP and TCP checksums */
+static libspectrum_dword
+checksum_add( libspectrum_dword sum, const libspectrum_byte *data,
+	      size_t length )
+{
+  for( ; length > 1; data += 2, length -= 2 ) sum += get_word( data );
+  if( length ) sum += data[0] << 8;
+
+  return sum;
+}
+
+static libspectrum_word
+checksum_fold( libspectrum_dword sum )
+{
+  while( sum >> 16 ) sum = ( sum & 0xffff ) + ( sum >> 16 );
+
+  return ~sum & 0xffff;
+}
+
+static int
+parse_ip( const char *string, libspectrum_byte *ip )
+{
+  unsigned int a, b, c, d;
+  char end;
+
+  if( sscanf( string, "%u.%u.%u.%u%c", &a, &b, &c, &d, &end ) != 4 ||
+      a > 255 || b > 255 || c > 255 || d > 255 )
+    return 1;
+
+  ip[0] = a; ip[1] = b; ip[2] = c; ip[3] = d;
+
+  return 0;
+}
+
+static void
+add_service( nic_loopback_t *self, int protocol, libspectrum_word port,
+	     loopback_action action )
+{
+  loopback_service_t *service = &self->services[ self->service_count++ ];
+
+  service->protocol = protocol;
+  service->port = port;
+  service->action = action;
+  service->file.buffer = NULL;
+  service->file.length = 0;
+}
+
+nic_loopback_t*
+nic_loopback_alloc( const char *script )
+{
+  nic_loopback_t *self = libspectrum_new0( nic_loopback_t, 1 );
+
+  /* A locally administered address */
+  self->mac[0] = 0x02; self->mac[5] = 0x01;
+
+  parse_ip( "10.0.0.1", self->ip );
+  parse_ip( "10.0.0.2", self->client_ip );
+  parse_ip( "255.255.255.0", self->netmask );
+
+  self->next_port = 0xc000;
+  self->next_sequence = 0x00010000;
+
+  if( script ) {
+    if( read_script( self, script ) ) {
+      nic_loopback_free( self );
+      return NULL;
+    }
+  } else {
+    add_service( self, IP_PROTOCOL_UDP, 7, LOOPBACK_ECHO );
+    add_service( self, IP_PROTOCOL_TCP, 7, LOOPBACK_ECHO );
+  }
+
+  return self;
+}
+
+static void
+tcp_close( loopback_tcp_t *connection )
+{
+  libspectrum_free( connection->pending );
+  memset( connection, 0, sizeof( *connection ) );
+}
+
+void
+nic_loopback_free( nic_loopback_t *self )
+{
+  loopback_frame_t *frame;
+  size_t i;
+
+  while( self->head ) {
+    frame = self->head;
+    self->head = frame->next;
+    libspectrum_free( frame );
+  }
+
+  while( self->sockets ) nic_loopback_socket_close( self->sockets );
+
+  for( i = 0; i < MAX_CONNECTIONS; i++ ) tcp_close( &self->connections[i] );
+  if( self->tftp.active ) utils_close_file( &self->tftp.file );
+
+  for( i = 0; i < self->service_count; i++ )
+    if( self->services[i].file.buffer )
+      utils_close_file( &self->services[i].file );
+
+  libspectrum_free( self->tftp_root );
+  libspectrum_free( self->bootfile );
+  libspectrum_free( self );
+}
+
+/* The script is a list of lines of the form
+
+     address <ip>		the host's address
+     client <ip>		the address given out by DHCP
+     netmask <ip>
+     tftp <directory>		serve files from <directory> by TFTP
+     bootfile <name>		boot file name given out by DHCP
+     udp|tcp <port> echo
+     udp|tcp <port> discard
+     udp|tcp <port> file <file>	reply with (UDP) or send (TCP) <file>
+
+   with anything after a '#' ignored */
+static int
+read_script( nic_loopback_t *self, const char *script )
+{
+  FILE *f;
+  char line[ 1024 ], keyword[ 16 ], argument[ 1024 ], action[ 16 ];
+  char filename[ 1024 ], *hash;
+  unsigned int port;
+  int line_number = 0, count, protocol, error = 0;
+
+  f = fopen( script, "r" );
+  if( !f ) {
+    ui_error( UI_ERROR_ERROR, "couldn't open '%s'", script );
+    return 1;
+  }
+
+  while( !error && fgets( line, sizeof( line ), f ) ) {
+
+    line_number++;
+
+    hash = strchr( line, '#' ); if( hash ) *hash = '\0';
+
+    count = sscanf( line, "%15s %1023s %15s %1023s", keyword, argument,
+		    action, filename );
+    if( count <= 0 ) continue;
+
+    if( !strcmp( keyword, "address" ) && count == 2 ) {
+      error = parse_ip( argument, self->ip );
+    } else if( !strcmp( keyword, "client" ) && count == 2 ) {
+      error = parse_ip( argument, self->client_ip );
+    } else if( !strcmp( keyword, "netmask" ) && count == 2 ) {
+      error = parse_ip( argument, self->netmask );
+    } else if( !strcmp( keyword, "tftp" ) && count == 2 ) {
+      libspectrum_free( self->tftp_root );
+      self->tftp_root = utils_safe_strdup( argument );
+    } else if( !strcmp( keyword, "bootfile" ) && count == 2 ) {
+      libspectrum_free( self->bootfile );
+      self->bootfile = utils_safe_strdup( argument );
+    } else if( ( !strcmp( keyword, "udp" ) || !strcmp( keyword, "tcp" ) ) &&
+	       count >= 3 && sscanf( argument, "%u", &port ) == 1 &&
+	       port > 0 && port < 0x10000 &&
+	       self->service_count < MAX_SERVICES ) {
+
+      protocol = keyword[0] == 'u' ? IP_PROTOCOL_UDP : IP_PROTOCOL_TCP;
+
+      if( !strcmp( action, "echo" ) && count == 3 ) {
+	add_service( self, protocol, port, LOOPBACK_ECHO );
+      } else if( !strcmp( action, "discard" ) && count == 3 ) {
+	add_service( self, protocol, port, LOOPBACK_DISCARD );
+      } else if( !strcmp( action, "file" ) && count == 4 ) {
+	add_service( self, protocol, port, LOOPBACK_FILE );
+	if( utils_read_file( filename,
+			     &self->services[ self->service_count - 1 ].file ) ) {
+	  fclose( f );
+	  return 1;
+	}
+      } else {
+	error = 1;
+      }
+
+    } else {
+      error = 1;
+    }
+
+  }
+
+  fclose( f );
+
+  if( error ) {
+    ui_error( UI_ERROR_ERROR, "%s:%d: invalid line in network script",
+	      script, line_number );
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Queue a frame for the emulated interface */
+static loopback_frame_t*
+frame_new( nic_loopback_t *self, const libspectrum_byte *destination,
+	   libspectrum_word type, size_t length )
+{
+  loopback_frame_t *frame = libspectrum_new( loopback_frame_t, 1 );
+
+  memcpy( frame->data + ETH_DESTINATION, destination, 6 );
+  memcpy( frame->data + ETH_SOURCE, self->mac, 6 );
+  put_word( frame->data + ETH_TYPE, type );
+  frame->length = ETH_HEADER + length;
+  frame->next = NULL;
+
+  if( self->tail ) {
+    self->tail->next = frame;
+  } else {
+    self->head = frame;
+  }
+  self->tail = frame;
+
+  return frame;
+}
+
+/* Fill in the IP header for a datagram of 'length' bytes after it */
+static void
+ip_header( nic_loopback_t *self, libspectrum_byte *header,
+	   const libspectrum_byte *source, const libspectrum_byte *destination,
+	   int protocol, size_t length )
+{
+  header[0] = 0x45;			/* IPv4, no options */
+  header[1] = 0;
+  put_word( header + 2, IP_HEADER + length );
+  put_word( header + 4, self->ip_id++ );
+  put_word( header + 6, 0x4000 );	/* Don't fragment */
+  header[8] = 64;
+  header[9] = protocol;
+  put_word( header + 10, 0 );
+  memcpy( header + 12, source, 4 );
+  memcpy( header + 16, destination, 4 );
+  put_word( header + 10, checksum_fold( checksum_add( 0, header,
+						      IP_HEADER ) ) );
+}
+
+/* Queue an IP datagram of 'length' bytes after the IP header, which the
+   caller fills in */
+static libspectrum_byte*
+ip_output( nic_loopback_t *self, const libspectrum_byte *mac,
+	   const libspectrum_byte *ip, int protocol, size_t length )
+{
+  loopback_frame_t *frame;
+  libspectrum_byte *header;
+
+  frame = frame_new( self, mac, ETH_TYPE_IP, IP_HEADER + length );
+  header = frame->data + ETH_HEADER;
+
+  ip_header( self, header, self->ip, ip, protocol, length );
+
+  return header + IP_HEADER;
+}
+
+/* Fill in the UDP or TCP checksum, which covers a pseudo-header */
+static void
+transport_checksum( const libspectrum_byte *payload, size_t length,
+		    libspectrum_byte *checksum )
+{
+  const libspectrum_byte *ip = payload - IP_HEADER;
+  libspectrum_dword sum;
+  libspectrum_word value;
+
+  sum = checksum_add( 0, ip + 12, 8 );
+  sum += ip[9] + length;
+  sum = checksum_add( sum, payload, length );
+
+  value = checksum_fold( sum );
+  if( !value && ip[9] == IP_PROTOCOL_UDP ) value = 0xffff;
+  put_word( checksum, value );
+}
+
+/* Fill in a UDP datagram after its IP header */
+static void
+udp_header( libspectrum_byte *udp, libspectrum_word source_port,
+	    libspectrum_word destination_port, const libspectrum_byte *data,
+	    size_t length )
+{
+  put_word( udp + 0, source_port );
+  put_word( udp + 2, destination_port );
+  put_word( udp + 4, UDP_HEADER + length );
+  put_word( udp + 6, 0 );
+  memcpy( udp + UDP_HEADER, data, length );
+  transport_checksum( udp, UDP_HEADER + length, udp + 6 );
+}
+
+static void
+udp_output( nic_loopback_t *self, const libspectrum_byte *mac,
+	    const libspectrum_byte *ip, libspectrum_word source_port,
+	    libspectrum_word destination_port, const libspectrum_byte *data,
+	    size_t length )
+{
+  libspectrum_byte *udp;
+
+  if( length > FRAME_MAX - ETH_HEADER - IP_HEADER - UDP_HEADER )
+    length = FRAME_MAX - ETH_HEADER - IP_HEADER - UDP_HEADER;
+
+  udp = ip_output( self, mac, ip, IP_PROTOCOL_UDP, UDP_HEADER + length );
+  udp_header( udp, source_port, destination_port, data, length );
+}
+
+void
+nic_loopback_send( nic_loopback_t *self, const libspectrum_byte *buffer,
+		   size_t length )
+{
+  if( length < ETH_HEADER ) return;
+
+  /* The switch only passes on frames for the host */
+  if( memcmp( buffer + ETH_DESTINATION, self->mac, 6 ) &&
+      memcmp( buffer + ETH_DESTINATION, broadcast_mac, 6 ) )
+    return;
+
+  switch( get_word( buffer + ETH_TYPE ) ) {
+  case ETH_TYPE_ARP: arp_input( self, buffer, length ); break;
+  case ETH_TYPE_IP: ip_input( self, buffer, length ); break;
+  }
+}
+
+size_t
+nic_loopback_recv( nic_loopback_t *self, libspectrum_byte *buffer,
+		   size_t length )
+{
+  loopback_frame_t *frame = self->head;
+
+  if( !frame ) return 0;
+
+  if( length > frame->length ) length = frame->length;
+  memcpy( buffer, frame->data, length );
+
+  self->head = frame->next;
+  if( !self->head ) self->tail = NULL;
+  libspectrum_free( frame );
+
+  return length;
+}
+
+static void
+arp_input( nic_loopback_t *self, const libspectrum_byte *frame, size_t length )
+{
+  const libspectrum_byte *arp = frame + ETH_HEADER;
+  libspectrum_byte *reply;
+
+  /* Ethernet/IPv4 requests for our address only */
+  if( length < ETH_HEADER + 28 || get_word( arp ) != 1 ||
+      get_word( arp + 2 ) != ETH_TYPE_IP || arp[4] != 6 || arp[5] != 4 ||
+      get_word( arp + 6 ) != 1 || memcmp( arp + 24, self->ip, 4 ) )
+    return;
+
+  reply = frame_new( self, frame + ETH_SOURCE, ETH_TYPE_ARP, 28 )->data +
+	  ETH_HEADER;
+
+  memcpy( reply, arp, 6 );
+  put_word( reply + 6, 2 );
+  memcpy( reply + 8, self->mac, 6 );
+  memcpy( reply + 14, self->ip, 4 );
+  memcpy( reply + 18, arp + 8, 10 );
+}
+
+static void
+icmp_input( nic_loopback_t *self, const libspectrum_byte *frame,
+	    const libspectrum_byte *ip, const libspectrum_byte *icmp,
+	    size_t length )
+{
+  libspectrum_byte *reply;
+
+  if( length < 8 || icmp[0] != 8 ) return;	/* Echo requests only */
+
+  reply = ip_output( self, frame + ETH_SOURCE, ip + 12, IP_PROTOCOL_ICMP,
+		     length );
+  memcpy( reply, icmp, length );
+  reply[0] = 0;
+  put_word( reply + 2, 0 );
+  put_word( reply + 2, checksum_fold( checksum_add( 0, reply, length ) ) );
+}
+
+static void
+dhcp_input( nic_loopback_t *self, const libspectrum_byte *frame,
+	    const libspectrum_byte *dhcp, size_t length )
+{
+  libspectrum_byte reply[ DHCP_OPTIONS + 64 ], *option;
+  const libspectrum_byte *p, *end = dhcp + length;
+  int type = 0;
+  size_t name_length;
+
+  if( length < DHCP_OPTIONS || dhcp[0] != 1 ||
+      get_dword( dhcp + 236 ) != DHCP_MAGIC )
+    return;
+
+  for( p = dhcp + DHCP_OPTIONS; p < end && *p != 255; ) {
+    if( *p == 0 ) { p++; continue; }
+    if( p + 2 > end || p + 2 + p[1] > end ) return;
+    if( p[0] == 53 && p[1] == 1 ) type = p[2];
+    p += 2 + p[1];
+  }
+
+  switch( type ) {
+  case DHCP_DISCOVER: type = DHCP_OFFER; break;
+  case DHCP_REQUEST: type = DHCP_ACK; break;
+  default: return;
+  }
+
+  memset( reply, 0, sizeof( reply ) );
+  reply[0] = 2;				/* BOOTREPLY */
+  memcpy( reply + 1, dhcp + 1, 3 );	/* htype, hlen, hops */
+  memcpy( reply + 4, dhcp + 4, 4 );	/* xid */
+  memcpy( reply + 10, dhcp + 10, 2 );	/* flags */
+  memcpy( reply + 16, self->client_ip, 4 );
+  memcpy( reply + 20, self->ip, 4 );
+  memcpy( reply + 28, dhcp + 28, 16 );	/* chaddr */
+
+  if( self->bootfile ) {
+    name_length = strlen( self->bootfile );
+    if( name_length > 127 ) name_length = 127;
+    memcpy( reply + 108, self->bootfile, name_length );
+  }
+
+  put_dword( reply + 236, DHCP_MAGIC );
+
+  option = reply + DHCP_OPTIONS;
+  *option++ = 53; *option++ = 1; *option++ = type;
+  *option++ = 54; *option++ = 4; memcpy( option, self->ip, 4 ); option += 4;
+  *option++ = 51; *option++ = 4; put_dword( option, 86400 ); option += 4;
+  *option++ = 1; *option++ = 4; memcpy( option, self->netmask, 4 ); option += 4;
+  *option++ = 3; *option++ = 4; memcpy( option, self->ip, 4 ); option += 4;
+  *option++ = 255;
+
+  udp_output( self, broadcast_mac, broadcast_ip, DHCP_SERVER_PORT,
+	      DHCP_CLIENT_PORT, reply, sizeof( reply ) );
+}
+
+static void
+tftp_error( nic_loopback_t *self, const libspectrum_byte *frame,
+	    const libspectrum_byte *ip, libspectrum_word port,
+	    libspectrum_word code, const char *message )
+{
+  libspectrum_byte packet[ 64 ];
+  size_t length = strlen( message ) + 1;
+
+  put_word( packet, TFTP_ERROR );
+  put_word( packet + 2, code );
+  memcpy( packet + 4, message, length );
+
+  udp_output( self, frame + ETH_SOURCE, ip + 12, self->next_port++, port,
+	      packet, 4 + length );
+}
+
+static void
+tftp_send_block( nic_loopback_t *self )
+{
+  loopback_tftp_t *tftp = &self->tftp;
+  libspectrum_byte packet[ 4 + TFTP_BLOCK ];
+  size_t offset = ( tftp->block - 1 ) * TFTP_BLOCK, length;
+
+  length = offset < tftp->file.length ? tftp->file.length - offset : 0;
+  if( length > TFTP_BLOCK ) length = TFTP_BLOCK;
+
+  put_word( packet, TFTP_DATA );
+  put_word( packet + 2, tftp->block );
+  if( length ) memcpy( packet + 4, tftp->file.buffer + offset, length );
+
+  udp_output( self, tftp->peer_mac, tftp->peer_ip, tftp->port,
+	      tftp->peer_port, packet, 4 + length );
+}
+
+/* Read requests only, in octet mode; any options are ignored */
+static void
+tftp_request( nic_loopback_t *self, const libspectrum_byte *frame,
+	      const libspectrum_byte *ip, libspectrum_word port,
+	      const libspectrum_byte *data, size_t length )
+{
+  loopback_tftp_t *tftp = &self->tftp;
+  const libspectrum_byte *end;
+  char name[ 256 ], *path;
+  size_t name_length, path_length;
+
+  if( length < 4 || get_word( data ) != TFTP_RRQ ) {
+    tftp_error( self, frame, ip, port, 4, "Illegal TFTP operation" );
+    return;
+  }
+
+  end = memchr( data + 2, '\0', length - 2 );
+  name_length = end ? end - ( data + 2 ) : 0;
+  if( !self->tftp_root || !end || name_length >= sizeof( name ) ) {
+    tftp_error( self, frame, ip, port, 1, "File not found" );
+    return;
+  }
+  memcpy( name, data + 2, name_length + 1 );
+
+  /* Stay inside the TFTP directory */
+  if( name[0] == '/' || strstr( name, ".." ) ) {
+    tftp_error( self, frame, ip, port, 2, "Access violation" );
+    return;
+  }
+
+  path_length = strlen( self->tftp_root ) + 1 + name_length + 1;
+  path = libspectrum_new( char, path_length );
+  snprintf( path, path_length, "%s" FUSE_DIR_SEP_STR "%s", self->tftp_root,
+	    name );
+
+  if( tftp->active ) {
+    utils_close_file( &tftp->file );
+    tftp->active = 0;
+  }
+
+  if( !compat_file_exists( path ) || utils_read_file( path, &tftp->file ) ) {
+    libspectrum_free( path );
+    tftp_error( self, frame, ip, port, 1, "File not found" );
+    return;
+  }
+  libspectrum_free( path );
+
+  tftp->active = 1;
+  memcpy( tftp->peer_mac, frame + ETH_SOURCE, 6 );
+  memcpy( tftp->peer_ip, ip + 12, 4 );
+  tftp->peer_port = port;
+  tftp->port = self->next_port++;
+  tftp->block = 1;
+
+  tftp_send_block( self );
+}
+
+static void
+tftp_input( nic_loopback_t *self, const libspectrum_byte *data, size_t length )
+{
+  loopback_tftp_t *tftp = &self->tftp;
+  libspectrum_word block;
+
+  if( length < 4 || get_word( data ) != TFTP_ACK ) return;
+
+  block = get_word( data + 2 );
+
+  if( block == tftp->block ) {
+
+    /* The transfer ends with a short block */
+    if( ( tftp->block - 1 ) * TFTP_BLOCK + TFTP_BLOCK > tftp->file.length ) {
+      utils_close_file( &tftp->file );
+      tftp->active = 0;
+      return;
+    }
+
+    tftp->block++;
+    tftp_send_block( self );
+
+  } else if( block == (libspectrum_word)( tftp->block - 1 ) ) {
+    tftp_send_block( self );
+  }
+}
+
+static const loopback_service_t*
+find_service( nic_loopback_t *self, int protocol, libspectrum_word port )
+{
+  size_t i;
+
+  for( i = 0; i < self->service_count; i++ )
+    if( self->services[i].protocol == protocol &&
+	self->services[i].port == port )
+      return &self->services[i];
+
+  return NULL;
+}
+
+static void
+udp_input( nic_loopback_t *self, const libspectrum_byte *frame,
+	   const libspectrum_byte *ip, const libspectrum_byte *udp,
+	   size_t length )
+{
+  const loopback_service_t *service;
+  libspectrum_word source, destination;
+
+  if( length < UDP_HEADER || get_word( udp + 4 ) < UDP_HEADER ||
+      get_word( udp + 4 ) > length )
+    return;
+
+  length = get_word( udp + 4 ) - UDP_HEADER;
+  source = get_word( udp );
+  destination = get_word( udp + 2 );
+  udp += UDP_HEADER;
+
+  if( destination == DHCP_SERVER_PORT ) {
+    dhcp_input( self, frame, udp, length );
+    return;
+  }
+
+  /* Broadcasts are only of interest to the DHCP server */
+  if( memcmp( ip + 16, self->ip, 4 ) ) return;
+
+  if( destination == TFTP_PORT ) {
+    tftp_request( self, frame, ip, source, udp, length );
+    return;
+  }
+
+  if( self->tftp.active && destination == self->tftp.port &&
+      source == self->tftp.peer_port ) {
+    tftp_input( self, udp, length );
+    return;
+  }
+
+  service = find_service( self, IP_PROTOCOL_UDP, destination );
+  if( !service ) return;
+
+  switch( service->action ) {
+
+  case LOOPBACK_ECHO:
+    udp_output( self, frame + ETH_SOURCE, ip + 12, destination, source, udp,
+		length );
+    break;
+
+  case LOOPBACK_FILE:
+    udp_output( self, frame + ETH_SOURCE, ip + 12, destination, source,
+		service->file.buffer, service->file.length );
+    break;
+
+  case LOOPBACK_DISCARD:
+    break;
+
+  }
+}
+
+/* SYNs carry a maximum segment size option */
+static size_t
+tcp_header_length( int flags )
+{
+  return flags & TCP_SYN ? TCP_HEADER + 4 : TCP_HEADER;
+}
+
+/* Fill in a TCP segment after its IP header */
+static void
+tcp_header( libspectrum_byte *tcp, libspectrum_word source_port,
+	    libspectrum_word destination_port, libspectrum_dword sequence,
+	    libspectrum_dword acknowledgement, int flags,
+	    const libspectrum_byte *data, size_t length )
+{
+  size_t header = tcp_header_length( flags );
+
+  put_word( tcp + 0, source_port );
+  put_word( tcp + 2, destination_port );
+  put_dword( tcp + 4, sequence );
+  put_dword( tcp + 8, acknowledgement );
+  tcp[12] = ( header / 4 ) << 4;
+  tcp[13] = flags;
+  put_word( tcp + 14, 0x4000 );		/* Window */
+  put_word( tcp + 16, 0 );
+  put_word( tcp + 18, 0 );
+
+  if( flags & TCP_SYN ) {		/* Maximum segment size option */
+    tcp[20] = 2; tcp[21] = 4; put_word( tcp + 22, TCP_MSS );
+  }
+
+  if( length ) memcpy( tcp + header, data, length );
+
+  transport_checksum( tcp, header + length, tcp + 16 );
+}
+
+static void
+tcp_segment( nic_loopback_t *self, const libspectrum_byte *mac,
+	     const libspectrum_byte *ip, libspectrum_word source_port,
+	     libspectrum_word destination_port, libspectrum_dword sequence,
+	     libspectrum_dword acknowledgement, int flags,
+	     const libspectrum_byte *data, size_t length )
+{
+  libspectrum_byte *tcp;
+
+  tcp = ip_output( self, mac, ip, IP_PROTOCOL_TCP,
+		   tcp_header_length( flags ) + length );
+  tcp_header( tcp, source_port, destination_port, sequence, acknowledgement,
+	      flags, data, length );
+}
+
+static void
+tcp_send( nic_loopback_t *self, loopback_tcp_t *connection, int flags,
+	  const libspectrum_byte *data, size_t length )
+{
+  tcp_segment( self, connection->peer_mac, connection->peer_ip,
+	       connection->port, connection->peer_port, connection->snd_nxt,
+	       connection->rcv_nxt, flags, data, length );
+}
+
+static void
+tcp_queue( loopback_tcp_t *connection, const libspectrum_byte *data,
+	   size_t length )
+{
+  connection->pending =
+    libspectrum_renew( libspectrum_byte, connection->pending,
+		       connection->pending_length + length );
+  memcpy( connection->pending + connection->pending_length, data, length );
+  connection->pending_length += length;
+}
+
+/* Send as much pending data as the peer's window allows, followed by a
+   FIN if we're closing */
+static void
+tcp_output( nic_loopback_t *self, loopback_tcp_t *connection )
+{
+  size_t length, in_flight;
+
+  while( connection->sent < connection->pending_length ) {
+
+    in_flight = connection->snd_nxt - connection->snd_una;
+    if( in_flight >= connection->window ) return;
+
+    length = connection->pending_length - connection->sent;
+    if( length > connection->mss ) length = connection->mss;
+    if( length > connection->window - in_flight )
+      length = connection->window - in_flight;
+
+    tcp_send( self, connection, TCP_ACK | TCP_PSH,
+	      connection->pending + connection->sent, length );
+    connection->sent += length;
+    connection->snd_nxt += length;
+  }
+
+  if( connection->close_when_sent && !connection->fin_sent ) {
+    tcp_send( self, connection, TCP_FIN | TCP_ACK, NULL, 0 );
+    connection->snd_nxt++;
+    connection->fin_sent = 1;
+    connection->state = TCP_LAST_ACK;
+  }
+}
+
+static void
+tcp_accept( nic_loopback_t *self, const libspectrum_byte *frame,
+	    const libspectrum_byte *ip, const libspectrum_byte *tcp,
+	    size_t header, const loopback_service_t *service )
+{
+  loopback_tcp_t *connection = NULL;
+  const libspectrum_byte *option;
+  size_t i;
+
+  for( i = 0; i < MAX_CONNECTIONS; i++ )
+    if( self->connections[i].state == TCP_CLOSED ) {
+      connection = &self->connections[i];
+      break;
+    }
+
+  if( !connection ) {
+    tcp_segment( self, frame + ETH_SOURCE, ip + 12, get_word( tcp + 2 ),
+		 get_word( tcp ), 0, get_dword( tcp + 4 ) + 1,
+		 TCP_RST | TCP_ACK, NULL, 0 );
+    return;
+  }
+
+  connection->state = TCP_SYN_RECEIVED;
+  connection->service = service;
+  memcpy( connection->peer_mac, frame + ETH_SOURCE, 6 );
+  memcpy( connection->peer_ip, ip + 12, 4 );
+  connection->peer_port = get_word( tcp );
+  connection->port = get_word( tcp + 2 );
+  connection->rcv_nxt = get_dword( tcp + 4 ) + 1;
+  connection->snd_una = connection->snd_nxt = self->next_sequence;
+  connection->window = get_word( tcp + 14 );
+  connection->mss = TCP_MSS;
+
+  self->next_sequence += 0x00010000;
+
+  for( option = tcp + TCP_HEADER; option < tcp + header; ) {
+    if( *option == 0 ) break;
+    if( *option == 1 ) { option++; continue; }
+    if( option + 2 > tcp + header || option[1] < 2 ) break;
+    if( option[0] == 2 && option[1] == 4 && option + 4 <= tcp + header &&
+	get_word( option + 2 ) < connection->mss )
+      connection->mss = get_word( option + 2 );
+    option += option[1];
+  }
+
+  tcp_send( self, connection, TCP_SYN | TCP_ACK, NULL, 0 );
+  connection->snd_nxt++;
+}
+
+static void
+tcp_input( nic_loopback_t *self, const libspectrum_byte *frame,
+	   const libspectrum_byte *ip, const libspectrum_byte *tcp,
+	   size_t length )
+{
+  loopback_tcp_t *connection = NULL;
+  const loopback_service_t *service;
+  libspectrum_word source, destination;
+  libspectrum_dword sequence, acknowledgement;
+  size_t header, i;
+  int flags;
+
+  if( length < TCP_HEADER ) return;
+  header = ( tcp[12] >> 4 ) * 4;
+  if( header < TCP_HEADER || header > length ) return;
+
+  source = get_word( tcp );
+  destination = get_word( tcp + 2 );
+  sequence = get_dword( tcp + 4 );
+  acknowledgement = get_dword( tcp + 8 );
+  flags = tcp[13];
+
+  for( i = 0; i < MAX_CONNECTIONS; i++ )
+    if( self->connections[i].state != TCP_CLOSED &&
+	self->connections[i].port == destination &&
+	self->connections[i].peer_port == source &&
+	!memcmp( self->connections[i].peer_ip, ip + 12, 4 ) ) {
+      connection = &self->connections[i];
+      break;
+    }
+
+  if( !connection ) {
+    if( flags & TCP_RST ) return;
+
+    service = find_service( self, IP_PROTOCOL_TCP, destination );
+    if( service && ( flags & ( TCP_SYN | TCP_ACK ) ) == TCP_SYN ) {
+      tcp_accept( self, frame, ip, tcp, header, service );
+    } else if( flags & TCP_ACK ) {
+      tcp_segment( self, frame + ETH_SOURCE, ip + 12, destination, source,
+		   acknowledgement, 0, TCP_RST, NULL, 0 );
+    } else {
+      tcp_segment( self, frame + ETH_SOURCE, ip + 12, destination, source,
+		   0, sequence + length - header + ( flags & TCP_SYN ? 1 : 0 ),
+		   TCP_RST | TCP_ACK, NULL, 0 );
+    }
+    return;
+  }
+
+  if( flags & TCP_RST ) {
+    tcp_close( connection );
+    return;
+  }
+
+  if( !( flags & TCP_ACK ) ) return;
+
+  /* Process the acknowledgement */
+  if( acknowledgement - connection->snd_una <=
+      connection->snd_nxt - connection->snd_una ) {
+    libspectrum_dword acked = acknowledgement - connection->snd_una;
+
+    if( connection->state == TCP_SYN_RECEIVED && acked ) {
+      acked--;
+      connection->snd_una++;
+      connection->state = TCP_ESTABLISHED;
+      if( connection->service->action == LOOPBACK_FILE ) {
+	tcp_queue( connection, connection->service->file.buffer,
+		   connection->service->file.length );
+	connection->close_when_sent = 1;
+      }
+    }
+
+    if( acked > connection->sent ) {	/* Our FIN has been acknowledged */
+      tcp_close( connection );
+      return;
+    }
+
+    if( acked ) {
+      memmove( connection->pending, connection->pending + acked,
+	       connection->pending_length - acked );
+      connection->pending_length -= acked;
+      connection->sent -= acked;
+      connection->snd_una += acked;
+    }
+    connection->window = get_word( tcp + 14 );
+  }
+
+  if( connection->state == TCP_SYN_RECEIVED ) return;
+
+  /* Process any data in order; anything else just gets acknowledged
+     again */
+  length -= header;
+  if( length || ( flags & TCP_FIN ) ) {
+
+    if( sequence == connection->rcv_nxt ) {
+      connection->rcv_nxt += length;
+
+      if( length && connection->service->action == LOOPBACK_ECHO &&
+	  !connection->close_when_sent )
+	tcp_queue( connection, tcp + header, length );
+
+      if( flags & TCP_FIN ) {
+	connection->rcv_nxt++;
+	connection->close_when_sent = 1;
+      }
+    }
+
+    if( connection->sent == connection->pending_length &&
+	!( connection->close_when_sent && !connection->fin_sent ) )
+      tcp_send( self, connection, TCP_ACK, NULL, 0 );
+  }
+
+  tcp_output( self, connection );
+}
+
+static void
+ip_input( nic_loopback_t *self, const libspectrum_byte *frame, size_t length )
+{
+  const libspectrum_byte *ip = frame + ETH_HEADER;
+  size_t header, total;
+
+  if( length < ETH_HEADER + IP_HEADER || ( ip[0] >> 4 ) != 4 ) return;
+
+  header = ( ip[0] & 0x0f ) * 4;
+  total = get_word( ip + 2 );
+  if( header < IP_HEADER || total < header || total > length - ETH_HEADER )
+    return;
+
+  /* No fragments */
+  if( get_word( ip + 6 ) & 0x3fff ) return;
+
+  if( memcmp( ip + 16, self->ip, 4 ) &&
+      memcmp( ip + 16, broadcast_ip, 4 ) )
+    return;
+
+  switch( ip[9] ) {
+
+  case IP_PROTOCOL_ICMP:
+    if( !memcmp( ip + 16, self->ip, 4 ) )
+      icmp_input( self, frame, ip, ip + header, total - header );
+    break;
+
+  case IP_PROTOCOL_UDP:
+    udp_input( self, frame, ip, ip + header, total - header );
+    break;
+
+  case IP_PROTOCOL_TCP:
+    if( !memcmp( ip + 16, self->ip, 4 ) )
+      tcp_input( self, frame, ip, ip + header, total - header );
+    break;
+
+  }
+}
+
+/* Send a UDP datagram or TCP segment from one of the emulated
+   interface's sockets to the host */
+static void
+socket_output( nic_loopback_socket_t *socket, const libspectrum_byte *ip,
+	       libspectrum_word port, int flags, const libspectrum_byte *data,
+	       size_t length )
+{
+  nic_loopback_t *self = socket->owner;
+  libspectrum_byte frame[ FRAME_MAX ], *payload;
+  size_t header = socket->protocol == IP_PROTOCOL_TCP ?
+		  tcp_header_length( flags ) : UDP_HEADER;
+
+  if( length > FRAME_MAX - ETH_HEADER - IP_HEADER - header )
+    length = FRAME_MAX - ETH_HEADER - IP_HEADER - header;
+
+  memcpy( frame + ETH_DESTINATION,
+	  memcmp( ip, broadcast_ip, 4 ) ? self->mac : broadcast_mac, 6 );
+  memcpy( frame + ETH_SOURCE, client_mac, 6 );
+  put_word( frame + ETH_TYPE, ETH_TYPE_IP );
+
+  ip_header( self, frame + ETH_HEADER, self->client_ip, ip, socket->protocol,
+	     header + length );
+  payload = frame + ETH_HEADER + IP_HEADER;
+
+  if( socket->protocol == IP_PROTOCOL_TCP ) {
+    tcp_header( payload, socket->port, port, socket->snd_nxt,
+		socket->rcv_nxt, flags, data, length );
+  } else {
+    udp_header( payload, socket->port, port, data, length );
+  }
+
+  nic_loopback_send( self, frame, ETH_HEADER + IP_HEADER + header + length );
+}
+
+static void
+socket_tcp_send( nic_loopback_socket_t *socket, int flags,
+		 const libspectrum_byte *data, size_t length )
+{
+  socket_output( socket, socket->peer_ip, socket->peer_port, flags, data,
+		 length );
+}
+
+static void
+socket_receive( nic_loopback_socket_t *socket, const libspectrum_byte *data,
+		size_t length )
+{
+  socket->received =
+    libspectrum_renew( libspectrum_byte, socket->received,
+		       socket->received_length + length );
+  memcpy( socket->received + socket->received_length, data, length );
+  socket->received_length += length;
+}
+
+static void
+socket_tcp_input( nic_loopback_socket_t *socket, const libspectrum_byte *tcp,
+		  size_t length )
+{
+  libspectrum_dword sequence, acknowledgement;
+  size_t header;
+  int flags;
+
+  if( length < TCP_HEADER ) return;
+  header = ( tcp[12] >> 4 ) * 4;
+  if( header < TCP_HEADER || header > length ) return;
+
+  sequence = get_dword( tcp + 4 );
+  acknowledgement = get_dword( tcp + 8 );
+  flags = tcp[13];
+  length -= header;
+
+  if( flags & TCP_RST ) {
+    socket->state = SOCKET_CLOSED;
+    socket->peer_closed = 1;
+    return;
+  }
+
+  if( !( flags & TCP_ACK ) ) return;
+
+  if( socket->state == SOCKET_SYN_SENT ) {
+    if( !( flags & TCP_SYN ) || acknowledgement != socket->snd_nxt ) return;
+    socket->rcv_nxt = sequence + 1;
+    socket->state = SOCKET_ESTABLISHED;
+    socket_tcp_send( socket, TCP_ACK, NULL, 0 );
+    return;
+  }
+
+  /* Everything arrives in order, so anything else is a duplicate */
+  if( ( length || ( flags & TCP_FIN ) ) && sequence == socket->rcv_nxt ) {
+    socket_receive( socket, tcp + header, length );
+    socket->rcv_nxt += length;
+
+    if( flags & TCP_FIN ) {
+      socket->rcv_nxt++;
+      socket->peer_closed = 1;
+    }
+
+    socket_tcp_send( socket, TCP_ACK, NULL, 0 );
+  }
+
+  /* Both FINs sent, and ours acknowledged */
+  if( socket->state == SOCKET_FIN_SENT && socket->peer_closed &&
+      acknowledgement == socket->snd_nxt )
+    socket->state = SOCKET_CLOSED;
+}
+
+/* Pass a frame from the host to whichever socket it is for */
+static void
+socket_input( nic_loopback_t *self, const libspectrum_byte *frame,
+	      size_t length )
+{
+  const libspectrum_byte *ip = frame + ETH_HEADER, *payload;
+  nic_loopback_socket_t *socket;
+  libspectrum_byte header[8];
+  size_t data_length;
+  int protocol;
+
+  if( length < ETH_HEADER + IP_HEADER ||
+      get_word( frame + ETH_TYPE ) != ETH_TYPE_IP )
+    return;
+
+  /* The host's frames are well formed */
+  protocol = ip[9];
+  payload = ip + ( ip[0] & 0x0f ) * 4;
+  length = get_word( ip + 2 ) - ( payload - ip );
+  if( length < 4 ) return;
+
+  for( socket = self->sockets; socket; socket = socket->next )
+    if( socket->protocol == protocol &&
+	socket->port == get_word( payload + 2 ) &&
+	( protocol == IP_PROTOCOL_UDP ||
+	  ( socket->state != SOCKET_CLOSED &&
+	    socket->peer_port == get_word( payload ) &&
+	    !memcmp( socket->peer_ip, ip + 12, 4 ) ) ) )
+      break;
+
+  if( !socket ) return;
+
+  if( protocol == IP_PROTOCOL_TCP ) {
+    socket_tcp_input( socket, payload, length );
+    return;
+  }
+
+  if( length < UDP_HEADER || get_word( payload + 4 ) < UDP_HEADER ||
+      get_word( payload + 4 ) > length )
+    return;
+  data_length = get_word( payload + 4 ) - UDP_HEADER;
+
+  memcpy( header, ip + 12, 4 );
+  memcpy( header + 4, payload, 2 );
+  put_word( header + 6, data_length );
+  socket_receive( socket, header, 8 );
+  socket_receive( socket, payload + UDP_HEADER, data_length );
+}
+
+/* Deliver everything the host has sent, including anything it sends in
+   reply to the sockets' acknowledgements */
+static void
+socket_deliver( nic_loopback_t *self )
+{
+  libspectrum_byte frame[ FRAME_MAX ];
+  size_t length;
+
+  while( ( length = nic_loopback_recv( self, frame, sizeof( frame ) ) ) )
+    socket_input( self, frame, length );
+}
+
+nic_loopback_socket_t*
+nic_loopback_socket_open( nic_loopback_t *self, int tcp,
+			  libspectrum_word port )
+{
+  nic_loopback_socket_t *socket = libspectrum_new0( nic_loopback_socket_t, 1 );
+
+  socket->owner = self;
+  socket->protocol = tcp ? IP_PROTOCOL_TCP : IP_PROTOCOL_UDP;
+  socket->port = port ? port : self->next_port++;
+
+  socket->next = self->sockets;
+  self->sockets = socket;
+
+  return socket;
+}
+
+void
+nic_loopback_socket_close( nic_loopback_socket_t *socket )
+{
+  nic_loopback_t *self = socket->owner;
+  nic_loopback_socket_t **p;
+
+  /* Drop the host's end of any connection */
+  if( socket->state != SOCKET_CLOSED ) {
+    socket_tcp_send( socket, TCP_RST | TCP_ACK, NULL, 0 );
+    socket_deliver( self );
+  }
+
+  for( p = &self->sockets; *p != socket; p = &(*p)->next )
+    ;
+  *p = socket->next;
+
+  libspectrum_free( socket->received );
+  libspectrum_free( socket );
+}
+
+int
+nic_loopback_socket_connect( nic_loopback_socket_t *socket,
+			     const libspectrum_byte *ip,
+			     libspectrum_word port )
+{
+  nic_loopback_t *self = socket->owner;
+
+  if( socket->protocol != IP_PROTOCOL_TCP ||
+      socket->state != SOCKET_CLOSED || socket->peer_closed )
+    return 1;
+
+  memcpy( socket->peer_ip, ip, 4 );
+  socket->peer_port = port;
+  socket->snd_nxt = self->next_sequence;
+  self->next_sequence += 0x00010000;
+
+  socket->state = SOCKET_SYN_SENT;
+  socket_tcp_send( socket, TCP_SYN, NULL, 0 );
+  socket->snd_nxt++;
+  socket_deliver( self );
+
+  /* The host answers straight away or not at all */
+  if( socket->state != SOCKET_ESTABLISHED ) {
+    socket->state = SOCKET_CLOSED;
+    return 1;
+  }
+
+  return 0;
+}
+
+void
+nic_loopback_socket_disconnect( nic_loopback_socket_t *socket )
+{
+  if( socket->state != SOCKET_ESTABLISHED ) return;
+
+  socket_tcp_send( socket, TCP_FIN | TCP_ACK, NULL, 0 );
+  socket->snd_nxt++;
+  socket->state = SOCKET_FIN_SENT;
+  socket_deliver( socket->owner );
+}
+
+void
+nic_loopback_socket_send( nic_loopback_socket_t *socket,
+			  const libspectrum_byte *ip, libspectrum_word port,
+			  const libspectrum_byte *data, size_t length )
+{
+  size_t chunk;
+
+  if( socket->protocol == IP_PROTOCOL_UDP ) {
+    socket_output( socket, ip, port, 0, data, length );
+  } else if( socket->state == SOCKET_ESTABLISHED ) {
+    for( ; length; data += chunk, length -= chunk ) {
+      chunk = length < TCP_MSS ? length : TCP_MSS;
+      socket_tcp_send( socket, TCP_ACK | TCP_PSH, data, chunk );
+      socket->snd_nxt += chunk;
+    }
+  }
+
+  socket_deliver( socket->owner );
+}
+
+size_t
+nic_loopback_socket_recv( nic_loopback_socket_t *socket,
+			  libspectrum_byte *buffer, size_t length )
+{
+  size_t used = 0, datagram;
+
+  if( socket->protocol == IP_PROTOCOL_TCP ) {
+    used = socket->received_length < length ? socket->received_length :
+					      length;
+  } else {
+    /* Whole datagrams only */
+    while( used < socket->received_length ) {
+      datagram = 8 + get_word( socket->received + used + 6 );
+      if( used + datagram > length ) break;
+      used += datagram;
+    }
+  }
+
+  memcpy( buffer, socket->received, used );
+  memmove( socket->received, socket->received + used,
+	   socket->received_length - used );
+  socket->received_length -= used;
+
+  return used;
+}
+
+int
+nic_loopback_socket_closed( nic_loopback_socket_t *socket )
+{
+  return socket->peer_closed && !socket->received_length;
+}
+
+/* Build a frame from the emulated interface to the host */
+static size_t
+unittest_frame( libspectrum_byte *frame, int protocol, libspectrum_word port,
+		libspectrum_dword sequence, libspectrum_dword acknowledgement,
+		int flags, const char *data )
+{
+  static const libspectrum_byte host_mac[6] = { 0x02, 0, 0, 0, 0, 0x01 };
+  static const libspectrum_byte client_ip[4] = { 10, 0, 0, 2 };
+  static const libspectrum_byte host_ip[4] = { 10, 0, 0, 1 };
+  libspectrum_byte *ip = frame + ETH_HEADER, *payload = ip + IP_HEADER;
+  size_t length = strlen( data ), header;
+
+  memset( frame, 0, FRAME_MAX );
+  memcpy( frame + ETH_DESTINATION, host_mac, 6 );
+  memcpy( frame + ETH_SOURCE, client_mac, 6 );
+  put_word( frame + ETH_TYPE, ETH_TYPE_IP );
+
+  ip[0] = 0x45; ip[8] = 64; ip[9] = protocol;
+  memcpy( ip + 12, client_ip, 4 );
+  memcpy( ip + 16, host_ip, 4 );
+
+  switch( protocol ) {
+  case IP_PROTOCOL_ICMP:
+    header = 8;
+    payload[0] = 8;
+    break;
+  case IP_PROTOCOL_UDP:
+    header = UDP_HEADER;
+    put_word( payload, 1024 ); put_word( payload + 2, port );
+    put_word( payload + 4, UDP_HEADER + length );
+    break;
+  default:
+    header = TCP_HEADER;
+    put_word( payload, 1024 ); put_word( payload + 2, port );
+    put_dword( payload + 4, sequence ); put_dword( payload + 8, acknowledgement );
+    payload[12] = 0x50; payload[13] = flags;
+    put_word( payload + 14, 0x1000 );
+    break;
+  }
+
+  memcpy( payload + header, data, length );
+  put_word( ip + 2, IP_HEADER + header + length );
+
+  return ETH_HEADER + IP_HEADER + header + length;
+}
+
+static int
+unittest_expect( nic_loopback_t *self, int protocol, int flags,
+		 const char *data )
+{
+  libspectrum_byte frame[ FRAME_MAX ], *ip = frame + ETH_HEADER, *payload;
+  size_t length = nic_loopback_recv( self, frame, sizeof( frame ) ), header;
+
+  if( length < ETH_HEADER + IP_HEADER || ip[9] != protocol ||
+      checksum_fold( checksum_add( 0, ip, IP_HEADER ) ) ) {
+    fprintf( stderr, "%s: loopback didn't send expected frame\n",
+	     fuse_progname );
+    return 1;
+  }
+
+  payload = ip + IP_HEADER;
+  header = protocol == IP_PROTOCOL_TCP ? ( payload[12] >> 4 ) * 4 :
+	   protocol == IP_PROTOCOL_UDP ? UDP_HEADER : 8;
+
+  if( ( protocol == IP_PROTOCOL_TCP && payload[13] != flags ) ||
+      get_word( ip + 2 ) != IP_HEADER + header + strlen( data ) ||
+      memcmp( payload + header, data, strlen( data ) ) ) {
+    fprintf( stderr, "%s: loopback sent unexpected frame\n", fuse_progname );
+    return 1;
+  }
+
+  return 0;
+}
+
+/* The echo services again, through the socket interface and with more
+   data than fits in one segment */
+static int
+unittest_sockets( void )
+{
+  static const libspectrum_byte host_ip[4] = { 10, 0, 0, 1 };
+  nic_loopback_t *self = nic_loopback_alloc( NULL );
+  nic_loopback_socket_t *socket;
+  libspectrum_byte data[ 2000 ], buffer[ 2100 ];
+  size_t i, length;
+  int r = 0;
+
+  for( i = 0; i < sizeof( data ); i++ ) data[i] = i * 7;
+
+  socket = nic_loopback_socket_open( self, 0, 1024 );
+  nic_loopback_socket_send( socket, host_ip, 7, data, 100 );
+  length = nic_loopback_socket_recv( socket, buffer, sizeof( buffer ) );
+  if( length != 8 + 100 || memcmp( buffer, host_ip, 4 ) ||
+      get_word( buffer + 4 ) != 7 || get_word( buffer + 6 ) != 100 ||
+      memcmp( buffer + 8, data, 100 ) ) {
+    fprintf( stderr, "%s: loopback UDP socket didn't get echo\n",
+	     fuse_progname );
+    r++;
+  }
+  nic_loopback_socket_close( socket );
+
+  socket = nic_loopback_socket_open( self, 1, 0 );
+  if( nic_loopback_socket_connect( socket, host_ip, 7 ) ) {
+    fprintf( stderr, "%s: loopback TCP socket couldn't connect\n",
+	     fuse_progname );
+    r++;
+  }
+  nic_loopback_socket_send( socket, NULL, 0, data, sizeof( data ) );
+  length = nic_loopback_socket_recv( socket, buffer, sizeof( buffer ) );
+  if( length != sizeof( data ) || memcmp( buffer, data, sizeof( data ) ) ) {
+    fprintf( stderr, "%s: loopback TCP socket didn't get echo\n",
+	     fuse_progname );
+    r++;
+  }
+  nic_loopback_socket_disconnect( socket );
+  if( !nic_loopback_socket_closed( socket ) ||
+      self->connections[0].state != TCP_CLOSED || self->head ) {
+    fprintf( stderr, "%s: loopback TCP socket not closed\n",
+	     fuse_progname );
+    r++;
+  }
+  nic_loopback_socket_close( socket );
+
+  /* Nothing listening */
+  socket = nic_loopback_socket_open( self, 1, 0 );
+  if( !nic_loopback_socket_connect( socket, host_ip, 9 ) ) {
+    fprintf( stderr, "%s: loopback TCP socket connected to nothing\n",
+	     fuse_progname );
+    r++;
+  }
+  nic_loopback_socket_close( socket );
+
+  nic_loopback_free( self );
+
+  return r;
+}
+
+int
+nic_loopback_unittest( void )
+{
+  nic_loopback_t *self = nic_loopback_alloc( NULL );
+  libspectrum_byte frame[ FRAME_MAX ];
+  libspectrum_dword isn = 0x00010000;
+  int r = 0;
+
+  nic_loopback_send( self, frame,
+		     unittest_frame( frame, IP_PROTOCOL_ICMP, 0, 0, 0, 0,
+				     "ping" ) );
+  r += unittest_expect( self, IP_PROTOCOL_ICMP, 0, "ping" );
+
+  nic_loopback_send( self, frame,
+		     unittest_frame( frame, IP_PROTOCOL_UDP, 7, 0, 0, 0,
+				     "datagram" ) );
+  r += unittest_expect( self, IP_PROTOCOL_UDP, 0, "datagram" );
+
+  nic_loopback_send( self, frame,
+		     unittest_frame( frame, IP_PROTOCOL_TCP, 7, 100, 0,
+				     TCP_SYN, "" ) );
+  r += unittest_expect( self, IP_PROTOCOL_TCP, TCP_SYN | TCP_ACK, "" );
+
+  nic_loopback_send( self, frame,
+		     unittest_frame( frame, IP_PROTOCOL_TCP, 7, 101, isn + 1,
+				     TCP_ACK | TCP_PSH, "stream" ) );
+  r += unittest_expect( self, IP_PROTOCOL_TCP, TCP_ACK | TCP_PSH, "stream" );
+
+  nic_loopback_send( self, frame,
+		     unittest_frame( frame, IP_PROTOCOL_TCP, 7, 107, isn + 7,
+				     TCP_ACK | TCP_FIN, "" ) );
+  r += unittest_expect( self, IP_PROTOCOL_TCP, TCP_ACK | TCP_FIN, "" );
+
+  nic_loopback_send( self, frame,
+		     unittest_frame( frame, IP_PROTOCOL_TCP, 7, 108, isn + 8,
+				     TCP_ACK, "" ) );
+  if( self->connections[0].state != TCP_CLOSED || self->head ) {
+    fprintf( stderr, "%s: loopback TCP connection not closed\n",
+	     fuse_progname );
+    r++;
+  }
+
+  nic_loopback_free( self );
+
+  r += unittest_sockets();
+
+  return r;
+}
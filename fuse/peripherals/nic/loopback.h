@@ -0,0 +1,77 @@
+/* loopback.h: In-process virtual network for emulated network interfaces
+   Copyright (c) 2014 Philip Kendall
+
+   $Id$
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+#ifndef FUSE_NIC_LOOPBACK_H
+#define FUSE_NIC_LOOPBACK_H
+
+#include <libspectrum.h>
+
+typedef struct nic_loopback_t nic_loopback_t;
+
+/* 'script' may be NULL for the default set of services */
+nic_loopback_t* nic_loopback_alloc( const char *script );
+void nic_loopback_free( nic_loopback_t *self );
+
+void nic_loopback_send( nic_loopback_t *self, const libspectrum_byte *buffer,
+			size_t length );
+size_t nic_loopback_recv( nic_loopback_t *self, libspectrum_byte *buffer,
+			  size_t length );
+
+/* Sockets for interfaces which implement TCP/IP themselves; each is a
+   client of the host, at the address it gives out by DHCP */
+typedef struct nic_loopback_socket_t nic_loopback_socket_t;
+
+/* 'port' 0 picks an unused one */
+nic_loopback_socket_t* nic_loopback_socket_open( nic_loopback_t *self,
+						 int tcp,
+						 libspectrum_word port );
+void nic_loopback_socket_close( nic_loopback_socket_t *socket );
+
+/* TCP only; returns 0 if the connection was made */
+int nic_loopback_socket_connect( nic_loopback_socket_t *socket,
+				 const libspectrum_byte *ip,
+				 libspectrum_word port );
+void nic_loopback_socket_disconnect( nic_loopback_socket_t *socket );
+
+/* 'ip' and 'port' give the destination of a UDP datagram, and are
+   ignored for TCP */
+void nic_loopback_socket_send( nic_loopback_socket_t *socket,
+			       const libspectrum_byte *ip,
+			       libspectrum_word port,
+			       const libspectrum_byte *data, size_t length );
+
+/* Read up to 'length' bytes of TCP data, or as many whole UDP datagrams
+   as fit. Each datagram is preceded by the sender's address and port and
+   its length, all in network byte order, as the W5100 does */
+size_t nic_loopback_socket_recv( nic_loopback_socket_t *socket,
+				 libspectrum_byte *buffer, size_t length );
+
+/* Non-zero once a TCP connection has been closed or reset by the host
+   and everything it sent has been read */
+int nic_loopback_socket_closed( nic_loopback_socket_t *socket );
+
+int nic_loopback_unittest( void );
+
+#endif			/* #ifndef FUSE_NIC_LOOPBACK_H */
@@ -28,12 +28,18 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <pthread.h>
 #include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #include "fuse.h"
+#include "settings.h"
 #include "ui/ui.h"
 #include "w5100.h"
 #include "w5100_internals.h"
@@ -85,10 +91,127 @@ nic_w5100_reset( nic_w5100_t *self )
     nic_w5100_socket_reset( &self->socket[i] );
 }
 
-static void*
-w5100_io_thread( void *arg )
+#ifdef HAVE_SYS_EPOLL_H
+
+/* Bring the epoll registration of a socket up to date; this needs a
+   system call only when the socket's fd or the I/O it waits for changed.
+   The socket stays locked throughout, so its fd can't be closed and the
+   number reused by another socket before epoll_ctl() sees it */
+static void
+w5100_epoll_update( nic_w5100_t *self, nic_w5100_socket_t *socket )
+{
+  struct epoll_event event;
+  compat_socket_t fd;
+  unsigned int generation;
+  int io, op, error;
+
+  nic_w5100_socket_acquire_lock( socket );
+
+  io = nic_w5100_socket_get_io_locked( socket, &fd, &generation );
+
+  /* A closed fd has already left the epoll set */
+  if( generation != socket->poll_generation )
+    socket->poll_events = 0;
+
+  socket->poll_generation = generation;
+  if( io == socket->poll_events ) {
+    nic_w5100_socket_release_lock( socket );
+    return;
+  }
+
+  memset( &event, 0, sizeof( event ) );
+  event.events = ( io & W5100_SOCKET_IO_READ ? EPOLLIN : 0 ) |
+                 ( io & W5100_SOCKET_IO_WRITE ? EPOLLOUT : 0 );
+  event.data.u32 = socket->id;
+
+  op = !io ? EPOLL_CTL_DEL :
+       !socket->poll_events ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+
+  error = epoll_ctl( self->epoll_fd, op, fd, &event );
+
+  /* If our idea of the registration was wrong (say the fd was dup()ed
+     before being closed, so never left the set), try the other way */
+  if( error == -1 && op == EPOLL_CTL_ADD && errno == EEXIST ) {
+    op = EPOLL_CTL_MOD;
+    error = epoll_ctl( self->epoll_fd, op, fd, &event );
+  } else if( error == -1 && op == EPOLL_CTL_MOD && errno == ENOENT ) {
+    op = EPOLL_CTL_ADD;
+    error = epoll_ctl( self->epoll_fd, op, fd, &event );
+  }
+
+  if( error == -1 ) {
+    nic_w5100_debug( "w5100: epoll_ctl %d for socket %d fd %d failed; errno %d: %s\n",
+                     op, socket->id, fd, errno, strerror( errno ) );
+    io = 0;
+  }
+
+  socket->poll_events = io;
+
+  nic_w5100_socket_release_lock( socket );
+}
+
+static void
+w5100_io_thread_epoll( nic_w5100_t *self )
+{
+  struct epoll_event event, events[5];
+  int i, active, io;
+  nic_w5100_socket_t *socket;
+
+  memset( &event, 0, sizeof( event ) );
+  event.events = EPOLLIN;
+  event.data.u32 = 4;           /* Not a socket */
+  if( epoll_ctl( self->epoll_fd, EPOLL_CTL_ADD,
+                 compat_socket_selfpipe_get_read_fd( self->selfpipe ),
+                 &event ) == -1 ) {
+    ui_error( UI_ERROR_ERROR, "w5100: error %d adding selfpipe to epoll set",
+              errno );
+    fuse_abort();
+  }
+
+  while( !self->stop_io_thread ) {
+
+    for( i = 0; i < 4; i++ )
+      w5100_epoll_update( self, &self->socket[i] );
+
+    nic_w5100_debug( "w5100: io thread epoll_wait\n" );
+
+    active = epoll_wait( self->epoll_fd, events, 5, -1 );
+
+    nic_w5100_debug( "w5100: io thread wake; %d active\n", active );
+
+    if( active == -1 ) {
+      if( errno != EINTR )
+        nic_w5100_debug( "w5100: epoll_wait returned unexpected errno %d: %s\n",
+                         errno, strerror( errno ) );
+      continue;
+    }
+
+    for( i = 0; i < active; i++ ) {
+      if( events[i].data.u32 == 4 ) {
+        nic_w5100_debug( "w5100: discarding selfpipe data\n" );
+        compat_socket_selfpipe_discard_data( self->selfpipe );
+        continue;
+      }
+
+      socket = &self->socket[ events[i].data.u32 ];
+
+      /* Errors and hangups are picked up by the read or write */
+      io = 0;
+      if( events[i].events & ( EPOLLIN | EPOLLERR | EPOLLHUP ) )
+        io |= socket->poll_events & W5100_SOCKET_IO_READ;
+      if( events[i].events & ( EPOLLOUT | EPOLLERR | EPOLLHUP ) )
+        io |= socket->poll_events & W5100_SOCKET_IO_WRITE;
+
+      nic_w5100_socket_process_io( socket, socket->poll_generation, io );
+    }
+  }
+}
+
+#endif                          /* #ifdef HAVE_SYS_EPOLL_H */
+
+static void
+w5100_io_thread_select( nic_w5100_t *self )
 {
-  nic_w5100_t *self = arg;
   int i;
 
   while( !self->stop_io_thread ) {
@@ -97,15 +220,24 @@ w5100_io_thread( void *arg )
     compat_socket_t selfpipe_socket =
       compat_socket_selfpipe_get_read_fd( self->selfpipe );
     int max_fd = selfpipe_socket;
+    compat_socket_t fd[4];
+    unsigned int generation[4];
+    int io;
 
     FD_ZERO( &readfds );
     FD_ZERO( &writefds );
 
     FD_SET( selfpipe_socket, &readfds );
 
-    for( i = 0; i < 4; i++ )
-      nic_w5100_socket_add_to_sets( &self->socket[i], &readfds, &writefds,
-        &max_fd );
+    for( i = 0; i < 4; i++ ) {
+      io = nic_w5100_socket_get_io( &self->socket[i], &fd[i], &generation[i] );
+      if( io & W5100_SOCKET_IO_READ )
+        FD_SET( fd[i], &readfds );
+      if( io & W5100_SOCKET_IO_WRITE )
+        FD_SET( fd[i], &writefds );
+      if( io && fd[i] > max_fd )
+        max_fd = fd[i];
+    }
 
     /* Note that if a socket is closed between when we added it to the sets
        above and when we call select() below, it will cause the select to fail
@@ -125,8 +257,13 @@ w5100_io_thread( void *arg )
         compat_socket_selfpipe_discard_data( self->selfpipe );
       }
 
-      for( i = 0; i < 4; i++ )
-        nic_w5100_socket_process_io( &self->socket[i], readfds, writefds );
+      for( i = 0; i < 4; i++ ) {
+        if( fd[i] == compat_socket_invalid ) continue;
+        io = ( FD_ISSET( fd[i], &readfds ) ? W5100_SOCKET_IO_READ : 0 ) |
+             ( FD_ISSET( fd[i], &writefds ) ? W5100_SOCKET_IO_WRITE : 0 );
+        if( io )
+          nic_w5100_socket_process_io( &self->socket[i], generation[i], io );
+      }
     }
     else if( compat_socket_get_error() == compat_socket_EBADF ) {
       /* Do nothing - just loop again */
@@ -137,6 +274,21 @@ w5100_io_thread( void *arg )
                        compat_socket_get_strerror() );
     }
   }
+}
+
+static void*
+w5100_io_thread( void *arg )
+{
+  nic_w5100_t *self = arg;
+
+#ifdef HAVE_SYS_EPOLL_H
+  if( self->epoll_fd != -1 ) {
+    w5100_io_thread_epoll( self );
+    return NULL;
+  }
+#endif                          /* #ifdef HAVE_SYS_EPOLL_H */
+
+  w5100_io_thread_select( self );
 
   return NULL;
 }
@@ -153,9 +305,24 @@ nic_w5100_alloc( void )
 
   self->selfpipe = compat_socket_selfpipe_alloc();
 
+#ifdef HAVE_SYS_EPOLL_H
+  /* If this fails, the I/O thread falls back to select() */
+  self->epoll_fd = epoll_create( 5 );
+#endif                          /* #ifdef HAVE_SYS_EPOLL_H */
+
   for( i = 0; i < 4; i++ )
     nic_w5100_socket_init( &self->socket[i], i );
 
+  self->loopback = NULL;
+  if( settings_current.spectranet_network &&
+      !strcmp( settings_current.spectranet_network, "loopback" ) ) {
+    self->loopback = nic_loopback_alloc( settings_current.spectranet_script );
+  } else if( settings_current.spectranet_network &&
+             strcmp( settings_current.spectranet_network, "host" ) ) {
+    ui_error( UI_ERROR_ERROR, "unknown Spectranet network '%s'",
+              settings_current.spectranet_network );
+  }
+
   nic_w5100_reset( self );
 
   self->stop_io_thread = 0;
@@ -183,8 +350,16 @@ nic_w5100_free( nic_w5100_t *self )
     for( i = 0; i < 4; i++ )
       nic_w5100_socket_end( &self->socket[i] );
 
+    if( self->loopback )
+      nic_loopback_free( self->loopback );
+
     compat_socket_selfpipe_free( self->selfpipe );
 
+#ifdef HAVE_SYS_EPOLL_H
+    if( self->epoll_fd != -1 )
+      close( self->epoll_fd );
+#endif                          /* #ifdef HAVE_SYS_EPOLL_H */
+
     compat_socket_networking_end();
 
     libspectrum_free( self );
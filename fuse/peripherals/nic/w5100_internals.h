@@ -31,6 +31,8 @@
 
 #include <signal.h>
 
+#include "loopback.h"
+
 typedef enum w5100_socket_mode {
   W5100_SOCKET_MODE_CLOSED = 0x00,
   W5100_SOCKET_MODE_TCP,
@@ -113,6 +115,7 @@ typedef struct nic_w5100_socket_t {
   /* Host properties */
 
   compat_socket_t fd;       /* Socket file descriptor */
+  nic_loopback_socket_t *loopback; /* Used instead of fd on the loopback network */
   int bind_count;           /* Number of writes to the Sn_PORTx registers we've received */
   int socket_bound;         /* True once we've bound the socket to a port */
   int write_pending;        /* True if we're waiting to write data on this socket */
@@ -121,13 +124,18 @@ typedef struct nic_w5100_socket_t {
   int datagram_lengths[0x20]; /* The lengths of datagrams to be sent */
   int datagram_count;
 
-  /* Flag used to indicate that a socket has been closed since we started
-     waiting for it in a select() call and therefore the socket should no
-     longer be used */
-  int ok_for_io;
+  /* Incremented whenever fd is opened, replaced or closed, so the I/O
+     thread can tell that an fd it has been waiting on is no longer the
+     socket's one */
+  unsigned int fd_generation;
 
   pthread_mutex_t lock;     /* Mutex for this socket */
 
+  /* What the I/O thread has registered with epoll for this socket; used
+     only by the I/O thread */
+  unsigned int poll_generation;
+  int poll_events;
+
 } nic_w5100_socket_t;
 
 struct nic_w5100_t {
@@ -138,9 +146,14 @@ struct nic_w5100_t {
 
   nic_w5100_socket_t socket[4];
 
+  nic_loopback_t *loopback; /* Virtual network, or NULL for host sockets */
+
   pthread_t thread;         /* Thread for doing I/O */
   sig_atomic_t stop_io_thread; /* Flag to stop I/O thread */
   compat_socket_selfpipe_t *selfpipe; /* Device for waking I/O thread */
+#ifdef HAVE_SYS_EPOLL_H
+  int epoll_fd;             /* -1 if we have to use select() */
+#endif
 };
 
 void nic_w5100_socket_init( nic_w5100_socket_t *socket, int which );
@@ -154,10 +167,20 @@ void nic_w5100_socket_write( nic_w5100_t *self, libspectrum_word reg, libspectru
 libspectrum_byte nic_w5100_socket_read_rx_buffer( nic_w5100_t *self, libspectrum_word reg );
 void nic_w5100_socket_write_tx_buffer( nic_w5100_t *self, libspectrum_word reg, libspectrum_byte b );
 
-void nic_w5100_socket_add_to_sets( nic_w5100_socket_t *socket, fd_set *readfds,
-  fd_set *writefds, int *max_fd );
-void nic_w5100_socket_process_io( nic_w5100_socket_t *socket, fd_set readfds,
-  fd_set writefds );
+/* The I/O a socket is waiting for */
+#define W5100_SOCKET_IO_READ  0x01
+#define W5100_SOCKET_IO_WRITE 0x02
+
+void nic_w5100_socket_acquire_lock( nic_w5100_socket_t *socket );
+void nic_w5100_socket_release_lock( nic_w5100_socket_t *socket );
+
+int nic_w5100_socket_get_io( nic_w5100_socket_t *socket, compat_socket_t *fd,
+  unsigned int *generation );
+/* As nic_w5100_socket_get_io(), for a caller already holding the lock */
+int nic_w5100_socket_get_io_locked( nic_w5100_socket_t *socket,
+  compat_socket_t *fd, unsigned int *generation );
+void nic_w5100_socket_process_io( nic_w5100_socket_t *socket,
+  unsigned int generation, int io );
 
 /* Debug routines */
 
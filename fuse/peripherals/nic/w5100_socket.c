@@ -40,6 +40,7 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #endif
 
 #include "fuse.h"
@@ -57,13 +58,15 @@ enum w5100_socket_command {
   W5100_SOCKET_COMMAND_RECV = 1 << 6,
 };
 
+static void w5100_socket_loopback_read( nic_w5100_socket_t *socket );
+
 static void
 w5100_socket_init_common( nic_w5100_socket_t *socket )
 {
   socket->fd = compat_socket_invalid;
   socket->bind_count = 0;
   socket->socket_bound = 0;
-  socket->ok_for_io = 0;
+  socket->fd_generation++;
   socket->write_pending = 0;
 }
 
@@ -71,6 +74,10 @@ void
 nic_w5100_socket_init( nic_w5100_socket_t *socket, int which )
 {
   socket->id = which;
+  socket->loopback = NULL;
+  socket->fd_generation = 0;
+  socket->poll_generation = 0;
+  socket->poll_events = 0;
   w5100_socket_init_common( socket );
   pthread_mutex_init( &socket->lock, NULL );
 }
@@ -82,8 +89,8 @@ nic_w5100_socket_end( nic_w5100_socket_t *socket )
   pthread_mutex_destroy( &socket->lock );
 }
 
-static void
-w5100_socket_acquire_lock( nic_w5100_socket_t *socket )
+void
+nic_w5100_socket_acquire_lock( nic_w5100_socket_t *socket )
 {
   int error = pthread_mutex_lock( &socket->lock );
   if( error ) {
@@ -94,8 +101,8 @@ w5100_socket_acquire_lock( nic_w5100_socket_t *socket )
   }
 }
 
-static void
-w5100_socket_release_lock( nic_w5100_socket_t *socket )
+void
+nic_w5100_socket_release_lock( nic_w5100_socket_t *socket )
 {
   int error = pthread_mutex_unlock( &socket->lock );
   if( error ) {
@@ -122,12 +129,18 @@ w5100_socket_clean( nic_w5100_socket_t *socket )
     compat_socket_close( socket->fd );
     w5100_socket_init_common( socket );
   }
+
+  if( socket->loopback ) {
+    nic_loopback_socket_close( socket->loopback );
+    socket->loopback = NULL;
+    socket->socket_bound = 0;
+  }
 }
 
 void
 nic_w5100_socket_reset( nic_w5100_socket_t *socket )
 {
-  w5100_socket_acquire_lock( socket );
+  nic_w5100_socket_acquire_lock( socket );
 
   socket->mode = W5100_SOCKET_MODE_CLOSED;
   socket->flags = 0;
@@ -135,7 +148,7 @@ nic_w5100_socket_reset( nic_w5100_socket_t *socket )
 
   w5100_socket_clean( socket );
 
-  w5100_socket_release_lock( socket );
+  nic_w5100_socket_release_lock( socket );
 }
 
 static void
@@ -177,7 +190,7 @@ w5100_write_socket_mr( nic_w5100_socket_t *socket, libspectrum_byte b )
 }
 
 static void
-w5100_socket_open( nic_w5100_socket_t *socket_obj )
+w5100_socket_open( nic_w5100_t *self, nic_w5100_socket_t *socket_obj )
 {
   if( ( socket_obj->mode == W5100_SOCKET_MODE_UDP ||
       socket_obj->mode == W5100_SOCKET_MODE_TCP ) &&
@@ -194,7 +207,15 @@ w5100_socket_open( nic_w5100_socket_t *socket_obj )
 
     w5100_socket_clean( socket_obj );
 
+    /* The loopback network's socket is made when the port is bound */
+    if( self->loopback ) {
+      socket_obj->state = final_state;
+      nic_w5100_debug( "w5100: opened loopback %s socket %d\n", description, socket_obj->id );
+      return;
+    }
+
     socket_obj->fd = socket( AF_INET, type, protocol );
+    socket_obj->fd_generation++;
     if( socket_obj->fd == compat_socket_invalid ) {
       nic_w5100_error( UI_ERROR_ERROR,
         "w5100: failed to open %s socket for socket %d; errno %d: %s\n",
@@ -225,6 +246,15 @@ w5100_socket_bind_port( nic_w5100_t *self, nic_w5100_socket_t *socket )
 {
   struct sockaddr_in sa;
 
+  if( self->loopback ) {
+    socket->loopback =
+      nic_loopback_socket_open( self->loopback,
+                                socket->mode == W5100_SOCKET_MODE_TCP,
+                                ( socket->port[0] << 8 ) | socket->port[1] );
+    socket->socket_bound = 1;
+    return 0;
+  }
+
   memset( &sa, 0, sizeof(sa) );
   sa.sin_family = AF_INET;
   memcpy( &sa.sin_port, socket->port, 2 );
@@ -257,7 +287,8 @@ w5100_socket_listen( nic_w5100_t *self, nic_w5100_socket_t *socket )
       if( w5100_socket_bind_port( self, socket ) )
         return;
 
-    if( listen( socket->fd, 1 ) == -1 ) {
+    /* Nothing ever connects to the loopback network's sockets */
+    if( !self->loopback && listen( socket->fd, 1 ) == -1 ) {
       nic_w5100_error( UI_ERROR_ERROR, 
                        "w5100: failed to listen on socket %d; errno %d: %s\n",
                        socket->id, compat_socket_get_error(),
@@ -283,6 +314,19 @@ w5100_socket_connect( nic_w5100_t *self, nic_w5100_socket_t *socket )
       if( w5100_socket_bind_port( self, socket ) )
         return;
 
+    if( self->loopback ) {
+      if( nic_loopback_socket_connect( socket->loopback, socket->dip,
+            ( socket->dport[0] << 8 ) | socket->dport[1] ) ) {
+        socket->ir |= 1 << 3;
+        socket->state = W5100_SOCKET_STATE_CLOSED;
+        return;
+      }
+
+      socket->ir |= 1 << 0;
+      socket->state = W5100_SOCKET_STATE_ESTABLISHED;
+      return;
+    }
+
     memset( &sa, 0, sizeof(sa) );
     sa.sin_family = AF_INET;
     memcpy( &sa.sin_port, socket->dport, 2 );
@@ -309,6 +353,8 @@ w5100_socket_discon( nic_w5100_t *self, nic_w5100_socket_t *socket )
 {
   if( socket->state == W5100_SOCKET_STATE_ESTABLISHED ||
     socket->state == W5100_SOCKET_STATE_CLOSE_WAIT ) {
+    if( socket->loopback )
+      nic_loopback_socket_disconnect( socket->loopback );
     socket->ir |= 1 << 1;
     socket->state = W5100_SOCKET_STATE_CLOSED;
     compat_socket_selfpipe_wake( self->selfpipe );
@@ -324,11 +370,50 @@ w5100_socket_close( nic_w5100_t *self, nic_w5100_socket_t *socket )
     compat_socket_close( socket->fd );
     socket->fd = compat_socket_invalid;
     socket->socket_bound = 0;
-    socket->ok_for_io = 0;
+    socket->fd_generation++;
     socket->state = W5100_SOCKET_STATE_CLOSED;
     compat_socket_selfpipe_wake( self->selfpipe );
     nic_w5100_debug( "w5100: closed socket %d\n", socket->id );
   }
+
+  if( socket->loopback ) {
+    nic_loopback_socket_close( socket->loopback );
+    socket->loopback = NULL;
+    socket->socket_bound = 0;
+    socket->state = W5100_SOCKET_STATE_CLOSED;
+    nic_w5100_debug( "w5100: closed loopback socket %d\n", socket->id );
+  }
+}
+
+/* The loopback network takes everything at once, so just send the
+   whole of the transmit buffer */
+static void
+w5100_socket_loopback_write( nic_w5100_socket_t *socket )
+{
+  libspectrum_byte buffer[0x800];
+  int offset = socket->tx_rr & 0x7ff;
+  int length = (libspectrum_word)( socket->tx_wr - socket->tx_rr );
+  int first_chunk = 0x800 - offset;
+
+  /* Never more than the whole buffer, whatever S_TX_WR says */
+  if( length > 0x800 ) length = 0x800;
+
+  if( length <= first_chunk ) {
+    memcpy( buffer, socket->tx_buffer + offset, length );
+  }
+  else {
+    memcpy( buffer, socket->tx_buffer + offset, first_chunk );
+    memcpy( buffer + first_chunk, socket->tx_buffer, length - first_chunk );
+  }
+
+  nic_w5100_debug( "w5100: sending 0x%03x bytes to loopback socket %d\n", length, socket->id );
+
+  nic_loopback_socket_send( socket->loopback, socket->dip,
+                            ( socket->dport[0] << 8 ) | socket->dport[1],
+                            buffer, length );
+
+  socket->tx_rr = socket->last_send = socket->tx_wr;
+  socket->ir |= 1 << 4;
 }
 
 static void
@@ -340,6 +425,11 @@ w5100_socket_send( nic_w5100_t *self, nic_w5100_socket_t *socket )
       if( w5100_socket_bind_port( self, socket ) )
         return;
 
+    if( socket->loopback ) {
+      w5100_socket_loopback_write( socket );
+      return;
+    }
+
     socket->datagram_lengths[socket->datagram_count++] =
       socket->tx_wr - socket->last_send;
     socket->last_send = socket->tx_wr;
@@ -347,6 +437,11 @@ w5100_socket_send( nic_w5100_t *self, nic_w5100_socket_t *socket )
     compat_socket_selfpipe_wake( self->selfpipe );
   }
   else if( socket->state == W5100_SOCKET_STATE_ESTABLISHED ) {
+    if( socket->loopback ) {
+      w5100_socket_loopback_write( socket );
+      return;
+    }
+
     socket->write_pending = 1;
     compat_socket_selfpipe_wake( self->selfpipe );
   }
@@ -372,7 +467,7 @@ w5100_write_socket_cr( nic_w5100_t *self, nic_w5100_socket_t *socket, libspectru
 
   switch( b ) {
     case W5100_SOCKET_COMMAND_OPEN:
-      w5100_socket_open( socket );
+      w5100_socket_open( self, socket );
       break;
     case W5100_SOCKET_COMMAND_LISTEN:
       w5100_socket_listen( self, socket );
@@ -424,7 +519,7 @@ nic_w5100_socket_read( nic_w5100_t *self, libspectrum_word reg )
   libspectrum_word fsr;
   libspectrum_byte b;
 
-  w5100_socket_acquire_lock( socket );
+  nic_w5100_socket_acquire_lock( socket );
 
   switch( socket_reg ) {
     case W5100_SOCKET_MR:
@@ -475,7 +570,7 @@ nic_w5100_socket_read( nic_w5100_t *self, libspectrum_word reg )
       break;
   }
 
-  w5100_socket_release_lock( socket );
+  nic_w5100_socket_release_lock( socket );
 
   return b;
 }
@@ -486,7 +581,7 @@ nic_w5100_socket_write( nic_w5100_t *self, libspectrum_word reg, libspectrum_byt
   nic_w5100_socket_t *socket = &self->socket[(reg >> 8) - 4];
   int socket_reg = reg & 0xff;
 
-  w5100_socket_acquire_lock( socket );
+  nic_w5100_socket_acquire_lock( socket );
 
   switch( socket_reg ) {
     case W5100_SOCKET_MR:
@@ -534,7 +629,15 @@ nic_w5100_socket_write( nic_w5100_t *self, libspectrum_word reg, libspectrum_byt
   if( socket_reg != W5100_SOCKET_PORT0 && socket_reg != W5100_SOCKET_PORT1 )
     socket->bind_count = 0;
 
-  w5100_socket_release_lock( socket );
+  nic_w5100_socket_release_lock( socket );
+
+  /* The loopback network only ever answers a command, so this is the only
+     time there can be anything new to read */
+  if( socket_reg == W5100_SOCKET_CR && self->loopback ) {
+    int i;
+    for( i = 0; i < 4; i++ )
+      w5100_socket_loopback_read( &self->socket[i] );
+  }
 }
 
 libspectrum_byte
@@ -556,11 +659,14 @@ nic_w5100_socket_write_tx_buffer( nic_w5100_t *self, libspectrum_word reg, libsp
   socket->tx_buffer[offset] = b;
 }
 
-void
-nic_w5100_socket_add_to_sets( nic_w5100_socket_t *socket, fd_set *readfds,
-  fd_set *writefds, int *max_fd )
+int
+nic_w5100_socket_get_io_locked( nic_w5100_socket_t *socket,
+  compat_socket_t *fd, unsigned int *generation )
 {
-  w5100_socket_acquire_lock( socket );
+  int io = 0;
+
+  *fd = socket->fd;
+  *generation = socket->fd_generation;
 
   if( socket->fd != compat_socket_invalid ) {
     /* We can process a UDP read if we're in a UDP state and there are at least
@@ -575,24 +681,31 @@ nic_w5100_socket_add_to_sets( nic_w5100_socket_t *socket, fd_set *readfds,
 
     int tcp_listen = socket->state == W5100_SOCKET_STATE_LISTEN;
 
-    socket->ok_for_io = 1;
-
     if( udp_read || tcp_read || tcp_listen ) {
-      FD_SET( socket->fd, readfds );
-      if( socket->fd > *max_fd )
-        *max_fd = socket->fd;
-      nic_w5100_debug( "w5100: checking for read on socket %d with fd %d; max fd %d\n", socket->id, socket->fd, *max_fd );
+      io |= W5100_SOCKET_IO_READ;
+      nic_w5100_debug( "w5100: checking for read on socket %d with fd %d\n", socket->id, socket->fd );
     }
 
     if( socket->write_pending ) {
-      FD_SET( socket->fd, writefds );
-      if( socket->fd > *max_fd )
-        *max_fd = socket->fd;
-      nic_w5100_debug( "w5100: write pending on socket %d with fd %d; max fd %d\n", socket->id, socket->fd, *max_fd );
+      io |= W5100_SOCKET_IO_WRITE;
+      nic_w5100_debug( "w5100: write pending on socket %d with fd %d\n", socket->id, socket->fd );
     }
   }
 
-  w5100_socket_release_lock( socket );
+  return io;
+}
+
+int
+nic_w5100_socket_get_io( nic_w5100_socket_t *socket, compat_socket_t *fd,
+  unsigned int *generation )
+{
+  int io;
+
+  nic_w5100_socket_acquire_lock( socket );
+  io = nic_w5100_socket_get_io_locked( socket, fd, generation );
+  nic_w5100_socket_release_lock( socket );
+
+  return io;
 }
 
 static void
@@ -618,13 +731,55 @@ w5100_socket_process_accept( nic_w5100_socket_t *socket )
     nic_w5100_debug( "w5100: error attempting to close fd %d for socket %d\n", socket->fd, socket->id );
 
   socket->fd = new_fd;
+  socket->fd_generation++;
   socket->state = W5100_SOCKET_STATE_ESTABLISHED;
 }
 
+/* Copy 'length' bytes into one of the 2K socket buffers at 'offset',
+   wrapping round its end */
+static void
+w5100_buffer_write( libspectrum_byte *buffer, int offset,
+                    const libspectrum_byte *data, int length )
+{
+  int first_chunk;
+
+  offset &= 0x7ff;
+  first_chunk = 0x800 - offset;
+
+  if( length <= first_chunk ) {
+    memcpy( buffer + offset, data, length );
+  }
+  else {
+    memcpy( buffer + offset, data, first_chunk );
+    memcpy( buffer, data + first_chunk, length - first_chunk );
+  }
+}
+
+#ifndef WIN32
+/* Describe 'length' bytes at 'offset' in one of the 2K socket buffers, so
+   the host socket can be read into or written from the buffer directly */
+static int
+w5100_buffer_iov( libspectrum_byte *buffer, int offset, int length,
+                  struct iovec *iov )
+{
+  offset &= 0x7ff;
+
+  iov[0].iov_base = buffer + offset;
+  if( offset + length <= 0x800 ) {
+    iov[0].iov_len = length;
+    return 1;
+  }
+
+  iov[0].iov_len = 0x800 - offset;
+  iov[1].iov_base = buffer;
+  iov[1].iov_len = length - iov[0].iov_len;
+  return 2;
+}
+#endif                          /* #ifndef WIN32 */
+
 static void
 w5100_socket_process_read( nic_w5100_socket_t *socket )
 {
-  libspectrum_byte buffer[0x800];
   int bytes_free = 0x800 - socket->rx_rsr;
   ssize_t bytes_read;
   struct sockaddr_in sa;
@@ -632,42 +787,61 @@ w5100_socket_process_read( nic_w5100_socket_t *socket )
   int udp = socket->state == W5100_SOCKET_STATE_UDP;
   const char *description = udp ? "UDP" : "TCP";
 
+  /* UDP data is preceded by the W5100's 8 byte header */
+  int header_length = udp ? 8 : 0;
+  int offset = (socket->old_rx_rd + socket->rx_rsr) & 0x7ff;
+
+#ifndef WIN32
+  struct iovec iov[2];
+  struct msghdr msg;
+
+  nic_w5100_debug( "w5100: reading from socket %d\n", socket->id );
+
+  memset( &msg, 0, sizeof(msg) );
+  msg.msg_iov = iov;
+  msg.msg_iovlen = w5100_buffer_iov( socket->rx_buffer,
+                                     offset + header_length,
+                                     bytes_free - header_length, iov );
+  if( udp ) {
+    msg.msg_name = &sa;
+    msg.msg_namelen = sizeof(sa);
+  }
+
+  bytes_read = recvmsg( socket->fd, &msg, 0 );
+#else                           /* #ifndef WIN32 */
+  libspectrum_byte buffer[0x800];
+
   nic_w5100_debug( "w5100: reading from socket %d\n", socket->id );
 
   if( udp ) {
     socklen_t sa_length = sizeof(sa);
-    bytes_read = recvfrom( socket->fd, (char*)buffer + 8, bytes_free - 8, 0,
+    bytes_read = recvfrom( socket->fd, (char*)buffer, bytes_free - 8, 0,
       (struct sockaddr*)&sa, &sa_length );
   }
   else
     bytes_read = recv( socket->fd, (char*)buffer, bytes_free, 0 );
 
+  if( bytes_read > 0 )
+    w5100_buffer_write( socket->rx_buffer, offset + header_length, buffer,
+                        bytes_read );
+#endif                          /* #ifndef WIN32 */
+
   nic_w5100_debug( "w5100: read 0x%03x bytes from %s socket %d\n", (int)bytes_read, description, socket->id );
 
   if( bytes_read > 0 || (udp && bytes_read == 0) ) {
-    int offset = (socket->old_rx_rd + socket->rx_rsr) & 0x7ff;
-    libspectrum_byte *dest = &socket->rx_buffer[offset];
-
     if( udp ) {
       /* Add the W5100's UDP header */
-      memcpy( buffer, &sa.sin_addr.s_addr, 4 );
-      memcpy( buffer + 4, &sa.sin_port, 2 );
-      buffer[6] = (bytes_read >> 8) & 0xff;
-      buffer[7] = bytes_read & 0xff;
-      bytes_read += 8;
+      libspectrum_byte header[8];
+
+      memcpy( header, &sa.sin_addr.s_addr, 4 );
+      memcpy( header + 4, &sa.sin_port, 2 );
+      header[6] = (bytes_read >> 8) & 0xff;
+      header[7] = bytes_read & 0xff;
+      w5100_buffer_write( socket->rx_buffer, offset, header, 8 );
     }
 
-    socket->rx_rsr += bytes_read;
+    socket->rx_rsr += bytes_read + header_length;
     socket->ir |= 1 << 2;
-
-    if( offset + bytes_read <= 0x800 ) {
-      memcpy( dest, buffer, bytes_read );
-    }
-    else {
-      int first_chunk = 0x800 - offset;
-      memcpy( dest, buffer, first_chunk );
-      memcpy( socket->rx_buffer, buffer + first_chunk, bytes_read - first_chunk );
-    }
   }
   else if( bytes_read == 0 ) {  /* TCP */
     socket->state = W5100_SOCKET_STATE_CLOSE_WAIT;
@@ -682,18 +856,72 @@ w5100_socket_process_read( nic_w5100_socket_t *socket )
   }
 }
 
+static void
+w5100_socket_loopback_read( nic_w5100_socket_t *socket )
+{
+  libspectrum_byte buffer[0x800];
+  size_t bytes_read;
+
+  nic_w5100_socket_acquire_lock( socket );
+
+  if( socket->loopback &&
+      ( socket->state == W5100_SOCKET_STATE_UDP ||
+        socket->state == W5100_SOCKET_STATE_ESTABLISHED ) ) {
+
+    /* UDP datagrams come with the W5100's header already in place */
+    bytes_read = nic_loopback_socket_recv( socket->loopback, buffer,
+                                           0x800 - socket->rx_rsr );
+    if( bytes_read ) {
+      nic_w5100_debug( "w5100: read 0x%03x bytes from loopback socket %d\n",
+                       (int)bytes_read, socket->id );
+      w5100_buffer_write( socket->rx_buffer,
+                          socket->old_rx_rd + socket->rx_rsr, buffer,
+                          bytes_read );
+      socket->rx_rsr += bytes_read;
+      socket->ir |= 1 << 2;
+    }
+
+    if( socket->state == W5100_SOCKET_STATE_ESTABLISHED &&
+        nic_loopback_socket_closed( socket->loopback ) )
+      socket->state = W5100_SOCKET_STATE_CLOSE_WAIT;
+  }
+
+  nic_w5100_socket_release_lock( socket );
+}
+
 static void
 w5100_socket_process_udp_write( nic_w5100_socket_t *socket )
 {
   ssize_t bytes_sent;
   int offset = socket->tx_rr & 0x7ff;
   libspectrum_word length = socket->datagram_lengths[0];
-  libspectrum_byte *data = &socket->tx_buffer[ offset ];
   struct sockaddr_in sa;
+#ifndef WIN32
+  struct iovec iov[2];
+  struct msghdr msg;
+#else                           /* #ifndef WIN32 */
+  libspectrum_byte *data = &socket->tx_buffer[ offset ];
   libspectrum_byte buffer[0x800];
+#endif                          /* #ifndef WIN32 */
 
   nic_w5100_debug( "w5100: writing to UDP socket %d\n", socket->id );
 
+  memset( &sa, 0, sizeof(sa) );
+  sa.sin_family = AF_INET;
+  memcpy( &sa.sin_port, socket->dport, 2 );
+  memcpy( &sa.sin_addr.s_addr, socket->dip, 4 );
+
+#ifndef WIN32
+  /* Send straight from the transmit buffer, even if the datagram wraps
+     round its end */
+  memset( &msg, 0, sizeof(msg) );
+  msg.msg_name = &sa;
+  msg.msg_namelen = sizeof(sa);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = w5100_buffer_iov( socket->tx_buffer, offset, length, iov );
+
+  bytes_sent = sendmsg( socket->fd, &msg, 0 );
+#else                           /* #ifndef WIN32 */
   /* If the data wraps round the write buffer, we need to coalesce it into
      one chunk for the call to sendto() */
   if( offset + length > 0x800 ) {
@@ -703,12 +931,8 @@ w5100_socket_process_udp_write( nic_w5100_socket_t *socket )
     data = buffer;
   }
 
-  memset( &sa, 0, sizeof(sa) );
-  sa.sin_family = AF_INET;
-  memcpy( &sa.sin_port, socket->dport, 2 );
-  memcpy( &sa.sin_addr.s_addr, socket->dip, 4 );
-
   bytes_sent = sendto( socket->fd, (const char*)data, length, 0, (struct sockaddr*)&sa, sizeof(sa) );
+#endif                          /* #ifndef WIN32 */
   nic_w5100_debug( "w5100: sent 0x%03x bytes of 0x%03x to UDP socket %d\n",
                    (int)bytes_sent, length, socket->id );
 
@@ -737,15 +961,30 @@ w5100_socket_process_tcp_write( nic_w5100_socket_t *socket )
   ssize_t bytes_sent;
   int offset = socket->tx_rr & 0x7ff;
   libspectrum_word length = socket->tx_wr - socket->tx_rr;
+#ifndef WIN32
+  struct iovec iov[2];
+  struct msghdr msg;
+#else                           /* #ifndef WIN32 */
   libspectrum_byte *data = &socket->tx_buffer[ offset ];
+#endif                          /* #ifndef WIN32 */
 
   nic_w5100_debug( "w5100: writing to TCP socket %d\n", socket->id );
 
+#ifndef WIN32
+  /* Send straight from the transmit buffer, both chunks at once if the
+     data wraps round its end */
+  memset( &msg, 0, sizeof(msg) );
+  msg.msg_iov = iov;
+  msg.msg_iovlen = w5100_buffer_iov( socket->tx_buffer, offset, length, iov );
+
+  bytes_sent = sendmsg( socket->fd, &msg, 0 );
+#else                           /* #ifndef WIN32 */
   /* If the data wraps round the write buffer, write it in two chunks */
   if( offset + length > 0x800 )
     length = 0x800 - offset;
 
   bytes_sent = send( socket->fd, (const char*)data, length, 0 );
+#endif                          /* #ifndef WIN32 */
   nic_w5100_debug( "w5100: sent 0x%03x bytes of 0x%03x to TCP socket %d\n",
                    (int)bytes_sent, length, socket->id );
 
@@ -763,22 +1002,23 @@ w5100_socket_process_tcp_write( nic_w5100_socket_t *socket )
 }
 
 void
-nic_w5100_socket_process_io( nic_w5100_socket_t *socket, fd_set readfds,
-  fd_set writefds )
+nic_w5100_socket_process_io( nic_w5100_socket_t *socket,
+  unsigned int generation, int io )
 {
-  w5100_socket_acquire_lock( socket );
+  nic_w5100_socket_acquire_lock( socket );
 
   /* Process only if we're an open socket, and we haven't been closed and
-     re-opened since the select() started */
-  if( socket->fd != compat_socket_invalid && socket->ok_for_io ) {
-    if( FD_ISSET( socket->fd, &readfds ) ) {
+     re-opened since we started waiting for it */
+  if( socket->fd != compat_socket_invalid &&
+      socket->fd_generation == generation ) {
+    if( io & W5100_SOCKET_IO_READ ) {
       if( socket->state == W5100_SOCKET_STATE_LISTEN )
         w5100_socket_process_accept( socket );
       else
         w5100_socket_process_read( socket );
     }
 
-    if( FD_ISSET( socket->fd, &writefds ) ) {
+    if( io & W5100_SOCKET_IO_WRITE ) {
       if( socket->state == W5100_SOCKET_STATE_UDP ) {
         w5100_socket_process_udp_write( socket );
       }
@@ -788,5 +1028,5 @@ nic_w5100_socket_process_io( nic_w5100_socket_t *socket, fd_set readfds,
     }
   }
 
-  w5100_socket_release_lock( socket );
+  nic_w5100_socket_release_lock( socket );
 }
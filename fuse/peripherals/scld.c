@@ -38,6 +38,7 @@
 #include "memory.h"
 #include "module.h"
 #include "periph.h"
+#include "quicksave.h"
 #include "scld.h"
 #include "spectrum.h"
 #include "ui/ui.h"
@@ -86,6 +87,9 @@ scld_init( void )
 {
   module_register( &scld_module_info );
   periph_register( PERIPH_TYPE_SCLD, &scld_periph );
+
+  quicksave_register( &scld_last_dec, sizeof( scld_last_dec ) );
+  quicksave_register( &scld_last_hsr, sizeof( scld_last_hsr ) );
 }
 
 static libspectrum_byte
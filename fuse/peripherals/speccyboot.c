@@ -46,6 +46,10 @@
 
 static nic_enc28j60_t *nic;
 
+/* Emulated time at the start of this frame, so the network backend can
+   timestamp frames without reference to real time */
+static libspectrum_qword speccyboot_frame_tstates = 0;
+
 /* ---------------------------------------------------------------------------
  * Spectrum I/O register state (IN/OUT from/to 0x9f)
  * ------------------------------------------------------------------------ */
@@ -138,6 +142,9 @@ static void
 speccyboot_register_write( libspectrum_word port GCC_UNUSED,
                            libspectrum_byte val )
 {
+  nic_enc28j60_set_time( nic,
+                         ( speccyboot_frame_tstates + tstates ) * 1000000 /
+                         machine_current->timings.processor_speed );
   nic_enc28j60_poll( nic );
 
   if( GONE_LO( out_register_state, val, OUT_BIT_ETH_RST ) )
@@ -212,6 +219,12 @@ speccyboot_end( void )
   nic_enc28j60_free( nic );
 }
 
+void
+speccyboot_frame( libspectrum_dword frame_length )
+{
+  speccyboot_frame_tstates += frame_length;
+}
+
 int
 speccyboot_unittest( void )
 {
@@ -248,6 +261,11 @@ speccyboot_end( void )
 {
 }
 
+void
+speccyboot_frame( libspectrum_dword frame_length GCC_UNUSED )
+{
+}
+
 int
 speccyboot_unittest( void )
 {
@@ -42,6 +42,8 @@ void speccyboot_init( void );
 
 void speccyboot_end( void );
 
+void speccyboot_frame( libspectrum_dword frame_length );
+
 int speccyboot_unittest( void );
 
 #endif /* #ifndef FUSE_SPECCYBOOT_H */
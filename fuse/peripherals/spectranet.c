@@ -29,6 +29,7 @@
 
 #include "compat.h"
 #include "debugger/debugger.h"
+#include "event.h"
 #include "flash/am29f010.h"
 #include "machine.h"
 #include "memory.h"
@@ -38,6 +39,7 @@
 #include "peripherals/ula.h"
 #include "settings.h"
 #include "ui/ui.h"
+#include "z80/z80.h"
 
 #ifdef BUILD_SPECTRANET
 
@@ -89,6 +91,22 @@ static int spectranet_source;
 static const char * const event_type_string = "spectranet";
 static int page_event, unpage_event;
 
+static void spectranet_pc_trap_page( libspectrum_word pc );
+static void spectranet_pc_trap_unpage( libspectrum_word pc );
+static void spectranet_pc_trap_programmable( libspectrum_word pc );
+
+/* Where in spectranet_pc_traps[] the programmable trap is */
+#define PROGRAMMABLE_TRAP 3
+
+/* Not const as the programmable trap can be moved */
+static periph_pc_trap_t spectranet_pc_traps[] = {
+  { 0xffff, 0x0008, spectranet_pc_trap_page, NULL },
+  { 0xfff8, 0x3ff8, spectranet_pc_trap_page, NULL },
+  { 0xffff, 0x007c, NULL, spectranet_pc_trap_unpage },
+  { 0xffff, 0x0000, spectranet_pc_trap_programmable, NULL },
+  { 0, 0, NULL, NULL }
+};
+
 void
 spectranet_page( int via_io )
 {
@@ -151,6 +169,34 @@ spectranet_map_page( int dest, int source )
   }
 }
 
+static void
+update_programmable_trap( void )
+{
+  spectranet_pc_traps[ PROGRAMMABLE_TRAP ].value =
+    spectranet_programmable_trap;
+  periph_update_pc_traps();
+}
+
+static void
+spectranet_pc_trap_page( libspectrum_word pc GCC_UNUSED )
+{
+  if( !settings_current.spectranet_disable ) spectranet_page( 0 );
+}
+
+static void
+spectranet_pc_trap_unpage( libspectrum_word pc GCC_UNUSED )
+{
+  spectranet_unpage();
+}
+
+static void
+spectranet_pc_trap_programmable( libspectrum_word pc GCC_UNUSED )
+{
+  if( spectranet_programmable_trap_active &&
+      !settings_current.spectranet_disable )
+    event_add( 0, z80_nmi_event );
+}
+
 static void
 spectranet_hard_reset( void )
 {
@@ -160,6 +206,7 @@ spectranet_hard_reset( void )
   spectranet_programmable_trap = 0x0000;
   spectranet_programmable_trap_active = 0;
   trap_write_msb = 0;
+  update_programmable_trap();
 
   nmi_flipflop = 0;
 }  
@@ -280,6 +327,7 @@ spectranet_from_snapshot( libspectrum_snap *snap )
       libspectrum_snap_spectranet_programmable_trap_active( snap );
     trap_write_msb =
       libspectrum_snap_spectranet_programmable_trap_msb( snap );
+    update_programmable_trap();
 
     settings_current.spectranet_disable =
       libspectrum_snap_spectranet_all_traps_disabled( snap );
@@ -393,6 +441,8 @@ spectranet_trap( libspectrum_word port, libspectrum_byte data )
       (spectranet_programmable_trap & 0xff00) | data;
 
   trap_write_msb = !trap_write_msb;
+
+  update_programmable_trap();
 }
 
 static libspectrum_byte
@@ -434,7 +484,8 @@ static const periph_t spectranet_periph = {
   &settings_current.spectranet,
   spectranet_ports,
   1,
-  spectranet_activate
+  spectranet_activate,
+  spectranet_pc_traps
 };
 
 void
@@ -33,6 +33,7 @@
 #include "machine.h"
 #include "module.h"
 #include "periph.h"
+#include "quicksave.h"
 #include "settings.h"
 #include "sound.h"
 #include "spectrum.h"
@@ -97,6 +98,8 @@ ula_init( void )
   periph_register( PERIPH_TYPE_ULA_FULL_DECODE, &ula_periph_full_decode );
 
   ula_default_value = 0xff;
+
+  quicksave_register( &last_byte, sizeof( last_byte ) );
 }
 
 static libspectrum_byte
@@ -123,7 +123,7 @@ pokemem_read_from_file( const char *filename )
 
   pokemem_clear();
 
-  error = utils_read_file( filename, &file );
+  error = utils_map_file( filename, &file );
   if( error ) return error;
 
   pokfile = utils_safe_strdup( filename );
@@ -580,7 +580,7 @@ pokemem_autoload_pokfile( void )
 
   if( !pokfile || trainer_list ) return 1;
 
-  error = utils_read_file( pokfile, &file );
+  error = utils_map_file( pokfile, &file );
   if( error ) return error;
 
   error = pokemem_read_from_buffer( file.buffer, file.length );
@@ -0,0 +1,322 @@
+/* quicksave.c: Fast in-process save and restore of the machine state
+   Copyright (c) 2015 Philip Kendall
+
+   $Id$
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+/*
+  A quicksave is a straight copy of the emulator's own state into a
+  single buffer: no compression, no libspectrum_snap and no per-module
+  conversion. It is intended for rewind, search tools and test harnesses
+  which save and restore many times a second, and so only works within
+  one run of Fuse and one machine reset: the copied memory maps point
+  into ROM pages which are reallocated whenever the machine is reset.
+
+  Modules add their raw state with quicksave_register(); the machine
+  specific state, RAM and the event queue are handled here. Peripherals
+  whose state lives outside anything registered (disk and IDE
+  interfaces, Interface 1, the network interfaces) make quicksave_save()
+  fail so the caller can fall back to a normal snapshot.
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_LIB_GLIB
+#include <glib.h>
+#endif				/* #ifdef HAVE_LIB_GLIB */
+
+#include <libspectrum.h>
+
+#include "compat.h"
+#include "display.h"
+#include "event.h"
+#include "machine.h"
+#include "memory.h"
+#include "periph.h"
+#include "quicksave.h"
+#include "spectrum.h"
+#include "z80/z80.h"
+
+typedef struct quicksave_region_t {
+  void *state;
+  size_t length;
+} quicksave_region_t;
+
+struct quicksave_t {
+  libspectrum_machine machine;
+  unsigned long generation;	/* value of quicksave_generation when saved */
+  size_t ram_pages;
+  size_t events;
+
+  libspectrum_byte *arena;
+  size_t length, allocated;
+};
+
+static GArray *regions;
+static size_t regions_length;
+
+/* Incremented every time the machine is reset */
+static unsigned long quicksave_generation;
+
+/* Peripherals with state we don't copy */
+static const periph_type unsupported_peripherals[] = {
+  PERIPH_TYPE_BETA128,
+  PERIPH_TYPE_BETA128_PENTAGON,
+  PERIPH_TYPE_BETA128_PENTAGON_LATE,
+  PERIPH_TYPE_DIVIDE,
+  PERIPH_TYPE_PLUSD,
+  PERIPH_TYPE_DISCIPLE,
+  PERIPH_TYPE_INTERFACE1,
+  PERIPH_TYPE_OPUS,
+  PERIPH_TYPE_SE_MEMORY,
+  PERIPH_TYPE_SIMPLEIDE,
+  PERIPH_TYPE_SPECCYBOOT,
+  PERIPH_TYPE_SPECTRANET,
+  PERIPH_TYPE_UPD765,
+  PERIPH_TYPE_ZXATASP,
+  PERIPH_TYPE_ZXCF,
+};
+
+void
+quicksave_register( void *state, size_t length )
+{
+  quicksave_region_t region;
+
+  if( !regions )
+    regions = g_array_new( FALSE, FALSE, sizeof( quicksave_region_t ) );
+
+  region.state = state; region.length = length;
+  g_array_append_val( regions, region );
+
+  regions_length += length;
+}
+
+void
+quicksave_invalidate( void )
+{
+  quicksave_generation++;
+}
+
+quicksave_t*
+quicksave_alloc( void )
+{
+  quicksave_t *save = libspectrum_new( quicksave_t, 1 );
+
+  save->machine = LIBSPECTRUM_MACHINE_UNKNOWN;
+  save->generation = 0;
+  save->ram_pages = save->events = 0;
+  save->arena = NULL;
+  save->length = save->allocated = 0;
+
+  return save;
+}
+
+void
+quicksave_free( quicksave_t *save )
+{
+  if( !save ) return;
+
+  libspectrum_free( save->arena );
+  libspectrum_free( save );
+}
+
+static int
+quicksave_supported( void )
+{
+  size_t i;
+
+  for( i = 0; i < ARRAY_SIZE( unsupported_peripherals ); i++ )
+    if( periph_is_active( unsupported_peripherals[i] ) ) return 0;
+
+  return 1;
+}
+
+/* Not all machines use RAM pages 0 to valid_pages - 1 (the 48K machine
+   uses pages 0, 2 and 5), so always copy at least the 128K's worth */
+static size_t
+ram_pages( void )
+{
+  size_t pages = machine_current->ram.valid_pages;
+
+  return pages < 8 ? 8 : pages;
+}
+
+static void
+count_event( gpointer data GCC_UNUSED, gpointer user_data )
+{
+  size_t *count = user_data;
+  (*count)++;
+}
+
+static void
+copy_event( gpointer data, gpointer user_data )
+{
+  libspectrum_byte **ptr = user_data;
+
+  memcpy( *ptr, data, sizeof( event_t ) ); *ptr += sizeof( event_t );
+}
+
+int
+quicksave_save( quicksave_t *save )
+{
+  libspectrum_byte *ptr;
+  size_t i, length, events = 0;
+
+  if( !quicksave_supported() ) return 1;
+
+  event_foreach( count_event, &events );
+
+  length = regions_length + sizeof( spectrum_raminfo ) + sizeof( ayinfo ) +
+	   sizeof( specdrum_info ) + ram_pages() * 0x4000 +
+	   events * sizeof( event_t );
+
+  if( length > save->allocated ) {
+    save->arena = libspectrum_renew( libspectrum_byte, save->arena, length );
+    save->allocated = length;
+  }
+
+  save->machine = machine_current->machine;
+  save->generation = quicksave_generation;
+  save->ram_pages = ram_pages();
+  save->events = events;
+  save->length = length;
+
+  ptr = save->arena;
+
+  for( i = 0; regions && i < regions->len; i++ ) {
+    quicksave_region_t *region =
+      &g_array_index( regions, quicksave_region_t, i );
+    memcpy( ptr, region->state, region->length ); ptr += region->length;
+  }
+
+  memcpy( ptr, &machine_current->ram, sizeof( spectrum_raminfo ) );
+  ptr += sizeof( spectrum_raminfo );
+  memcpy( ptr, &machine_current->ay, sizeof( ayinfo ) );
+  ptr += sizeof( ayinfo );
+  memcpy( ptr, &machine_current->specdrum, sizeof( specdrum_info ) );
+  ptr += sizeof( specdrum_info );
+
+  memcpy( ptr, RAM, save->ram_pages * 0x4000 );
+  ptr += save->ram_pages * 0x4000;
+
+  event_foreach( copy_event, &ptr );
+
+  return 0;
+}
+
+int
+quicksave_load( const quicksave_t *save )
+{
+  const libspectrum_byte *ptr;
+  size_t i;
+
+  if( !save->arena || save->machine != machine_current->machine ||
+      save->generation != quicksave_generation || !quicksave_supported() )
+    return 1;
+
+  ptr = save->arena;
+
+  for( i = 0; regions && i < regions->len; i++ ) {
+    quicksave_region_t *region =
+      &g_array_index( regions, quicksave_region_t, i );
+    memcpy( region->state, ptr, region->length ); ptr += region->length;
+  }
+
+  memcpy( &machine_current->ram, ptr, sizeof( spectrum_raminfo ) );
+  ptr += sizeof( spectrum_raminfo );
+  memcpy( &machine_current->ay, ptr, sizeof( ayinfo ) );
+  ptr += sizeof( ayinfo );
+  memcpy( &machine_current->specdrum, ptr, sizeof( specdrum_info ) );
+  ptr += sizeof( specdrum_info );
+
+  memcpy( RAM, ptr, save->ram_pages * 0x4000 );
+  ptr += save->ram_pages * 0x4000;
+
+  event_reset();
+  for( i = 0; i < save->events; i++ ) {
+    event_t event;
+    memcpy( &event, ptr, sizeof( event_t ) ); ptr += sizeof( event_t );
+    event_add_with_data( event.tstates, event.type, event.user_data );
+  }
+
+  display_refresh_all();
+
+  return 0;
+}
+
+void
+quicksave_end( void )
+{
+  if( regions ) {
+    g_array_free( regions, TRUE );
+    regions = NULL;
+  }
+  regions_length = 0;
+}
+
+int
+quicksave_unittest( void )
+{
+  quicksave_t *save;
+  regpair pc = z80.pc, de = z80.de;
+  libspectrum_byte byte = RAM[2][0x1234];
+  libspectrum_dword now = tstates;
+  int r = 0;
+
+  save = quicksave_alloc();
+
+  if( quicksave_save( save ) ) {
+    /* Not supported with this machine's peripherals; nothing to test */
+    quicksave_free( save );
+    return 0;
+  }
+
+  z80.pc.w = 0x1234; z80.de.w = 0xbeef;
+  RAM[2][0x1234] = ~byte;
+  tstates += 100;
+  event_add( tstates + 1000, event_type_null );
+
+  if( quicksave_load( save ) ) {
+    printf( "%s:%d: quicksave_load failed\n", __FILE__, __LINE__ );
+    r++;
+  }
+
+  if( z80.pc.w != pc.w || z80.de.w != de.w || RAM[2][0x1234] != byte ||
+      tstates != now ) {
+    printf( "%s:%d: state not restored\n", __FILE__, __LINE__ );
+    r++;
+  }
+
+  quicksave_invalidate();
+  if( !quicksave_load( save ) ) {
+    printf( "%s:%d: quicksave_load succeeded after reset\n",
+	    __FILE__, __LINE__ );
+    r++;
+  }
+
+  quicksave_free( save );
+
+  return r;
+}
@@ -0,0 +1,53 @@
+/* quicksave.h: Fast in-process save and restore of the machine state
+   Copyright (c) 2015 Philip Kendall
+
+   $Id$
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+#ifndef FUSE_QUICKSAVE_H
+#define FUSE_QUICKSAVE_H
+
+#include <stddef.h>
+
+typedef struct quicksave_t quicksave_t;
+
+/* Add a block of raw state to what is quicksaved; for use by modules
+   from their init functions */
+void quicksave_register( void *state, size_t length );
+
+/* Note that the machine has been reset, invalidating all quicksaves */
+void quicksave_invalidate( void );
+
+quicksave_t* quicksave_alloc( void );
+void quicksave_free( quicksave_t *save );
+
+/* Both of these return non-zero if the state can't be quicksaved or
+   restored, in which case the snapshot_copy_[to|from]() path should be
+   used instead */
+int quicksave_save( quicksave_t *save );
+int quicksave_load( const quicksave_t *save );
+
+void quicksave_end( void );
+
+int quicksave_unittest( void );
+
+#endif				/* #ifndef FUSE_QUICKSAVE_H */
@@ -114,8 +114,11 @@ static int playback_frame( void );
 static int counter_reset( void );
 static void rzx_sentinel( libspectrum_dword ts, int type,
 			  void *user_data );
+static void budget_schedule( void );
+static void rzx_budget( libspectrum_dword ts, int type, void *user_data );
 
 static int sentinel_event;
+static int budget_event;
 
 void
 rzx_init( void )
@@ -126,6 +129,7 @@ rzx_init( void )
   rzx_in_allocated = 0;
 
   sentinel_event = event_register( rzx_sentinel, "RZX sentinel" );
+  budget_event = event_register( rzx_budget, "RZX instruction budget" );
 
   end_event = debugger_event_register( event_type_string, end_event_detail_string );
 }
@@ -275,7 +279,7 @@ int rzx_start_playback( const char *filename, int check_snapshot )
 
   rzx = libspectrum_rzx_alloc();
 
-  error = utils_read_file( filename, &file );
+  error = utils_map_file( filename, &file );
   if( error ) return error;
 
   libspec_error = libspectrum_rzx_read( rzx, file.buffer, file.length );
@@ -358,6 +362,7 @@ start_playback( libspectrum_rzx *rzx )
   rzx_instruction_count = libspectrum_rzx_instructions( rzx );
   rzx_playback = 1;
   counter_reset();
+  budget_schedule();
 
   ui_menu_activate( UI_MENU_ITEM_RECORDING, 1 );
   ui_menu_activate( UI_MENU_ITEM_RECORDING_ROLLBACK, 0 );
@@ -376,6 +381,7 @@ int rzx_stop_playback( int add_interrupt )
   ui_menu_activate( UI_MENU_ITEM_RECORDING_ROLLBACK, 0 );
 
   event_remove_type( sentinel_event );
+  event_remove_type( budget_event );
 
   /* We've now finished with the RZX file, so add an end of frame
      event if we've been requested to do so; we don't if we just run
@@ -450,7 +456,7 @@ rzx_continue_recording( const char *filename )
   /* Store the filename */
   rzx_filename = utils_safe_strdup( filename );
 
-  error = utils_read_file( filename, &file );
+  error = utils_map_file( filename, &file );
   if( error ) return error;
 
   rzx = libspectrum_rzx_alloc();
@@ -491,7 +497,7 @@ rzx_finalise_recording( const char *filename )
 
   if( rzx_recording || rzx_playback ) return 1;
 
-  error = utils_read_file( filename, &file );
+  error = utils_map_file( filename, &file );
   if( error ) return error;
 
   rzx = libspectrum_rzx_alloc();
@@ -708,6 +714,7 @@ static int playback_frame( void )
      continue */
   rzx_instruction_count = libspectrum_rzx_instructions( rzx );
   counter_reset();
+  budget_schedule();
 
   return 0;
 }
@@ -857,4 +864,37 @@ rzx_sentinel( libspectrum_dword ts GCC_UNUSED, int type GCC_UNUSED,
   /* Add another sentinel event in case this frame continues a lot more after
      this */
   event_add( RZX_SENTINEL_TIME, sentinel_event );
+
+  /* The budget event has just been moved further away */
+  budget_schedule();
+}
+
+/* The end of a playback frame comes after a number of instructions, not
+   at a known time, so can't just be an event; but every instruction
+   (that is, every M1 cycle) takes at least four tstates, so the frame
+   can't end until at least four tstates per instruction still left in
+   it have gone by. Checking only then, and again after the same
+   calculation until nothing is left, saves the core from checking the
+   count after every opcode */
+static void
+budget_schedule( void )
+{
+  size_t done = R + rzx_instructions_offset, left;
+
+  left = done < rzx_instruction_count ? rzx_instruction_count - done : 0;
+
+  event_remove_type( budget_event );
+  event_add( tstates + 4 * left, budget_event );
+}
+
+static void
+rzx_budget( libspectrum_dword ts GCC_UNUSED, int type GCC_UNUSED,
+            void *user_data GCC_UNUSED )
+{
+  /* If we're due an end of frame, generate one */
+  if( R + rzx_instructions_offset >= rzx_instruction_count ) {
+    event_add( tstates, spectrum_frame_event );
+  } else {
+    budget_schedule();
+  }
 }
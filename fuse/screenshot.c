@@ -384,7 +384,7 @@ screenshot_scr_read( const char *filename )
   int i;
   utils_file screen;
 
-  error =  utils_read_file( filename, &screen );
+  error = utils_map_file( filename, &screen );
   if( error ) return error;
 
   switch( screen.length ) {
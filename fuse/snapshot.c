@@ -42,7 +42,7 @@ int snapshot_read( const char *filename )
   libspectrum_snap *snap = libspectrum_snap_alloc();
   int error;
 
-  error = utils_read_file( filename, &file );
+  error = utils_map_file( filename, &file );
   if( error ) { libspectrum_snap_free( snap ); return error; }
 
   error = libspectrum_snap_read( snap, file.buffer, file.length,
@@ -34,8 +34,10 @@
 #include "machine.h"
 #include "movie.h"
 #include "options.h"
+#include "peripherals/ay.h"
 #include "settings.h"
 #include "sound.h"
+#include "stems.h"
 #include "tape.h"
 #include "ui/ui.h"
 #include "sound/blipbuffer.h"
@@ -44,6 +46,7 @@
 
 /* configuration */
 int sound_enabled = 0;		/* Are we currently using the sound card */
+int sound_silent = 0;		/* Generate sound without a sound card? */
 
 static int sound_enabled_ever = 0; /* whether sound has *ever* been in use; see
 				      sound_ay_write() and sound_ay_reset() */
@@ -69,22 +72,40 @@ static int sound_channels;
 
 static unsigned int ay_tone_levels[16];
 
-static unsigned int ay_tone_tick[3], ay_tone_high[3], ay_noise_tick;
-static unsigned int ay_tone_cycles, ay_env_cycles;
-static unsigned int ay_env_internal_tick, ay_env_tick;
-static unsigned int ay_tone_period[3], ay_noise_period, ay_env_period;
-
-/* Local copy of the AY registers */
-static libspectrum_byte sound_ay_registers[16];
-
 struct ay_change_tag
 {
   libspectrum_dword tstates;
   unsigned char reg, val;
 };
 
-static struct ay_change_tag ay_change[ AY_CHANGE_MAX ];
-static int ay_change_count;
+/* Everything about one AY chip: its generators, the writes made to it
+   during this frame and the synths for its channels. All the chips'
+   synths write into the same buffers, so they are mixed together there */
+struct ay_chip_tag
+{
+  /* Local copy of the AY registers */
+  libspectrum_byte registers[16];
+
+  unsigned int tone_tick[3], tone_high[3], noise_tick;
+  unsigned int env_internal_tick, env_tick;
+  unsigned int tone_period[3], noise_period, env_period;
+
+  /* Noise generator and envelope state */
+  int rng, noise_toggle;
+  int env_first, env_rev, env_counter;
+
+  struct ay_change_tag change[ AY_CHANGE_MAX ];
+  int change_count;
+
+  /* Channels A, B and C, and for stereo the right hand side of the
+     middle one */
+  Blip_Synth *synth[3], *synth_r[3];
+
+  /* And when recording stems, the synths for each channel's own stem */
+  Blip_Synth *stem[3];
+};
+
+static struct ay_chip_tag ay_chips[ AY_CHIPS_MAX ];
 
 Blip_Buffer *left_buf = NULL;
 Blip_Buffer *right_buf = NULL;
@@ -92,11 +113,17 @@ blip_sample_t *samples = NULL;
 
 Blip_Synth *left_beeper_synth = NULL, *right_beeper_synth = NULL;
 
-Blip_Synth *ay_a_synth = NULL, *ay_b_synth = NULL, *ay_c_synth = NULL;
-Blip_Synth *ay_a_synth_r = NULL, *ay_b_synth_r = NULL, *ay_c_synth_r = NULL;
-
 Blip_Synth *left_specdrum_synth = NULL, *right_specdrum_synth = NULL;
 
+/* When recording stems, a buffer and synth for each stem. These run at
+   the stems sample rate against the emulated processor speed rather than
+   the effective one, so the stems are in emulated time whatever the
+   emulation speed */
+static Blip_Buffer *stem_buf[ STEMS_MAX ];
+static Blip_Synth *stem_synth[ STEMS_MAX ];
+static blip_sample_t *stem_samples = NULL;
+static int stem_framesiz;
+
 struct speaker_type_tag
 {
   int bass;
@@ -148,6 +175,43 @@ sound_init_blip( Blip_Buffer **buf, Blip_Synth **synth )
   return 1;
 }
 
+static void
+sound_stems_init( void )
+{
+  libspectrum_dword processor_speed =
+    machine_current->timings.processor_speed;
+  int g, i;
+
+  for( i = 0; i < stems_channels; i++ ) {
+    stem_buf[i] = new_Blip_Buffer();
+    blip_buffer_set_clock_rate( stem_buf[i], processor_speed );
+    if( blip_buffer_set_sample_rate( stem_buf[i], stems_rate, 1000 ) ) {
+      sound_end();
+      ui_error( UI_ERROR_ERROR, "out of memory at %s:%d", __FILE__, __LINE__ );
+      return;
+    }
+
+    /* No treble cut, and unit volume so the stems add up to the mix
+       before the volume controls are applied */
+    stem_synth[i] = new_Blip_Synth();
+    blip_synth_set_volume( stem_synth[i], 1.0 );
+    blip_synth_set_output( stem_synth[i], stem_buf[i] );
+    blip_synth_set_treble_eq( stem_synth[i], 0.0 );
+  }
+
+  for( i = 0; i < AY_CHIPS_MAX; i++ )
+    for( g = 0; g < 3; g++ )
+      if( STEMS_AY + 3 * i + g < stems_channels )
+        ay_chips[i].stem[g] = stem_synth[ STEMS_AY + 3 * i + g ];
+
+  stem_framesiz = (float)stems_rate *
+    machine_current->timings.tstates_per_frame / processor_speed;
+  stem_framesiz++;
+
+  stem_samples = libspectrum_new0( blip_sample_t,
+                                   stem_framesiz * stems_channels );
+}
+
 static void
 sound_ay_init( void )
 {
@@ -162,19 +226,26 @@ sound_ay_init( void )
     0x2B4C, 0x43C1, 0x5A4B, 0x732F,
     0x9204, 0xAFF1, 0xD921, 0xFFFF
   };
-  int f;
+  int f, i;
 
   /* scale the values down to fit */
   for( f = 0; f < 16; f++ )
     ay_tone_levels[f] = ( levels[f] * AMPL_AY_TONE + 0x8000 ) / 0xffff;
 
-  ay_noise_tick = ay_noise_period = 0;
-  ay_env_internal_tick = ay_env_tick = ay_env_period = 0;
-  ay_tone_cycles = ay_env_cycles = 0;
-  for( f = 0; f < 3; f++ )
-    ay_tone_tick[f] = ay_tone_high[f] = 0, ay_tone_period[f] = 1;
+  for( i = 0; i < AY_CHIPS_MAX; i++ ) {
+    struct ay_chip_tag *chip = &ay_chips[i];
+
+    chip->noise_tick = chip->noise_period = 0;
+    chip->env_internal_tick = chip->env_tick = chip->env_period = 0;
+    for( f = 0; f < 3; f++ )
+      chip->tone_tick[f] = chip->tone_high[f] = 0, chip->tone_period[f] = 1;
 
-  ay_change_count = 0;
+    chip->rng = 1;
+    chip->noise_toggle = 0;
+    chip->env_first = 1; chip->env_rev = 0; chip->env_counter = 15;
+
+    chip->change_count = 0;
+  }
 }
 
 void
@@ -182,16 +253,15 @@ sound_init( const char *device )
 {
   float hz;
   double treble;
-  Blip_Synth **ay_left_synth;
-  Blip_Synth **ay_mid_synth;
-  Blip_Synth **ay_mid_synth_r;
-  Blip_Synth **ay_right_synth;
+  int left, mid, right;
+  int g, i;
 
   /* Allow sound as long as emulation speed is greater than 2%
      (less than that and a single Speccy frame generates more
      than a seconds worth of sound which is bigger than the
      maximum Blip_Buffer of 1 second) */
-  if( !( !sound_enabled && settings_current.sound &&
+  if( !( !sound_enabled &&
+         ( settings_current.sound || sound_silent || stems_recording ) &&
          settings_current.emulation_speed > 1 ) )
     return;
 
@@ -210,17 +280,14 @@ sound_init( const char *device )
 
   treble = speaker_type[ option_enumerate_sound_speaker_type() ].treble;
 
-  ay_a_synth = new_Blip_Synth();
-  blip_synth_set_volume( ay_a_synth, sound_get_volume( settings_current.volume_ay) );
-  blip_synth_set_treble_eq( ay_a_synth, treble );
-
-  ay_b_synth = new_Blip_Synth();
-  blip_synth_set_volume( ay_b_synth, sound_get_volume( settings_current.volume_ay) );
-  blip_synth_set_treble_eq( ay_b_synth, treble );
-
-  ay_c_synth = new_Blip_Synth();
-  blip_synth_set_volume( ay_c_synth, sound_get_volume( settings_current.volume_ay) );
-  blip_synth_set_treble_eq( ay_c_synth, treble );
+  for( i = 0; i < AY_CHIPS_MAX; i++ ) {
+    for( g = 0; g < 3; g++ ) {
+      ay_chips[i].synth[g] = new_Blip_Synth();
+      blip_synth_set_volume( ay_chips[i].synth[g],
+                             sound_get_volume( settings_current.volume_ay ) );
+      blip_synth_set_treble_eq( ay_chips[i].synth[g], treble );
+    }
+  }
 
   left_specdrum_synth = new_Blip_Synth();
   blip_synth_set_volume( left_specdrum_synth, sound_get_volume( settings_current.volume_specdrum ) );
@@ -233,46 +300,44 @@ sound_init( const char *device )
    * rather than using the real ones).
    */
 
-  ay_a_synth_r = NULL;
-  ay_b_synth_r = NULL;
-  ay_c_synth_r = NULL;
+  for( i = 0; i < AY_CHIPS_MAX; i++ )
+    for( g = 0; g < 3; g++ )
+      ay_chips[i].synth_r[g] = NULL;
 
   if( sound_stereo_ay != SOUND_STEREO_AY_NONE ) {
     /* Attach the Blip_Synth's we've already created as appropriate, and
      * create one more Blip_Synth for the middle channel's right buffer. */
     if( sound_stereo_ay == SOUND_STEREO_AY_ACB ) {
-      ay_left_synth = &ay_a_synth;
-      ay_mid_synth = &ay_c_synth;
-      ay_mid_synth_r = &ay_c_synth_r;
-      ay_right_synth = &ay_b_synth;
+      left = 0; mid = 2; right = 1;
     } else if ( sound_stereo_ay == SOUND_STEREO_AY_ABC ) {
-      ay_left_synth = &ay_a_synth;
-      ay_mid_synth = &ay_b_synth;
-      ay_mid_synth_r = &ay_b_synth_r;
-      ay_right_synth = &ay_c_synth;
+      left = 0; mid = 1; right = 2;
     } else {
       ui_error( UI_ERROR_ERROR, "unknown AY stereo separation type: %d", sound_stereo_ay );
       fuse_abort();
     }
 
-    blip_synth_set_output( *ay_left_synth, left_buf );
-    blip_synth_set_output( *ay_mid_synth, left_buf );
-    blip_synth_set_output( *ay_right_synth, right_buf );
+    for( i = 0; i < AY_CHIPS_MAX; i++ ) {
+      struct ay_chip_tag *chip = &ay_chips[i];
 
-    *ay_mid_synth_r = new_Blip_Synth();
-    blip_synth_set_volume( *ay_mid_synth_r,
-                           sound_get_volume( settings_current.volume_ay ) );
-    blip_synth_set_output( *ay_mid_synth_r, right_buf );
-    blip_synth_set_treble_eq( *ay_mid_synth_r, treble );
+      blip_synth_set_output( chip->synth[ left ], left_buf );
+      blip_synth_set_output( chip->synth[ mid ], left_buf );
+      blip_synth_set_output( chip->synth[ right ], right_buf );
+
+      chip->synth_r[ mid ] = new_Blip_Synth();
+      blip_synth_set_volume( chip->synth_r[ mid ],
+                             sound_get_volume( settings_current.volume_ay ) );
+      blip_synth_set_output( chip->synth_r[ mid ], right_buf );
+      blip_synth_set_treble_eq( chip->synth_r[ mid ], treble );
+    }
 
     right_specdrum_synth = new_Blip_Synth();
     blip_synth_set_volume( right_specdrum_synth, sound_get_volume( settings_current.volume_specdrum ) );
     blip_synth_set_output( right_specdrum_synth, right_buf );
     blip_synth_set_treble_eq( right_specdrum_synth, treble );
   } else {
-    blip_synth_set_output( ay_a_synth, left_buf );
-    blip_synth_set_output( ay_b_synth, left_buf );
-    blip_synth_set_output( ay_c_synth, left_buf );
+    for( i = 0; i < AY_CHIPS_MAX; i++ )
+      for( g = 0; g < 3; g++ )
+        blip_synth_set_output( ay_chips[i].synth[g], left_buf );
   }
 
   sound_enabled = sound_enabled_ever = 1;
@@ -293,6 +358,8 @@ sound_init( const char *device )
   /* initialize movie settings... */
   movie_init_sound( settings_current.sound_freq, sound_stereo_ay );
 
+  if( stems_recording ) sound_stems_init();
+
 }
 
 void
@@ -315,16 +382,18 @@ sound_unpause( void )
 void
 sound_end( void )
 {
+  int g, i;
+
   if( sound_enabled ) {
     delete_Blip_Synth( &left_beeper_synth );
     delete_Blip_Synth( &right_beeper_synth );
 
-    delete_Blip_Synth( &ay_a_synth );
-    delete_Blip_Synth( &ay_b_synth );
-    delete_Blip_Synth( &ay_c_synth );
-    delete_Blip_Synth( &ay_a_synth_r );
-    delete_Blip_Synth( &ay_b_synth_r );
-    delete_Blip_Synth( &ay_c_synth_r );
+    for( i = 0; i < AY_CHIPS_MAX; i++ ) {
+      for( g = 0; g < 3; g++ ) {
+        delete_Blip_Synth( &ay_chips[i].synth[g] );
+        delete_Blip_Synth( &ay_chips[i].synth_r[g] );
+      }
+    }
 
     delete_Blip_Synth( &left_specdrum_synth );
     delete_Blip_Synth( &right_specdrum_synth );
@@ -332,6 +401,18 @@ sound_end( void )
     delete_Blip_Buffer( &left_buf );
     delete_Blip_Buffer( &right_buf );
 
+    for( i = 0; i < AY_CHIPS_MAX; i++ )
+      for( g = 0; g < 3; g++ )
+        ay_chips[i].stem[g] = NULL;
+
+    for( i = 0; i < STEMS_MAX; i++ ) {
+      delete_Blip_Synth( &stem_synth[i] );
+      delete_Blip_Buffer( &stem_buf[i] );
+    }
+
+    libspectrum_free( stem_samples );
+    stem_samples = NULL;
+
     if( settings_current.sound ) 
       sound_lowlevel_end();
     libspectrum_free( samples );
@@ -340,19 +421,20 @@ sound_end( void )
 }
 
 static inline void
-ay_do_tone( int level, unsigned int tone_count, int *var, int chan )
+ay_do_tone( struct ay_chip_tag *chip, int level, unsigned int tone_count,
+            int *var, int chan )
 {
   *var = 0;
 
-  ay_tone_tick[ chan ] += tone_count;
+  chip->tone_tick[ chan ] += tone_count;
 
-  if( ay_tone_tick[ chan ] >= ay_tone_period[ chan ] ) {
-    ay_tone_tick[ chan ] -= ay_tone_period[ chan ];
-    ay_tone_high[ chan ] = !ay_tone_high[ chan ];
+  if( chip->tone_tick[ chan ] >= chip->tone_period[ chan ] ) {
+    chip->tone_tick[ chan ] -= chip->tone_period[ chan ];
+    chip->tone_high[ chan ] = !chip->tone_high[ chan ];
   }
 
   if( level ) {
-    if( ay_tone_high[ chan ] )
+    if( chip->tone_high[ chan ] )
       *var = level;
     else {
       *var = -level;
@@ -369,7 +451,7 @@ ay_do_tone( int level, unsigned int tone_count, int *var, int chan )
    * returned DC offset, so for now we just ignore the high
    * frequency wave and hope it's a sample
    */
-  if( ay_tone_period[ chan ] == 1 ) {
+  if( chip->tone_period[ chan ] == 1 ) {
       *var = -level;
   }
 }
@@ -387,34 +469,219 @@ ay_do_tone( int level, unsigned int tone_count, int *var, int chan )
    master clock by 2 to drive the AY */
 #define AY_CLOCK_RATIO 2
 
+/* The generators are updated in steps of AY_CLOCK_DIVISOR AY cycles;
+   in each step the tone counters are incremented twice and the noise
+   and envelope counters once */
+#define AY_STEP_TSTATES ( AY_CLOCK_DIVISOR * AY_CLOCK_RATIO )
+
+/* Advance tone generator 'chan' by 'steps' steps */
 static void
-sound_ay_overlay( void )
+ay_tone_advance( struct ay_chip_tag *chip, int chan, libspectrum_dword steps )
+{
+  unsigned int period = chip->tone_period[ chan ], tick = chip->tone_tick[ chan ];
+
+  if( period <= 2 ) {
+
+    /* The output flips on every step */
+    tick += steps * ( 2 - period );
+    if( steps & 1 ) chip->tone_high[ chan ] = !chip->tone_high[ chan ];
+
+  } else {
+
+    /* The counter can be past the period just after the period has been
+       reduced; it only comes back down by one period per step */
+    while( steps && tick >= period ) {
+      tick += 2 - period;
+      chip->tone_high[ chan ] = !chip->tone_high[ chan ];
+      steps--;
+    }
+
+    tick += 2 * steps;
+    if( ( tick / period ) & 1 ) chip->tone_high[ chan ] = !chip->tone_high[ chan ];
+    tick %= period;
+
+  }
+
+  chip->tone_tick[ chan ] = tick;
+}
+
+/* One clock of the noise RNG */
+static void
+ay_noise_step( struct ay_chip_tag *chip )
+{
+  if( ( chip->rng & 1 ) ^ ( ( chip->rng & 2 ) ? 1 : 0 ) )
+    chip->noise_toggle = !chip->noise_toggle;
+
+  /* rng is 17-bit shift reg, bit 0 is output.
+   * input is bit 0 xor bit 3.
+   */
+  if( chip->rng & 1 ) {
+    chip->rng ^= 0x24000;
+  }
+  chip->rng >>= 1;
+}
+
+static void
+ay_noise_advance( struct ay_chip_tag *chip, libspectrum_dword steps )
+{
+  libspectrum_dword clocks;
+
+  chip->noise_tick += steps;
+
+  /* a zero period clocks the RNG once per step */
+  if( chip->noise_period ) {
+    clocks = chip->noise_tick / chip->noise_period;
+    chip->noise_tick %= chip->noise_period;
+  } else {
+    clocks = steps;
+  }
+
+  while( clocks-- ) ay_noise_step( chip );
+}
+
+/* One envelope period has passed */
+static void
+ay_env_step( struct ay_chip_tag *chip, int envshape )
+{
+  /* do a 1/16th-of-period incr/decr if needed */
+  if( chip->env_first ||
+      ( ( envshape & AY_ENV_CONT ) && !( envshape & AY_ENV_HOLD ) ) ) {
+    if( chip->env_rev )
+      chip->env_counter -= ( envshape & AY_ENV_ATTACK ) ? 1 : -1;
+    else
+      chip->env_counter += ( envshape & AY_ENV_ATTACK ) ? 1 : -1;
+    if( chip->env_counter < 0 )
+      chip->env_counter = 0;
+    if( chip->env_counter > 15 )
+      chip->env_counter = 15;
+  }
+
+  chip->env_internal_tick++;
+  while( chip->env_internal_tick >= 16 ) {
+    chip->env_internal_tick -= 16;
+
+    /* end of cycle */
+    if( !( envshape & AY_ENV_CONT ) )
+      chip->env_counter = 0;
+    else {
+      if( envshape & AY_ENV_HOLD ) {
+        if( chip->env_first && ( envshape & AY_ENV_ALT ) )
+          chip->env_counter = ( chip->env_counter ? 0 : 15 );
+      } else {
+        /* non-hold */
+        if( envshape & AY_ENV_ALT )
+          chip->env_rev = !chip->env_rev;
+        else
+          chip->env_counter = ( envshape & AY_ENV_ATTACK ) ? 0 : 15;
+      }
+    }
+
+    chip->env_first = 0;
+  }
+}
+
+static void
+ay_env_advance( struct ay_chip_tag *chip, libspectrum_dword steps )
+{
+  int envshape = chip->registers[13];
+  libspectrum_dword periods;
+
+  chip->env_tick += steps;
+
+  /* a zero period means one envelope step per step */
+  if( chip->env_period ) {
+    periods = chip->env_tick / chip->env_period;
+    chip->env_tick %= chip->env_period;
+  } else {
+    periods = steps;
+  }
+
+  while( periods-- ) ay_env_step( chip, envshape );
+}
+
+/* Once the envelope has finished its first cycle, these shapes just
+   hold their last level */
+static int
+ay_env_frozen( struct ay_chip_tag *chip )
+{
+  int envshape = chip->registers[13];
+
+  return !chip->env_first &&
+         ( !( envshape & AY_ENV_CONT ) || ( envshape & AY_ENV_HOLD ) );
+}
+
+/* How many steps after the one just done can go by without any
+   channel's output changing: until the next register change or the end
+   of the frame, and until the next flip of an audible tone, or the
+   next clock of the noise or envelope generators if they are heard.
+   Silent channels and ones at a fixed level with neither tone nor noise
+   add nothing to wait for, other than the envelope if they use it */
+static libspectrum_dword
+ay_quiet_steps( struct ay_chip_tag *chip, libspectrum_dword f,
+                libspectrum_dword limit,
+                const int *tone_level, int mixer, int env_level,
+                int noise_toggle )
+{
+  libspectrum_dword steps = ( limit - 1 - f ) / AY_STEP_TSTATES, wait;
+  int noise = 0, envelope = 0, g;
+
+  for( g = 0; g < 3; g++ ) {
+    if( chip->registers[ 8 + g ] & 16 ) envelope = 1;
+    if( !tone_level[g] ) continue;
+
+    if( !( mixer & ( 0x08 << g ) ) ) noise = 1;
+
+    /* Flips of a period 1 tone aren't heard; see ay_do_tone() */
+    if( !( mixer & ( 1 << g ) ) && chip->tone_period[g] > 1 ) {
+      wait = chip->tone_tick[g] >= chip->tone_period[g] ? 1 :
+             ( chip->tone_period[g] - chip->tone_tick[g] + 1 ) / 2;
+      if( wait - 1 < steps ) steps = wait - 1;
+    }
+  }
+
+  /* Noise and envelope changes are heard in the step after the one
+     which clocks them, so any made by the step just done come next */
+  if( noise ) {
+    if( chip->noise_toggle != noise_toggle ) return 0;
+    wait = chip->noise_tick < chip->noise_period ?
+           chip->noise_period - chip->noise_tick : 1;
+    if( wait < steps ) steps = wait;
+  }
+
+  if( envelope ) {
+    if( ay_tone_levels[ chip->env_counter ] != env_level ) return 0;
+    if( !ay_env_frozen( chip ) ) {
+      wait = chip->env_tick < chip->env_period ? chip->env_period - chip->env_tick : 1;
+      if( wait < steps ) steps = wait;
+    }
+  }
+
+  return steps;
+}
+
+/* Generate one chip's output for the frame. Rather than running every
+   step of the generators, the state is advanced in one go over stretches
+   in which none of the channels' output can change, so the output is
+   only worked out where it might change */
+static void
+ay_chip_overlay( struct ay_chip_tag *chip )
 {
-  static int rng = 1;
-  static int noise_toggle = 0;
-  static int env_first = 1, env_rev = 0, env_counter = 15;
   int tone_level[3];
-  int mixer, envshape;
+  int mixer, env_level, noise_toggle;
   int g, level;
-  libspectrum_dword f;
-  struct ay_change_tag *change_ptr = ay_change;
-  int changes_left = ay_change_count;
+  libspectrum_dword f, frame_length, limit, quiet;
+  struct ay_change_tag *change_ptr = chip->change;
+  int changes_left = chip->change_count;
   int reg, r;
   int chan1, chan2, chan3;
   int last_chan1 = 0, last_chan2 = 0, last_chan3 = 0;
-  unsigned int tone_count, noise_count;
 
-  /* If no AY chip, don't produce any AY sound (!) */
-  if( !( periph_is_active( PERIPH_TYPE_FULLER) ||
-         periph_is_active( PERIPH_TYPE_MELODIK ) ||
-         machine_current->capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_AY ) )
-    return;
+  frame_length = machine_current->timings.tstates_per_frame;
 
-  for( f = 0; f < machine_current->timings.tstates_per_frame;
-       f+= AY_CLOCK_DIVISOR * AY_CLOCK_RATIO ) {
+  for( f = 0; f < frame_length; f += ( quiet + 1 ) * AY_STEP_TSTATES ) {
     /* update ay registers. */
     while( changes_left && f >= change_ptr->tstates ) {
-      sound_ay_registers[ reg = change_ptr->reg ] = change_ptr->val;
+      chip->registers[ reg = change_ptr->reg ] = change_ptr->val;
       change_ptr++;
       changes_left--;
 
@@ -423,97 +690,47 @@ sound_ay_overlay( void )
       case 0: case 1: case 2: case 3: case 4: case 5:
         r = reg >> 1;
         /* a zero-len period is the same as 1 */
-        ay_tone_period[r] = ( sound_ay_registers[ reg & ~1 ] |
-                              ( sound_ay_registers[ reg | 1 ] & 15 ) << 8 );
-        if( !ay_tone_period[r] )
-          ay_tone_period[r]++;
+        chip->tone_period[r] = ( chip->registers[ reg & ~1 ] |
+                              ( chip->registers[ reg | 1 ] & 15 ) << 8 );
+        if( !chip->tone_period[r] )
+          chip->tone_period[r]++;
 
         /* important to get this right, otherwise e.g. Ghouls 'n' Ghosts
          * has really scratchy, horrible-sounding vibrato.
          */
-        if( ay_tone_tick[r] >= ay_tone_period[r] * 2 )
-          ay_tone_tick[r] %= ay_tone_period[r] * 2;
+        if( chip->tone_tick[r] >= chip->tone_period[r] * 2 )
+          chip->tone_tick[r] %= chip->tone_period[r] * 2;
         break;
       case 6:
-        ay_noise_tick = 0;
-        ay_noise_period = ( sound_ay_registers[ reg ] & 31 );
+        chip->noise_tick = 0;
+        chip->noise_period = ( chip->registers[ reg ] & 31 );
         break;
       case 11: case 12:
-        ay_env_period =
-          sound_ay_registers[11] | ( sound_ay_registers[12] << 8 );
+        chip->env_period =
+          chip->registers[11] | ( chip->registers[12] << 8 );
         break;
       case 13:
-        ay_env_internal_tick = ay_env_tick = ay_env_cycles = 0;
-        env_first = 1;
-        env_rev = 0;
-        env_counter = ( sound_ay_registers[13] & AY_ENV_ATTACK ) ? 0 : 15;
+        chip->env_internal_tick = chip->env_tick = 0;
+        chip->env_first = 1;
+        chip->env_rev = 0;
+        chip->env_counter = ( chip->registers[13] & AY_ENV_ATTACK ) ? 0 : 15;
         break;
       }
     }
 
     /* the tone level if no enveloping is being used */
     for( g = 0; g < 3; g++ )
-      tone_level[g] = ay_tone_levels[ sound_ay_registers[ 8 + g ] & 15 ];
+      tone_level[g] = ay_tone_levels[ chip->registers[ 8 + g ] & 15 ];
 
     /* envelope */
-    envshape = sound_ay_registers[13];
-    level = ay_tone_levels[ env_counter ];
+    env_level = ay_tone_levels[ chip->env_counter ];
 
     for( g = 0; g < 3; g++ )
-      if( sound_ay_registers[ 8 + g ] & 16 )
-        tone_level[g] = level;
+      if( chip->registers[ 8 + g ] & 16 )
+        tone_level[g] = env_level;
 
     /* envelope output counter gets incr'd every 16 AY cycles. */
-    ay_env_cycles += AY_CLOCK_DIVISOR;
-    noise_count = 0;
-    while( ay_env_cycles >= 16 ) {
-      ay_env_cycles -= 16;
-      noise_count++;
-      ay_env_tick++;
-      while( ay_env_tick >= ay_env_period ) {
-        ay_env_tick -= ay_env_period;
-
-        /* do a 1/16th-of-period incr/decr if needed */
-        if( env_first ||
-            ( ( envshape & AY_ENV_CONT ) && !( envshape & AY_ENV_HOLD ) ) ) {
-          if( env_rev )
-            env_counter -= ( envshape & AY_ENV_ATTACK ) ? 1 : -1;
-          else
-            env_counter += ( envshape & AY_ENV_ATTACK ) ? 1 : -1;
-          if( env_counter < 0 )
-            env_counter = 0;
-          if( env_counter > 15 )
-            env_counter = 15;
-        }
-
-        ay_env_internal_tick++;
-        while( ay_env_internal_tick >= 16 ) {
-          ay_env_internal_tick -= 16;
-
-          /* end of cycle */
-          if( !( envshape & AY_ENV_CONT ) )
-            env_counter = 0;
-          else {
-            if( envshape & AY_ENV_HOLD ) {
-              if( env_first && ( envshape & AY_ENV_ALT ) )
-                env_counter = ( env_counter ? 0 : 15 );
-            } else {
-              /* non-hold */
-              if( envshape & AY_ENV_ALT )
-                env_rev = !env_rev;
-              else
-                env_counter = ( envshape & AY_ENV_ATTACK ) ? 0 : 15;
-            }
-          }
-
-          env_first = 0;
-        }
-
-        /* don't keep trying if period is zero */
-        if( !ay_env_period )
-          break;
-      }
-    }
+    ay_env_advance( chip, 1 );
 
     /* generate tone+noise... or neither.
      * (if no tone/noise is selected, the chip just shoves the
@@ -523,83 +740,96 @@ sound_ay_overlay( void )
     chan1 = tone_level[0];
     chan2 = tone_level[1];
     chan3 = tone_level[2];
-    mixer = sound_ay_registers[7];
-
-    ay_tone_cycles += AY_CLOCK_DIVISOR;
-    tone_count = ay_tone_cycles >> 3;
-    ay_tone_cycles &= 7;
+    mixer = chip->registers[7];
 
     if( ( mixer & 1 ) == 0 ) {
       level = chan1;
-      ay_do_tone( level, tone_count, &chan1, 0 );
+      ay_do_tone( chip, level, 2, &chan1, 0 );
     }
-    if( ( mixer & 0x08 ) == 0 && noise_toggle )
+    if( ( mixer & 0x08 ) == 0 && chip->noise_toggle )
       chan1 = 0;
 
     if( ( mixer & 2 ) == 0 ) {
       level = chan2;
-      ay_do_tone( level, tone_count, &chan2, 1 );
+      ay_do_tone( chip, level, 2, &chan2, 1 );
     }
-    if( ( mixer & 0x10 ) == 0 && noise_toggle )
+    if( ( mixer & 0x10 ) == 0 && chip->noise_toggle )
       chan2 = 0;
 
     if( ( mixer & 4 ) == 0 ) {
       level = chan3;
-      ay_do_tone( level, tone_count, &chan3, 2 );
+      ay_do_tone( chip, level, 2, &chan3, 2 );
     }
-    if( ( mixer & 0x20 ) == 0 && noise_toggle )
+    if( ( mixer & 0x20 ) == 0 && chip->noise_toggle )
       chan3 = 0;
 
     if( last_chan1 != chan1 ) {
-      blip_synth_update( ay_a_synth, f, chan1 );
-      if( ay_a_synth_r ) blip_synth_update( ay_a_synth_r, f, chan1 );
+      blip_synth_update( chip->synth[0], f, chan1 );
+      if( chip->synth_r[0] ) blip_synth_update( chip->synth_r[0], f, chan1 );
+      if( chip->stem[0] ) blip_synth_update( chip->stem[0], f, chan1 );
       last_chan1 = chan1;
     }
     if( last_chan2 != chan2 ) {
-      blip_synth_update( ay_b_synth, f, chan2 );
-      if( ay_b_synth_r ) blip_synth_update( ay_b_synth_r, f, chan2 );
+      blip_synth_update( chip->synth[1], f, chan2 );
+      if( chip->synth_r[1] ) blip_synth_update( chip->synth_r[1], f, chan2 );
+      if( chip->stem[1] ) blip_synth_update( chip->stem[1], f, chan2 );
       last_chan2 = chan2;
     }
     if( last_chan3 != chan3 ) {
-      blip_synth_update( ay_c_synth, f, chan3 );
-      if( ay_c_synth_r ) blip_synth_update( ay_c_synth_r, f, chan3 );
+      blip_synth_update( chip->synth[2], f, chan3 );
+      if( chip->synth_r[2] ) blip_synth_update( chip->synth_r[2], f, chan3 );
+      if( chip->stem[2] ) blip_synth_update( chip->stem[2], f, chan3 );
       last_chan3 = chan3;
     }
 
     /* update noise RNG/filter */
-    ay_noise_tick += noise_count;
-    while( ay_noise_tick >= ay_noise_period ) {
-      ay_noise_tick -= ay_noise_period;
-
-      if( ( rng & 1 ) ^ ( ( rng & 2 ) ? 1 : 0 ) )
-        noise_toggle = !noise_toggle;
-
-      /* rng is 17-bit shift reg, bit 0 is output.
-       * input is bit 0 xor bit 3.
-       */
-      if( rng & 1 ) {
-        rng ^= 0x24000;
-      }
-      rng >>= 1;
-
-      /* don't keep trying if period is zero */
-      if( !ay_noise_period )
-        break;
+    noise_toggle = chip->noise_toggle;
+    ay_noise_advance( chip, 1 );
+
+    /* Skip ahead to the next step where the output might change */
+    limit = changes_left && change_ptr->tstates < frame_length ?
+            change_ptr->tstates : frame_length;
+    quiet = ay_quiet_steps( chip, f, limit, tone_level, mixer,
+                            env_level, noise_toggle );
+    if( quiet ) {
+      for( g = 0; g < 3; g++ )
+        if( !( mixer & ( 1 << g ) ) ) ay_tone_advance( chip, g, quiet );
+      ay_env_advance( chip, quiet );
+      ay_noise_advance( chip, quiet );
     }
   }
 }
 
+static void
+sound_ay_overlay( void )
+{
+  int i;
+
+  /* If no AY chip, don't produce any AY sound (!) */
+  if( !( periph_is_active( PERIPH_TYPE_FULLER) ||
+         periph_is_active( PERIPH_TYPE_MELODIK ) ||
+         machine_current->capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_AY ) )
+    return;
+
+  /* Chips which aren't in use have never been written to, so are silent
+     and take next to no time */
+  for( i = 0; i < AY_CHIPS_MAX; i++ )
+    ay_chip_overlay( &ay_chips[i] );
+}
+
 /* don't make the change immediately; record it for later,
  * to be made by sound_frame() (via sound_ay_overlay()).
  */
 void
-sound_ay_write( int reg, int val, libspectrum_dword now )
+sound_ay_write( int chip, int reg, int val, libspectrum_dword now )
 {
-  if( ay_change_count < AY_CHANGE_MAX ) {
-    ay_change[ ay_change_count ].tstates = now;
-    ay_change[ ay_change_count ].reg = ( reg & 15 );
-    ay_change[ ay_change_count ].val = val;
-    ay_change_count++;
+  struct ay_chip_tag *ay = &ay_chips[ chip ];
+
+  if( ay->change_count < AY_CHANGE_MAX ) {
+    ay->change[ ay->change_count ].tstates = now;
+    ay->change[ ay->change_count ].reg = ( reg & 15 );
+    ay->change[ ay->change_count ].val = val;
+    ay->change_count++;
   }
 }
 
@@ -609,17 +839,14 @@ sound_ay_write( int reg, int val, libspectrum_dword now )
 void
 sound_ay_reset( void )
 {
-  int f;
+  int f, i;
 
   /* recalculate timings based on new machines ay clock */
   sound_ay_init();
 
-  ay_change_count = 0;
-  for( f = 0; f < 16; f++ )
-    sound_ay_write( f, 0, 0 );
-  for( f = 0; f < 3; f++ )
-    ay_tone_high[f] = 0;
-  ay_tone_cycles = ay_env_cycles = 0;
+  for( i = 0; i < AY_CHIPS_MAX; i++ )
+    for( f = 0; f < 16; f++ )
+      sound_ay_write( i, f, 0, 0 );
 }
 
 /*
@@ -634,14 +861,36 @@ sound_specdrum_write( libspectrum_word port GCC_UNUSED, libspectrum_byte val )
     if( right_specdrum_synth ) {
       blip_synth_update( right_specdrum_synth, tstates, ( val - 128) * 128);
     }
+    if( stem_synth[ STEMS_SPECDRUM ] )
+      blip_synth_update( stem_synth[ STEMS_SPECDRUM ], tstates,
+                         ( val - 128 ) * 128 );
     machine_current->specdrum.specdrum_dac = val - 128;
   }
 }
 
+/* Write this frame's samples for each stem */
+static void
+sound_stems_frame( void )
+{
+  long count = 0;
+  int i;
+
+  for( i = 0; i < stems_channels; i++ ) {
+    blip_buffer_end_frame( stem_buf[i],
+                           machine_current->timings.tstates_per_frame );
+    count = blip_buffer_read_samples( stem_buf[i],
+                                      stem_samples + i * stem_framesiz,
+                                      stem_framesiz, 0 );
+  }
+
+  stems_write( stem_samples, stem_framesiz, count );
+}
+
 void
 sound_frame( void )
 {
   long count;
+  int i;
 
   if( !sound_enabled )
     return;
@@ -649,6 +898,8 @@ sound_frame( void )
   /* overlay AY sound */
   sound_ay_overlay();
 
+  if( stem_samples ) sound_stems_frame();
+
   blip_buffer_end_frame( left_buf, machine_current->timings.tstates_per_frame );
 
   if( sound_stereo_ay != SOUND_STEREO_AY_NONE ) {
@@ -668,7 +919,8 @@ sound_frame( void )
 
   if( movie_recording )
       movie_add_sound( samples, count );
-  ay_change_count = 0;
+  for( i = 0; i < AY_CHIPS_MAX; i++ )
+    ay_chips[i].change_count = 0;
 }
 
 void
@@ -694,4 +946,12 @@ sound_beeper( int on )
   blip_synth_update( left_beeper_synth, tstates, val );
   if( sound_stereo_ay != SOUND_STEREO_AY_NONE )
     blip_synth_update( right_beeper_synth, tstates, val );
+
+  /* The two halves of the above, which add up to it */
+  if( stem_synth[ STEMS_BEEPER ] ) {
+    blip_synth_update( stem_synth[ STEMS_BEEPER ], tstates,
+                       on & 0x02 ? AMPL_BEEPER : -AMPL_BEEPER );
+    blip_synth_update( stem_synth[ STEMS_TAPE ], tstates,
+                       on & 0x01 ? AMPL_TAPE : -AMPL_TAPE );
+  }
 }
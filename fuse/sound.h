@@ -32,7 +32,7 @@ void sound_init( const char *device );
 void sound_pause( void );
 void sound_unpause( void );
 void sound_end( void );
-void sound_ay_write( int reg, int val, libspectrum_dword now );
+void sound_ay_write( int chip, int reg, int val, libspectrum_dword now );
 void sound_ay_reset( void );
 void sound_specdrum_write( libspectrum_word port, libspectrum_byte val );
 void sound_frame( void );
@@ -42,6 +42,10 @@ libspectrum_dword sound_get_effective_processor_speed( void );
 extern int sound_enabled;
 extern int sound_framesiz;
 
+/* Generate sound even with sound output turned off, as the benchmarks
+   do */
+extern int sound_silent;
+
 /* Stereo separation types:
  *  * ACB is used in the Melodik interface.
  *  * ABC stereo is used in the Pentagon/Scorpion.
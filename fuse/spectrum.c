@@ -27,6 +27,7 @@
 
 #include <libspectrum.h>
 
+#include "benchmark.h"
 #include "compat.h"
 #include "debugger/debugger.h"
 #include "display.h"
@@ -36,8 +37,10 @@
 #include "machine.h"
 #include "memory.h"
 #include "peripherals/printer.h"
+#include "peripherals/speccyboot.h"
 #include "psg.h"
 #include "profile.h"
+#include "quicksave.h"
 #include "rzx.h"
 #include "settings.h"
 #include "sound.h"
@@ -86,6 +89,9 @@ spectrum_init( void )
 {
   spectrum_frame_event = event_register( spectrum_frame_event_fn,
 					 "End of frame" );
+
+  quicksave_register( &tstates, sizeof( tstates ) );
+  quicksave_register( &spectrum_last_ula, sizeof( spectrum_last_ula ) );
 }
 
 int
@@ -105,11 +111,15 @@ spectrum_frame( void )
   if( z80.interrupts_enabled_at >= 0 )
     z80.interrupts_enabled_at -= frame_length;
 
+  if( benchmark_active ) benchmark_switch( BENCHMARK_SOUND );
   if( sound_enabled ) sound_frame();
 
+  if( benchmark_active ) benchmark_switch( BENCHMARK_DISPLAY );
   if( display_frame() ) return 1;
+  if( benchmark_active ) benchmark_switch( BENCHMARK_EVENTS );
   if( profile_active ) profile_frame( frame_length );
   printer_frame();
+  speccyboot_frame( frame_length );
 
   /* Add an interrupt unless they're being generated by .rzx playback */
   if( !rzx_playback )
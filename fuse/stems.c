@@ -0,0 +1,210 @@
+/* stems.c: recording each sound source to its own channel of a WAV file
+   Copyright (c) 2015 Philip Kendall
+
+   $Id$
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+
+#include "fuse.h"
+#include "settings.h"
+#include "stems.h"
+#include "ui/ui.h"
+#include "writer.h"
+
+/* Are we currently recording stems? */
+int stems_recording;
+
+int stems_channels;
+int stems_rate;
+
+static FILE *stems_file;
+
+/* How many bytes of samples we've written */
+static libspectrum_dword stems_data_length;
+
+/* The samples are written out on a separate thread where possible */
+static writer_t stems_writer;
+
+static int write_header( void );
+static int write_samples( const libspectrum_byte *data, size_t length,
+                          void *user_data );
+
+void
+stems_init( void )
+{
+  /* start recording if the user requested... */
+  if( settings_current.stems_start ) {
+    /* The sound buffers for the stems are set up when sound starts */
+    fuse_emulation_pause();
+    if( !stems_start_recording( settings_current.stems_start ) )
+      ui_menu_activate( UI_MENU_ITEM_AUDIO_STEMS, 1 );
+    fuse_emulation_unpause();
+  }
+}
+
+/* The sound system must be restarted (as pausing the emulation does)
+   for this to take effect */
+int
+stems_start_recording( const char *filename )
+{
+  if( stems_recording ) return 1;
+
+  if( settings_current.stems_freq < 8000 ||
+      settings_current.stems_freq > 192000 ) {
+    ui_error( UI_ERROR_ERROR, "stems sample rate must be 8000 to 192000 Hz" );
+    return 1;
+  }
+
+  stems_file = fopen( filename, "wb" );
+  if( stems_file == NULL ) {
+    ui_error( UI_ERROR_ERROR, "unable to open stems file for writing" );
+    return 1;
+  }
+
+  stems_channels = STEMS_AY + 3 * ay_chip_count();
+  stems_rate = settings_current.stems_freq;
+  stems_data_length = 0;
+
+  /* The lengths are filled in when recording stops */
+  if( write_header() ) {
+    ui_error( UI_ERROR_ERROR, "unable to write stems file header" );
+    fclose( stems_file );
+    return 1;
+  }
+
+  writer_start( &stems_writer, write_samples, NULL );
+
+  stems_recording = 1;
+  return 0;
+}
+
+int
+stems_stop_recording( void )
+{
+  int error;
+
+  if( !stems_recording ) return 1;
+
+  stems_recording = 0;
+
+  /* Everything recorded so far must be out before the header is updated */
+  if( writer_stop( &stems_writer ) ) {
+    ui_error( UI_ERROR_ERROR, "error writing stems file" );
+    error = 1;
+  } else {
+    error = fseek( stems_file, 0, SEEK_SET ) || write_header();
+    if( error )
+      ui_error( UI_ERROR_ERROR, "unable to write stems file header" );
+  }
+
+  fclose( stems_file );
+
+  return error;
+}
+
+static void
+write_word( libspectrum_word w )
+{
+  putc( w & 0xff, stems_file );
+  putc( w >> 8, stems_file );
+}
+
+static void
+write_dword( libspectrum_dword d )
+{
+  write_word( d & 0xffff );
+  write_word( d >> 16 );
+}
+
+/* A canonical 16-bit PCM WAV header */
+static int
+write_header( void )
+{
+  fputs( "RIFF", stems_file );
+  write_dword( 36 + stems_data_length );
+  fputs( "WAVEfmt ", stems_file );
+  write_dword( 16 );
+  write_word( 1 );		/* PCM */
+  write_word( stems_channels );
+  write_dword( stems_rate );
+  write_dword( stems_rate * stems_channels * 2 );
+  write_word( stems_channels * 2 );
+  write_word( 16 );
+  fputs( "data", stems_file );
+  write_dword( stems_data_length );
+
+  return ferror( stems_file );
+}
+
+/* Called on the writer thread with a buffer of interleaved samples */
+static int
+write_samples( const libspectrum_byte *data, size_t length,
+               void *user_data GCC_UNUSED )
+{
+  return fwrite( data, 1, length, stems_file ) != length;
+}
+
+/* 'data' has 'count' samples for each channel in turn, with each
+   channel starting 'stride' samples after the previous one */
+int
+stems_write( const libspectrum_signed_word *data, size_t stride,
+             size_t count )
+{
+  libspectrum_byte *ptr;
+  libspectrum_word w;
+  size_t i;
+  int channel;
+
+  if( !stems_recording ) return 0;
+
+  /* An earlier frame couldn't be written */
+  if( writer_error( &stems_writer ) ) {
+    stems_stop_recording();
+    ui_menu_activate( UI_MENU_ITEM_AUDIO_STEMS, 0 );
+    return 1;
+  }
+
+  ptr = writer_reserve( &stems_writer, count * stems_channels * 2 );
+
+  for( i = 0; i < count; i++ )
+    for( channel = 0; channel < stems_channels; channel++ ) {
+      w = data[ channel * stride + i ];
+      *ptr++ = w & 0xff;
+      *ptr++ = w >> 8;
+    }
+
+  writer_submit( &stems_writer );
+
+  stems_data_length += count * stems_channels * 2;
+
+  return 0;
+}
+
+int
+stems_end( void )
+{
+  if( stems_recording ) return stems_stop_recording();
+  return 0;
+}
@@ -0,0 +1,59 @@
+/* stems.h: recording each sound source to its own channel of a WAV file
+   Copyright (c) 2015 Philip Kendall
+
+   $Id$
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+#ifndef FUSE_STEMS_H
+#define FUSE_STEMS_H
+
+#include <libspectrum.h>
+
+#include "peripherals/ay.h"
+
+/* The channels in a stems recording; the AY channels are A, B and C of
+   the first chip, then of the second chip and so on */
+#define STEMS_BEEPER   0
+#define STEMS_TAPE     1
+#define STEMS_SPECDRUM 2
+#define STEMS_AY       3
+
+#define STEMS_MAX ( STEMS_AY + 3 * AY_CHIPS_MAX )
+
+/* Are we currently recording stems? */
+extern int stems_recording;
+
+/* How many channels and at what sample rate */
+extern int stems_channels;
+extern int stems_rate;
+
+void stems_init( void );
+
+int stems_start_recording( const char *filename );
+int stems_stop_recording( void );
+
+int stems_write( const libspectrum_signed_word *data, size_t stride,
+                 size_t count );
+
+int stems_end( void );
+
+#endif			/* #ifndef FUSE_STEMS_H */
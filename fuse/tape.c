@@ -123,7 +123,7 @@ int tape_open( const char *filename, int autoload )
   utils_file file;
   int error;
 
-  error = utils_read_file( filename, &file );
+  error = utils_map_file( filename, &file );
   if( error ) return error;
 
   error = tape_read_buffer( file.buffer, file.length, LIBSPECTRUM_ID_UNKNOWN,
@@ -604,6 +604,10 @@ static const struct menu_item_entries menu_item_lookup[] = {
     "/File/AY Logging/Stop",
     "/File/AY Logging/Record...", 1, },
 
+  { UI_MENU_ITEM_AUDIO_STEMS,
+    "/File/Audio Stems/Stop",
+    "/File/Audio Stems/Record...", 1, },
+
   { UI_MENU_ITEM_TAPE_RECORDING,
     "/Media/Tape/Record Stop",
     "/Media/Tape/Record Start", 1,
@@ -289,6 +289,7 @@ gtkui_make_menu(GtkAccelGroup **accel_group,
 
   /* Start various menus in the 'off' state */
   ui_menu_activate( UI_MENU_ITEM_AY_LOGGING, 0 );
+  ui_menu_activate( UI_MENU_ITEM_AUDIO_STEMS, 0 );
   ui_menu_activate( UI_MENU_ITEM_FILE_MOVIE_RECORDING, 0 );
   ui_menu_activate( UI_MENU_ITEM_MACHINE_PROFILER, 0 );
   ui_menu_activate( UI_MENU_ITEM_RECORDING, 0 );
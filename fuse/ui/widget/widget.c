@@ -466,6 +466,7 @@ int widget_init( void )
   widget_numfiles = 0;
 
   ui_menu_activate( UI_MENU_ITEM_AY_LOGGING, 0 );
+  ui_menu_activate( UI_MENU_ITEM_AUDIO_STEMS, 0 );
   ui_menu_activate( UI_MENU_ITEM_FILE_MOVIE_RECORDING, 0 );
   ui_menu_activate( UI_MENU_ITEM_MACHINE_PROFILER, 0 );
   ui_menu_activate( UI_MENU_ITEM_RECORDING, 0 );
@@ -32,6 +32,7 @@
 
 #include "fuse.h"
 #include "options.h"
+#include "settings.h"
 #include "ui/ui.h"
 #include "ui/uimedia.h"
 #include "utils.h"
@@ -317,7 +318,8 @@ int
 ui_media_drive_insert( const ui_media_drive_info_t *drive,
                        const char *filename, int autoload )
 {
-  int error;
+  int error, merge;
+  char *other_side;
   const fdd_params_t *dt;
 
   /* Eject any disk already in the drive */
@@ -328,8 +330,16 @@ ui_media_drive_insert( const ui_media_drive_info_t *drive,
   }
 
   if( filename ) {
-    error = disk_open( &drive->fdd->disk, filename, 0,
-                       DISK_TRY_MERGE( drive->fdd->fdd_heads ) );
+    merge = DISK_TRY_MERGE( drive->fdd->fdd_heads );
+    if( merge && settings_current.disk_ask_merge ) {
+      other_side = disk_other_side( filename );
+      if( other_side ) {
+        merge = ui_query( "Try to merge 'B' side of this disk?" );
+        libspectrum_free( other_side );
+      }
+    }
+
+    error = disk_open( &drive->fdd->disk, filename, 0, merge );
     if( error != DISK_OK ) {
       ui_error( UI_ERROR_ERROR, "Failed to open disk image: %s",
                 disk_strerror( error ) );
@@ -25,12 +25,18 @@
 
 #include <config.h>
 
+#include <string.h>
+
 #include <libspectrum.h>
 
+#include "debugger/debugger.h"
+#include "event.h"
 #include "fuse.h"
 #include "machine.h"
+#include "memory.h"
 #include "mempool.h"
 #include "periph.h"
+#include "peripherals/ay.h"
 #include "peripherals/disk/beta.h"
 #include "peripherals/disk/disciple.h"
 #include "peripherals/disk/opus.h"
@@ -40,10 +46,15 @@
 #include "peripherals/ide/zxcf.h"
 #include "peripherals/if1.h"
 #include "peripherals/if2.h"
+#include "peripherals/nic/loopback.h"
 #include "peripherals/speccyboot.h"
 #include "peripherals/ula.h"
+#include "quicksave.h"
+#include "rzx.h"
 #include "settings.h"
+#include "snapshot.h"
 #include "unittests.h"
+#include "z80/z80.h"
 
 static int
 contention_test( void )
@@ -221,6 +232,479 @@ floating_bus_test( void )
   return error;
 }
 
+/* Run the core while halted from 'start' until an event at 'end' and
+   check it ends up in exactly the same state as doing each M1 cycle in
+   turn would */
+static int
+halt_test_one( libspectrum_word address, libspectrum_dword start,
+               libspectrum_dword end )
+{
+  processor expected;
+  libspectrum_dword expected_tstates = start;
+  int contended =
+    memory_map_read[ address >> MEMORY_PAGE_SIZE_LOGARITHM ].contended;
+  int even_m1 =
+    machine_current->capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_EVEN_M1;
+
+  z80.pc.w = address;
+  z80.halted = 1;
+  z80.iff1 = z80.iff2 = 0;
+  z80.r = 0x1234;
+  memcpy( &expected, &z80, sizeof( processor ) );
+
+  while( expected_tstates < end ) {
+    if( contended ) expected_tstates += ula_contention[ expected_tstates ];
+    expected_tstates += 4;
+    if( even_m1 && ( expected_tstates & 1 ) ) expected_tstates++;
+    expected.r++;
+  }
+
+  event_reset();
+  event_add( end, event_type_null );
+  tstates = start;
+
+  z80_do_opcodes();
+
+  if( tstates != expected_tstates ||
+      memcmp( &z80, &expected, sizeof( processor ) ) ) {
+    printf( "%s: halt test at 0x%04x from %u to %u: tstates = %u, R = %u; "
+            "expected %u, %u\n", fuse_progname, address, start, end, tstates,
+            z80.r, expected_tstates, expected.r );
+    return 1;
+  }
+
+  return 0;
+}
+
+static int
+halt_test( void )
+{
+  libspectrum_dword frame = machine_current->timings.tstates_per_frame;
+  int error = 0;
+
+  /* Both in and out of contended memory, through the screen and not */
+  error += halt_test_one( 0x8000, 0, frame );
+  error += halt_test_one( 0x8000, 1, 101 );
+  error += halt_test_one( 0x8000, 14000, 14002 );
+  error += halt_test_one( 0x6000, 0, frame );
+  error += halt_test_one( 0x6000, 14335, 20000 );
+  error += halt_test_one( 0x6000, 14336, 14337 );
+  error += halt_test_one( 0x6000, 30000, 30000 );
+
+  /* Put things back as they were */
+  z80.halted = 0;
+  machine_reset( 0 );
+
+  return error;
+}
+
+/* Fill the RAM from 0x4000 up with a pattern, put 'length' bytes of
+   'code' at 'address' and run it from there, with the other registers
+   from 'initial', until an event at 'end'. 'end' must be within the
+   contention table. The processor and, unless 'memory' is NULL, the RAM
+   are then returned as they were left */
+static void
+run_program( const libspectrum_byte *code, size_t length,
+             libspectrum_word address, const processor *initial,
+             libspectrum_dword end, processor *state,
+             libspectrum_dword *end_tstates, libspectrum_byte *memory )
+{
+  libspectrum_dword i;
+
+  for( i = 0x4000; i < 0x10000; i++ )
+    writebyte_internal( i, ( i * 7 ) & 0x7f );
+  for( i = 0; i < length; i++ )
+    writebyte_internal( address + i, code[i] );
+
+  memcpy( &z80, initial, sizeof( processor ) );
+  z80.pc.w = address; z80.sp.w = 0xff00;
+  z80.iff1 = z80.iff2 = 0; z80.halted = 0;
+
+  event_reset();
+  event_add( end, event_type_null );
+  tstates = 100;
+
+  while( tstates < end ) {
+    z80_do_opcodes();
+    event_do_events();
+  }
+
+  memcpy( state, &z80, sizeof( processor ) );
+  *end_tstates = tstates;
+  if( memory )
+    for( i = 0x4000; i < 0x10000; i++ )
+      memory[ i - 0x4000 ] = readbyte_internal( i );
+}
+
+/* The repeating block instructions, run with the debugger active (which
+   forces the core to go round the main loop for every iteration) and
+   not, must give exactly the same results */
+typedef struct block_test_t {
+  const char *name;
+  libspectrum_byte opcode;
+  libspectrum_word hl, de, bc;
+  libspectrum_byte a;
+} block_test_t;
+
+static const block_test_t block_tests[] = {
+  { "LDIR",             0xb0, 0x9000, 0xa000, 0x1000, 0x00 },
+  { "LDIR to screen",   0xb0, 0xc000, 0x4000, 0x1b00, 0x00 },
+  { "LDIR fill",        0xb0, 0x9000, 0x9001, 0x2000, 0x00 },
+  { "LDIR over itself", 0xb0, 0x8000, 0x7ff0, 0x0040, 0x00 },
+  { "LDDR",             0xb8, 0x9fff, 0xafff, 0x1000, 0x00 },
+  { "CPIR found",       0xb1, 0x9000, 0x0000, 0x1000, 0x3d },
+  { "CPIR not found",   0xb1, 0x9000, 0x0000, 0x1000, 0x80 },
+  { "CPDR",             0xb9, 0x9fff, 0x0000, 0x1000, 0x80 },
+};
+
+static int
+block_test( void )
+{
+  processor initial, slow, fast;
+  libspectrum_dword slow_tstates, fast_tstates;
+  libspectrum_dword ends[] = { 5000, 40000, 69000 };
+  libspectrum_byte *slow_memory, *fast_memory;
+  libspectrum_byte code[0x13] = { 0 };
+  size_t i, j;
+  int error = 0;
+
+  memcpy( &initial, &z80, sizeof( processor ) );
+  slow_memory = libspectrum_new( libspectrum_byte, 0xc000 );
+  fast_memory = libspectrum_new( libspectrum_byte, 0xc000 );
+
+  for( i = 0; i < ARRAY_SIZE( block_tests ); i++ ) {
+
+    /* The instruction followed by a HALT, and the same again 16 bytes
+       on, which "LDIR over itself" copies over the first */
+    code[0x00] = code[0x10] = 0xed;
+    code[0x01] = code[0x11] = block_tests[i].opcode;
+    code[0x02] = code[0x12] = 0x76;
+
+    initial.hl.w = block_tests[i].hl; initial.de.w = block_tests[i].de;
+    initial.bc.w = block_tests[i].bc;
+    initial.af.b.h = block_tests[i].a; initial.af.b.l = 0;
+
+    for( j = 0; j < ARRAY_SIZE( ends ); j++ ) {
+      debugger_mode = DEBUGGER_MODE_ACTIVE;
+      run_program( code, sizeof( code ), 0x8000, &initial, ends[j], &slow,
+                   &slow_tstates, slow_memory );
+      debugger_mode = DEBUGGER_MODE_INACTIVE;
+      run_program( code, sizeof( code ), 0x8000, &initial, ends[j], &fast,
+                   &fast_tstates, fast_memory );
+
+      if( fast_tstates != slow_tstates ||
+          memcmp( &fast, &slow, sizeof( processor ) ) ||
+          memcmp( fast_memory, slow_memory, 0xc000 ) ) {
+        printf( "%s: %s test to %u: tstates = %u, PC = 0x%04x, "
+                "BC = 0x%04x; expected %u, 0x%04x, 0x%04x\n",
+                fuse_progname, block_tests[i].name, ends[j], fast_tstates,
+                fast.pc.w, fast.bc.w, slow_tstates, slow.pc.w, slow.bc.w );
+        error = 1;
+      }
+    }
+  }
+
+  libspectrum_free( slow_memory );
+  libspectrum_free( fast_memory );
+
+  /* Put things back as they were */
+  machine_reset( 0 );
+
+  return error;
+}
+
+/* Loops waiting for something which can't happen without an event (the
+   RAM pattern has 0x48 at 23672 and 0x00 at 0x9000), and one which does
+   end by itself, each followed by a HALT; with idle loop
+   skipping on, the results must be exactly the same as without it. Each
+   is run from both contended and uncontended memory */
+typedef struct idle_loop_test_t {
+  const char *name;
+  libspectrum_byte code[6];
+  libspectrum_word hl, bc;
+  libspectrum_byte a;
+} idle_loop_test_t;
+
+static const idle_loop_test_t idle_loop_tests[] = {
+  { "LD A,(nn)", { 0x3a, 0x78, 0x5c, 0xb8, 0x28, 0xfa },
+    0x0000, 0x4800, 0x00 },			/* ld a,(23672); cp b; jr z */
+  { "BIT n,(HL)", { 0xcb, 0x46, 0x28, 0xfc, 0x76, 0x76 },
+    0x5c78, 0x0000, 0x00 },			/* bit 0,(hl); jr z */
+  { "LD A,(BC)", { 0x0a, 0xb7, 0x28, 0xfc, 0x76, 0x76 },
+    0x0000, 0x9000, 0x00 },			/* ld a,(bc); or a; jr z */
+  { "JR", { 0x18, 0xfe, 0x76, 0x76, 0x76, 0x76 },
+    0x0000, 0x0000, 0x00 },			/* jr $ */
+  { "Counting", { 0x3c, 0xb8, 0x20, 0xfc, 0x76, 0x76 },
+    0x0000, 0xe000, 0x00 },			/* inc a; cp b; jr nz */
+};
+
+static int
+idle_loop_test( void )
+{
+  processor initial, slow, fast;
+  libspectrum_dword slow_tstates, fast_tstates;
+  libspectrum_dword ends[] = { 5000, 40000, 69000 };
+  libspectrum_word addresses[] = { 0x6000, 0x8000 };
+  int skip_idle_loops = settings_current.skip_idle_loops;
+  size_t i, j, k;
+  int error = 0;
+
+  memcpy( &initial, &z80, sizeof( processor ) );
+
+  for( i = 0; i < ARRAY_SIZE( idle_loop_tests ); i++ ) {
+    const idle_loop_test_t *test = &idle_loop_tests[i];
+
+    initial.hl.w = test->hl; initial.bc.w = test->bc;
+    initial.af.b.h = test->a; initial.af.b.l = 0;
+
+    for( j = 0; j < ARRAY_SIZE( addresses ); j++ ) {
+      for( k = 0; k < ARRAY_SIZE( ends ); k++ ) {
+        settings_current.skip_idle_loops = 0;
+        run_program( test->code, ARRAY_SIZE( test->code ), addresses[j],
+                     &initial, ends[k], &slow, &slow_tstates, NULL );
+        settings_current.skip_idle_loops = 1;
+        run_program( test->code, ARRAY_SIZE( test->code ), addresses[j],
+                     &initial, ends[k], &fast, &fast_tstates, NULL );
+
+        if( fast_tstates != slow_tstates ||
+            memcmp( &fast, &slow, sizeof( processor ) ) ) {
+          printf( "%s: %s idle loop test at 0x%04x to %u: tstates = %u, "
+                  "PC = 0x%04x, R = %u; expected %u, 0x%04x, %u\n",
+                  fuse_progname, test->name, addresses[j],
+                  ends[k], fast_tstates, fast.pc.w, fast.r, slow_tstates,
+                  slow.pc.w, slow.r );
+          error = 1;
+        }
+      }
+    }
+  }
+
+  /* Put things back as they were */
+  settings_current.skip_idle_loops = skip_idle_loops;
+  machine_reset( 0 );
+
+  return error;
+}
+
+/* Memory reads and writes, stack accesses and I/O, each going to both a
+   contended and an uncontended address: RAM at 0x5800 and 0x9000 (which
+   swap over on every pass), the stack at 0x7000, the ULA's even port and
+   odd ports with both contended and uncontended high bytes */
+static const libspectrum_byte contention_code[] = {
+  0x31, 0x00, 0x70,		/* 8000:       ld sp,0x7000     */
+  0x21, 0x00, 0x58,		/* 8003:       ld hl,0x5800     */
+  0x11, 0x00, 0x90,		/* 8006:       ld de,0x9000     */
+  0x01, 0xff, 0x40,		/* 8009:       ld bc,0x40ff     */
+  0x7e,				/* 800c: loop: ld a,(hl)        */
+  0x12,				/* 800d:       ld (de),a        */
+  0x34,				/* 800e:       inc (hl)         */
+  0x1a,				/* 800f:       ld a,(de)        */
+  0x86,				/* 8010:       add a,(hl)       */
+  0x77,				/* 8011:       ld (hl),a        */
+  0xe5,				/* 8012:       push hl          */
+  0xd5,				/* 8013:       push de          */
+  0xe1,				/* 8014:       pop hl           */
+  0xd1,				/* 8015:       pop de           */
+  0xdb, 0xfe,			/* 8016:       in a,(0xfe)      */
+  0xd3, 0xff,			/* 8018:       out (0xff),a     */
+  0xed, 0x78,			/* 801a:       in a,(c)         */
+  0xed, 0x79,			/* 801c:       out (c),a        */
+  0x2c,				/* 801e:       inc l            */
+  0x1c,				/* 801f:       inc e            */
+  0x18, 0xea,			/* 8020:       jr loop          */
+};
+
+/* On a machine with no contention, the core built without the
+   contention checks must give exactly the same results as the full
+   core. Emptying the contention table makes this machine one of those;
+   on a machine which does have contention, the program must be slowed
+   down by the real table, or it isn't testing anything */
+static int
+contention_free_test( void )
+{
+  processor initial, contended, slow, fast;
+  libspectrum_dword contended_tstates, slow_tstates, fast_tstates;
+  libspectrum_dword ends[] = { 5000, 40000, 69000 };
+  libspectrum_byte *slow_memory, *fast_memory;
+  int contention_free = z80_contention_free;
+  size_t i;
+  int error = 0;
+
+  memcpy( &initial, &z80, sizeof( processor ) );
+  slow_memory = libspectrum_new( libspectrum_byte, 0xc000 );
+  fast_memory = libspectrum_new( libspectrum_byte, 0xc000 );
+
+  z80_contention_free = 0;
+  run_program( contention_code, ARRAY_SIZE( contention_code ), 0x8000,
+               &initial, ends[ ARRAY_SIZE( ends ) - 1 ], &contended,
+               &contended_tstates, NULL );
+
+  memset( ula_contention, 0, sizeof( ula_contention ) );
+  memset( ula_contention_no_mreq, 0, sizeof( ula_contention_no_mreq ) );
+
+  for( i = 0; i < ARRAY_SIZE( ends ); i++ ) {
+    z80_contention_free = 0;
+    run_program( contention_code, ARRAY_SIZE( contention_code ), 0x8000,
+                 &initial, ends[i], &slow, &slow_tstates, slow_memory );
+    z80_contention_free = 1;
+    run_program( contention_code, ARRAY_SIZE( contention_code ), 0x8000,
+                 &initial, ends[i], &fast, &fast_tstates, fast_memory );
+
+    if( fast_tstates != slow_tstates ||
+        memcmp( &fast, &slow, sizeof( processor ) ) ||
+        memcmp( fast_memory, slow_memory, 0xc000 ) ) {
+      printf( "%s: contention free test to %u: tstates = %u, PC = 0x%04x, "
+              "R = %u; expected %u, 0x%04x, %u\n", fuse_progname, ends[i],
+              fast_tstates, fast.pc.w, fast.r, slow_tstates, slow.pc.w,
+              slow.r );
+      error = 1;
+    }
+  }
+
+  if( !contention_free && contended.r == slow.r ) {
+    printf( "%s: contention free test: program not slowed by contention\n",
+            fuse_progname );
+    error = 1;
+  }
+
+  libspectrum_free( slow_memory );
+  libspectrum_free( fast_memory );
+
+  /* Put things back as they were, including the contention table */
+  z80_contention_free = contention_free;
+  machine_reset( 0 );
+
+  return error;
+}
+
+/* Playback of a recording of a few single instructions, a block copy
+   and a HALT: each frame must end at the first instruction boundary at
+   or after its count of instructions. The second number is the count it
+   actually ends at: one more than the first when that would be part way
+   through a LDIR iteration, which has two M1 cycles. The counts are all
+   different so the end of each frame can be seen */
+static const libspectrum_byte rzx_budget_code[] = {
+  0x21, 0x00, 0x90,		/* ld hl,0x9000 */
+  0x11, 0x00, 0xa0,		/* ld de,0xa000 */
+  0x01, 0x00, 0x04,		/* ld bc,0x0400 */
+  0xed, 0xb0,			/* ldir */
+  0x76,				/* halt */
+};
+
+static const size_t rzx_budget_frames[][2] = {
+  { 2, 2 }, { 1000, 1001 }, { 1002, 1002 }, { 10000, 10000 }, { 5, 5 },
+};
+
+static int
+rzx_budget_test( void )
+{
+  libspectrum_rzx *recording;
+  libspectrum_snap *snap;
+  libspectrum_byte *buffer = NULL;
+  size_t length = 0, frame = 0, i;
+  int error;
+
+  for( i = 0; i < ARRAY_SIZE( rzx_budget_code ); i++ )
+    writebyte_internal( 0x8000 + i, rzx_budget_code[i] );
+  z80.pc.w = 0x8000; z80.sp.w = 0xff00;
+  z80.iff1 = z80.iff2 = 0; z80.halted = 0;
+
+  recording = libspectrum_rzx_alloc();
+  snap = libspectrum_snap_alloc();
+  error = snapshot_copy_to( snap );
+  if( !error ) error = libspectrum_rzx_add_snap( recording, snap, 0 );
+  if( error ) {
+    libspectrum_snap_free( snap );
+    libspectrum_rzx_free( recording );
+    return error;
+  }
+
+  libspectrum_rzx_start_input( recording, 100 );
+  for( i = 0; i < ARRAY_SIZE( rzx_budget_frames ); i++ )
+    libspectrum_rzx_store_frame( recording, rzx_budget_frames[i][0], 0, NULL );
+
+  /* And one more so playback is still going after the last frame above */
+  libspectrum_rzx_store_frame( recording, 1, 0, NULL );
+  libspectrum_rzx_stop_input( recording );
+
+  error = libspectrum_rzx_write( &buffer, &length, recording,
+                                 LIBSPECTRUM_ID_UNKNOWN, fuse_creator, 0,
+                                 NULL );
+  libspectrum_rzx_free( recording );
+  if( error ) return error;
+
+  error = rzx_start_playback_from_buffer( buffer, length );
+  libspectrum_free( buffer );
+  if( error ) return error;
+
+  while( frame < ARRAY_SIZE( rzx_budget_frames ) ) {
+    size_t count = rzx_instruction_count, done;
+
+    z80_do_opcodes();
+    done = z80.r + rzx_instructions_offset;
+    event_do_events();
+
+    if( rzx_instruction_count == count ) continue;
+
+    if( done != rzx_budget_frames[ frame ][1] ) {
+      printf( "%s: RZX frame %lu of %lu instructions ended after %lu; "
+              "expected %lu\n", fuse_progname, (unsigned long)frame,
+              (unsigned long)rzx_budget_frames[ frame ][0],
+              (unsigned long)done,
+              (unsigned long)rzx_budget_frames[ frame ][1] );
+      error = 1;
+    }
+    frame++;
+  }
+
+  /* Put things back as they were */
+  rzx_stop_playback( 1 );
+  machine_reset( 0 );
+
+  return error;
+}
+
+/* Check that the TurboSound-style select values switch between chips,
+   and that each chip keeps its own registers */
+static int
+ay_chips_test( void )
+{
+  int old_chips = settings_current.ay_chips, attached, error = 0;
+  libspectrum_byte value[2];
+
+  if( !( machine_current->capabilities &
+         LIBSPECTRUM_MACHINE_CAPABILITY_AY ) ) return 0;
+
+  settings_current.ay_chips = 2;
+
+  ay_registerport_write( 0xfffd, 0xfe );
+  ay_registerport_write( 0xfffd, 8 );
+  ay_dataport_write( 0xbffd, 0x0a );
+
+  ay_registerport_write( 0xfffd, 0xff );
+  ay_registerport_write( 0xfffd, 8 );
+  ay_dataport_write( 0xbffd, 0x05 );
+
+  /* 0xfd would be a third chip, which isn't there */
+  ay_registerport_write( 0xfffd, 0xfd );
+  value[0] = ay_registerport_read( 0xfffd, &attached );
+
+  ay_registerport_write( 0xfffd, 0xfe );
+  value[1] = ay_registerport_read( 0xfffd, &attached );
+
+  if( value[0] != 0x05 || value[1] != 0x0a ||
+      machine_current->ay.registers[8] != 0x05 ) {
+    printf( "%s: AY chips read back 0x%02x and 0x%02x; expected 0x05 and "
+            "0x0a\n", fuse_progname, value[0], value[1] );
+    error = 1;
+  }
+
+  settings_current.ay_chips = old_chips;
+  machine_reset( 0 );
+
+  return error;
+}
+
 #define TEST_ASSERT(x) do { if( !(x) ) { printf("Test assertion failed at %s:%d: %s\n", __FILE__, __LINE__, #x ); return 1; } } while( 0 )
 
 static int
@@ -284,6 +768,41 @@ mempool_test( void )
   return 0;
 }
 
+static int
+pc_trap_test( void )
+{
+  static libspectrum_byte initial[ 0x10000 ];
+  int initial_active = periph_pc_traps_active;
+  int address;
+
+  /* DivIDE has traps for single addresses and for ranges, both before
+     and after the opcode fetch */
+  if( periph_is_active( PERIPH_TYPE_DIVIDE ) ) return 0;
+
+  memcpy( initial, periph_pc_traps, sizeof( initial ) );
+
+  periph_activate_type( PERIPH_TYPE_DIVIDE, 1 );
+
+  TEST_ASSERT( periph_pc_traps_active );
+  TEST_ASSERT( !( periph_pc_traps[ 0x3cff ] & PERIPH_PC_TRAP_EARLY ) );
+  for( address = 0x3d00; address < 0x3e00; address++ )
+    TEST_ASSERT( periph_pc_traps[ address ] & PERIPH_PC_TRAP_EARLY );
+  TEST_ASSERT( !( periph_pc_traps[ 0x3e00 ] & PERIPH_PC_TRAP_EARLY ) );
+
+  TEST_ASSERT( !( periph_pc_traps[ 0x1ff7 ] & PERIPH_PC_TRAP_LATE ) );
+  for( address = 0x1ff8; address < 0x2000; address++ )
+    TEST_ASSERT( periph_pc_traps[ address ] & PERIPH_PC_TRAP_LATE );
+  TEST_ASSERT( periph_pc_traps[ 0x0038 ] & PERIPH_PC_TRAP_LATE );
+  TEST_ASSERT( !( periph_pc_traps[ 0x0039 ] & PERIPH_PC_TRAP_LATE ) );
+
+  periph_activate_type( PERIPH_TYPE_DIVIDE, 0 );
+
+  TEST_ASSERT( periph_pc_traps_active == initial_active );
+  TEST_ASSERT( !memcmp( periph_pc_traps, initial, sizeof( initial ) ) );
+
+  return 0;
+}
+
 static int
 assert_page( libspectrum_word base, libspectrum_word length, int source, int page )
 {
@@ -748,8 +1267,17 @@ unittests_run( void )
 
   r += contention_test();
   r += floating_bus_test();
+  r += halt_test();
+  r += block_test();
+  r += idle_loop_test();
+  r += contention_free_test();
+  r += rzx_budget_test();
+  r += ay_chips_test();
   r += mempool_test();
+  r += pc_trap_test();
   r += paging_test();
+  r += quicksave_unittest();
+  r += nic_loopback_unittest();
 
   return r;
 }
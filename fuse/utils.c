@@ -74,8 +74,8 @@ utils_open_file( const char *filename, int autoload,
   if( rzx_playback  ) error = rzx_stop_playback( 1 );
   if( error ) return error;
 
-  /* Read the file into a buffer */
-  if( utils_read_file( filename, &file ) ) return 1;
+  /* Map the file into memory; nothing below writes to it */
+  if( utils_map_file( filename, &file ) ) return 1;
 
   /* See if we can work out what it is */
   if( libspectrum_identify_file_with_class( &type, &class, filename,
@@ -328,6 +328,7 @@ utils_read_fd( compat_fd fd, const char *filename, utils_file *file )
   if( file->length == -1 ) return 1;
 
   file->buffer = libspectrum_new( unsigned char, file->length );
+  file->mapped = 0;
 
   if( compat_file_read( fd, file ) ) {
     libspectrum_free( file->buffer );
@@ -345,10 +346,48 @@ utils_read_fd( compat_fd fd, const char *filename, utils_file *file )
   return 0;
 }
 
+/* As utils_read_file(), but map the file into memory rather than copying
+   it if possible. The buffer must not be written to */
+int
+utils_map_file( const char *filename, utils_file *file )
+{
+  compat_fd fd;
+
+  fd = compat_file_open( filename, 0 );
+  if( fd == COMPAT_FILE_OPEN_FAILED ) {
+    ui_error( UI_ERROR_ERROR, "couldn't open '%s': %s", filename,
+	      strerror( errno ) );
+    return 1;
+  }
+
+  file->length = compat_file_get_length( fd );
+  if( file->length == -1 ) {
+    compat_file_close( fd );
+    return 1;
+  }
+
+  if( compat_file_map( fd, file ) )
+    return utils_read_fd( fd, filename, file );
+
+  file->mapped = 1;
+
+  if( compat_file_close( fd ) ) {
+    ui_error( UI_ERROR_ERROR, "Couldn't close '%s': %s", filename,
+	      strerror( errno ) );
+    compat_file_unmap( file );
+    return 1;
+  }
+
+  return 0;
+}
+
 void
 utils_close_file( utils_file *file )
 {
-  libspectrum_free( file->buffer );
+  if( file->mapped )
+    compat_file_unmap( file );
+  else
+    libspectrum_free( file->buffer );
 }
 
 int utils_write_file( const char *filename, const unsigned char *buffer,
@@ -396,7 +435,7 @@ utils_make_temp_file( int *fd, char *tempfilename, const char *filename,
     return 1;
   }
 
-  error = utils_read_file( filename, &file );
+  error = utils_map_file( filename, &file );
   if( error ) { close( *fd ); unlink( tempfilename ); return error; }
 
   bytes_written = write( *fd, file.buffer, file.length );
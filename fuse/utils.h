@@ -34,6 +34,7 @@ typedef struct utils_file {
 
   unsigned char *buffer;
   size_t length;
+  int mapped;			/* buffer is a read-only mapping of the file */
 
 } utils_file;
 
@@ -45,6 +46,7 @@ int utils_read_auxiliary_file( const char *filename, utils_file *file,
 
 int utils_read_file( const char *filename, utils_file *file );
 int utils_read_fd( compat_fd fd, const char *filename, utils_file *file );
+int utils_map_file( const char *filename, utils_file *file );
 void utils_close_file( utils_file *file );
 
 int utils_write_file( const char *filename, const unsigned char *buffer,
@@ -0,0 +1,203 @@
+/* writer.c: handing buffers of data to a separate writer thread
+   Copyright (c) 2015 Philip Kendall
+
+   $Id$
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+#include <config.h>
+
+#include <string.h>
+
+#include "writer.h"
+
+/* Process one buffer, unless an earlier one failed */
+static void
+writer_process( writer_t *writer, const writer_buffer_t *buffer )
+{
+  int error;
+
+  if( writer->error ) return;
+
+  error = writer->process( buffer->data, buffer->length, writer->user_data );
+
+  if( error ) {
+#ifdef HAVE_PTHREAD
+    if( writer->running ) pthread_mutex_lock( &writer->lock );
+#endif				/* #ifdef HAVE_PTHREAD */
+    writer->error = error;
+#ifdef HAVE_PTHREAD
+    if( writer->running ) pthread_mutex_unlock( &writer->lock );
+#endif				/* #ifdef HAVE_PTHREAD */
+  }
+}
+
+#ifdef HAVE_PTHREAD
+static void*
+writer_thread( void *arg )
+{
+  writer_t *writer = arg;
+  writer_buffer_t *buffer;
+
+  while( 1 ) {
+    pthread_mutex_lock( &writer->lock );
+    while( !writer->count && !writer->exit )
+      pthread_cond_wait( &writer->filled, &writer->lock );
+    if( !writer->count ) {
+      pthread_mutex_unlock( &writer->lock );
+      break;
+    }
+    buffer = &writer->queue[ writer->tail ];
+    pthread_mutex_unlock( &writer->lock );
+
+    writer_process( writer, buffer );
+
+    pthread_mutex_lock( &writer->lock );
+    writer->tail = ( writer->tail + 1 ) % WRITER_QUEUE_LENGTH;
+    writer->count--;
+    pthread_cond_signal( &writer->drained );
+    pthread_mutex_unlock( &writer->lock );
+  }
+
+  return NULL;
+}
+#endif				/* #ifdef HAVE_PTHREAD */
+
+void
+writer_start( writer_t *writer, writer_process_fn process, void *user_data )
+{
+  memset( writer, 0, sizeof( *writer ) );
+  writer->process = process;
+  writer->user_data = user_data;
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_init( &writer->lock, NULL );
+  pthread_cond_init( &writer->filled, NULL );
+  pthread_cond_init( &writer->drained, NULL );
+
+  /* If we can't get a thread, just process everything as we go along */
+  writer->running =
+    !pthread_create( &writer->thread, NULL, writer_thread, writer );
+#endif				/* #ifdef HAVE_PTHREAD */
+}
+
+/* Add 'length' bytes to the end of the buffer being filled, and return
+   where they should go */
+void*
+writer_reserve( writer_t *writer, size_t length )
+{
+  writer_buffer_t *buffer = &writer->queue[ writer->head ];
+  libspectrum_byte *ptr;
+
+  if( buffer->length + length > buffer->allocated ) {
+    size_t new_size = buffer->allocated ? 2 * buffer->allocated : 65536;
+    while( new_size < buffer->length + length ) new_size *= 2;
+    buffer->data = libspectrum_renew( libspectrum_byte, buffer->data,
+                                      new_size );
+    buffer->allocated = new_size;
+  }
+
+  ptr = buffer->data + buffer->length;
+  buffer->length += length;
+
+  return ptr;
+}
+
+/* Hand the buffer being filled over to the writer */
+void
+writer_submit( writer_t *writer )
+{
+  if( !writer->queue[ writer->head ].length ) return;
+
+  writer->buffers++;
+
+  if( !writer->running ) {
+    writer_process( writer, &writer->queue[ writer->head ] );
+    writer->queue[ writer->head ].length = 0;
+    return;
+  }
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock( &writer->lock );
+  writer->count++;
+  if( writer->count > writer->max_depth ) writer->max_depth = writer->count;
+  pthread_cond_signal( &writer->filled );
+  if( writer->count == WRITER_QUEUE_LENGTH ) {
+    writer->stalls++;
+    while( writer->count == WRITER_QUEUE_LENGTH )
+      pthread_cond_wait( &writer->drained, &writer->lock );
+  }
+  pthread_mutex_unlock( &writer->lock );
+#endif				/* #ifdef HAVE_PTHREAD */
+
+  writer->head = ( writer->head + 1 ) % WRITER_QUEUE_LENGTH;
+  writer->queue[ writer->head ].length = 0;
+}
+
+/* Has processing any buffer failed so far? */
+int
+writer_error( writer_t *writer )
+{
+  int error;
+
+#ifdef HAVE_PTHREAD
+  if( writer->running ) pthread_mutex_lock( &writer->lock );
+#endif				/* #ifdef HAVE_PTHREAD */
+  error = writer->error;
+#ifdef HAVE_PTHREAD
+  if( writer->running ) pthread_mutex_unlock( &writer->lock );
+#endif				/* #ifdef HAVE_PTHREAD */
+
+  return error;
+}
+
+/* Wait for the writer to process every submitted buffer and finish;
+   returns the first error from processing any of them */
+int
+writer_stop( writer_t *writer )
+{
+  size_t i;
+
+  writer_submit( writer );
+
+#ifdef HAVE_PTHREAD
+  if( writer->running ) {
+    pthread_mutex_lock( &writer->lock );
+    writer->exit = 1;
+    pthread_cond_signal( &writer->filled );
+    pthread_mutex_unlock( &writer->lock );
+    pthread_join( writer->thread, NULL );
+    writer->running = 0;
+  }
+
+  pthread_cond_destroy( &writer->drained );
+  pthread_cond_destroy( &writer->filled );
+  pthread_mutex_destroy( &writer->lock );
+#endif				/* #ifdef HAVE_PTHREAD */
+
+  for( i = 0; i < WRITER_QUEUE_LENGTH; i++ ) {
+    libspectrum_free( writer->queue[i].data );
+    writer->queue[i].data = NULL;
+    writer->queue[i].length = writer->queue[i].allocated = 0;
+  }
+
+  return writer->error;
+}
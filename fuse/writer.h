@@ -0,0 +1,85 @@
+/* writer.h: handing buffers of data to a separate writer thread
+   Copyright (c) 2015 Philip Kendall
+
+   $Id$
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License along
+   with this program; if not, write to the Free Software Foundation, Inc.,
+   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+   Author contact information:
+
+   E-mail: philip-fuse@shadowmagic.org.uk
+
+*/
+
+#ifndef FUSE_WRITER_H
+#define FUSE_WRITER_H
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif				/* #ifdef HAVE_PTHREAD */
+
+#include <libspectrum.h>
+
+#define WRITER_QUEUE_LENGTH 16
+
+typedef struct writer_buffer_t {
+  libspectrum_byte *data;
+  size_t length, allocated;
+} writer_buffer_t;
+
+/* Called with each buffer in turn; non-zero means an error, after which
+   no more buffers are passed on */
+typedef int (*writer_process_fn)( const libspectrum_byte *data, size_t length,
+                                  void *user_data );
+
+/* The emulation thread fills the buffer at the head of the queue and hands
+   it over with writer_submit(); the writer thread processes buffers from
+   the tail. The queue is bounded: if the writer falls too far behind, the
+   emulation thread waits for it. Without POSIX threads, or if the thread
+   can't be started, each buffer is processed as it is submitted */
+typedef struct writer_t {
+
+  writer_process_fn process;
+  void *user_data;
+
+  writer_buffer_t queue[ WRITER_QUEUE_LENGTH ];
+  size_t head;			/* buffer being filled */
+  size_t tail;			/* next buffer to be processed */
+  size_t count;			/* buffers waiting to be processed */
+  int error;			/* the first error from process() */
+
+  /* Backpressure statistics */
+  int buffers;			/* buffers handed to the writer */
+  int stalls;			/* times the emulation had to wait */
+  size_t max_depth;		/* most buffers ever waiting */
+
+#ifdef HAVE_PTHREAD
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t filled, drained;
+  int exit;
+#endif				/* #ifdef HAVE_PTHREAD */
+  int running;
+
+} writer_t;
+
+void writer_start( writer_t *writer, writer_process_fn process,
+                   void *user_data );
+void* writer_reserve( writer_t *writer, size_t length );
+void writer_submit( writer_t *writer );
+int writer_error( writer_t *writer );
+int writer_stop( writer_t *writer );
+
+#endif			/* #ifndef FUSE_WRITER_H */
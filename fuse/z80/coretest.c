@@ -32,6 +32,7 @@
 
 #include "event.h"
 #include "module.h"
+#include "quicksave.h"
 #include "spectrum.h"
 #include "ui/ui.h"
 #include "z80.h"
@@ -382,7 +383,6 @@ tape_save_trap( void )
 
 scld scld_last_dec;
 
-size_t rzx_instruction_count;
 int rzx_playback;
 int rzx_instructions_offset;
 
@@ -422,7 +422,6 @@ slt_trap( libspectrum_word address GCC_UNUSED, libspectrum_byte level GCC_UNUSED
 
 int beta_available = 0;
 int beta_active = 0;
-int if1_available = 0;
 
 void
 beta_page( void )
@@ -444,77 +443,29 @@ event_register( event_fn_t fn GCC_UNUSED, const char *string GCC_UNUSED )
   return 0;
 }
 
-int opus_available = 0;
-int opus_active = 0;
+libspectrum_byte periph_pc_traps[ 0x10000 ];
+int periph_pc_traps_active = 0;
 
 void
-opus_page( void )
+periph_pc_trap_early( libspectrum_word pc GCC_UNUSED )
 {
   abort();
 }
 
 void
-opus_unpage( void )
-{
-  abort();
-}
-
-int plusd_available = 0;
-int plusd_active = 0;
-
-void
-plusd_page( void )
-{
-  abort();
-}
-
-int disciple_available = 0;
-int disciple_active = 0;
-
-void
-disciple_page( void )
-{
-  abort();
-}
-
-void
-if1_page( void )
-{
-  abort();
-}
-
-void
-if1_unpage( void )
-{
-  abort();
-}
-
-void
-divide_set_automap( int state GCC_UNUSED )
+periph_pc_trap_late( libspectrum_word pc GCC_UNUSED )
 {
   abort();
 }
 
 int spectranet_available = 0;
 
-void
-spectranet_page( void )
-{
-  abort();
-}
-
 void
 spectranet_nmi( void )
 {
   abort();
 }
 
-void
-spectranet_unpage( void )
-{
-  abort();
-}
-
 void
 spectranet_retn( void )
 {
@@ -551,17 +502,17 @@ module_register( module_info_t *module GCC_UNUSED )
   return 0;
 }
 
+void
+quicksave_register( void *state GCC_UNUSED, size_t length GCC_UNUSED )
+{
+  /* Do nothing */
+}
+
 fuse_machine_info *machine_current;
 static fuse_machine_info dummy_machine;
 
 settings_info settings_current;
 
-libspectrum_word beta_pc_mask;
-libspectrum_word beta_pc_value;
-
-int spectranet_programmable_trap_active;
-libspectrum_word spectranet_programmable_trap;
-
 /* Initialise the dummy variables such that we're running on a clean a
    machine as possible */
 static int
@@ -582,10 +533,6 @@ init_dummies( void )
   settings_current.slt_traps = 0;
   settings_current.divide_enabled = 0;
   settings_current.z80_is_cmos = 0;
-  beta_pc_mask = 0xfe00;
-  beta_pc_value = 0x3c00;
-  spectranet_programmable_trap_active = 0;
-  spectranet_programmable_trap = 0x0000;
 
   return 0;
 }
@@ -31,6 +31,7 @@
 #include "module.h"
 #include "peripherals/scld.h"
 #include "peripherals/spectranet.h"
+#include "quicksave.h"
 #include "rzx.h"
 #include "settings.h"
 #include "spectrum.h"
@@ -63,6 +64,9 @@ libspectrum_byte sz53p_table[0x100]; /* OR the above two tables together */
 /* This is what everything acts on! */
 processor z80;
 
+/* Set if the current machine has no memory contention at all */
+int z80_contention_free = 0;
+
 int z80_interrupt_event, z80_nmi_event, z80_halt_event, z80_nmos_iff2_event;
 
 static void z80_init_tables(void);
@@ -105,6 +109,8 @@ z80_init( void )
   z80_nmos_iff2_event = event_register( NULL, "IFF2 update dummy event" );
 
   module_register( &z80_module_info );
+
+  quicksave_register( &z80, sizeof( z80 ) );
 }
 
 /* Initalise the tables used to set flags */
@@ -63,10 +63,12 @@ int z80_interrupt( void );
 void z80_retn( void );
 
 void z80_do_opcodes(void);
+void z80_do_opcodes_uncontended( void );
 
 void z80_enable_interrupts( void );
 
 extern processor z80;
+extern int z80_contention_free;
 extern const libspectrum_byte halfcarry_add_table[];
 extern const libspectrum_byte halfcarry_sub_table[];
 extern const libspectrum_byte overflow_add_table[];
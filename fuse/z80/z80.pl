@@ -153,6 +153,7 @@ sub cpir_cpdr ($) {
     my( $opcode ) = @_;
 
     my $modifier = ( $opcode eq 'CPIR' ? '++' : '--' );
+    my $step = ( $opcode eq 'CPIR' ? 1 : -1 );
 
     print << "CODE";
       {
@@ -176,6 +177,9 @@ sub cpir_cpdr ($) {
 	  PC-=2;
 	}
 	HL$modifier;
+#ifndef CORETEST
+	if( ( F & ( FLAG_V | FLAG_Z ) ) == FLAG_V ) z80_cpxr_bulk( $step );
+#endif				/* #ifndef CORETEST */
       }
 CODE
 }
@@ -305,6 +309,7 @@ sub ldir_lddr ($) {
     my( $opcode ) = @_;
 
     my $modifier = ( $opcode eq 'LDIR' ? '++' : '--' );
+    my $step = ( $opcode eq 'LDIR' ? 1 : -1 );
 
     print << "CODE";
       {
@@ -322,6 +327,9 @@ sub ldir_lddr ($) {
 	  PC-=2;
 	}
         HL$modifier; DE$modifier;
+#ifndef CORETEST
+	if( BC ) z80_ldxr_bulk( $step );
+#endif				/* #ifndef CORETEST */
       }
 CODE
 }
@@ -697,6 +705,11 @@ sub opcode_JR (@) {
 
     if( !$condition ) {
 	print "      JR();\n";
+	print << "JR";
+#ifndef CORETEST
+      if( settings_current.skip_idle_loops ) z80_idle_loop( PC + 1 );
+#endif				/* #ifndef CORETEST */
+JR
     } else {
 	my $condition_string;
 	if( defined $not{$condition} ) {
@@ -707,6 +720,9 @@ sub opcode_JR (@) {
 	print << "JR";
       if( $condition_string ) {
         JR();
+#ifndef CORETEST
+        if( settings_current.skip_idle_loops ) z80_idle_loop( PC + 1 );
+#endif				/* #ifndef CORETEST */
       } else {
         contend_read( PC, 3 );
       }
@@ -105,6 +105,16 @@
 
 #ifndef CORETEST
 
+#ifdef Z80_UNCONTENDED
+
+/* The core used for machines with no contended memory at all */
+
+#define contend_read(address,time) tstates += (time);
+#define contend_read_no_mreq(address,time) tstates += (time);
+#define contend_write_no_mreq(address,time) tstates += (time);
+
+#else				/* #ifdef Z80_UNCONTENDED */
+
 #define contend_read(address,time) \
   if( memory_map_read[ (address) >> MEMORY_PAGE_SIZE_LOGARITHM ].contended ) \
     tstates += ula_contention[ tstates ]; \
@@ -120,6 +130,8 @@
     tstates += ula_contention_no_mreq[ tstates ]; \
   tstates += (time);
 
+#endif				/* #ifdef Z80_UNCONTENDED */
+
 #else				/* #ifndef CORETEST */
 
 void contend_read( libspectrum_word address, libspectrum_dword time );
@@ -26,6 +26,7 @@
 #include <config.h>
 
 #include <stdio.h>
+#include <string.h>
 
 #include "debugger/debugger.h"
 #include "event.h"
@@ -33,11 +34,7 @@
 #include "memory.h"
 #include "periph.h"
 #include "peripherals/disk/beta.h"
-#include "peripherals/disk/disciple.h"
 #include "peripherals/disk/opus.h"
-#include "peripherals/disk/plusd.h"
-#include "peripherals/ide/divide.h"
-#include "peripherals/if1.h"
 #include "peripherals/spectranet.h"
 #include "peripherals/ula.h"
 #include "profile.h"
@@ -58,15 +55,345 @@ static void z80_ddfdcbxx( libspectrum_byte opcode3,
 			  libspectrum_word tempaddr );
 #endif				/* #ifndef HAVE_ENOUGH_MEMORY */
 
-/* Certain features (eg RZX playback trigged interrupts, the debugger,
-   TR-DOS ROM paging) can't be handled within the normal 'events'
-   framework as they don't happen at a specified tstate. In order to
-   support these, we basically need to check every opcode as to
-   whether they have occurred or not.
+#ifndef CORETEST
+
+/* Once a repeating block instruction has gone round once, the checks at
+   the top of the main loop can't change anything until the next event:
+   PC stays the same and any paging they do has already been done. So
+   the remaining iterations can be done here, each exactly as it would be
+   by going back through the main loop (two M1 cycles, then the body of
+   the instruction), without the checks and the opcode dispatch.
+
+   Not done when the debugger is active (breakpoints can be hit on any
+   iteration), when profiling (which counts the instructions) or if a
+   peripheral traps the instruction's address */
+static int
+block_bulk_allowed( void )
+{
+  return debugger_mode == DEBUGGER_MODE_INACTIVE && !profile_active &&
+         !( periph_pc_traps_active && periph_pc_traps[ PC ] );
+}
+
+static void
+block_m1_cycles( libspectrum_word pc, int even_m1 )
+{
+  contend_read( pc, 4 );
+  if( even_m1 && ( tstates & 1 ) ) tstates++;
+  R++;
+  contend_read( (libspectrum_word)( pc + 1 ), 4 );
+  R++;
+}
+
+/* LDIR ('step' = 1) or LDDR ('step' = -1), with PC pointing at the
+   instruction again */
+static void
+z80_ldxr_bulk( int step )
+{
+  libspectrum_word pc = PC;
+  int even_m1 =
+    machine_current->capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_EVEN_M1;
+
+  if( !block_bulk_allowed() ) return;
+
+  while( BC && tstates < event_next_event ) {
+    libspectrum_byte bytetemp;
+    libspectrum_word de = DE;
+
+    block_m1_cycles( pc, even_m1 );
+
+    bytetemp = readbyte( HL );
+    writebyte( DE, bytetemp );
+    contend_write_no_mreq( DE, 1 ); contend_write_no_mreq( DE, 1 );
+    BC--;
+    if( BC ) {
+      contend_write_no_mreq( DE, 1 ); contend_write_no_mreq( DE, 1 );
+      contend_write_no_mreq( DE, 1 ); contend_write_no_mreq( DE, 1 );
+      contend_write_no_mreq( DE, 1 );
+    }
+    HL += step; DE += step;
+
+    bytetemp += A;
+    F = ( F & ( FLAG_C | FLAG_Z | FLAG_S ) ) | ( BC ? FLAG_V : 0 ) |
+      ( bytetemp & FLAG_3 ) | ( (bytetemp & 0x02) ? FLAG_5 : 0 );
+
+    /* The instruction has overwritten itself, so must be fetched again */
+    if( de == pc || de == (libspectrum_word)( pc + 1 ) ) break;
+  }
+
+  if( !BC ) PC = pc + 2;
+}
+
+/* CPIR ('step' = 1) or CPDR ('step' = -1), with PC pointing at the
+   instruction again */
+static void
+z80_cpxr_bulk( int step )
+{
+  libspectrum_word pc = PC;
+  int even_m1 =
+    machine_current->capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_EVEN_M1;
+
+  if( !block_bulk_allowed() ) return;
+
+  while( tstates < event_next_event ) {
+    libspectrum_byte value, bytetemp, lookup;
+
+    block_m1_cycles( pc, even_m1 );
+
+    value = readbyte( HL ); bytetemp = A - value;
+    lookup = ( (        A & 0x08 ) >> 3 ) |
+             ( (  (value) & 0x08 ) >> 2 ) |
+             ( ( bytetemp & 0x08 ) >> 1 );
+    contend_read_no_mreq( HL, 1 ); contend_read_no_mreq( HL, 1 );
+    contend_read_no_mreq( HL, 1 ); contend_read_no_mreq( HL, 1 );
+    contend_read_no_mreq( HL, 1 );
+    BC--;
+    F = ( F & FLAG_C ) | ( BC ? ( FLAG_V | FLAG_N ) : FLAG_N ) |
+      halfcarry_sub_table[lookup] | ( bytetemp ? 0 : FLAG_Z ) |
+      ( bytetemp & FLAG_S );
+    if(F & FLAG_H) bytetemp--;
+    F |= ( bytetemp & FLAG_3 ) | ( (bytetemp&0x02) ? FLAG_5 : 0 );
+    if( ( F & ( FLAG_V | FLAG_Z ) ) != FLAG_V ) {
+      HL += step;
+      PC = pc + 2;
+      return;
+    }
+    contend_read_no_mreq( HL, 1 ); contend_read_no_mreq( HL, 1 );
+    contend_read_no_mreq( HL, 1 ); contend_read_no_mreq( HL, 1 );
+    contend_read_no_mreq( HL, 1 );
+    HL += step;
+  }
+}
+
+/* Idle loops: a loop such as
+
+     loop: ld a,(FRAMES)
+           cp b
+           jr z,loop
+
+   which writes nothing but A and F and reads only memory can't do
+   anything different from one time round to the next until an event
+   (normally the interrupt) happens. So once it has gone round once and
+   come back to the start in exactly the same state, all the remaining
+   iterations before the next event can be skipped, just adding on the
+   time they would have taken. The time for each iteration is worked out
+   from the same memory accesses the core would make, so contention is
+   unchanged, and is checked against the time the iteration actually
+   took before anything is skipped */
+
+#define IDLE_LOOP_MAX_INSTRUCTIONS 8
+#define IDLE_LOOP_MAX_ACCESSES ( IDLE_LOOP_MAX_INSTRUCTIONS * 4 + 3 )
+
+/* One memory access made by the loop */
+typedef struct idle_loop_access_t {
+  libspectrum_word address;
+  libspectrum_byte time;
+  int no_mreq;
+} idle_loop_access_t;
+
+static struct {
+
+  /* Where the loop starts and the state the last time it was jumped to */
+  libspectrum_word start;
+  processor state;
+  libspectrum_dword tstates;
+  libspectrum_dword next_event;
+
+  idle_loop_access_t accesses[ IDLE_LOOP_MAX_ACCESSES ];
+  size_t access_count;
+  libspectrum_word m1_cycles;
+  int contended;		/* Does any of them touch contended memory? */
+
+} idle_loop;
+
+static void
+idle_loop_add( libspectrum_word address, libspectrum_byte time, int no_mreq )
+{
+  idle_loop_access_t *access =
+    &idle_loop.accesses[ idle_loop.access_count++ ];
+
+  access->address = address;
+  access->time = time;
+  access->no_mreq = no_mreq;
+
+  if( memory_map_read[ address >> MEMORY_PAGE_SIZE_LOGARITHM ].contended )
+    idle_loop.contended = 1;
+}
+
+/* Work out the memory accesses made by one iteration of the loop at
+   'start'. Returns non-zero if it isn't a loop we can skip */
+static int
+idle_loop_decode( libspectrum_word start )
+{
+  libspectrum_word pc = start;
+  libspectrum_byte opcode, opcode2;
+  size_t i;
+
+  idle_loop.access_count = 0;
+  idle_loop.m1_cycles = 0;
+  idle_loop.contended = 0;
+
+  for( i = 0; i < IDLE_LOOP_MAX_INSTRUCTIONS; i++ ) {
+
+    if( periph_pc_traps_active && periph_pc_traps[ pc ] ) return 1;
+
+    opcode = readbyte_internal( pc );
+    idle_loop_add( pc, 4, 0 ); idle_loop.m1_cycles++;
+
+    switch( opcode ) {
+
+    /* The jump back to the start, which must end the loop */
+    case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+      if( (libspectrum_word)( pc + 2 +
+            (libspectrum_signed_byte)readbyte_internal( pc + 1 ) ) != start )
+        return 1;
+      idle_loop_add( pc + 1, 3, 0 );
+      idle_loop_add( pc + 1, 1, 1 ); idle_loop_add( pc + 1, 1, 1 );
+      idle_loop_add( pc + 1, 1, 1 ); idle_loop_add( pc + 1, 1, 1 );
+      idle_loop_add( pc + 1, 1, 1 );
+      return 0;
+
+    /* NOP, the accumulator rotates, DAA, CPL, SCF, CCF, INC A and DEC A */
+    case 0x00: case 0x07: case 0x0f: case 0x17: case 0x1f: case 0x27:
+    case 0x2f: case 0x37: case 0x3f: case 0x3c: case 0x3d:
+      pc++;
+      break;
+
+    case 0x0a:			/* LD A,(BC) */
+      idle_loop_add( BC, 3, 0 ); pc++;
+      break;
+
+    case 0x1a:			/* LD A,(DE) */
+      idle_loop_add( DE, 3, 0 ); pc++;
+      break;
+
+    case 0x3a:			/* LD A,(nn) */
+      idle_loop_add( pc + 1, 3, 0 ); idle_loop_add( pc + 2, 3, 0 );
+      idle_loop_add( readbyte_internal( pc + 1 ) |
+                     readbyte_internal( pc + 2 ) << 8, 3, 0 );
+      pc += 3;
+      break;
+
+    case 0x3e:			/* LD A,n */
+      idle_loop_add( pc + 1, 3, 0 ); pc += 2;
+      break;
+
+    case 0xcb:			/* BIT n,r and BIT n,(HL) only */
+      opcode2 = readbyte_internal( pc + 1 );
+      if( ( opcode2 & 0xc0 ) != 0x40 ) return 1;
+      idle_loop_add( pc + 1, 4, 0 ); idle_loop.m1_cycles++;
+      if( ( opcode2 & 0x07 ) == 0x06 ) {
+        idle_loop_add( HL, 3, 0 ); idle_loop_add( HL, 1, 1 );
+      }
+      pc += 2;
+      break;
+
+    default:
+
+      if( ( opcode & 0xf8 ) == 0x78 ) { /* LD A,r and LD A,(HL) */
+        if( opcode == 0x7e ) idle_loop_add( HL, 3, 0 );
+        pc++;
+      } else if( ( opcode & 0xc0 ) == 0x80 ) { /* ALU A,r and ALU A,(HL) */
+        if( ( opcode & 0x07 ) == 0x06 ) idle_loop_add( HL, 3, 0 );
+        pc++;
+      } else if( ( opcode & 0xc7 ) == 0xc6 ) { /* ALU A,n */
+        idle_loop_add( pc + 1, 3, 0 ); pc += 2;
+      } else {
+        return 1;
+      }
+      break;
+
+    }
+  }
+
+  return 1;
+}
+
+/* The time at the end of one iteration of the loop starting at 'time' */
+static libspectrum_dword
+idle_loop_iteration( libspectrum_dword time )
+{
+  size_t i;
+
+  for( i = 0; i < idle_loop.access_count; i++ ) {
+    const idle_loop_access_t *access = &idle_loop.accesses[i];
+    libspectrum_word bank = access->address >> MEMORY_PAGE_SIZE_LOGARITHM;
+
+    if( memory_map_read[ bank ].contended )
+      time += access->no_mreq ? ula_contention_no_mreq[ time ] :
+                                ula_contention[ time ];
+    time += access->time;
+  }
+
+  return time;
+}
+
+static void
+idle_loop_record( libspectrum_word start )
+{
+  idle_loop.start = start;
+  memcpy( &idle_loop.state, &z80, sizeof( processor ) );
+  idle_loop.tstates = tstates;
+  idle_loop.next_event = event_next_event;
+}
+
+/* Called when a JR to 'start' has been taken, before PC is incremented
+   past the offset */
+static void
+z80_idle_loop( libspectrum_word start )
+{
+  processor state;
+  libspectrum_dword iteration_time, iterations;
+
+  if( debugger_mode != DEBUGGER_MODE_INACTIVE || profile_active ||
+      rzx_recording || opus_active || spectranet_paged ||
+      machine_current->capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_EVEN_M1 )
+    return;
+
+  /* Only the same loop, with just one time round it (and no events)
+     since it was last jumped to, is of interest */
+  memcpy( &state, &z80, sizeof( processor ) );
+  state.r = idle_loop.state.r;
+
+  if( start != idle_loop.start || event_next_event != idle_loop.next_event ||
+      memcmp( &state, &idle_loop.state, sizeof( processor ) ) ||
+      idle_loop_decode( start ) ||
+      (libspectrum_word)( R - idle_loop.state.r ) != idle_loop.m1_cycles ||
+      idle_loop_iteration( idle_loop.tstates ) != tstates ) {
+    idle_loop_record( start );
+    return;
+  }
+
+  if( idle_loop.contended ) {
+
+    while( 1 ) {
+      libspectrum_dword end = idle_loop_iteration( tstates );
+      if( end >= event_next_event ) break;
+      tstates = end;
+      R += idle_loop.m1_cycles;
+    }
+
+  } else if( tstates < event_next_event ) {
+
+    iteration_time = tstates - idle_loop.tstates;
+    iterations = ( event_next_event - tstates - 1 ) / iteration_time;
+    tstates += iterations * iteration_time;
+    R += iterations * idle_loop.m1_cycles;
+
+  }
+
+  idle_loop_record( start );
+}
+
+#endif				/* #ifndef CORETEST */
+
+/* Certain features (eg the debugger, TR-DOS ROM paging) can't be
+   handled within the normal 'events' framework as they don't happen at
+   a specified tstate. In order to support these, we basically need to
+   check every opcode as to whether they have occurred or not.
 
    There are (fairly common) circumstances under which we know that
-   the features will never occur (eg we will never get an interrupt
-   from RZX playback unless we're doing RZX playback), and we would
+   the features will never occur (eg we will never hit a breakpoint
+   unless the debugger is active), and we would
    quite like to skip the check in this state. We can do this if we
    use gcc's computed goto feature[1]. What follows is some
    preprocessor hackery to moderately transparently do this while
@@ -105,7 +432,11 @@ static libspectrum_byte opcode = 0x00;
 
 /* Execute Z80 opcodes until the next event */
 void
+#ifndef Z80_UNCONTENDED
 z80_do_opcodes( void )
+#else				/* #ifndef Z80_UNCONTENDED */
+z80_do_opcodes_uncontended( void )
+#endif				/* #ifndef Z80_UNCONTENDED */
 {
 #ifdef HAVE_ENOUGH_MEMORY
   libspectrum_byte opcode = 0x00;
@@ -132,6 +463,15 @@ z80_do_opcodes( void )
 
 #endif				/* #ifdef __GNUC__ */
 
+#if !defined( CORETEST ) && !defined( Z80_UNCONTENDED )
+  /* Machines with no contended memory use the core built without the
+     contention checks */
+  if( z80_contention_free ) {
+    z80_do_opcodes_uncontended();
+    return;
+  }
+#endif
+
   while( tstates < event_next_event ) {
 
     /* Profiler */
@@ -141,17 +481,6 @@ z80_do_opcodes( void )
 
     END_CHECK
 
-    /* If we're due an end of frame from RZX playback, generate one */
-    CHECK( rzx, rzx_playback )
-
-    if( R + rzx_instructions_offset >= rzx_instruction_count ) {
-      event_add( tstates, spectrum_frame_event );
-      break;		/* And break out of the execution loop to let
-			   the interrupt happen */
-    }
-
-    END_CHECK
-
     /* Check if the debugger should become active at this point */
     CHECK( debugger, debugger_mode != DEBUGGER_MODE_INACTIVE )
 
@@ -160,66 +489,25 @@ z80_do_opcodes( void )
 
     END_CHECK
 
+    /* The Beta disk interface pages out whenever the ROM is left; its
+       paging in is a PC trap like those of the other interfaces */
     CHECK( beta, beta_available )
 
-#define NOT_128_TYPE_OR_IS_48_TYPE ( !( machine_current->capabilities & \
-            LIBSPECTRUM_MACHINE_CAPABILITY_128_MEMORY ) || \
-            machine_current->ram.current_rom )
-
-    if( beta_active ) {
-      if( NOT_128_TYPE_OR_IS_48_TYPE && PC >= 16384 ) {
-	beta_unpage();
-      }
-    } else if( ( PC & beta_pc_mask ) == beta_pc_value &&
-               NOT_128_TYPE_OR_IS_48_TYPE ) {
-      beta_page();
-    }
-
-    END_CHECK
-
-    CHECK( plusd, plusd_available )
-
-    if( PC == 0x0008 || PC == 0x003a || PC == 0x0066 || PC == 0x028e ) {
-      plusd_page();
-    }
-
-    END_CHECK
-
-    CHECK( disciple, disciple_available )
-
-    if( PC == 0x0001 || PC == 0x0008 || PC == 0x0066 || PC == 0x028e ) {
-      disciple_page();
+    if( beta_active && PC >= 16384 && NOT_128_TYPE_OR_IS_48_TYPE ) {
+      beta_unpage();
     }
 
     END_CHECK
 
-    CHECK( if1p, if1_available )
+    /* Peripherals which page in or out at specific addresses */
+    CHECK( pc_traps_early, periph_pc_traps_active )
 
-    if( PC == 0x0008 || PC == 0x1708 ) {
-      if1_page();
+    if( periph_pc_traps[ PC ] & PERIPH_PC_TRAP_EARLY ) {
+      periph_pc_trap_early( PC );
     }
 
     END_CHECK
 
-    CHECK( divide_early, settings_current.divide_enabled )
-    
-    if( ( PC & 0xff00 ) == 0x3d00 ) {
-      divide_set_automap( 1 );
-    }
-    
-    END_CHECK
-
-    CHECK( spectranet_page, spectranet_available && !settings_current.spectranet_disable )
-
-    if( PC == 0x0008 || ((PC & 0xfff8) == 0x3ff8) )
-      spectranet_page( 0 );
-
-    if( PC == spectranet_programmable_trap &&
-      spectranet_programmable_trap_active )
-      event_add( 0, z80_nmi_event );
-
-    END_CHECK
-
   opcode_delay:
 
     contend_read( PC, 4 );
@@ -236,48 +524,44 @@ z80_do_opcodes( void )
        triggering read breakpoints */
     opcode = readbyte_internal( PC );
 
-    CHECK( if1u, if1_available )
+    CHECK( pc_traps_late, periph_pc_traps_active )
 
-    if( PC == 0x0700 ) {
-      if1_unpage();
+    if( periph_pc_traps[ PC ] & PERIPH_PC_TRAP_LATE ) {
+      periph_pc_trap_late( PC );
     }
 
     END_CHECK
 
-    CHECK( divide_late, settings_current.divide_enabled )
-
-    if( ( PC & 0xfff8 ) == 0x1ff8 ) {
-      divide_set_automap( 0 );
-    } else if( (PC == 0x0000) || (PC == 0x0008) || (PC == 0x0038)
-      || (PC == 0x0066) || (PC == 0x04c6) || (PC == 0x0562) ) {
-      divide_set_automap( 1 );
-    }
-    
-    END_CHECK
+    CHECK( z80_halted, z80.halted )
 
-    CHECK( opus, opus_available )
+    /* Opcode read from memory is ignored and PC is left unchanged */
+    R++;
 
-    if( opus_active ) {
-      if( PC == 0x1748 ) {
-        opus_unpage();
+    /* Nothing but more of the same M1 cycles can happen before the next
+       event, so do them all now rather than going round the loop for
+       each one. Not when the debugger is active or when profiling, both
+       of which need to see every M1 cycle */
+    if( debugger_mode == DEBUGGER_MODE_INACTIVE && !profile_active ) {
+#ifndef CORETEST
+      if( !even_m1 &&
+          !memory_map_read[ PC >> MEMORY_PAGE_SIZE_LOGARITHM ].contended ) {
+        if( tstates < event_next_event ) {
+          libspectrum_dword m1_cycles =
+            ( event_next_event - tstates + 3 ) / 4;
+          tstates += 4 * m1_cycles;
+          R += m1_cycles;
+        }
+      } else
+#endif				/* #ifndef CORETEST */
+      {
+        while( tstates < event_next_event ) {
+          contend_read( PC, 4 );
+          if( even_m1 && ( tstates & 1 ) ) tstates++;
+          R++;
+        }
       }
-    } else if( PC == 0x0008 || PC == 0x0048 || PC == 0x1708 ) {
-      opus_page();
     }
 
-    END_CHECK
-
-    CHECK( spectranet_unpage, spectranet_available )
-
-    if( PC == 0x007c )
-      spectranet_unpage();
-
-    END_CHECK
-
-    CHECK( z80_halted, z80.halted )
-
-    /* Opcode read from memory is ignored and PC is left unchanged */
-    R++;
     continue;
 
     END_CHECK
@@ -139,4 +139,53 @@ libspectrum_bzip2_inflate( const libspectrum_byte *bzptr, size_t bzlength,
   }				/* Matches if( *outlength ) { ... } */
 }
 
+/* As libspectrum_bzip2_inflate(), but stop after at most *outlength
+   bytes; running out of either input or output space is not an error */
+libspectrum_error
+libspectrum_bzip2_inflate_prefix( const libspectrum_byte *bzptr,
+				  size_t bzlength, libspectrum_byte **outptr,
+				  size_t *outlength )
+{
+  bz_stream stream;
+  int error;
+
+  *outptr = libspectrum_new( libspectrum_byte, *outlength );
+
+  stream.bzalloc = NULL; stream.bzfree = NULL; stream.opaque = NULL;
+
+  error = BZ2_bzDecompressInit( &stream, 0, 0 );
+  if( error != BZ_OK ) {
+    libspectrum_print_error(
+      error == BZ_MEM_ERROR ? LIBSPECTRUM_ERROR_MEMORY :
+			      LIBSPECTRUM_ERROR_LOGIC,
+      "bzip2_inflate: serious error from BZ2_bzDecompressInit: %d", error
+    );
+    libspectrum_free( *outptr );
+    return error == BZ_MEM_ERROR ? LIBSPECTRUM_ERROR_MEMORY :
+				   LIBSPECTRUM_ERROR_LOGIC;
+  }
+
+  stream.next_in = (char*)bzptr; stream.avail_in = bzlength;
+  stream.next_out = (char*)*outptr; stream.avail_out = *outlength;
+
+  do {
+    error = BZ2_bzDecompress( &stream );
+  } while( error == BZ_OK && stream.avail_in && stream.avail_out );
+
+  BZ2_bzDecompressEnd( &stream );
+
+  if( error != BZ_OK && error != BZ_STREAM_END ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_LOGIC,
+      "bzip2_inflate: serious error from BZ2_bzDecompress: %d", error
+    );
+    libspectrum_free( *outptr );
+    return LIBSPECTRUM_ERROR_LOGIC;
+  }
+
+  *outlength -= stream.avail_out;
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
 #endif				/* #ifdef HAVE_LIBBZ2 */
@@ -30,6 +30,11 @@
 #include <stdio.h>
 #include <string.h>
 
+#if defined( HAVE_SYS_MMAN_H ) && defined( HAVE_MMAP )
+#include <sys/mman.h>
+#define USE_MMAP 1
+#endif
+
 #include "internals.h"
 
 typedef enum libspectrum_ide_command {
@@ -118,6 +123,40 @@ typedef struct libspectrum_hdf_header {
   libspectrum_byte drive_identity[0x6a];
 
 } libspectrum_hdf_header;
+
+/* If the image can't be memory mapped, it is read in blocks of this
+   many sectors, the most recently used of which are kept */
+#define CACHE_BLOCK_SECTORS 64
+#define CACHE_BLOCKS 16
+
+typedef struct libspectrum_ide_cache_block {
+
+  long block;			/* Block number, or -1 if unused */
+  unsigned long last_used;
+  libspectrum_byte data[ CACHE_BLOCK_SECTORS * 512 ];
+
+} libspectrum_ide_cache_block;
+
+/* Sectors written since the last commit are kept in a three level radix
+   tree indexed by sector number, with groups of consecutive sectors
+   stored together at the leaves so they can be written out together */
+#define OVERLAY_GROUP_SECTORS 16
+#define OVERLAY_GROUP_BITS 4
+#define OVERLAY_FANOUT 256
+#define OVERLAY_FANOUT_BITS 8
+
+typedef struct libspectrum_ide_overlay_group {
+
+  libspectrum_word present;	/* Bitmap of the sectors held */
+  libspectrum_byte data[ OVERLAY_GROUP_SECTORS * 512 ];
+
+} libspectrum_ide_overlay_group;
+
+typedef struct libspectrum_ide_overlay_node {
+
+  void *child[ OVERLAY_FANOUT ];
+
+} libspectrum_ide_overlay_node;
   
 typedef struct libspectrum_ide_drive {
 
@@ -126,6 +165,19 @@ typedef struct libspectrum_ide_drive {
   libspectrum_word data_offset;
   libspectrum_word sector_size;
   libspectrum_hdf_header hdf;
+
+  /* The length of the file; any sectors beyond this read as zero, so
+     unused space at the end of the image need not be stored */
+  long length;
+
+  /* Read path: either the memory mapped file, or a cache of blocks */
+  libspectrum_byte *map;
+  libspectrum_ide_cache_block *cache;
+  unsigned long cache_clock;
+
+  /* Write overlay, and the number of sectors in it */
+  void *overlay;
+  size_t dirty_sectors;
   
   /* Drive geometry */
   int cylinders;
@@ -165,16 +217,14 @@ struct libspectrum_ide_channel {
   libspectrum_byte buffer[512];
   int sector_number;
 
-  /* One write cache for each drive */
-  GHashTable *cache[2];
-
 };
 
 /* Private function prototypes */
-static gboolean write_to_disk( gpointer key, gpointer value,
-  gpointer user_data );
-static gboolean clear_cache( gpointer key, gpointer value,
-  gpointer user_data GCC_UNUSED );
+static void map_disk( libspectrum_ide_drive *drv );
+static void unmap_disk( libspectrum_ide_drive *drv );
+static libspectrum_byte* overlay_find( libspectrum_ide_drive *drv,
+  int sector_number, int create );
+static void overlay_clear( libspectrum_ide_drive *drv );
 static int read_hdf( libspectrum_ide_channel *chn );
 static int write_hdf( libspectrum_ide_channel *chn );
 static libspectrum_byte read_data( libspectrum_ide_channel *chn );
@@ -198,13 +248,7 @@ libspectrum_ide_alloc( libspectrum_ide_databus databus )
   channel = libspectrum_new( libspectrum_ide_channel, 1 );
 
   channel->databus = databus;
-  channel->drive[ LIBSPECTRUM_IDE_MASTER ].disk = NULL;
-  channel->drive[ LIBSPECTRUM_IDE_SLAVE  ].disk = NULL;
-
-  channel->cache[ LIBSPECTRUM_IDE_MASTER ] =
-    g_hash_table_new( g_int_hash, g_int_equal );
-  channel->cache[ LIBSPECTRUM_IDE_SLAVE  ] =
-    g_hash_table_new( g_int_hash, g_int_equal );
+  memset( channel->drive, 0, sizeof( channel->drive ) );
 
   return channel;
 }
@@ -217,9 +261,6 @@ libspectrum_ide_free( libspectrum_ide_channel *chn )
   libspectrum_ide_eject( chn, LIBSPECTRUM_IDE_MASTER );
   libspectrum_ide_eject( chn, LIBSPECTRUM_IDE_SLAVE  );
 
-  g_hash_table_destroy( chn->cache[ LIBSPECTRUM_IDE_MASTER ] );
-  g_hash_table_destroy( chn->cache[ LIBSPECTRUM_IDE_SLAVE  ] );
-  
   /* Free the channel structure */
   libspectrum_free( chn );
 
@@ -285,30 +326,79 @@ libspectrum_ide_insert( libspectrum_ide_channel *chn,
     drv->hdf.drive_identity, LIBSPECTRUM_IDE_IDENTITY_NUM_HEADS );
   drv->sectors = GET_WORD(
     drv->hdf.drive_identity, LIBSPECTRUM_IDE_IDENTITY_NUM_SECTORS );
+
+  map_disk( drv );
   
   return LIBSPECTRUM_ERROR_NONE;
 }
 
-static gboolean
-write_to_disk( gpointer key, gpointer value, gpointer user_data )
+/* Set up the read path for a newly opened or newly written file */
+static void
+map_disk( libspectrum_ide_drive *drv )
+{
+  size_t i;
+
+  drv->length = 0;
+  if( !fseek( drv->disk, 0, SEEK_END ) ) drv->length = ftell( drv->disk );
+  if( drv->length < 0 ) drv->length = 0;
+
+#ifdef USE_MMAP
+  if( drv->length ) {
+    void *map = mmap( NULL, drv->length, PROT_READ, MAP_SHARED,
+		      fileno( drv->disk ), 0 );
+    if( map != MAP_FAILED ) {
+      drv->map = map;
+      return;
+    }
+  }
+#endif			/* #ifdef USE_MMAP */
+
+  if( !drv->cache )
+    drv->cache = libspectrum_new( libspectrum_ide_cache_block, CACHE_BLOCKS );
+  for( i = 0; i < CACHE_BLOCKS; i++ ) drv->cache[i].block = -1;
+}
+
+static void
+unmap_disk( libspectrum_ide_drive *drv )
+{
+#ifdef USE_MMAP
+  if( drv->map ) munmap( drv->map, drv->length );
+#endif			/* #ifdef USE_MMAP */
+  drv->map = NULL;
+
+  libspectrum_free( drv->cache );
+  drv->cache = NULL;
+}
+
+/* Write out each run of consecutive sectors in a group */
+static int
+commit_group( libspectrum_ide_drive *drv, long first_sector,
+	      libspectrum_ide_overlay_group *group )
 {
-  guint sector_number = *(guint*)key;
-  libspectrum_byte *buffer = value;
-  libspectrum_ide_drive *drv = user_data;
+  int start, end;
+  long position;
+  size_t length;
 
-  long sector_position;
+  for( start = 0; start < OVERLAY_GROUP_SECTORS; start = end ) {
 
-  sector_position = drv->data_offset + ( drv->sector_size * sector_number );
+    if( !( group->present & ( 1 << start ) ) ) { end = start + 1; continue; }
 
-  if( fseek( drv->disk, sector_position, SEEK_SET ) )
-    return FALSE;
+    for( end = start + 1;
+	 end < OVERLAY_GROUP_SECTORS && ( group->present & ( 1 << end ) );
+	 end++ )
+      ;
 
-  if( fwrite( buffer, 1, drv->sector_size, drv->disk ) != drv->sector_size )
-    return FALSE;
+    position = drv->data_offset +
+	       (long)drv->sector_size * ( first_sector + start );
+    length = ( end - start ) * drv->sector_size;
 
-  libspectrum_free( key ); libspectrum_free( value );
+    if( fseek( drv->disk, position, SEEK_SET ) ||
+	fwrite( group->data + start * drv->sector_size, 1, length,
+		drv->disk ) != length )
+      return 1;
+  }
 
-  return TRUE;	/* TRUE => remove key/value pair from hash */
+  return 0;
 }
 
 /* Commit any pending writes to disk */
@@ -317,24 +407,49 @@ libspectrum_ide_commit( libspectrum_ide_channel *chn,
 			libspectrum_ide_unit unit )
 {
   libspectrum_ide_drive *drv;
-  GHashTable *cache;
+  libspectrum_ide_overlay_node *top, *mid, *low;
+  int i, j, k, error = 0;
 
   drv = &chn->drive[ unit ];
-  cache = chn->cache[ unit ];
 
-  if( !drv->disk ) return LIBSPECTRUM_ERROR_NONE;
+  if( !drv->disk || !drv->overlay ) return LIBSPECTRUM_ERROR_NONE;
+
+  /* Walk the tree in order, so the file is written sequentially */
+  top = drv->overlay;
+  for( i = 0; i < OVERLAY_FANOUT && !error; i++ ) {
+    mid = top->child[i];
+    if( !mid ) continue;
+    for( j = 0; j < OVERLAY_FANOUT && !error; j++ ) {
+      low = mid->child[j];
+      if( !low ) continue;
+      for( k = 0; k < OVERLAY_FANOUT && !error; k++ ) {
+	if( !low->child[k] ) continue;
+	error = commit_group(
+	  drv, ( ( ( (long)i << OVERLAY_FANOUT_BITS ) + j ) <<
+		 OVERLAY_FANOUT_BITS | k ) << OVERLAY_GROUP_BITS,
+	  low->child[k]
+	);
+      }
+    }
+  }
 
-  g_hash_table_foreach_remove( cache, write_to_disk, drv );
+  if( fflush( drv->disk ) ) error = 1;
 
-  return LIBSPECTRUM_ERROR_NONE;
-}
+  /* The file may have grown, and any cached blocks are out of date */
+  unmap_disk( drv );
+  map_disk( drv );
 
-static gboolean
-clear_cache( gpointer key, gpointer value, gpointer user_data GCC_UNUSED )
-{
-  libspectrum_free( key );
-  libspectrum_free( value );
-  return TRUE;
+  if( error ) {
+    libspectrum_print_error(
+      LIBSPECTRUM_ERROR_UNKNOWN,
+      "libspectrum_ide_commit: error writing to disk: %s", strerror( errno )
+    );
+    return LIBSPECTRUM_ERROR_UNKNOWN;
+  }
+
+  overlay_clear( drv );
+
+  return LIBSPECTRUM_ERROR_NONE;
 }
 
 /* Is there any dirty data for this disk? */
@@ -342,7 +457,7 @@ int
 libspectrum_ide_dirty( libspectrum_ide_channel *chn,
 		       libspectrum_ide_unit unit )
 {
-  return g_hash_table_size( chn->cache[ unit ] ) != 0;
+  return chn->drive[ unit ].dirty_sectors != 0;
 }
 
 /* Eject a hard disk from a drive */
@@ -351,17 +466,17 @@ libspectrum_ide_eject( libspectrum_ide_channel *chn,
                        libspectrum_ide_unit unit )
 {
   libspectrum_ide_drive *drv;
-  GHashTable *cache;
 
   drv = &chn->drive[ unit ];
-  cache = chn->cache[ unit ];
 
   if( !drv->disk ) return LIBSPECTRUM_ERROR_NONE;
 
+  unmap_disk( drv );
+
   fclose( drv->disk );
   drv->disk = NULL;
 
-  g_hash_table_foreach_remove( cache, clear_cache, NULL );
+  overlay_clear( drv );
   
   return LIBSPECTRUM_ERROR_NONE;
 }
@@ -430,38 +545,143 @@ libspectrum_ide_reset( libspectrum_ide_channel *chn )
 }
 
 
+/* Find a sector in the write overlay, optionally adding it */
+static libspectrum_byte*
+overlay_find( libspectrum_ide_drive *drv, int sector_number, int create )
+{
+  void **slot = &drv->overlay;
+  libspectrum_ide_overlay_node *node;
+  libspectrum_ide_overlay_group *group;
+  long index = sector_number >> OVERLAY_GROUP_BITS;
+  int sector = sector_number & ( OVERLAY_GROUP_SECTORS - 1 );
+  int level, shift;
+
+  for( level = 0; level < 3; level++ ) {
+    if( !*slot ) {
+      if( !create ) return NULL;
+      *slot = libspectrum_new0( libspectrum_ide_overlay_node, 1 );
+    }
+    node = *slot;
+    shift = ( 2 - level ) * OVERLAY_FANOUT_BITS;
+    slot = &node->child[ ( index >> shift ) & ( OVERLAY_FANOUT - 1 ) ];
+  }
+
+  group = *slot;
+  if( !group ) {
+    if( !create ) return NULL;
+    group = libspectrum_new( libspectrum_ide_overlay_group, 1 );
+    group->present = 0;
+    *slot = group;
+  }
+
+  if( !( group->present & ( 1 << sector ) ) ) {
+    if( !create ) return NULL;
+    group->present |= 1 << sector;
+    drv->dirty_sectors++;
+  }
+
+  return group->data + sector * drv->sector_size;
+}
+
+static void
+overlay_free( void *node, int level )
+{
+  libspectrum_ide_overlay_node *n = node;
+  int i;
+
+  if( level < 3 )
+    for( i = 0; i < OVERLAY_FANOUT; i++ )
+      if( n->child[i] ) overlay_free( n->child[i], level + 1 );
+
+  libspectrum_free( node );
+}
+
+static void
+overlay_clear( libspectrum_ide_drive *drv )
+{
+  if( drv->overlay ) overlay_free( drv->overlay, 0 );
+  drv->overlay = NULL;
+  drv->dirty_sectors = 0;
+}
+
+/* Read a sector from the disk image itself */
+static int
+read_image( libspectrum_ide_drive *drv, int sector_number,
+	    libspectrum_byte *buffer )
+{
+  libspectrum_ide_cache_block *block, *victim;
+  long position, block_number, available;
+  size_t i, length;
+
+  if( drv->map ) {
+
+    position = drv->data_offset + (long)drv->sector_size * sector_number;
+    available = drv->length - position;
+    if( available < 0 ) available = 0;
+    if( available > drv->sector_size ) available = drv->sector_size;
+
+    if( available ) memcpy( buffer, drv->map + position, available );
+    memset( buffer + available, 0, drv->sector_size - available );
+
+    return 0;
+  }
+
+  block_number = sector_number / CACHE_BLOCK_SECTORS;
+
+  victim = &drv->cache[0];
+  for( i = 0; i < CACHE_BLOCKS; i++ ) {
+    block = &drv->cache[i];
+    if( block->block == block_number ) break;
+    if( block->last_used < victim->last_used ) victim = block;
+  }
+
+  if( i == CACHE_BLOCKS ) {
+
+    /* Not cached, so read the whole block in */
+    block = victim;
+    block->block = -1;
+
+    length = CACHE_BLOCK_SECTORS * drv->sector_size;
+    position = drv->data_offset + (long)length * block_number;
+
+    if( position < drv->length ) {
+      if( fseek( drv->disk, position, SEEK_SET ) ) return 1;
+      available = fread( block->data, 1, length, drv->disk );
+      if( ferror( drv->disk ) ) return 1;
+    } else {
+      available = 0;
+    }
+    memset( block->data + available, 0, length - available );
+
+    block->block = block_number;
+  }
+
+  block->last_used = ++drv->cache_clock;
+
+  memcpy( buffer,
+	  block->data +
+	    ( sector_number % CACHE_BLOCK_SECTORS ) * drv->sector_size,
+	  drv->sector_size );
+
+  return 0;
+}
+
 /* Read a sector from the HDF file */
 static int
 read_hdf( libspectrum_ide_channel *chn )
 {
-  libspectrum_ide_unit selected;
   libspectrum_ide_drive *drv;
-  GHashTable *cache;
   libspectrum_byte *buffer, packed_buf[512];
 
-  selected = chn->selected;
-  drv = &chn->drive[ selected ];
-  cache = chn->cache[ selected ];
+  drv = &chn->drive[ chn->selected ];
 
-  /* First look in the write cache */
-  buffer = g_hash_table_lookup( cache, &chn->sector_number );
+  /* First look in the write overlay */
+  buffer = overlay_find( drv, chn->sector_number, 0 );
 
-  /* If it's not in the write cache, read from the disk image */
+  /* If it's not there, read from the disk image */
   if( !buffer ) {
-
-    long sector_position;
-
-    sector_position =
-      drv->data_offset + ( drv->sector_size * chn->sector_number );
-
-    /* Seek to the correct file position */
-    if( fseek( drv->disk, sector_position, SEEK_SET ) ) return 1;
-
-    /* Read the packed data into a temporary buffer */
-    if ( fread( packed_buf, 1, drv->sector_size, drv->disk ) !=
-	 drv->sector_size                                       )
+    if( read_image( drv, chn->sector_number, packed_buf ) )
       return 1;		/* read error */
-
     buffer = packed_buf;
   }
 
@@ -487,31 +707,15 @@ read_hdf( libspectrum_ide_channel *chn )
 static int
 write_hdf( libspectrum_ide_channel *chn )
 {
-  libspectrum_ide_unit selected;
   libspectrum_ide_drive *drv;
-  GHashTable *cache;
   libspectrum_byte *buffer;
 
-  selected = chn->selected;
-  drv = &chn->drive[ selected ];
-  cache = chn->cache[ selected ];
-
-  buffer = g_hash_table_lookup( cache, &chn->sector_number );
+  drv = &chn->drive[ chn->selected ];
 
-  /* Add this sector to the write cache if it's not already present */
-  if( !buffer ) {
-
-    gint *key;
-
-    key = libspectrum_new( gint, 1 );
-    buffer = libspectrum_new( libspectrum_byte, drv->sector_size );
-
-    *key = chn->sector_number;
-    g_hash_table_insert( cache, key, buffer );
-
-  }
+  /* Find this sector in the write overlay, adding it if necessary */
+  buffer = overlay_find( drv, chn->sector_number, 1 );
 
-  /* Pack or copy the data into the write cache */
+  /* Pack or copy the data into the write overlay */
   if ( drv->sector_size == 256 ) {
     int i;
     for( i = 0; i < 256; i++ ) buffer[i] = chn->buffer[ i * 2 ];
@@ -114,12 +114,6 @@ int libspectrum_write_dword( libspectrum_byte **buffer, libspectrum_dword d );
 
 /* (de)compression routines */
 
-libspectrum_error
-libspectrum_uncompress_file( unsigned char **new_buffer, size_t *new_length,
-			     char **new_filename, libspectrum_id_t type,
-			     const unsigned char *old_buffer,
-			     size_t old_length, const char *old_filename );
-
 libspectrum_error
 libspectrum_gzip_inflate( const libspectrum_byte *gzptr, size_t gzlength,
 			  libspectrum_byte **outptr, size_t *outlength );
@@ -128,6 +122,33 @@ libspectrum_error
 libspectrum_bzip2_inflate( const libspectrum_byte *bzptr, size_t bzlength,
 			   libspectrum_byte **outptr, size_t *outlength );
 
+/* Decompress only the first *outlength bytes */
+
+libspectrum_error
+libspectrum_gzip_inflate_prefix( const libspectrum_byte *gzptr,
+				 size_t gzlength, libspectrum_byte **outptr,
+				 size_t *outlength );
+
+libspectrum_error
+libspectrum_bzip2_inflate_prefix( const libspectrum_byte *bzptr,
+				  size_t bzlength, libspectrum_byte **outptr,
+				  size_t *outlength );
+
+libspectrum_error
+libspectrum_zlib_compress_level( const libspectrum_byte *data, size_t length,
+				 libspectrum_byte **gzptr, size_t *gzlength,
+				 int level );
+
+int libspectrum_zlib_level( int in_flags );
+
+/* Compress independent blocks concurrently */
+
+libspectrum_error
+libspectrum_zlib_compress_blocks( size_t count, const libspectrum_byte **data,
+				  const size_t *length,
+				  libspectrum_byte **gzptr, size_t *gzlength,
+				  int level );
+
 /* The TZX file signature */
 
 extern const char * const libspectrum_tzx_signature;
@@ -180,6 +201,15 @@ internal_z80_read( libspectrum_snap *snap,
 libspectrum_error
 libspectrum_z80_write2( libspectrum_byte **buffer, size_t *length,
 			int *out_flags, libspectrum_snap *snap, int in_flags );
+void
+libspectrum_z80_compress_block( libspectrum_byte **dest, size_t *dest_length,
+				const libspectrum_byte *src,
+				size_t src_length );
+void
+libspectrum_z80_uncompress_block( libspectrum_byte **dest,
+				  size_t *dest_length,
+				  const libspectrum_byte *src,
+				  size_t src_length );
 libspectrum_error
 libspectrum_zxs_read( libspectrum_snap *snap,
 		      const libspectrum_byte *buffer, size_t buffer_length );
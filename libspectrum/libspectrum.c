@@ -448,6 +448,16 @@ libspectrum_machine_capabilities( libspectrum_machine type )
   return capabilities;
 }
 
+/* How much of a compressed file we decompress in order to identify it;
+   comfortably more than any of the signatures we look for */
+#define IDENTIFY_PREFIX_LENGTH 4096
+
+static libspectrum_error
+uncompress_file( unsigned char **new_buffer, size_t *new_length,
+		 char **new_filename, libspectrum_id_t type,
+		 const unsigned char *old_buffer, size_t old_length,
+		 const char *old_filename, size_t prefix );
+
 /* Given a buffer and optionally a filename, make a best guess as to
    what sort of file this is */
 libspectrum_error
@@ -467,8 +477,10 @@ libspectrum_identify_file_with_class(
   if( *libspectrum_class != LIBSPECTRUM_CLASS_COMPRESSED )
     return LIBSPECTRUM_ERROR_NONE;
 
-  error = libspectrum_uncompress_file( &new_buffer, &new_length, &new_filename,
-				       *type, buffer, length, filename );
+  /* Only the start of the file is needed to identify it, so don't
+     decompress any more than that */
+  error = uncompress_file( &new_buffer, &new_length, &new_filename, *type,
+			   buffer, length, filename, IDENTIFY_PREFIX_LENGTH );
   if( error ) return error;
 
   error = libspectrum_identify_file_with_class( type, libspectrum_class,
@@ -750,6 +762,18 @@ libspectrum_uncompress_file( unsigned char **new_buffer, size_t *new_length,
 			     char **new_filename, libspectrum_id_t type,
 			     const unsigned char *old_buffer,
 			     size_t old_length, const char *old_filename )
+{
+  return uncompress_file( new_buffer, new_length, new_filename, type,
+			  old_buffer, old_length, old_filename, 0 );
+}
+
+/* If 'prefix' is non-zero, decompress at most that many bytes from the
+   start of the file */
+static libspectrum_error
+uncompress_file( unsigned char **new_buffer, size_t *new_length,
+		 char **new_filename, libspectrum_id_t type,
+		 const unsigned char *old_buffer, size_t old_length,
+		 const char *old_filename, size_t prefix )
 {
   libspectrum_class_t class;
   libspectrum_error error;
@@ -773,7 +797,7 @@ libspectrum_uncompress_file( unsigned char **new_buffer, size_t *new_length,
   }
 
   /* Tells the inflation routines to allocate memory for us */
-  *new_length = 0;
+  *new_length = prefix;
   
   switch( type ) {
 
@@ -788,8 +812,11 @@ libspectrum_uncompress_file( unsigned char **new_buffer, size_t *new_length,
 	(*new_filename)[ strlen( *new_filename ) - 4 ] = '\0';
     }
 
-    error = libspectrum_bzip2_inflate( old_buffer, old_length,
-				       new_buffer, new_length );
+    error = prefix ?
+      libspectrum_bzip2_inflate_prefix( old_buffer, old_length,
+					new_buffer, new_length ) :
+      libspectrum_bzip2_inflate( old_buffer, old_length,
+				 new_buffer, new_length );
     if( error ) {
       if( new_filename ) libspectrum_free( *new_filename );
       return error;
@@ -819,8 +846,11 @@ libspectrum_uncompress_file( unsigned char **new_buffer, size_t *new_length,
 	(*new_filename)[ strlen( *new_filename ) - 3 ] = '\0';
     }
       
-    error = libspectrum_gzip_inflate( old_buffer, old_length,
-				      new_buffer, new_length );
+    error = prefix ?
+      libspectrum_gzip_inflate_prefix( old_buffer, old_length,
+				       new_buffer, new_length ) :
+      libspectrum_gzip_inflate( old_buffer, old_length,
+				new_buffer, new_length );
     if( error ) {
       if( new_filename ) libspectrum_free( *new_filename );
       return error;
@@ -85,6 +85,9 @@ static const libspectrum_byte ZXSTZF_FSET = 4;
 #define ZXSTBID_RAMPAGE "RAMP"
 static const libspectrum_word ZXSTRF_COMPRESSED = 1;
 
+/* The most RAM pages any machine has (the Pentagon 1024) */
+#define SZX_MAX_RAM_PAGES 64
+
 #define ZXSTBID_AY "AY\0\0"
 static const libspectrum_byte ZXSTAYF_FULLERBOX = 1;
 static const libspectrum_byte ZXSTAYF_128AY = 2;
@@ -256,13 +259,20 @@ static libspectrum_error
 write_ram_pages( libspectrum_byte **buffer, libspectrum_byte **ptr,
 		 size_t *length, libspectrum_snap *snap, int compress );
 static libspectrum_error
-write_ramp_chunk( libspectrum_byte **buffer, libspectrum_byte **ptr,
-		  size_t *length, libspectrum_snap *snap, int page,
-		  int compress );
+write_ramp_chunks( libspectrum_byte **buffer, libspectrum_byte **ptr,
+		   size_t *length, libspectrum_snap *snap, const int *pages,
+		   size_t count, int compress );
 static libspectrum_error
 write_ram_page( libspectrum_byte **buffer, libspectrum_byte **ptr,
 		size_t *length, const char *id, const libspectrum_byte *data,
 		size_t data_length, int page, int compress, int extra_flags );
+static void
+write_ram_page_data( libspectrum_byte **buffer, libspectrum_byte **ptr,
+		     size_t *length, const char *id,
+		     const libspectrum_byte *data, size_t data_length,
+		     const libspectrum_byte *compressed_data,
+		     size_t compressed_length, int page, int compress,
+		     int extra_flags );
 static libspectrum_error
 write_rom_chunk( libspectrum_byte **buffer, libspectrum_byte **ptr,
 		 size_t *length, int *out_flags, libspectrum_snap *snap,
@@ -2429,7 +2439,14 @@ libspectrum_szx_write( libspectrum_byte **buffer, size_t *length,
   capabilities =
     libspectrum_machine_capabilities( libspectrum_snap_machine( snap ) );
 
+  /* 'compress' is passed around as the zlib compression level to use,
+     or zero for no compression */
+#ifdef HAVE_ZLIB_H
+  compress = in_flags & LIBSPECTRUM_FLAG_SNAPSHOT_NO_COMPRESSION ? 0 :
+	     libspectrum_zlib_level( in_flags );
+#else				/* #ifdef HAVE_ZLIB_H */
   compress = !( in_flags & LIBSPECTRUM_FLAG_SNAPSHOT_NO_COMPRESSION );
+#endif				/* #ifdef HAVE_ZLIB_H */
 
   error = write_file_header( buffer, &ptr, length, out_flags, snap );
   if( error ) return error;
@@ -2976,8 +2993,9 @@ write_rom_chunk( libspectrum_byte **buffer, libspectrum_byte **ptr, size_t *leng
     libspectrum_byte *compressed_data;
     size_t compressed_length;
 
-    error = libspectrum_zlib_compress( data, data_length,
-				       &compressed_data, &compressed_length );
+    error = libspectrum_zlib_compress_level( data, data_length,
+					     &compressed_data,
+					     &compressed_length, compress );
     if( error ) return error;
 
     if( compress & LIBSPECTRUM_FLAG_SNAPSHOT_ALWAYS_COMPRESS ||
@@ -3013,75 +3031,86 @@ write_ram_pages( libspectrum_byte **buffer, libspectrum_byte **ptr,
 {
   libspectrum_machine machine;
   int i, capabilities; 
-  libspectrum_error error;
+  int pages[ SZX_MAX_RAM_PAGES ];
+  size_t count = 0;
 
   machine = libspectrum_snap_machine( snap );
   capabilities = libspectrum_machine_capabilities( machine );
 
-  error = write_ramp_chunk( buffer, ptr, length, snap, 5, compress );
-  if( error ) return error;
+  pages[ count++ ] = 5;
 
   if( machine != LIBSPECTRUM_MACHINE_16 ) {
-    error = write_ramp_chunk( buffer, ptr, length, snap, 2, compress );
-    if( error ) return error;
-    error = write_ramp_chunk( buffer, ptr, length, snap, 0, compress );
-    if( error ) return error;
+    pages[ count++ ] = 2;
+    pages[ count++ ] = 0;
   }
 
   if( capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_128_MEMORY ) {
-    error = write_ramp_chunk( buffer, ptr, length, snap, 1, compress );
-    if( error ) return error;
-    error = write_ramp_chunk( buffer, ptr, length, snap, 3, compress );
-    if( error ) return error;
-    error = write_ramp_chunk( buffer, ptr, length, snap, 4, compress );
-    if( error ) return error;
-    error = write_ramp_chunk( buffer, ptr, length, snap, 6, compress );
-    if( error ) return error;
-    error = write_ramp_chunk( buffer, ptr, length, snap, 7, compress );
-    if( error ) return error;
+    pages[ count++ ] = 1;
+    pages[ count++ ] = 3;
+    pages[ count++ ] = 4;
+    pages[ count++ ] = 6;
+    pages[ count++ ] = 7;
 
     if( capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_SCORP_MEMORY ) {
-      for( i = 8; i < 16; i++ ) {
-        error = write_ramp_chunk( buffer, ptr, length, snap, i, compress );
-        if( error ) return error;
-      }
+      for( i = 8; i < 16; i++ ) pages[ count++ ] = i;
     } else if( capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_PENT512_MEMORY ) {
-      for( i = 8; i < 32; i++ ) {
-        error = write_ramp_chunk( buffer, ptr, length, snap, i, compress );
-        if( error ) return error;
-      }
+      for( i = 8; i < 32; i++ ) pages[ count++ ] = i;
 
       if( capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_PENT1024_MEMORY ) {
-	for( i = 32; i < 64; i++ ) {
-	  error = write_ramp_chunk( buffer, ptr, length, snap, i, compress );
-	  if( error ) return error;
-	}
+	for( i = 32; i < 64; i++ ) pages[ count++ ] = i;
       }
     }
 
   }
 
   if( capabilities & LIBSPECTRUM_MACHINE_CAPABILITY_SE_MEMORY ) {
-    error = write_ramp_chunk( buffer, ptr, length, snap, 8, compress );
-    if( error ) return error;
+    pages[ count++ ] = 8;
   }
 
-  return LIBSPECTRUM_ERROR_NONE;
+  return write_ramp_chunks( buffer, ptr, length, snap, pages, count,
+			    compress );
 }
 
+/* The pages are independent of each other, so compress them all at
+   once, in parallel if possible, and then write them out in order */
 static libspectrum_error
-write_ramp_chunk( libspectrum_byte **buffer, libspectrum_byte **ptr,
-		  size_t *length, libspectrum_snap *snap, int page,
-		  int compress )
+write_ramp_chunks( libspectrum_byte **buffer, libspectrum_byte **ptr,
+		   size_t *length, libspectrum_snap *snap, const int *pages,
+		   size_t count, int compress )
 {
-  libspectrum_error error;
-  const libspectrum_byte *data;
+  const libspectrum_byte *data[ SZX_MAX_RAM_PAGES ];
+  size_t data_length[ SZX_MAX_RAM_PAGES ];
+  libspectrum_byte *compressed_data[ SZX_MAX_RAM_PAGES ];
+  size_t compressed_length[ SZX_MAX_RAM_PAGES ];
+  size_t i;
 
-  data = libspectrum_snap_pages( snap, page );
+  for( i = 0; i < count; i++ ) {
+    data[i] = libspectrum_snap_pages( snap, pages[i] );
+    data_length[i] = 0x4000;
+    compressed_data[i] = NULL;
+    compressed_length[i] = 0;
+  }
 
-  error = write_ram_page( buffer, ptr, length, ZXSTBID_RAMPAGE, data, 0x4000,
-			  page, compress, 0x00 );
-  if( error ) return error;
+#ifdef HAVE_ZLIB_H
+
+  if( compress ) {
+    libspectrum_error error;
+
+    error = libspectrum_zlib_compress_blocks( count, data, data_length,
+					      compressed_data,
+					      compressed_length, compress );
+    if( error ) return error;
+  }
+
+#endif				/* #ifdef HAVE_ZLIB_H */
+
+  for( i = 0; i < count; i++ ) {
+    if( data[i] )
+      write_ram_page_data( buffer, ptr, length, ZXSTBID_RAMPAGE, data[i],
+			   data_length[i], compressed_data[i],
+			   compressed_length[i], pages[i], compress, 0x00 );
+    libspectrum_free( compressed_data[i] );
+  }
 
   return LIBSPECTRUM_ERROR_NONE;
 }
@@ -3094,11 +3123,46 @@ write_ram_page( libspectrum_byte **buffer, libspectrum_byte **ptr,
 #ifdef HAVE_ZLIB_H
   libspectrum_error error;
 #endif
-  libspectrum_byte *block_length, *flags, *compressed_data;
-  int use_compression;
+  libspectrum_byte *compressed_data;
+  size_t compressed_length;
 
   if( !data ) return LIBSPECTRUM_ERROR_NONE;
 
+  compressed_data = NULL;
+  compressed_length = 0;
+
+#ifdef HAVE_ZLIB_H
+
+  if( compress ) {
+    error = libspectrum_zlib_compress_level( data, data_length,
+					     &compressed_data,
+					     &compressed_length, compress );
+    if( error ) return error;
+  }
+
+#endif				/* #ifdef HAVE_ZLIB_H */
+
+  write_ram_page_data( buffer, ptr, length, id, data, data_length,
+		       compressed_data, compressed_length, page, compress,
+		       extra_flags );
+
+  if( compressed_data ) libspectrum_free( compressed_data );
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
+/* Write a page chunk, using the compressed form of the data if we have
+   one and it is worth it */
+static void
+write_ram_page_data( libspectrum_byte **buffer, libspectrum_byte **ptr,
+		     size_t *length, const char *id,
+		     const libspectrum_byte *data, size_t data_length,
+		     const libspectrum_byte *compressed_data,
+		     size_t compressed_length, int page, int compress,
+		     int extra_flags )
+{
+  libspectrum_byte *block_length, *flags;
+
   /* 8 for the chunk header, 3 for the flags and the page number */
   libspectrum_make_room( buffer, 8 + 3, ptr, length );
 
@@ -3112,41 +3176,20 @@ write_ram_page( libspectrum_byte **buffer, libspectrum_byte **ptr,
 
   *(*ptr)++ = (libspectrum_byte)page;
 
-  use_compression = 0;
-  compressed_data = NULL;
-
-#ifdef HAVE_ZLIB_H
-
-  if( compress ) {
-
-    size_t compressed_length;
-
-    error = libspectrum_zlib_compress( data, data_length,
-				       &compressed_data, &compressed_length );
-    if( error ) return error;
-
-    if( compress & LIBSPECTRUM_FLAG_SNAPSHOT_ALWAYS_COMPRESS ||
-        compressed_length < data_length ) {
-      use_compression = 1;
-      data = compressed_data;
-      data_length = compressed_length;
-    }
+  if( compressed_data &&
+      ( compress & LIBSPECTRUM_FLAG_SNAPSHOT_ALWAYS_COMPRESS ||
+        compressed_length < data_length ) ) {
+    extra_flags |= ZXSTRF_COMPRESSED;
+    data = compressed_data;
+    data_length = compressed_length;
   }
 
-#endif				/* #ifdef HAVE_ZLIB_H */
-
-  if( use_compression ) extra_flags |= ZXSTRF_COMPRESSED;
-
   libspectrum_write_dword( &block_length, 3 + data_length );
   libspectrum_write_word( &flags, extra_flags );
 
   libspectrum_make_room( buffer, data_length, ptr, length );
 
   memcpy( *ptr, data, data_length ); *ptr += data_length;
-
-  if( compressed_data ) libspectrum_free( compressed_data );
-
-  return LIBSPECTRUM_ERROR_NONE;
 }
 
 static libspectrum_error
@@ -3208,9 +3251,11 @@ write_b128_chunk( libspectrum_byte **buffer, libspectrum_byte **ptr,
 
       size_t compressed_rom_length;
 
-      error = libspectrum_zlib_compress( rom_data, uncompressed_rom_length,
-                                         &compressed_rom_data,
-                                         &compressed_rom_length );
+      error = libspectrum_zlib_compress_level( rom_data,
+					       uncompressed_rom_length,
+					       &compressed_rom_data,
+					       &compressed_rom_length,
+					       compress );
       if( error ) return error;
 
       if( compress & LIBSPECTRUM_FLAG_SNAPSHOT_ALWAYS_COMPRESS ||
@@ -3302,8 +3347,10 @@ write_if1_chunk( libspectrum_byte **buffer, libspectrum_byte **ptr,
 
     size_t compressed_rom_length;
 
-    error = libspectrum_zlib_compress( rom_data, disk_rom_length,
-				       &compressed_rom_data, &compressed_rom_length );
+    error = libspectrum_zlib_compress_level( rom_data, disk_rom_length,
+					     &compressed_rom_data,
+					     &compressed_rom_length,
+					     compress );
     if( error ) return error;
 
     if( compress & LIBSPECTRUM_FLAG_SNAPSHOT_ALWAYS_COMPRESS ||
@@ -3372,12 +3419,16 @@ write_opus_chunk( libspectrum_byte **buffer, libspectrum_byte **ptr,
 
     size_t compressed_rom_length, compressed_ram_length;
 
-    error = libspectrum_zlib_compress( rom_data, disk_rom_length,
-				       &compressed_rom_data, &compressed_rom_length );
+    error = libspectrum_zlib_compress_level( rom_data, disk_rom_length,
+					     &compressed_rom_data,
+					     &compressed_rom_length,
+					     compress );
     if( error ) return error;
 
-    error = libspectrum_zlib_compress( ram_data, disk_ram_length,
-				       &compressed_ram_data, &compressed_ram_length );
+    error = libspectrum_zlib_compress_level( ram_data, disk_ram_length,
+					     &compressed_ram_data,
+					     &compressed_ram_length,
+					     compress );
     if( error ) {
       if( compressed_rom_data ) libspectrum_free( compressed_rom_data );
       return error;
@@ -3466,12 +3517,16 @@ write_plsd_chunk( libspectrum_byte **buffer, libspectrum_byte **ptr,
 
     size_t compressed_rom_length, compressed_ram_length;
 
-    error = libspectrum_zlib_compress( rom_data, disk_rom_length,
-				       &compressed_rom_data, &compressed_rom_length );
+    error = libspectrum_zlib_compress_level( rom_data, disk_rom_length,
+					     &compressed_rom_data,
+					     &compressed_rom_length,
+					     compress );
     if( error ) return error;
 
-    error = libspectrum_zlib_compress( ram_data, disk_ram_length,
-				       &compressed_ram_data, &compressed_ram_length );
+    error = libspectrum_zlib_compress_level( ram_data, disk_ram_length,
+					     &compressed_ram_data,
+					     &compressed_ram_length,
+					     compress );
     if( error ) {
       if( compressed_rom_data ) libspectrum_free( compressed_rom_data );
       return error;
@@ -3716,9 +3771,11 @@ write_dide_chunk( libspectrum_byte **buffer, libspectrum_byte **ptr,
 
     size_t compressed_eprom_length;
 
-    error = libspectrum_zlib_compress( eprom_data, uncompressed_eprom_length,
-                                       &compressed_eprom_data,
-                                       &compressed_eprom_length );
+    error = libspectrum_zlib_compress_level( eprom_data,
+					     uncompressed_eprom_length,
+					     &compressed_eprom_data,
+					     &compressed_eprom_length,
+					     compress );
     if( error ) return error;
 
     if( compress & LIBSPECTRUM_FLAG_SNAPSHOT_ALWAYS_COMPRESS ||
@@ -3831,8 +3888,9 @@ write_snef_chunk( libspectrum_byte **buffer, libspectrum_byte **ptr,
   if( compress ) {
     size_t compressed_length;
 
-    error = libspectrum_zlib_compress( flash_data, flash_length,
-      &compressed_flash_data, &compressed_length );
+    error = libspectrum_zlib_compress_level( flash_data, flash_length,
+					     &compressed_flash_data,
+					     &compressed_length, compress );
     if( error ) return error;
 
     if( compress & LIBSPECTRUM_FLAG_SNAPSHOT_ALWAYS_COMPRESS ||
@@ -3887,8 +3945,9 @@ write_sner_chunk( libspectrum_byte **buffer, libspectrum_byte **ptr,
   if( compress ) {
     size_t compressed_length;
 
-    error = libspectrum_zlib_compress( ram_data, ram_length,
-      &compressed_ram_data, &compressed_length );
+    error = libspectrum_zlib_compress_level( ram_data, ram_length,
+					     &compressed_ram_data,
+					     &compressed_length, compress );
     if( error ) return error;
 
     if( compress & LIBSPECTRUM_FLAG_SNAPSHOT_ALWAYS_COMPRESS ||
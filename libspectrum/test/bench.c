@@ -0,0 +1,932 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "internals.h"
+
+/* Benchmarks for libspectrum. Each prints one line per measurement:
+
+     <benchmark> <tab> <variant> <tab> <MB/s> <tab> <allocations per run>
+
+   so the output can be compared between builds and releases. The data
+   is synthesised here, so the numbers are comparable between machines;
+   files given on the command line are benchmarked too */
+
+const char *progname;
+static const char *LIBSPECTRUM_MIN_VERSION = "0.4.0";
+
+typedef int (*bench_fn)( void );
+
+/* How long to run each measurement for */
+static const double BENCH_SECONDS = 0.5;
+
+/* Count every allocation libspectrum makes */
+static unsigned long allocations;
+
+static void*
+counting_malloc( size_t size )
+{
+  allocations++;
+  return malloc( size );
+}
+
+static void*
+counting_calloc( size_t nmemb, size_t size )
+{
+  allocations++;
+  return calloc( nmemb, size );
+}
+
+static void*
+counting_realloc( void *ptr, size_t size )
+{
+  allocations++;
+  return realloc( ptr, size );
+}
+
+static libspectrum_mem_vtable_t counting_vtable = {
+  counting_malloc,
+  counting_calloc,
+  counting_realloc,
+  free,
+};
+
+typedef void (*bench_op)( const libspectrum_byte *data, size_t length,
+			  void *user_data );
+
+/* Run 'op' on 'data' repeatedly for about BENCH_SECONDS and report the
+   throughput in MB/s of 'length' bytes and the allocations made each
+   time */
+static void
+measure( const char *benchmark, const char *variant, bench_op op,
+	 const libspectrum_byte *data, size_t length, void *user_data )
+{
+  clock_t start, elapsed;
+  unsigned long start_allocations;
+  size_t runs = 0;
+
+  start = clock();
+  start_allocations = allocations;
+  do {
+    op( data, length, user_data );
+    runs++;
+    elapsed = clock() - start;
+  } while( elapsed < BENCH_SECONDS * CLOCKS_PER_SEC );
+
+  if( !elapsed ) elapsed = 1;
+
+  printf( "%s\t%s\t%.1f\t%.1f\n", benchmark, variant,
+	  (double)runs * length / ( 1024 * 1024 ) /
+	    ( (double)elapsed / CLOCKS_PER_SEC ),
+	  (double)( allocations - start_allocations ) / runs );
+}
+
+/* Something like a Pentagon 1024's worth of RAM: blank pages, screens
+   with lots of short runs, code-like random bytes and some 0xed runs */
+static libspectrum_byte*
+make_memory( size_t pages )
+{
+  libspectrum_byte *memory;
+  libspectrum_dword seed = 1;
+  size_t i, j;
+
+  memory = libspectrum_new( libspectrum_byte, pages * 0x4000 );
+
+  for( i = 0; i < pages; i++ ) {
+    libspectrum_byte *page = memory + i * 0x4000;
+
+    for( j = 0; j < 0x4000; j++ ) {
+      seed = seed * 1103515245 + 12345;
+
+      switch( i % 4 ) {
+      case 0: page[j] = 0; break;
+      case 1: page[j] = ( seed >> 28 ) ? page[ j ? j - 1 : 0 ] : seed >> 16;
+	break;
+      case 2: page[j] = seed >> 16; break;
+      case 3: page[j] = ( seed >> 29 ) ? 0xed : seed >> 16; break;
+      }
+    }
+  }
+
+  return memory;
+}
+
+/* The original byte at a time implementation of the .z80 RLE scheme,
+   kept to compare against */
+
+static void
+reference_compress( libspectrum_byte **dest, size_t *dest_length,
+		    const libspectrum_byte *src, size_t src_length )
+{
+  const libspectrum_byte *in_ptr;
+  libspectrum_byte *out_ptr;
+  int last_char_ed = 0;
+
+  if( *dest_length == 0 ) {
+    *dest_length = src_length/2;
+    *dest = libspectrum_new( libspectrum_byte, *dest_length );
+  }
+
+  in_ptr = src;
+  out_ptr = *dest;
+
+  while( in_ptr < src + src_length ) {
+
+    if( in_ptr == src + src_length - 1 ) {
+      libspectrum_make_room( dest, 1, &out_ptr, dest_length );
+      *out_ptr++ = *in_ptr++;
+      continue;
+    }
+
+    if( *in_ptr == *(in_ptr+1) && !last_char_ed ) {
+
+      libspectrum_byte repeated;
+      size_t run_length;
+
+      last_char_ed = 0;
+
+      repeated = *in_ptr;
+      in_ptr += 2;
+      run_length = 2;
+
+      while( in_ptr < src + src_length && *in_ptr == repeated &&
+	     run_length < 0xff ) {
+	run_length++;
+	in_ptr++;
+      }
+
+      if( run_length >= 5 || repeated == 0xed ) {
+	libspectrum_make_room( dest, 4, &out_ptr, dest_length );
+	*out_ptr++ = 0xed;
+	*out_ptr++ = 0xed;
+	*out_ptr++ = run_length;
+	*out_ptr++ = repeated;
+      } else {
+	libspectrum_make_room( dest, run_length, &out_ptr, dest_length );
+	while(run_length--) *out_ptr++ = repeated;
+      }
+
+    } else {
+
+      last_char_ed = ( *in_ptr == 0xed ) ? 1 : 0;
+      libspectrum_make_room( dest, 1, &out_ptr, dest_length );
+      *out_ptr++ = *in_ptr++;
+
+    }
+
+  }
+
+  *dest_length = out_ptr - *dest;
+}
+
+static void
+reference_uncompress( libspectrum_byte **dest, size_t *dest_length,
+		      const libspectrum_byte *src, size_t src_length )
+{
+  const libspectrum_byte *in_ptr;
+  libspectrum_byte *out_ptr;
+
+  if( *dest_length == 0 ) {
+    *dest_length = src_length / 2;
+    *dest = libspectrum_new( libspectrum_byte, *dest_length );
+  }
+
+  in_ptr = src;
+  out_ptr = *dest;
+
+  while( in_ptr < src + src_length ) {
+
+    if( in_ptr == src + src_length - 1 ) {
+      libspectrum_make_room( dest, 1, &out_ptr, dest_length );
+      *out_ptr++ = *in_ptr++;
+      continue;
+    }
+
+    if( *in_ptr == 0xed && *(in_ptr+1) == 0xed ) {
+
+      size_t run_length;
+      libspectrum_byte repeated;
+
+      in_ptr+=2;
+      run_length = *in_ptr++;
+      repeated = *in_ptr++;
+
+      libspectrum_make_room( dest, run_length, &out_ptr, dest_length );
+      while(run_length--) *out_ptr++ = repeated;
+
+    } else {
+
+      libspectrum_make_room( dest, 1, &out_ptr, dest_length );
+      *out_ptr++ = *in_ptr++;
+
+    }
+
+  }
+
+  *dest_length = out_ptr - *dest;
+}
+
+typedef void (*rle_fn)( libspectrum_byte **dest, size_t *dest_length,
+			const libspectrum_byte *src, size_t src_length );
+
+/* Each page of memory is a separate block, as in a .z80 file */
+static void
+rle_pages( const libspectrum_byte *data, size_t length, void *user_data )
+{
+  rle_fn fn = *(rle_fn*)user_data;
+  size_t i;
+
+  for( i = 0; i < length; i += 0x4000 ) {
+    libspectrum_byte *out = NULL; size_t out_length = 0;
+    fn( &out, &out_length, data + i, 0x4000 );
+    libspectrum_free( out );
+  }
+}
+
+/* The compressed pages, one after the other */
+typedef struct rle_blocks_t {
+  rle_fn fn;
+  size_t count;
+  libspectrum_byte *block[ 64 ];
+  size_t length[ 64 ];
+} rle_blocks_t;
+
+static void
+unrle_pages( const libspectrum_byte *data GCC_UNUSED,
+	     size_t length GCC_UNUSED, void *user_data )
+{
+  rle_blocks_t *blocks = user_data;
+  size_t i;
+
+  for( i = 0; i < blocks->count; i++ ) {
+    libspectrum_byte *out = NULL; size_t out_length = 0;
+    blocks->fn( &out, &out_length, blocks->block[i], blocks->length[i] );
+    libspectrum_free( out );
+  }
+}
+
+static int
+bench_z80_rle( void )
+{
+  const size_t pages = 64;
+  libspectrum_byte *memory;
+  rle_blocks_t blocks;
+  rle_fn fn;
+  size_t i;
+  int error = 0;
+
+  memory = make_memory( pages );
+
+  /* Check the new implementation gives exactly the same results as the
+     old one before timing anything */
+  blocks.count = pages;
+  for( i = 0; i < pages; i++ ) {
+    libspectrum_byte *reference = NULL, *uncompressed = NULL;
+    size_t reference_length = 0, uncompressed_length = 0;
+
+    blocks.block[i] = NULL; blocks.length[i] = 0;
+    libspectrum_z80_compress_block( &blocks.block[i], &blocks.length[i],
+				    memory + i * 0x4000, 0x4000 );
+    reference_compress( &reference, &reference_length, memory + i * 0x4000,
+			0x4000 );
+    libspectrum_z80_uncompress_block( &uncompressed, &uncompressed_length,
+				      blocks.block[i], blocks.length[i] );
+
+    if( blocks.length[i] != reference_length ||
+	memcmp( blocks.block[i], reference, reference_length ) ||
+	uncompressed_length != 0x4000 ||
+	memcmp( uncompressed, memory + i * 0x4000, 0x4000 ) ) {
+      fprintf( stderr, "%s: z80 RLE mismatch on page %lu\n", progname,
+	       (unsigned long)i );
+      error = 1;
+    }
+
+    libspectrum_free( reference );
+    libspectrum_free( uncompressed );
+  }
+
+  if( !error ) {
+    fn = reference_compress;
+    measure( "z80-rle-compress", "reference", rle_pages, memory,
+	     pages * 0x4000, &fn );
+    fn = libspectrum_z80_compress_block;
+    measure( "z80-rle-compress", "libspectrum", rle_pages, memory,
+	     pages * 0x4000, &fn );
+
+    blocks.fn = reference_uncompress;
+    measure( "z80-rle-uncompress", "reference", unrle_pages, memory,
+	     pages * 0x4000, &blocks );
+    blocks.fn = libspectrum_z80_uncompress_block;
+    measure( "z80-rle-uncompress", "libspectrum", unrle_pages, memory,
+	     pages * 0x4000, &blocks );
+  }
+
+  for( i = 0; i < pages; i++ ) libspectrum_free( blocks.block[i] );
+  libspectrum_free( memory );
+
+  return error;
+}
+
+/* The file format benchmarks. Each has a synthesised file in each format,
+   and any files given on the command line are added to them */
+
+#define CORPUS_MAX_FILES 64
+
+typedef struct corpus_file_t {
+  const char *name;		/* "synthetic" or the filename */
+  libspectrum_id_t type;
+  libspectrum_class_t class;
+  libspectrum_byte *data;
+  size_t length;
+
+  /* The file as read, for the write and edge benchmarks */
+  libspectrum_snap *snap;
+  libspectrum_tape *tape;
+  libspectrum_rzx *rzx;
+} corpus_file_t;
+
+static corpus_file_t corpus[ CORPUS_MAX_FILES ];
+static size_t corpus_count;
+
+static void
+corpus_add( const char *name, libspectrum_id_t type, libspectrum_class_t class,
+	    libspectrum_byte *data, size_t length )
+{
+  corpus_file_t *file;
+
+  if( corpus_count == CORPUS_MAX_FILES ) {
+    fprintf( stderr, "%s: too many files; ignoring `%s'\n", progname, name );
+    libspectrum_free( data );
+    return;
+  }
+
+  file = &corpus[ corpus_count++ ];
+  file->name = name; file->type = type; file->class = class;
+  file->data = data; file->length = length;
+  file->snap = NULL; file->tape = NULL; file->rzx = NULL;
+}
+
+static const char*
+format_name( libspectrum_id_t type )
+{
+  switch( type ) {
+  case LIBSPECTRUM_ID_SNAPSHOT_SNA: return "sna";
+  case LIBSPECTRUM_ID_SNAPSHOT_SZX: return "szx";
+  case LIBSPECTRUM_ID_SNAPSHOT_Z80: return "z80";
+  case LIBSPECTRUM_ID_TAPE_TAP: return "tap";
+  case LIBSPECTRUM_ID_TAPE_TZX: return "tzx";
+  case LIBSPECTRUM_ID_TAPE_PZX: return "pzx";
+  case LIBSPECTRUM_ID_TAPE_CSW: return "csw";
+  case LIBSPECTRUM_ID_RECORDING_RZX: return "rzx";
+  default: return "other";
+  }
+}
+
+static void
+put_byte( libspectrum_byte **ptr, libspectrum_byte b )
+{
+  *(*ptr)++ = b;
+}
+
+static void
+put_word( libspectrum_byte **ptr, libspectrum_word w )
+{
+  *(*ptr)++ = w & 0xff; *(*ptr)++ = w >> 8;
+}
+
+static void
+put_dword( libspectrum_byte **ptr, libspectrum_dword d )
+{
+  put_word( ptr, d & 0xffff ); put_word( ptr, d >> 16 );
+}
+
+/* The blocks on the synthetic tapes: alternately a header sized block
+   and a screen sized one, as from a typical commercial tape */
+#define TAPE_BLOCKS 32
+
+static size_t
+tape_block_length( size_t i )
+{
+  return i % 2 ? 6914 : 19;
+}
+
+static void
+tape_block_data( libspectrum_byte **ptr, const libspectrum_byte *memory,
+		 size_t i )
+{
+  size_t length = tape_block_length( i );
+
+  memcpy( *ptr, memory + i * 0x100, length ); *ptr += length;
+}
+
+static libspectrum_byte*
+make_tap( const libspectrum_byte *memory, size_t *length )
+{
+  libspectrum_byte *buffer, *ptr;
+  size_t i;
+
+  buffer = ptr = libspectrum_new( libspectrum_byte,
+				  TAPE_BLOCKS * ( 2 + 6914 ) );
+
+  for( i = 0; i < TAPE_BLOCKS; i++ ) {
+    put_word( &ptr, tape_block_length( i ) );
+    tape_block_data( &ptr, memory, i );
+  }
+
+  *length = ptr - buffer;
+  return buffer;
+}
+
+/* Every other data block is a turbo block */
+static libspectrum_byte*
+make_tzx( const libspectrum_byte *memory, size_t *length )
+{
+  libspectrum_byte *buffer, *ptr;
+  size_t i;
+
+  buffer = ptr = libspectrum_new( libspectrum_byte,
+				  10 + TAPE_BLOCKS * ( 19 + 6914 ) );
+
+  memcpy( ptr, "ZXTape!\x1a\x01\x14", 10 ); ptr += 10;
+
+  for( i = 0; i < TAPE_BLOCKS; i++ ) {
+    if( i % 4 == 3 ) {
+      put_byte( &ptr, 0x11 );
+      put_word( &ptr, 2168 );		/* pilot */
+      put_word( &ptr, 667 );		/* sync1 */
+      put_word( &ptr, 735 );		/* sync2 */
+      put_word( &ptr, 600 );		/* zero */
+      put_word( &ptr, 1200 );		/* one */
+      put_word( &ptr, 3223 );		/* pilot pulses */
+      put_byte( &ptr, 8 );		/* bits in last byte */
+      put_word( &ptr, 1000 );		/* pause */
+      put_word( &ptr, tape_block_length( i ) );
+      put_byte( &ptr, 0 );
+    } else {
+      put_byte( &ptr, 0x10 );
+      put_word( &ptr, 1000 );
+      put_word( &ptr, tape_block_length( i ) );
+    }
+    tape_block_data( &ptr, memory, i );
+  }
+
+  *length = ptr - buffer;
+  return buffer;
+}
+
+/* PULS and DATA blocks for the ROM loader's timings */
+static libspectrum_byte*
+make_pzx( const libspectrum_byte *memory, size_t *length )
+{
+  libspectrum_byte *buffer, *ptr;
+  size_t i;
+
+  buffer = ptr = libspectrum_new( libspectrum_byte,
+				  10 + TAPE_BLOCKS * ( 28 + 20 + 6914 ) );
+
+  memcpy( ptr, "PZXT", 4 ); ptr += 4;
+  put_dword( &ptr, 2 );
+  put_byte( &ptr, 1 ); put_byte( &ptr, 0 );
+
+  for( i = 0; i < TAPE_BLOCKS; i++ ) {
+    size_t block_length = tape_block_length( i );
+
+    memcpy( ptr, "PULS", 4 ); ptr += 4;
+    put_dword( &ptr, 8 );
+    put_word( &ptr, 0x8000 | ( i % 2 ? 3223 : 8063 ) );
+    put_word( &ptr, 2168 );
+    put_word( &ptr, 667 );
+    put_word( &ptr, 735 );
+
+    memcpy( ptr, "DATA", 4 ); ptr += 4;
+    put_dword( &ptr, 8 + 8 + block_length );
+    put_dword( &ptr, block_length * 8 );
+    put_word( &ptr, 945 );			/* tail */
+    put_byte( &ptr, 2 ); put_byte( &ptr, 2 );
+    put_word( &ptr, 855 ); put_word( &ptr, 855 );
+    put_word( &ptr, 1710 ); put_word( &ptr, 1710 );
+    tape_block_data( &ptr, memory, i );
+  }
+
+  *length = ptr - buffer;
+  return buffer;
+}
+
+/* A 128K snapshot of something like a running game */
+static libspectrum_snap*
+make_snap( const libspectrum_byte *memory )
+{
+  libspectrum_snap *snap = libspectrum_snap_alloc();
+  size_t i;
+
+  libspectrum_snap_set_machine( snap, LIBSPECTRUM_MACHINE_128 );
+  libspectrum_snap_set_pc( snap, 0x8000 );
+  libspectrum_snap_set_sp( snap, 0xff00 );
+  libspectrum_snap_set_out_128_memoryport( snap, 0x10 );
+
+  for( i = 0; i < 8; i++ ) {
+    libspectrum_byte *page = libspectrum_new( libspectrum_byte, 0x4000 );
+    memcpy( page, memory + i * 0x4000, 0x4000 );
+    libspectrum_snap_set_pages( snap, i, page );
+  }
+
+  return snap;
+}
+
+/* A couple of seconds of recording with a keyboard reading loop */
+static libspectrum_byte*
+make_rzx( const libspectrum_byte *memory, size_t *length )
+{
+  libspectrum_rzx *rzx = libspectrum_rzx_alloc();
+  libspectrum_byte *buffer = NULL;
+  size_t i;
+
+  libspectrum_rzx_add_snap( rzx, make_snap( memory ), 0 );
+  libspectrum_rzx_start_input( rzx, 0 );
+  for( i = 0; i < 500; i++ )
+    libspectrum_rzx_store_frame( rzx, 17000 + i, 64,
+				 (libspectrum_byte*)memory + 0x4000 + i * 64 );
+  libspectrum_rzx_stop_input( rzx );
+
+  *length = 0;
+  if( libspectrum_rzx_write( &buffer, length, rzx,
+			     LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL, 1, NULL ) ) {
+    libspectrum_free( buffer );
+    buffer = NULL;
+  }
+
+  libspectrum_rzx_free( rzx );
+  return buffer;
+}
+
+static void
+make_corpus( void )
+{
+  static const libspectrum_id_t snap_types[] = {
+    LIBSPECTRUM_ID_SNAPSHOT_Z80,
+    LIBSPECTRUM_ID_SNAPSHOT_SZX,
+    LIBSPECTRUM_ID_SNAPSHOT_SNA,
+  };
+
+  libspectrum_byte *memory, *buffer;
+  libspectrum_snap *snap;
+  libspectrum_tape *tape;
+  size_t i, length;
+
+  memory = make_memory( 8 );
+
+  snap = make_snap( memory );
+  for( i = 0; i < ARRAY_SIZE( snap_types ); i++ ) {
+    int flags;
+
+    buffer = NULL; length = 0;
+    if( !libspectrum_snap_write( &buffer, &length, &flags, snap,
+				 snap_types[i], NULL, 0 ) )
+      corpus_add( "synthetic", snap_types[i], LIBSPECTRUM_CLASS_SNAPSHOT,
+		  buffer, length );
+  }
+  libspectrum_snap_free( snap );
+
+  buffer = make_tap( memory, &length );
+  corpus_add( "synthetic", LIBSPECTRUM_ID_TAPE_TAP, LIBSPECTRUM_CLASS_TAPE,
+	      buffer, length );
+
+  buffer = make_tzx( memory, &length );
+  corpus_add( "synthetic", LIBSPECTRUM_ID_TAPE_TZX, LIBSPECTRUM_CLASS_TAPE,
+	      buffer, length );
+
+  /* The CSW is the TZX resampled */
+  tape = libspectrum_tape_alloc();
+  if( !libspectrum_tape_read( tape, buffer, length, LIBSPECTRUM_ID_TAPE_TZX,
+			      NULL ) ) {
+    buffer = NULL; length = 0;
+    if( !libspectrum_tape_write( &buffer, &length, tape,
+				 LIBSPECTRUM_ID_TAPE_CSW ) )
+      corpus_add( "synthetic", LIBSPECTRUM_ID_TAPE_CSW,
+		  LIBSPECTRUM_CLASS_TAPE, buffer, length );
+  }
+  libspectrum_tape_free( tape );
+
+  buffer = make_pzx( memory, &length );
+  corpus_add( "synthetic", LIBSPECTRUM_ID_TAPE_PZX, LIBSPECTRUM_CLASS_TAPE,
+	      buffer, length );
+
+  buffer = make_rzx( memory, &length );
+  if( buffer )
+    corpus_add( "synthetic", LIBSPECTRUM_ID_RECORDING_RZX,
+		LIBSPECTRUM_CLASS_RECORDING, buffer, length );
+
+  libspectrum_free( memory );
+}
+
+/* Read a file given on the command line, uncompressing it if need be */
+static int
+add_file( const char *filename )
+{
+  libspectrum_byte *buffer, *new_buffer;
+  size_t length, new_length;
+  libspectrum_id_t type;
+  libspectrum_class_t class;
+  char *new_filename;
+  FILE *f;
+  long size;
+
+  f = fopen( filename, "rb" );
+  if( !f ) {
+    fprintf( stderr, "%s: couldn't open `%s': %s\n", progname, filename,
+	     strerror( errno ) );
+    return 1;
+  }
+
+  if( fseek( f, 0, SEEK_END ) || ( size = ftell( f ) ) < 0 ||
+      fseek( f, 0, SEEK_SET ) ) {
+    fprintf( stderr, "%s: couldn't find length of `%s': %s\n", progname,
+	     filename, strerror( errno ) );
+    fclose( f );
+    return 1;
+  }
+
+  length = size;
+  buffer = libspectrum_new( libspectrum_byte, length ? length : 1 );
+  if( fread( buffer, 1, length, f ) != length ) {
+    fprintf( stderr, "%s: error reading from `%s'\n", progname, filename );
+    libspectrum_free( buffer ); fclose( f );
+    return 1;
+  }
+  fclose( f );
+
+  if( libspectrum_identify_file_with_class( &type, &class, filename, buffer,
+					    length ) ) {
+    libspectrum_free( buffer );
+    return 1;
+  }
+
+  if( class == LIBSPECTRUM_CLASS_COMPRESSED ) {
+    new_buffer = NULL; new_filename = NULL;
+    if( libspectrum_uncompress_file( &new_buffer, &new_length, &new_filename,
+				     type, buffer, length, filename ) ) {
+      libspectrum_free( buffer );
+      return 1;
+    }
+    libspectrum_free( buffer );
+    buffer = new_buffer; length = new_length;
+
+    if( libspectrum_identify_file_with_class( &type, &class, new_filename,
+					      buffer, length ) ) {
+      free( new_filename ); libspectrum_free( buffer );
+      return 1;
+    }
+    free( new_filename );
+  }
+
+  switch( class ) {
+  case LIBSPECTRUM_CLASS_SNAPSHOT:
+  case LIBSPECTRUM_CLASS_TAPE:
+  case LIBSPECTRUM_CLASS_RECORDING:
+    corpus_add( filename, type, class, buffer, length );
+    return 0;
+  default:
+    fprintf( stderr, "%s: `%s' is not a snapshot, tape or recording\n",
+	     progname, filename );
+    libspectrum_free( buffer );
+    return 1;
+  }
+}
+
+static void
+snap_read( const libspectrum_byte *data, size_t length, void *user_data )
+{
+  const corpus_file_t *file = user_data;
+  libspectrum_snap *snap = libspectrum_snap_alloc();
+
+  libspectrum_snap_read( snap, data, length, file->type, NULL );
+  libspectrum_snap_free( snap );
+}
+
+static void
+snap_write( const libspectrum_byte *data GCC_UNUSED, size_t length GCC_UNUSED,
+	    void *user_data )
+{
+  const corpus_file_t *file = user_data;
+  libspectrum_byte *buffer = NULL;
+  size_t buffer_length = 0;
+  int flags;
+
+  libspectrum_snap_write( &buffer, &buffer_length, &flags, file->snap,
+			  file->type, NULL, 0 );
+  libspectrum_free( buffer );
+}
+
+static void
+tape_read( const libspectrum_byte *data, size_t length, void *user_data )
+{
+  const corpus_file_t *file = user_data;
+  libspectrum_tape *tape = libspectrum_tape_alloc();
+
+  libspectrum_tape_read( tape, data, length, file->type, NULL );
+  libspectrum_tape_free( tape );
+}
+
+static void
+tape_write( const libspectrum_byte *data GCC_UNUSED,
+	    size_t length GCC_UNUSED, void *user_data )
+{
+  const corpus_file_t *file = user_data;
+  libspectrum_byte *buffer = NULL;
+  size_t buffer_length = 0;
+
+  libspectrum_tape_write( &buffer, &buffer_length, file->tape, file->type );
+  libspectrum_free( buffer );
+}
+
+static void
+tape_write_csw( const libspectrum_byte *data GCC_UNUSED,
+		size_t length GCC_UNUSED, void *user_data )
+{
+  const corpus_file_t *file = user_data;
+  libspectrum_byte *buffer = NULL;
+  size_t buffer_length = 0;
+
+  libspectrum_tape_write( &buffer, &buffer_length, file->tape,
+			  LIBSPECTRUM_ID_TAPE_CSW );
+  libspectrum_free( buffer );
+}
+
+/* Every edge on the tape, as the emulator would see them */
+static void
+tape_edges( const libspectrum_byte *data GCC_UNUSED,
+	    size_t length GCC_UNUSED, void *user_data )
+{
+  const corpus_file_t *file = user_data;
+  libspectrum_dword tstates;
+  int flags;
+
+  do {
+    if( libspectrum_tape_get_next_edge( &tstates, &flags, file->tape ) )
+      break;
+  } while( !( flags & LIBSPECTRUM_TAPE_FLAGS_TAPE ) );
+}
+
+static void
+rzx_read( const libspectrum_byte *data, size_t length,
+	  void *user_data GCC_UNUSED )
+{
+  libspectrum_rzx *rzx = libspectrum_rzx_alloc();
+
+  libspectrum_rzx_read( rzx, data, length );
+  libspectrum_rzx_free( rzx );
+}
+
+static void
+rzx_write( const libspectrum_byte *data GCC_UNUSED, size_t length GCC_UNUSED,
+	   void *user_data )
+{
+  const corpus_file_t *file = user_data;
+  libspectrum_byte *buffer = NULL;
+  size_t buffer_length = 0;
+
+  libspectrum_rzx_write( &buffer, &buffer_length, file->rzx,
+			 LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL, 1, NULL );
+  libspectrum_free( buffer );
+}
+
+/* Writing is measured only for the formats libspectrum can write. The
+   CSW writer can't write the RLE blocks from a .csw file, so CSW writing
+   is measured by converting the TZX files. Edge throughput is in terms of
+   the bytes in the file */
+static void
+bench_file( corpus_file_t *file )
+{
+  char benchmark[ 32 ];
+  const char *format = format_name( file->type );
+
+  switch( file->class ) {
+
+  case LIBSPECTRUM_CLASS_SNAPSHOT:
+    snprintf( benchmark, sizeof( benchmark ), "%s-read", format );
+    measure( benchmark, file->name, snap_read, file->data, file->length,
+	     file );
+
+    file->snap = libspectrum_snap_alloc();
+    if( !libspectrum_snap_read( file->snap, file->data, file->length,
+				file->type, NULL ) ) {
+      snprintf( benchmark, sizeof( benchmark ), "%s-write", format );
+      measure( benchmark, file->name, snap_write, file->data, file->length,
+	       file );
+    }
+    libspectrum_snap_free( file->snap ); file->snap = NULL;
+    break;
+
+  case LIBSPECTRUM_CLASS_TAPE:
+    snprintf( benchmark, sizeof( benchmark ), "%s-read", format );
+    measure( benchmark, file->name, tape_read, file->data, file->length,
+	     file );
+
+    file->tape = libspectrum_tape_alloc();
+    if( !libspectrum_tape_read( file->tape, file->data, file->length,
+				file->type, NULL ) ) {
+      if( file->type == LIBSPECTRUM_ID_TAPE_TAP ||
+	  file->type == LIBSPECTRUM_ID_TAPE_TZX ) {
+	snprintf( benchmark, sizeof( benchmark ), "%s-write", format );
+	measure( benchmark, file->name, tape_write, file->data, file->length,
+		 file );
+      }
+      if( file->type == LIBSPECTRUM_ID_TAPE_TZX )
+	measure( "csw-write", file->name, tape_write_csw, file->data,
+		 file->length, file );
+      snprintf( benchmark, sizeof( benchmark ), "%s-edges", format );
+      measure( benchmark, file->name, tape_edges, file->data, file->length,
+	       file );
+    }
+    libspectrum_tape_free( file->tape ); file->tape = NULL;
+    break;
+
+  case LIBSPECTRUM_CLASS_RECORDING:
+    snprintf( benchmark, sizeof( benchmark ), "%s-read", format );
+    measure( benchmark, file->name, rzx_read, file->data, file->length,
+	     NULL );
+
+    file->rzx = libspectrum_rzx_alloc();
+    if( !libspectrum_rzx_read( file->rzx, file->data, file->length ) ) {
+      snprintf( benchmark, sizeof( benchmark ), "%s-write", format );
+      measure( benchmark, file->name, rzx_write, file->data, file->length,
+	       file );
+    }
+    libspectrum_rzx_free( file->rzx ); file->rzx = NULL;
+    break;
+
+  default:
+    break;
+
+  }
+}
+
+static int
+bench_formats( void )
+{
+  size_t i;
+
+  make_corpus();
+
+  for( i = 0; i < corpus_count; i++ ) bench_file( &corpus[i] );
+
+  return 0;
+}
+
+struct bench_description {
+  const char *name;
+  bench_fn bench;
+};
+
+static struct bench_description benches[] = {
+  { "z80-rle", bench_z80_rle },
+  { "formats", bench_formats },
+};
+
+int
+main( int argc, char *argv[] )
+{
+  size_t i;
+  int j, named = 0, error = 0;
+
+  progname = argv[0];
+
+  if( libspectrum_check_version( LIBSPECTRUM_MIN_VERSION ) ) {
+    if( libspectrum_init() ) return 2;
+  } else {
+    fprintf( stderr, "%s: libspectrum version %s found, but %s required",
+	     progname, libspectrum_version(), LIBSPECTRUM_MIN_VERSION );
+    return 2;
+  }
+
+  libspectrum_mem_set_vtable( &counting_vtable );
+
+  /* Anything which isn't the name of a benchmark is a file to add to
+     the format benchmarks */
+  for( j = 1; j < argc; j++ ) {
+    for( i = 0; i < ARRAY_SIZE( benches ); i++ )
+      if( !strcmp( argv[j], benches[i].name ) ) break;
+
+    if( i < ARRAY_SIZE( benches ) ) {
+      named = 1;
+    } else if( add_file( argv[j] ) ) {
+      error = 1;
+    }
+  }
+
+  /* Run everything, or just the benchmarks named on the command line */
+  for( i = 0; i < ARRAY_SIZE( benches ); i++ ) {
+    int run = !named;
+
+    for( j = 1; j < argc; j++ )
+      if( !strcmp( argv[j], benches[i].name ) ) run = 1;
+
+    if( run && benches[i].bench() ) error = 1;
+  }
+
+  for( i = 0; i < corpus_count; i++ ) libspectrum_free( corpus[i].data );
+
+  return error;
+}
@@ -733,6 +733,307 @@ test_27( void )
   return r;
 }
 
+static void
+ide_select( libspectrum_ide_channel *chn, int sector_number,
+	    libspectrum_byte command )
+{
+  libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_HEAD_DRIVE, 0xe0 );
+  libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_SECTOR_COUNT, 1 );
+  libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_SECTOR,
+			 sector_number & 0xff );
+  libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_CYLINDER_LOW,
+			 sector_number >> 8 );
+  libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_CYLINDER_HIGH, 0 );
+  libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_COMMAND_STATUS,
+			 command );
+}
+
+static int
+ide_check_sector( libspectrum_ide_channel *chn, int sector_number,
+		  libspectrum_byte value )
+{
+  int i, errors = 0;
+
+  ide_select( chn, sector_number, 0x20 );
+  for( i = 0; i < 512; i++ )
+    if( libspectrum_ide_read( chn, LIBSPECTRUM_IDE_REGISTER_DATA ) != value )
+      errors++;
+
+  if( errors )
+    fprintf( stderr, "%s: sector %d did not contain 0x%02x\n", progname,
+	     sector_number, value );
+
+  return errors;
+}
+
+/* HDF images may be shorter than their geometry, and writes are held
+   until committed */
+static test_return_t
+test_28( void )
+{
+  const char *filename = DYNAMIC_TEST_PATH( "short.hdf" );
+  libspectrum_byte header[ 0x80 ], sector[ 512 ];
+  libspectrum_ide_channel *chn;
+  FILE *f;
+  long length;
+  int i, errors = 0;
+
+  /* 16 cylinders, 4 heads, 16 sectors, but only 8 sectors in the file */
+  memset( header, 0, sizeof( header ) );
+  memcpy( header, "RS-IDE\x1a\x10", 8 );
+  header[ 0x09 ] = 0x80;
+  header[ 0x16 + 2 ] = 16;
+  header[ 0x16 + 6 ] = 4;
+  header[ 0x16 + 12 ] = 16;
+
+  f = fopen( filename, "wb" );
+  if( !f ) {
+    fprintf( stderr, "%s: couldn't create `%s': %s\n", progname, filename,
+	     strerror( errno ) );
+    return TEST_INCOMPLETE;
+  }
+  fwrite( header, sizeof( header ), 1, f );
+  for( i = 0; i < 8; i++ ) {
+    memset( sector, i, sizeof( sector ) );
+    fwrite( sector, sizeof( sector ), 1, f );
+  }
+  if( fclose( f ) ) return TEST_INCOMPLETE;
+
+  chn = libspectrum_ide_alloc( LIBSPECTRUM_IDE_DATA16 );
+  if( libspectrum_ide_insert( chn, LIBSPECTRUM_IDE_MASTER, filename ) ) {
+    libspectrum_ide_free( chn );
+    return TEST_INCOMPLETE;
+  }
+  libspectrum_ide_reset( chn );
+
+  errors += ide_check_sector( chn, 3, 3 );
+  errors += ide_check_sector( chn, 600, 0 );
+
+  ide_select( chn, 600, 0x30 );
+  for( i = 0; i < 512; i++ )
+    libspectrum_ide_write( chn, LIBSPECTRUM_IDE_REGISTER_DATA, 0xaa );
+
+  errors += ide_check_sector( chn, 600, 0xaa );
+  errors += ide_check_sector( chn, 601, 0 );
+
+  if( !libspectrum_ide_dirty( chn, LIBSPECTRUM_IDE_MASTER ) ) {
+    fprintf( stderr, "%s: disk not dirty after write\n", progname );
+    errors++;
+  }
+
+  if( libspectrum_ide_commit( chn, LIBSPECTRUM_IDE_MASTER ) ||
+      libspectrum_ide_dirty( chn, LIBSPECTRUM_IDE_MASTER ) ) {
+    fprintf( stderr, "%s: commit failed\n", progname );
+    errors++;
+  }
+
+  errors += ide_check_sector( chn, 600, 0xaa );
+  errors += ide_check_sector( chn, 7, 7 );
+
+  libspectrum_ide_free( chn );
+
+  f = fopen( filename, "rb" );
+  if( !f ) return TEST_INCOMPLETE;
+  fseek( f, 0, SEEK_END );
+  length = ftell( f );
+  fclose( f );
+  unlink( filename );
+
+  if( length != 0x80 + 601 * 512 ) {
+    fprintf( stderr, "%s: image is %ld bytes long after commit\n", progname,
+	     length );
+    errors++;
+  }
+
+  return errors ? TEST_FAIL : TEST_PASS;
+}
+
+/* Compressed files are identified from just the start of their
+   decompressed contents, but must still be read in full */
+static test_return_t
+test_29( void )
+{
+  const char *filename = STATIC_TEST_PATH( "long.tzx.gz" );
+  libspectrum_byte *buffer = NULL;
+  size_t filesize = 0;
+  libspectrum_id_t type;
+  libspectrum_class_t class;
+  libspectrum_tape *tape;
+  libspectrum_tape_block *block;
+  libspectrum_tape_iterator it;
+  test_return_t r = TEST_PASS;
+
+  if( read_file( &buffer, &filesize, filename ) ) return TEST_INCOMPLETE;
+
+  if( libspectrum_identify_file_with_class( &type, &class, NULL, buffer,
+					    filesize ) ) {
+    libspectrum_free( buffer );
+    return TEST_INCOMPLETE;
+  }
+
+  if( type != LIBSPECTRUM_ID_TAPE_TZX || class != LIBSPECTRUM_CLASS_TAPE ) {
+    fprintf( stderr, "%s: `%s' identified as type %d, class %d\n", progname,
+	     filename, type, class );
+    libspectrum_free( buffer );
+    return TEST_FAIL;
+  }
+
+  tape = libspectrum_tape_alloc();
+
+  if( libspectrum_tape_read( tape, buffer, filesize, LIBSPECTRUM_ID_UNKNOWN,
+			     NULL ) ) {
+    libspectrum_tape_free( tape );
+    libspectrum_free( buffer );
+    return TEST_INCOMPLETE;
+  }
+
+  libspectrum_free( buffer );
+
+  block = libspectrum_tape_iterator_init( &it, tape );
+  if( !block ||
+      libspectrum_tape_block_type( block ) != LIBSPECTRUM_TAPE_BLOCK_ROM ||
+      libspectrum_tape_block_data_length( block ) != 5000 ) {
+    fprintf( stderr, "%s: `%s' did not contain a 5000 byte ROM block\n",
+	     progname, filename );
+    r = TEST_FAIL;
+  }
+
+  if( libspectrum_tape_free( tape ) ) return TEST_INCOMPLETE;
+
+  return r;
+}
+
+/* Write a Scorpion snapshot, so there are lots of RAM pages to be
+   compressed, with the fast compression level and read it back */
+static test_return_t
+test_30( void )
+{
+  libspectrum_byte *buffer = NULL;
+  size_t length = 0;
+  libspectrum_snap *snap;
+  int flags;
+  int page;
+  size_t i;
+  test_return_t r = TEST_PASS;
+
+  snap = libspectrum_snap_alloc();
+
+  libspectrum_snap_set_machine( snap, LIBSPECTRUM_MACHINE_SCORP );
+
+  for( page = 0; page < 16; page++ ) {
+    libspectrum_byte *data = libspectrum_new( libspectrum_byte, 0x4000 );
+    /* Some pages compressible, some not */
+    for( i = 0; i < 0x4000; i++ )
+      data[i] = page & 1 ? ( i * 7919 + page ) >> 3 : page;
+    libspectrum_snap_set_pages( snap, page, data );
+  }
+
+  if( libspectrum_snap_write( &buffer, &length, &flags, snap,
+                              LIBSPECTRUM_ID_SNAPSHOT_SZX, NULL,
+			      LIBSPECTRUM_FLAG_SNAPSHOT_FAST_COMPRESSION ) !=
+      LIBSPECTRUM_ERROR_NONE ) {
+    fprintf( stderr, "%s: serialising to SZX failed\n", progname );
+    libspectrum_snap_free( snap );
+    return TEST_INCOMPLETE;
+  }
+
+  libspectrum_snap_free( snap );
+  snap = libspectrum_snap_alloc();
+
+  if( libspectrum_snap_read( snap, buffer, length, LIBSPECTRUM_ID_SNAPSHOT_SZX,
+                             NULL ) != LIBSPECTRUM_ERROR_NONE ) {
+    fprintf( stderr, "%s: restoring from SZX failed\n", progname );
+    libspectrum_snap_free( snap );
+    libspectrum_free( buffer );
+    return TEST_INCOMPLETE;
+  }
+
+  libspectrum_free( buffer );
+
+  for( page = 0; page < 16 && r == TEST_PASS; page++ ) {
+    const libspectrum_byte *data = libspectrum_snap_pages( snap, page );
+    if( !data ) {
+      fprintf( stderr, "%s: page %d missing\n", progname, page );
+      r = TEST_FAIL;
+      break;
+    }
+    for( i = 0; i < 0x4000; i++ ) {
+      libspectrum_byte expected =
+	page & 1 ? ( i * 7919 + page ) >> 3 : page;
+      if( data[i] != expected ) {
+	fprintf( stderr, "%s: page %d offset 0x%04lx is 0x%02x, not 0x%02x\n",
+		 progname, page, (unsigned long)i, data[i], expected );
+	r = TEST_FAIL;
+	break;
+      }
+    }
+  }
+
+  libspectrum_snap_free( snap );
+
+  return r;
+}
+
+/* The .z80 run length encoding, including the special cases for 0xed */
+static test_return_t
+test_31( void )
+{
+  static const libspectrum_byte data[] = {
+    0xed, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0xed, 0xed, 0x02, 0x02,
+    0x03
+  };
+  static const libspectrum_byte expected[] = {
+    0xed, 0x00, 0xed, 0xed, 0x05, 0x00, 0x01, 0xed, 0xed, 0x02, 0xed, 0x02,
+    0x02, 0x03
+  };
+  libspectrum_byte long_run[ 300 ];
+  libspectrum_byte *compressed = NULL, *uncompressed = NULL;
+  size_t compressed_length = 0, uncompressed_length = 0;
+  test_return_t r = TEST_PASS;
+
+  libspectrum_z80_compress_block( &compressed, &compressed_length, data,
+				  sizeof( data ) );
+  if( compressed_length != sizeof( expected ) ||
+      memcmp( compressed, expected, sizeof( expected ) ) ) {
+    fprintf( stderr, "%s: data compressed incorrectly\n", progname );
+    r = TEST_FAIL;
+  }
+
+  libspectrum_z80_uncompress_block( &uncompressed, &uncompressed_length,
+				    compressed, compressed_length );
+  if( uncompressed_length != sizeof( data ) ||
+      memcmp( uncompressed, data, sizeof( data ) ) ) {
+    fprintf( stderr, "%s: data uncompressed incorrectly\n", progname );
+    r = TEST_FAIL;
+  }
+
+  libspectrum_free( compressed ); libspectrum_free( uncompressed );
+  compressed = uncompressed = NULL;
+  compressed_length = uncompressed_length = 0;
+
+  /* Runs are split into pieces of at most 255 bytes */
+  memset( long_run, 0x55, sizeof( long_run ) );
+  libspectrum_z80_compress_block( &compressed, &compressed_length, long_run,
+				  sizeof( long_run ) );
+  if( compressed_length != 8 || compressed[2] != 0xff ||
+      compressed[6] != sizeof( long_run ) - 0xff ) {
+    fprintf( stderr, "%s: long run compressed incorrectly\n", progname );
+    r = TEST_FAIL;
+  }
+
+  libspectrum_z80_uncompress_block( &uncompressed, &uncompressed_length,
+				    compressed, compressed_length );
+  if( uncompressed_length != sizeof( long_run ) ||
+      memcmp( uncompressed, long_run, sizeof( long_run ) ) ) {
+    fprintf( stderr, "%s: long run uncompressed incorrectly\n", progname );
+    r = TEST_FAIL;
+  }
+
+  libspectrum_free( compressed ); libspectrum_free( uncompressed );
+
+  return r;
+}
+
 struct test_description {
 
   test_fn test;
@@ -769,6 +1070,10 @@ static struct test_description tests[] = {
   { test_25, "Writing SNA file", 0 },
   { test_26, "Writing +3 .Z80 file", 0 },
   { test_27, "Reading old SZX file", 0 },
+  { test_28, "Short HDF file and write overlay", 0 },
+  { test_29, "Identifying compressed file from its start", 0 },
+  { test_30, "Writing SZX file with fast compression", 0 },
+  { test_31, "Z80 run length encoding", 0 },
 };
 
 static size_t test_count = ARRAY_SIZE( tests );
@@ -25,6 +25,7 @@
 
 #include <config.h>
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -183,13 +184,6 @@ write_slt_entry( libspectrum_byte **buffer, libspectrum_byte **ptr,
 		 size_t *length, libspectrum_word type, libspectrum_word id,
 		 libspectrum_dword slt_length );
 
-static void
-compress_block( libspectrum_byte **dest, size_t *dest_length,
-		const libspectrum_byte *src, size_t src_length);
-static void
-uncompress_block( libspectrum_byte **dest, size_t *dest_length,
-		  const libspectrum_byte *src, size_t src_length);
-
 /* The various things which can appear in the .slt data */
 enum slt_type {
 
@@ -816,8 +810,11 @@ read_slt( libspectrum_snap *snap, const libspectrum_byte **next_block,
 	return LIBSPECTRUM_ERROR_CORRUPT;
       }
 
-      length = 0;	/* Tell uncompress_block to allocate memory for us */
-      uncompress_block( &buffer, &length, *next_block + offsets[i], slt_length[i] );
+      length = 0;	/* Tell libspectrum_z80_uncompress_block to allocate
+			   memory for us */
+      libspectrum_z80_uncompress_block( &buffer, &length,
+					*next_block + offsets[i],
+					slt_length[i] );
 
       libspectrum_snap_set_slt( snap, i, buffer );
       libspectrum_snap_set_slt_length( snap, i, length );
@@ -839,8 +836,9 @@ read_slt( libspectrum_snap *snap, const libspectrum_byte **next_block,
 
     } else {				/* Compressed */
       
-      uncompress_block( &buffer, &screen_length, (*next_block) + screen_offset,
-                        screen_length );
+      libspectrum_z80_uncompress_block( &buffer, &screen_length,
+					(*next_block) + screen_offset,
+					screen_length );
 
       /* A screen should be 6912 bytes long */
       if( screen_length != 6912 ) {
@@ -1028,8 +1026,8 @@ read_v1_block( const libspectrum_byte *buffer, int is_compressed,
     }
 
     /* Length passed here is reduced by 4 to remove the end marker */
-    uncompress_block( uncompressed, &uncompressed_length, buffer,
-                      ( ptr - buffer - 4 ) );
+    libspectrum_z80_uncompress_block( uncompressed, &uncompressed_length,
+				      buffer, ( ptr - buffer - 4 ) );
 
     /* Uncompressed data must be exactly 48Kb long */
     if( uncompressed_length != 0xc000 ) {
@@ -1092,7 +1090,7 @@ read_v2_block( const libspectrum_byte *buffer, libspectrum_byte **block,
     }
 
     *length = 0;
-    uncompress_block( block, length, buffer + 3, length2 );
+    libspectrum_z80_uncompress_block( block, length, buffer + 3, length2 );
 
     *next_block = buffer + 3 + length2;
 
@@ -1583,7 +1581,8 @@ write_page( libspectrum_byte **buffer, libspectrum_byte **ptr, size_t *length,
 
   if( compress ) {
     compressed_length = 0;
-    compress_block( &compressed, &compressed_length, page, 0x4000 );
+    libspectrum_z80_compress_block( &compressed, &compressed_length, page,
+				    0x4000 );
   }
 
   if( !compress || ( !(compress & LIBSPECTRUM_FLAG_SNAPSHOT_ALWAYS_COMPRESS) &&
@@ -1630,11 +1629,12 @@ write_slt( libspectrum_byte **buffer, libspectrum_byte **ptr, size_t *length,
     if( libspectrum_snap_slt_length( snap, i ) ) {
 
       /* Zero the compressed length so it will be allocated memory
-	 by compress_block */
+	 by libspectrum_z80_compress_block */
       compressed_length[i] = 0;
-      compress_block( &compressed_data[i], &compressed_length[i],
-            	      libspectrum_snap_slt( snap, i ),
-		      libspectrum_snap_slt_length( snap, i ) );
+      libspectrum_z80_compress_block( &compressed_data[i],
+				      &compressed_length[i],
+				      libspectrum_snap_slt( snap, i ),
+				      libspectrum_snap_slt_length( snap, i ) );
 
       write_slt_entry( buffer, ptr, length, LIBSPECTRUM_SLT_TYPE_LEVEL, i,
 		       compressed_length[i] );
@@ -1645,8 +1645,9 @@ write_slt( libspectrum_byte **buffer, libspectrum_byte **ptr, size_t *length,
   if( libspectrum_snap_slt_screen( snap ) ) {
 
     compressed_screen_length = 0;
-    compress_block( &compressed_screen, &compressed_screen_length,
-                    libspectrum_snap_slt_screen( snap ), 6912 );
+    libspectrum_z80_compress_block( &compressed_screen,
+				    &compressed_screen_length,
+				    libspectrum_snap_slt_screen( snap ), 6912 );
 
     /* If length >= 6912, write out uncompressed */
     if( compressed_screen_length >= 6912 ) {
@@ -1698,139 +1699,188 @@ write_slt_entry( libspectrum_byte **buffer, libspectrum_byte **ptr,
   libspectrum_write_word( ptr, slt_length >> 16 );
 }
 
-static void
-compress_block( libspectrum_byte **dest, size_t *dest_length,
-		const libspectrum_byte *src, size_t src_length)
+/* The RLE routines look at a machine word of data at a time where they
+   can: runs are found by comparing a word with the same word one byte
+   along, and a byte in that is zero wherever two neighbours match */
+
+typedef unsigned long rle_word;
+
+#define RLE_ONES ( (rle_word)-1 / 0xff )
+#define RLE_HIGHS ( RLE_ONES * 0x80 )
+
+/* Non-zero if any byte of 'x' is zero */
+#define RLE_HAS_ZERO( x ) ( ( (x) - RLE_ONES ) & ~(x) & RLE_HIGHS )
+
+static rle_word
+rle_load( const libspectrum_byte *ptr )
+{
+  rle_word word;
+
+  memcpy( &word, ptr, sizeof( word ) );
+
+  return word;
+}
+
+/* Find the first byte from 'ptr' onwards which is the same as the byte
+   after it, or return 'end' - 1 if there is no such byte */
+static const libspectrum_byte*
+find_pair( const libspectrum_byte *ptr, const libspectrum_byte *end )
+{
+  while( end - ptr > (ptrdiff_t)sizeof( rle_word ) &&
+	 !RLE_HAS_ZERO( rle_load( ptr ) ^ rle_load( ptr + 1 ) ) )
+    ptr += sizeof( rle_word );
+
+  while( ptr < end - 1 && ptr[0] != ptr[1] ) ptr++;
+
+  return ptr;
+}
+
+/* The length of the run of identical bytes starting at 'ptr', up to
+   'max' bytes */
+static size_t
+run_length( const libspectrum_byte *ptr, const libspectrum_byte *end,
+	    size_t max )
+{
+  const libspectrum_byte *run_end = ptr + 1;
+  rle_word pattern = RLE_ONES * *ptr;
+
+  if( (size_t)( end - ptr ) < max ) max = end - ptr;
+  end = ptr + max;
+
+  while( end - run_end >= (ptrdiff_t)sizeof( rle_word ) &&
+	 rle_load( run_end ) == pattern )
+    run_end += sizeof( rle_word );
+
+  while( run_end < end && *run_end == *ptr ) run_end++;
+
+  return run_end - ptr;
+}
+
+void
+libspectrum_z80_compress_block( libspectrum_byte **dest, size_t *dest_length,
+				const libspectrum_byte *src, size_t src_length )
 {
-  const libspectrum_byte *in_ptr;
+  const libspectrum_byte *in_ptr, *end, *literals;
   libspectrum_byte *out_ptr;
   int last_char_ed = 0;
 
-  /* Allocate memory for dest if requested */
-  if( *dest_length == 0 ) {
-    *dest_length = src_length/2;
-    *dest = libspectrum_new( libspectrum_byte, *dest_length );
-  }
+  /* The worst case is a pair of 0xed bytes, which becomes four bytes,
+     so make all the room we could need now */
+  out_ptr = *dest;
+  libspectrum_make_room( dest, 2 * src_length, &out_ptr, dest_length );
 
   in_ptr = src;
-  out_ptr = *dest;
+  end = src + src_length;
 
   /* Now loop over the entire input block */
-  while( in_ptr < src + src_length ) {
+  while( in_ptr < end ) {
+
+    /* Everything up to the next pair of identical bytes is output as it
+       is */
+    literals = find_pair( in_ptr, end );
+    if( literals != in_ptr ) {
+      memcpy( out_ptr, in_ptr, literals - in_ptr );
+      out_ptr += literals - in_ptr;
+      last_char_ed = ( literals[-1] == 0xed ) ? 1 : 0;
+      in_ptr = literals;
+    }
 
     /* If we're pointing at the last byte, just copy it across
        and exit */
-    if( in_ptr == src + src_length - 1 ) {
-      libspectrum_make_room( dest, 1, &out_ptr, dest_length );
+    if( in_ptr == end - 1 ) {
       *out_ptr++ = *in_ptr++;
       continue;
     }
 
-    /* Now see if we're pointing to a run of identical bytes, and
-       the last thing output wasn't a single 0xed */
-    if( *in_ptr == *(in_ptr+1) && !last_char_ed ) {
-
-      libspectrum_byte repeated;
-      size_t run_length;
-      
-      /* Reset the `last character was a 0xed' flag */
-      last_char_ed = 0;
+    /* Now we're pointing to a run of identical bytes; see if the last
+       thing output was a single 0xed */
+    if( !last_char_ed ) {
 
-      /* See how long the run is */
-      repeated = *in_ptr;
-      in_ptr += 2;
-      run_length = 2;
+      libspectrum_byte repeated = *in_ptr;
+      size_t length;
 
       /* Find the length of the run (but cap it at 255 bytes) */
-      while( in_ptr < src + src_length && *in_ptr == repeated && 
-	     run_length < 0xff ) {
-	run_length++;
-	in_ptr++;
-      }
+      length = run_length( in_ptr, end, 0xff );
+      in_ptr += length;
 
-      if( run_length >= 5 || repeated == 0xed ) {
+      if( length >= 5 || repeated == 0xed ) {
 	/* Output this in compressed form if it's of length 5 or longer,
 	   _or_ if it's a run of 0xed */
-
-	libspectrum_make_room( dest, 4, &out_ptr, dest_length );
-
 	*out_ptr++ = 0xed;
 	*out_ptr++ = 0xed;
-	*out_ptr++ = run_length;
+	*out_ptr++ = length;
 	*out_ptr++ = repeated;
-
       } else {
-
 	/* If not, just output the bytes */
-	libspectrum_make_room( dest, run_length, &out_ptr, dest_length );
-
-	while(run_length--) *out_ptr++ = repeated;
-
+	memset( out_ptr, repeated, length ); out_ptr += length;
       }
 
     } else {
 
       /* Not a repeated character, so just output the byte */
       last_char_ed = ( *in_ptr == 0xed ) ? 1 : 0;
-      libspectrum_make_room( dest, 1, &out_ptr, dest_length );
       *out_ptr++ = *in_ptr++;
 
     }
-      
+
   }
 
   *dest_length = out_ptr - *dest;
 }
 
-static void
-uncompress_block( libspectrum_byte **dest, size_t *dest_length,
-		  const libspectrum_byte *src, size_t src_length)
+/* Go through a compressed block, either finding out how long it is when
+   uncompressed if 'dest' is NULL, or uncompressing it into 'dest' */
+static size_t
+uncompress_block( libspectrum_byte *dest, const libspectrum_byte *src,
+		  size_t src_length )
 {
-  const libspectrum_byte *in_ptr;
-  libspectrum_byte *out_ptr;
+  const libspectrum_byte *in_ptr = src, *end = src + src_length, *ed;
+  size_t length = 0;
 
-  /* Allocate memory for dest if requested */
-  if( *dest_length == 0 ) {
-    *dest_length = src_length / 2;
-    *dest = libspectrum_new( libspectrum_byte, *dest_length );
-  }
+  while( in_ptr < end ) {
 
-  in_ptr = src;
-  out_ptr = *dest;
+    /* Copy across everything up to the next 0xed */
+    ed = memchr( in_ptr, 0xed, end - in_ptr );
+    if( !ed ) ed = end;
 
-  while( in_ptr < src + src_length ) {
+    if( dest ) memcpy( dest + length, in_ptr, ed - in_ptr );
+    length += ed - in_ptr;
+    in_ptr = ed;
 
-    /* If we're pointing at the last byte, just copy it across
-       and exit */
-    if( in_ptr == src + src_length - 1 ) {
-      libspectrum_make_room( dest, 1, &out_ptr, dest_length );
-      *out_ptr++ = *in_ptr++;
-      continue;
-    }
+    if( in_ptr == end ) break;
 
     /* If we're pointing at two successive 0xed bytes, that's
        a run. If not, just copy the byte across */
-    if( *in_ptr == 0xed && *(in_ptr+1) == 0xed ) {
-
-      size_t run_length;
-      libspectrum_byte repeated;
-      
-      in_ptr+=2;
-      run_length = *in_ptr++;
-      repeated = *in_ptr++;
+    if( end - in_ptr >= 4 && in_ptr[1] == 0xed ) {
+      if( dest ) memset( dest + length, in_ptr[3], in_ptr[2] );
+      length += in_ptr[2];
+      in_ptr += 4;
+    } else {
+      if( dest ) dest[ length ] = *in_ptr;
+      length++; in_ptr++;
+    }
 
-      libspectrum_make_room( dest, run_length, &out_ptr, dest_length );
+  }
 
-      while(run_length--) *out_ptr++ = repeated;
+  return length;
+}
 
-    } else {
+void
+libspectrum_z80_uncompress_block( libspectrum_byte **dest,
+				  size_t *dest_length,
+				  const libspectrum_byte *src,
+				  size_t src_length )
+{
+  libspectrum_byte *out_ptr;
+  size_t length;
 
-      libspectrum_make_room( dest, 1, &out_ptr, dest_length );
-      *out_ptr++ = *in_ptr++;
+  /* Find out how much room we need, so we only allocate once */
+  length = uncompress_block( NULL, src, src_length );
 
-    }
+  out_ptr = *dest;
+  libspectrum_make_room( dest, length, &out_ptr, dest_length );
 
-  }
+  uncompress_block( out_ptr, src, src_length );
 
-  *dest_length = out_ptr - *dest;
+  *dest_length = out_ptr - *dest + length;
 }
@@ -31,6 +31,7 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 
@@ -38,11 +39,22 @@
 #include <unistd.h>
 #endif			/* #ifdef HAVE_UNISTD_H */
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif			/* #ifdef HAVE_PTHREAD */
+
 #define ZLIB_CONST
 #include <zlib.h>
 
 #include "internals.h"
 
+/* The most threads libspectrum_zlib_compress_blocks() will use */
+#define MAX_COMPRESS_THREADS 16
+
+/* How many bytes each of those threads must have to compress to be worth
+   starting */
+#define COMPRESS_THREAD_BYTES 32768
+
 static libspectrum_error
 skip_gzip_header( const libspectrum_byte **gzptr, size_t *gzlength );
 static libspectrum_error
@@ -50,7 +62,8 @@ skip_null_terminated_string( const libspectrum_byte **ptr, size_t *length,
 			     const char *name );
 static libspectrum_error
 zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
-	      libspectrum_byte **outptr, size_t *outlength, int gzip_hack );
+	      libspectrum_byte **outptr, size_t *outlength, int gzip_hack,
+	      int partial );
 
 libspectrum_error 
 libspectrum_zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
@@ -63,7 +76,7 @@ libspectrum_zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
  * Returns:	error flag (libspectrum_error)
  */
 {
-  return zlib_inflate( gzptr, gzlength, outptr, outlength, 0 );
+  return zlib_inflate( gzptr, gzlength, outptr, outlength, 0, 0 );
 }
 
 libspectrum_error
@@ -74,12 +87,28 @@ libspectrum_gzip_inflate( const libspectrum_byte *gzptr, size_t gzlength,
 
   error = skip_gzip_header( &gzptr, &gzlength ); if( error ) return error;
 
-  return zlib_inflate( gzptr, gzlength, outptr, outlength, 1 );
+  return zlib_inflate( gzptr, gzlength, outptr, outlength, 1, 0 );
+}
+
+/* As libspectrum_gzip_inflate(), but stop after at most *outlength bytes;
+   running out of either input or output space is not an error. Used to
+   identify compressed files without decompressing all of them */
+libspectrum_error
+libspectrum_gzip_inflate_prefix( const libspectrum_byte *gzptr,
+				 size_t gzlength, libspectrum_byte **outptr,
+				 size_t *outlength )
+{
+  int error;
+
+  error = skip_gzip_header( &gzptr, &gzlength ); if( error ) return error;
+
+  return zlib_inflate( gzptr, gzlength, outptr, outlength, 1, 1 );
 }
 
 static libspectrum_error
 zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
-	      libspectrum_byte **outptr, size_t *outlength, int gzip_hack )
+	      libspectrum_byte **outptr, size_t *outlength, int gzip_hack,
+	      int partial )
 {
   z_stream stream;
   int error;
@@ -131,7 +160,9 @@ zlib_inflate( const libspectrum_byte *gzptr, size_t gzlength,
 
     *outptr = libspectrum_new( libspectrum_byte, *outlength );
     stream.next_out = *outptr; stream.avail_out = *outlength;
-    error = inflate( &stream, Z_FINISH );
+    error = inflate( &stream, partial ? Z_SYNC_FLUSH : Z_FINISH );
+    if( partial && ( error == Z_OK || error == Z_BUF_ERROR ) )
+      error = Z_STREAM_END;
 
   } else {
 
@@ -314,44 +345,239 @@ libspectrum_zlib_compress( const libspectrum_byte *data, size_t length,
  *		*gzlength	== length of the deflated data
  * Returns:	error flag (libspectrum_error)
  */
+{
+  return libspectrum_zlib_compress_level( data, length, gzptr, gzlength,
+					  Z_BEST_COMPRESSION );
+}
+
+/* Deflate a block of data, returning the zlib error code without
+   reporting it. The output buffer comes from libspectrum_new() unless
+   'use_malloc' is set, in which case it comes from malloc(): that is what
+   the worker threads use, as the allocator set with
+   libspectrum_mem_set_vtable() need not be thread safe */
+static int
+zlib_compress( const libspectrum_byte *data, size_t length,
+	       libspectrum_byte **gzptr, size_t *gzlength, int level,
+	       int use_malloc )
 {
   uLongf gzl = (uLongf)( length * 1.001 ) + 12;
   int gzret;
 
-  *gzptr = libspectrum_new( libspectrum_byte, gzl );
-  gzret = compress2( *gzptr, &gzl, data, length, Z_BEST_COMPRESSION );
+  if( use_malloc ) {
+    *gzptr = malloc( gzl );
+    if( !*gzptr ) return Z_MEM_ERROR;
+  } else {
+    *gzptr = libspectrum_new( libspectrum_byte, gzl );
+  }
+
+  gzret = compress2( *gzptr, &gzl, data, length, level );
 
+  if( gzret == Z_OK ) {
+    *gzlength = gzl;
+  } else {
+    if( use_malloc ) free( *gzptr ); else libspectrum_free( *gzptr );
+    *gzptr = 0;
+  }
+
+  return gzret;
+}
+
+static libspectrum_error
+zlib_compress_error( int gzret )
+{
   switch (gzret) {
 
   case Z_OK:			/* initialised OK */
-    *gzlength = gzl;
     return LIBSPECTRUM_ERROR_NONE;
 
   case Z_MEM_ERROR:		/* out of memory */
-    libspectrum_free( *gzptr ); *gzptr = 0;
     libspectrum_print_error( LIBSPECTRUM_ERROR_MEMORY,
 			     "libspectrum_zlib_compress: out of memory" );
     return LIBSPECTRUM_ERROR_MEMORY;
 
   case Z_VERSION_ERROR:		/* unrecognised version */
-    libspectrum_free( *gzptr ); *gzptr = 0;
     libspectrum_print_error( LIBSPECTRUM_ERROR_UNKNOWN,
 			     "libspectrum_zlib_compress: unknown version" );
     return LIBSPECTRUM_ERROR_UNKNOWN;
 
   case Z_BUF_ERROR:		/* Not enough space in output buffer.
 				   Shouldn't happen */
-    libspectrum_free( *gzptr ); *gzptr = 0;
     libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
 			     "libspectrum_zlib_compress: out of space?" ); 
     return LIBSPECTRUM_ERROR_LOGIC;
 
   default:			/* some other error */
-    libspectrum_free( *gzptr ); *gzptr = 0;
     libspectrum_print_error( LIBSPECTRUM_ERROR_LOGIC,
 			     "libspectrum_zlib_compress: unexpected error?" ); 
     return LIBSPECTRUM_ERROR_LOGIC;
   }
 }
 
+/* As libspectrum_zlib_compress(), but with a zlib compression level */
+libspectrum_error
+libspectrum_zlib_compress_level( const libspectrum_byte *data, size_t length,
+				 libspectrum_byte **gzptr, size_t *gzlength,
+				 int level )
+{
+  return zlib_compress_error( zlib_compress( data, length, gzptr, gzlength,
+					     level, 0 ) );
+}
+
+/* The zlib compression level to use for the given snapshot writing
+   flags */
+int
+libspectrum_zlib_level( int in_flags )
+{
+  return in_flags & LIBSPECTRUM_FLAG_SNAPSHOT_FAST_COMPRESSION ?
+	 Z_BEST_SPEED : Z_BEST_COMPRESSION;
+}
+
+typedef struct compress_blocks_t {
+
+  size_t count;
+  const libspectrum_byte **data;
+  const size_t *length;
+  libspectrum_byte **gzptr;
+  size_t *gzlength;
+  int level;
+  int use_malloc;		/* Set if other threads are compressing too */
+
+  size_t next;			/* The next block to be compressed */
+  int gzret;			/* The first error, if any */
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_t lock;
+#endif				/* #ifdef HAVE_PTHREAD */
+
+} compress_blocks_t;
+
+static void*
+compress_blocks_worker( void *arg )
+{
+  compress_blocks_t *blocks = arg;
+  size_t i;
+  int gzret;
+
+  while( 1 ) {
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock( &blocks->lock );
+#endif				/* #ifdef HAVE_PTHREAD */
+    i = blocks->gzret == Z_OK ? blocks->next++ : blocks->count;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock( &blocks->lock );
+#endif				/* #ifdef HAVE_PTHREAD */
+
+    if( i >= blocks->count ) break;
+
+    if( !blocks->data[i] ) continue;
+
+    gzret = zlib_compress( blocks->data[i], blocks->length[i],
+			   &blocks->gzptr[i], &blocks->gzlength[i],
+			   blocks->level, blocks->use_malloc );
+
+    if( gzret != Z_OK ) {
+#ifdef HAVE_PTHREAD
+      pthread_mutex_lock( &blocks->lock );
+#endif				/* #ifdef HAVE_PTHREAD */
+      if( blocks->gzret == Z_OK ) blocks->gzret = gzret;
+#ifdef HAVE_PTHREAD
+      pthread_mutex_unlock( &blocks->lock );
+#endif				/* #ifdef HAVE_PTHREAD */
+    }
+  }
+
+  return NULL;
+}
+
+/* Deflate 'count' independent blocks of data, using up to one thread per
+   CPU where we have POSIX threads and enough data to make them worthwhile.
+   Blocks whose data is NULL are skipped.
+   On success, every gzptr[i] is either NULL or must be freed by the
+   caller; on error, none of them need be */
+libspectrum_error
+libspectrum_zlib_compress_blocks( size_t count, const libspectrum_byte **data,
+				  const size_t *length,
+				  libspectrum_byte **gzptr, size_t *gzlength,
+				  int level )
+{
+  compress_blocks_t blocks;
+  size_t i;
+
+#ifdef HAVE_PTHREAD
+  pthread_t threads[ MAX_COMPRESS_THREADS ];
+  size_t started = 0, nthreads = 1, total = 0;
+
+#ifdef _SC_NPROCESSORS_ONLN
+  {
+    long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+    if( cpus > 1 ) nthreads = cpus;
+  }
+#endif				/* #ifdef _SC_NPROCESSORS_ONLN */
+
+  for( i = 0; i < count; i++ ) if( data[i] ) total += length[i];
+
+  if( nthreads > count ) nthreads = count;
+  if( nthreads > total / COMPRESS_THREAD_BYTES )
+    nthreads = total / COMPRESS_THREAD_BYTES;
+  if( nthreads < 1 ) nthreads = 1;
+  if( nthreads > MAX_COMPRESS_THREADS ) nthreads = MAX_COMPRESS_THREADS;
+#endif				/* #ifdef HAVE_PTHREAD */
+
+  for( i = 0; i < count; i++ ) { gzptr[i] = NULL; gzlength[i] = 0; }
+
+  blocks.count = count;
+  blocks.data = data; blocks.length = length;
+  blocks.gzptr = gzptr; blocks.gzlength = gzlength;
+  blocks.level = level;
+  blocks.use_malloc = 0;
+  blocks.next = 0;
+  blocks.gzret = Z_OK;
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_init( &blocks.lock, NULL );
+
+  blocks.use_malloc = nthreads > 1;
+
+  /* This thread does its share of the work too */
+  for( started = 0; started < nthreads - 1; started++ )
+    if( pthread_create( &threads[ started ], NULL, compress_blocks_worker,
+			&blocks ) )
+      break;
+#endif				/* #ifdef HAVE_PTHREAD */
+
+  compress_blocks_worker( &blocks );
+
+#ifdef HAVE_PTHREAD
+  for( i = 0; i < started; i++ ) pthread_join( threads[i], NULL );
+
+  pthread_mutex_destroy( &blocks.lock );
+#endif				/* #ifdef HAVE_PTHREAD */
+
+  /* Move anything from malloc() into memory from the user's allocator,
+     now we're back on their thread */
+  if( blocks.use_malloc ) {
+    for( i = 0; i < count; i++ ) {
+      libspectrum_byte *buffer = gzptr[i];
+      if( !buffer ) continue;
+      if( blocks.gzret == Z_OK ) {
+	gzptr[i] = libspectrum_new( libspectrum_byte, gzlength[i] );
+	memcpy( gzptr[i], buffer, gzlength[i] );
+      } else {
+	gzptr[i] = NULL;
+      }
+      free( buffer );
+    }
+  }
+
+  if( blocks.gzret != Z_OK ) {
+    for( i = 0; i < count; i++ ) {
+      libspectrum_free( gzptr[i] ); gzptr[i] = NULL;
+    }
+    return zlib_compress_error( blocks.gzret );
+  }
+
+  return LIBSPECTRUM_ERROR_NONE;
+}
+
 #endif				/* #ifdef HAVE_ZLIB_H */